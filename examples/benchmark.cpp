@@ -1,6 +1,11 @@
+#include "df_blend.h"
 #include "df_bmp.h"
+#include "df_command_list.h"
 #include "df_time.h"
 #include "df_polygon.h"
+#include "df_qoi.h"
+#include "df_scaler.h"
+#include "df_text_cache.h"
 #include "df_font.h"
 #include "df_window.h"
 #include "fonts/df_mono.h"
@@ -167,6 +172,72 @@ double CalcBillionRectFillPixelsPerSec(DfBitmap *bmp)
 }
 
 
+// Clears the whole bitmap, so unlike the rect fill test, this is limited by
+// memory bandwidth rather than the CPU.
+double CalcBillionClearPixelsPerSec(DfBitmap *bmp)
+{
+    g_iterations = 200;
+    double startTime = GetRealTime();
+    for (unsigned i = 0; i < g_iterations; i++)
+        BitmapClear(bmp, g_colourWhite);
+    double endTime = GetRealTime();
+    g_duration = endTime - startTime;
+    g_testFmtString = "Billion clear pixels per sec";
+    double numPixels = (double)bmp->width * bmp->height * (double)g_iterations;
+    return (numPixels / g_duration) / 1e9;
+}
+
+
+double CalcBillionTiledClearPixelsPerSec(DfBitmap *bmp, DfThreadPool *pool)
+{
+    DfCommandList *cl = CommandListCreate();
+    CommandListBitmapClear(cl, g_colourWhite);
+    g_iterations = 200;
+    double startTime = GetRealTime();
+    for (unsigned i = 0; i < g_iterations; i++)
+        CommandListReplayTiled(cl, bmp, pool);
+    double endTime = GetRealTime();
+    g_duration = endTime - startTime;
+    g_testFmtString = "Billion tiled clear pixels per sec";
+    double numPixels = (double)bmp->width * bmp->height * (double)g_iterations;
+    CommandListDelete(cl);
+    return (numPixels / g_duration) / 1e9;
+}
+
+
+// Draws a grid of 160x120 thumbnails of a 640x480 bitmap, like a thumbnail
+// view would. Uses StretchBlit() if scaler is NULL.
+double CalcMillionThumbnailPixelsPerSec(DfBitmap *bmp, DfScaler *scaler, DfThreadPool *pool)
+{
+    enum { SRC_W = 640, SRC_H = 480, THUMB_W = 160, THUMB_H = 120 };
+    DfBitmap *src = BitmapCreate(SRC_W, SRC_H);
+    for (int y = 0; y < SRC_H; y++)
+        for (int x = 0; x < SRC_W; x++)
+            PutPixUnclipped(src, x, y, Colour(x & 255, y & 255, (x ^ y) & 255));
+
+    int cols = bmp->width / THUMB_W;
+    int rows = bmp->height / THUMB_H;
+    g_iterations = 20;
+    double startTime = GetRealTime();
+    for (unsigned i = 0; i < g_iterations; i++) {
+        for (int y = 0; y < rows; y++) {
+            for (int x = 0; x < cols; x++) {
+                if (scaler)
+                    ScalerBlitThreaded(scaler, bmp, x * THUMB_W, y * THUMB_H, src, pool);
+                else
+                    StretchBlit(bmp, x * THUMB_W, y * THUMB_H, THUMB_W, THUMB_H, src);
+            }
+        }
+    }
+    double endTime = GetRealTime();
+    g_duration = endTime - startTime;
+    g_testFmtString = scaler ? "Million thumbnail pixels per sec (scaler)" : "Million thumbnail pixels per sec";
+    double numPixels = (double)cols * rows * THUMB_W * THUMB_H * (double)g_iterations;
+    BitmapDelete(src);
+    return (numPixels / g_duration) / 1e6;
+}
+
+
 double CalcBillionBlitPixelsPerSec(DfBitmap *bmp)
 {
     DfBitmap *dog = LoadBmp("../../marlieses_dog.bmp");
@@ -186,6 +257,69 @@ double CalcBillionBlitPixelsPerSec(DfBitmap *bmp)
 }
 
 
+// The image tests save and load the dog picture, in BMP or QOI format. The
+// scores are in megabytes of decoded pixels per second, so that the two
+// formats can be compared directly.
+static char const *GetImageTestFilename(bool qoi)
+{
+    return qoi ? "benchmark_tmp.qoi" : "benchmark_tmp.bmp";
+}
+
+
+double CalcImageSaveMegabytesPerSec(DfBitmap *img, bool qoi)
+{
+    char const *filename = GetImageTestFilename(qoi);
+    g_iterations = 100;
+    double startTime = GetRealTime();
+    for (unsigned i = 0; i < g_iterations; i++) {
+        bool ok = qoi ? SaveQoi(img, filename) : SaveBmp(img, filename);
+        ReleaseAssert(ok, "Couldn't save %s", filename);
+    }
+    double endTime = GetRealTime();
+    g_duration = endTime - startTime;
+    g_testFmtString = qoi ? "Megabytes per sec SaveQoi" : "Megabytes per sec SaveBmp";
+    double numBytes = (double)img->width * img->height * sizeof(DfColour) * g_iterations;
+    return (numBytes / g_duration) / 1e6;
+}
+
+
+// Loads the file that the save test wrote.
+double CalcImageLoadMegabytesPerSec(DfBitmap *img, bool qoi)
+{
+    char const *filename = GetImageTestFilename(qoi);
+    g_iterations = 100;
+    double startTime = GetRealTime();
+    for (unsigned i = 0; i < g_iterations; i++) {
+        DfBitmap *loaded = qoi ? LoadQoi(filename) : LoadBmp(filename);
+        ReleaseAssert(loaded, "Couldn't load %s", filename);
+        BitmapDelete(loaded);
+    }
+    double endTime = GetRealTime();
+    g_duration = endTime - startTime;
+    g_testFmtString = qoi ? "Megabytes per sec LoadQoi" : "Megabytes per sec LoadBmp";
+    double numBytes = (double)img->width * img->height * sizeof(DfColour) * g_iterations;
+    return (numBytes / g_duration) / 1e6;
+}
+
+
+// Measures and then deletes the file that the save test wrote.
+double CalcImageFileKilobytes(bool qoi)
+{
+    char const *filename = GetImageTestFilename(qoi);
+    FILE *f = fopen(filename, "rb");
+    ReleaseAssert(f, "Couldn't open %s", filename);
+    fseek(f, 0, SEEK_END);
+    double numBytes = (double)ftell(f);
+    fclose(f);
+    remove(filename);
+
+    g_iterations = 1;
+    g_duration = 0.0;
+    g_testFmtString = qoi ? "Kilobytes QOI file" : "Kilobytes BMP file";
+    return numBytes / 1e3;
+}
+
+
 double CalcMillionCharsPerSec(DfBitmap *bmp, DfFont *font)
 {
     static char const *str = "Here's some interesting text []# !";
@@ -204,6 +338,26 @@ double CalcMillionCharsPerSec(DfBitmap *bmp, DfFont *font)
 }
 
 
+double CalcMillionCachedCharsPerSec(DfBitmap *bmp, DfFont *font)
+{
+    static char const *str = "Here's some interesting text []# !";
+    DfTextCache *cache = TextCacheCreate(16);
+    g_iterations = 1000 * 500;
+    double startTime = GetRealTime();
+    for (unsigned i = 0; i < g_iterations; i++) {
+        int x = GetRand() % bmp->width;
+        int y = i % bmp->height;
+        TextCacheDrawTextSimple(cache, font, g_colourWhite, bmp, x, y, str);
+    }
+    double endTime = GetRealTime();
+    g_duration = endTime - startTime;
+    g_testFmtString = "Million cached DrawText chars per sec";
+    TextCacheDelete(cache);
+    double numChars = g_iterations * (double)strlen(str);
+    return (numChars / g_duration) / 1e6;
+}
+
+
 double CalcBillionPolyFillPixelsPerSec(DfBitmap *bmp)
 {
     g_iterations = 1000 * 4;
@@ -281,9 +435,15 @@ void BenchmarkMain()
 {
     FILE *file = fopen("report.txt", "w");
     ReleaseAssert(file, "Couldn't open report.txt");
+    fprintf(file, "Alpha blend implementation: %s\n", BlendGetImplName());
 
+    // This is the first thing to open a connection to the window system, so
+    // it measures what a short-lived app pays before its first frame appears.
+    double startupStartTime = GetRealTime();
     DfWindow *win = CreateWin(1024, 768, WT_WINDOWED_RESIZEABLE, "Benchmark");
     BitmapClear(win->bmp, g_colourBlack);
+    UpdateWin(win);
+    double startupDuration = GetRealTime() - startupStartTime;
 
     DfFont *font = LoadFontFromMemory(df_mono_7x13, sizeof(df_mono_7x13));
 
@@ -296,6 +456,13 @@ void BenchmarkMain()
     int yInc = font->charHeight * 4;
     double score;
 
+    // Startup
+    score = startupDuration * 1e3;
+    g_duration = startupDuration;
+    g_iterations = 1;
+    g_testFmtString = "Millisec connect to first frame";
+    END_TEST;
+
     // Put pixel
     score = CalcMillionPixelsPerSec(backBmp);
     END_TEST;
@@ -320,14 +487,60 @@ void BenchmarkMain()
     score = CalcBillionRectFillPixelsPerSec(backBmp);
     END_TEST;
 
+    // Clear
+    score = CalcBillionClearPixelsPerSec(backBmp);
+    END_TEST;
+
+    // Tiled clear
+    DfThreadPool *pool = ThreadPoolCreate(0);
+    score = CalcBillionTiledClearPixelsPerSec(backBmp, pool);
+    ThreadPoolDelete(pool);
+    END_TEST;
+
     // Blit
     score = CalcBillionBlitPixelsPerSec(backBmp);
     END_TEST;
 
+    // Image save, load and file size, for each format
+    DfBitmap *dog = LoadBmp("../../marlieses_dog.bmp");
+    if (!dog)
+        dog = LoadBmp("marlieses_dog.bmp");
+    ReleaseAssert(dog, "Couldn't load marlieses_dog.bmp");
+    for (int qoi = 0; qoi < 2; qoi++) {
+        score = CalcImageSaveMegabytesPerSec(dog, qoi);
+        END_TEST;
+        score = CalcImageLoadMegabytesPerSec(dog, qoi);
+        END_TEST;
+        score = CalcImageFileKilobytes(qoi);
+        END_TEST;
+    }
+    BitmapDelete(dog);
+
+    // Thumbnails
+    score = CalcMillionThumbnailPixelsPerSec(backBmp, NULL, NULL);
+    END_TEST;
+
+    // Thumbnails with a reused, threaded scaler
+    DfScaler *scaler = ScalerCreate(640, 480, 160, 120);
+    score = CalcMillionThumbnailPixelsPerSec(backBmp, scaler, NULL);
+    ScalerDelete(scaler);
+    END_TEST;
+
     // Text render
     score = CalcMillionCharsPerSec(backBmp, font);
     END_TEST;
 
+    // Cached text render
+    score = CalcMillionCachedCharsPerSec(backBmp, font);
+    END_TEST;
+
+    // Anti-aliased text render
+    DfFont *aaFont = LoadFontFromMemoryAA(df_mono_16x30, sizeof(df_mono_16x30), 13);
+    score = CalcMillionCharsPerSec(backBmp, aaFont);
+    g_testFmtString = "Million DrawText AA chars per sec";
+    FontDelete(aaFont);
+    END_TEST;
+
     // Polygon fill
     score = CalcBillionPolyFillPixelsPerSec(backBmp);
     END_TEST;
@@ -42,13 +42,13 @@ inline unsigned ColourDiff(DfColour a, DfColour b) {
 unsigned CalcDiff(DfBitmap *bmp, unsigned short x, unsigned short y, DfColour targetColour) {
     unsigned minDiff = UINT_MAX;
 
-    DfColour *row = bmp->pixels + (y-1) * bmp->width + x;
+    DfColour *row = bmp->pixels + (y-1) * bmp->stride + x;
 
     unsigned diff = ColourDiff(row[0], targetColour);
     if (diff < minDiff)
         minDiff = diff;
 
-    row += bmp->width;
+    row += bmp->stride;
     
     diff = ColourDiff(row[-1], targetColour);
     if (diff < minDiff)
@@ -58,7 +58,7 @@ unsigned CalcDiff(DfBitmap *bmp, unsigned short x, unsigned short y, DfColour ta
     if (diff < minDiff)
         minDiff = diff;
 
-    row += bmp->width;
+    row += bmp->stride;
 
     diff = ColourDiff(row[0], targetColour);
     if (diff < minDiff)
@@ -95,7 +95,7 @@ unsigned FindBestLocationIndex(DfBitmap *bmp, DfColour c) {
 // not to add the location to the array.
 inline void AddLocationIfNew(DfBitmap *bmp, unsigned short x, unsigned short y) {
     // Check if pixel has already been visited by looking at alpha value.
-    DfColour *pixel = bmp->pixels + bmp->width * y + x;
+    DfColour *pixel = bmp->pixels + bmp->stride * y + x;
     if (!pixel->a) {
         if (x > 1 && x < (bmp->width-1) &&
             y > 1 && y < (bmp->height-1))
@@ -136,7 +136,7 @@ void ColourWhirlMain() {
     // function because that will set the alpha values to 255. We want them to
     // be zero, because we will use the alpha channel to keep track of which
     // pixels have been visited.
-    memset(g_window->bmp->pixels, 0, sizeof(DfColour) * g_window->bmp->width * g_window->bmp->height);
+    memset(g_window->bmp->pixels, 0, sizeof(DfColour) * g_window->bmp->stride * g_window->bmp->height);
 
     // Create the palette of colours.
     int const maxComponent = 100;
@@ -75,7 +75,7 @@ static void Render(DfWindow *win)
         {
             unsigned brightness = 15;
             unsigned char invA = 255 - brightness;
-            DfColour *pixel = &win->bmp->pixels[y * win->bmp->width] + x;
+            DfColour *pixel = &win->bmp->pixels[y * win->bmp->stride] + x;
             pixel->r = (pixel->r * invA + 255 * brightness) >> 8;
             pixel->g = pixel->r;
             pixel->b = pixel->r;
@@ -0,0 +1,432 @@
+#include "df_async_loader.h"
+
+#include "df_bmp.h"
+#include "df_common.h"
+#include "df_qoi.h"
+#include "df_thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+enum {
+    REQUEST_BMP,
+    REQUEST_QOI,
+    REQUEST_FONT,
+    REQUEST_FONT_SIZES
+};
+
+
+struct _DfLoadRequest {
+    DfAsyncLoader  *loader;
+
+    // Set when the request is made and not changed after that.
+    int             type;
+    char           *filename;
+    int             pixHeight;
+    unsigned        seqNum;         // Orders requests with the same priority.
+
+    // The rest are protected by loader->mutex, except that the worker that
+    // is running the request writes the results without it.
+    int             priority;
+    DfLoadState     state;
+    int             pendingIndex;   // Index in loader->pending, or -1.
+    bool            cancelled;      // Cancel() was called while it was running.
+    bool            released;       // Release() was called while it was running.
+
+    DfBitmap       *bitmap;
+    DfFont         *font;
+    int             numFontSizes;
+    int             fontSizes[16];
+
+    // Finished requests that haven't been collected yet. inFinishedList is
+    // needed because the head has no prev.
+    bool            inFinishedList;
+    DfLoadRequest  *finishedPrev;
+    DfLoadRequest  *finishedNext;
+
+    // Every request that hasn't been freed, for AsyncLoaderDelete().
+    DfLoadRequest  *allPrev;
+    DfLoadRequest  *allNext;
+};
+
+
+struct _DfAsyncLoader {
+    DfMutex        *mutex;
+    DfCondVar      *condVar;        // Signalled when a request becomes pending, or quit is set.
+    bool            quit;
+
+    int             numThreads;
+    DfThread      **threads;
+
+    // Pending requests, in no particular order. The workers search for the
+    // one to do next, which is cheap next to loading a file.
+    DfLoadRequest **pending;
+    int             numPending;
+    int             maxPending;
+    unsigned        nextSeqNum;
+
+    DfLoadRequest  *finishedHead;   // Oldest first.
+    DfLoadRequest  *finishedTail;
+
+    DfLoadRequest  *allHead;
+};
+
+
+// ****************************************************************************
+// Private Functions
+// ****************************************************************************
+
+// These must be called with the mutex locked.
+
+static void AddPending(DfAsyncLoader *loader, DfLoadRequest *req) {
+    if (loader->numPending == loader->maxPending) {
+        int newMax = loader->maxPending * 2;
+        DfLoadRequest **newPending = new DfLoadRequest *[newMax];
+        memcpy(newPending, loader->pending, loader->numPending * sizeof(DfLoadRequest *));
+        delete [] loader->pending;
+        loader->pending = newPending;
+        loader->maxPending = newMax;
+    }
+
+    req->pendingIndex = loader->numPending;
+    loader->pending[loader->numPending] = req;
+    loader->numPending++;
+}
+
+
+static void RemovePending(DfAsyncLoader *loader, DfLoadRequest *req) {
+    int i = req->pendingIndex;
+    loader->numPending--;
+    loader->pending[i] = loader->pending[loader->numPending];
+    loader->pending[i]->pendingIndex = i;
+    req->pendingIndex = -1;
+}
+
+
+static DfLoadRequest *FindHighestPriority(DfAsyncLoader *loader) {
+    DfLoadRequest *best = loader->pending[0];
+    for (int i = 1; i < loader->numPending; i++) {
+        DfLoadRequest *req = loader->pending[i];
+        if (req->priority > best->priority ||
+            (req->priority == best->priority && (int)(req->seqNum - best->seqNum) < 0))
+            best = req;
+    }
+    return best;
+}
+
+
+static void AddToFinishedList(DfAsyncLoader *loader, DfLoadRequest *req) {
+    req->inFinishedList = true;
+    req->finishedPrev = loader->finishedTail;
+    req->finishedNext = NULL;
+    if (loader->finishedTail)
+        loader->finishedTail->finishedNext = req;
+    else
+        loader->finishedHead = req;
+    loader->finishedTail = req;
+}
+
+
+static void RemoveFromFinishedList(DfAsyncLoader *loader, DfLoadRequest *req) {
+    if (req->finishedPrev)
+        req->finishedPrev->finishedNext = req->finishedNext;
+    else
+        loader->finishedHead = req->finishedNext;
+    if (req->finishedNext)
+        req->finishedNext->finishedPrev = req->finishedPrev;
+    else
+        loader->finishedTail = req->finishedPrev;
+    req->inFinishedList = false;
+}
+
+
+static void DeleteResults(DfLoadRequest *req) {
+    if (req->bitmap) {
+        BitmapDelete(req->bitmap);
+        req->bitmap = NULL;
+    }
+    if (req->font) {
+        FontDelete(req->font);
+        req->font = NULL;
+    }
+}
+
+
+static void FreeRequest(DfAsyncLoader *loader, DfLoadRequest *req) {
+    if (req->pendingIndex >= 0)
+        RemovePending(loader, req);
+    if (req->inFinishedList)
+        RemoveFromFinishedList(loader, req);
+
+    if (req->allPrev)
+        req->allPrev->allNext = req->allNext;
+    else
+        loader->allHead = req->allNext;
+    if (req->allNext)
+        req->allNext->allPrev = req->allPrev;
+
+    DeleteResults(req);
+    delete [] req->filename;
+    delete req;
+}
+
+
+// Called by the worker without the mutex. Returns false if the load failed.
+static bool RunRequest(DfLoadRequest *req) {
+    switch (req->type) {
+    case REQUEST_BMP:
+        req->bitmap = TryLoadBmp(req->filename);
+        return req->bitmap != NULL;
+    case REQUEST_QOI:
+        req->bitmap = TryLoadQoi(req->filename);
+        return req->bitmap != NULL;
+    case REQUEST_FONT:
+        req->font = LoadFontFromFile(req->filename, req->pixHeight);
+        return req->font != NULL;
+    case REQUEST_FONT_SIZES:
+        req->numFontSizes = ListFontSizesInFile(req->filename, req->fontSizes);
+        return req->numFontSizes > 0;
+    }
+    return false;
+}
+
+
+static void WorkerThreadFunc(void *arg) {
+    DfAsyncLoader *loader = (DfAsyncLoader *)arg;
+
+    MutexLock(loader->mutex);
+    while (1) {
+        while (loader->numPending == 0 && !loader->quit)
+            CondVarWait(loader->condVar, loader->mutex);
+        if (loader->quit)
+            break;
+
+        DfLoadRequest *req = FindHighestPriority(loader);
+        RemovePending(loader, req);
+        req->state = DF_LOAD_RUNNING;
+        MutexUnlock(loader->mutex);
+
+        bool ok = RunRequest(req);
+
+        MutexLock(loader->mutex);
+        if (req->released) {
+            FreeRequest(loader, req);
+        }
+        else if (req->cancelled) {
+            DeleteResults(req);
+            req->state = DF_LOAD_CANCELLED;
+        }
+        else {
+            req->state = ok ? DF_LOAD_DONE : DF_LOAD_FAILED;
+            AddToFinishedList(loader, req);
+        }
+    }
+    MutexUnlock(loader->mutex);
+}
+
+
+static DfLoadRequest *MakeRequest(DfAsyncLoader *loader, int type, char const *filename,
+                                  int pixHeight, int priority) {
+    DfLoadRequest *req = new DfLoadRequest;
+    memset(req, 0, sizeof(DfLoadRequest));
+    req->loader = loader;
+    req->type = type;
+    req->pixHeight = pixHeight;
+    req->priority = priority;
+    req->state = DF_LOAD_PENDING;
+    req->pendingIndex = -1;
+    req->numFontSizes = -1;
+
+    int len = strlen(filename);
+    req->filename = new char [len + 1];
+    memcpy(req->filename, filename, len + 1);
+
+    MutexLock(loader->mutex);
+    req->seqNum = loader->nextSeqNum++;
+    req->allNext = loader->allHead;
+    if (loader->allHead)
+        loader->allHead->allPrev = req;
+    loader->allHead = req;
+    AddPending(loader, req);
+    CondVarSignal(loader->condVar);
+    MutexUnlock(loader->mutex);
+
+    return req;
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+DfAsyncLoader *AsyncLoaderCreate(int numThreads) {
+    if (numThreads <= 0) {
+        numThreads = GetNumCpuCores() - 1;
+        if (numThreads < 1)
+            numThreads = 1;
+    }
+
+    DfAsyncLoader *loader = new DfAsyncLoader;
+    memset(loader, 0, sizeof(DfAsyncLoader));
+    loader->mutex = MutexCreate();
+    loader->condVar = CondVarCreate();
+    loader->maxPending = 64;
+    loader->pending = new DfLoadRequest *[loader->maxPending];
+
+    loader->numThreads = numThreads;
+    loader->threads = new DfThread *[numThreads];
+    for (int i = 0; i < numThreads; i++)
+        loader->threads[i] = ThreadCreate(WorkerThreadFunc, loader);
+
+    return loader;
+}
+
+
+void AsyncLoaderDelete(DfAsyncLoader *loader) {
+    MutexLock(loader->mutex);
+    loader->quit = true;
+    CondVarBroadcast(loader->condVar);
+    MutexUnlock(loader->mutex);
+
+    // The workers finish what they're running before they see quit.
+    for (int i = 0; i < loader->numThreads; i++)
+        ThreadJoin(loader->threads[i]);
+
+    while (loader->allHead)
+        FreeRequest(loader, loader->allHead);
+
+    delete [] loader->threads;
+    delete [] loader->pending;
+    CondVarDelete(loader->condVar);
+    MutexDelete(loader->mutex);
+    delete loader;
+}
+
+
+DfLoadRequest *AsyncLoadBmp(DfAsyncLoader *loader, char const *filename, int priority) {
+    return MakeRequest(loader, REQUEST_BMP, filename, 0, priority);
+}
+
+
+DfLoadRequest *AsyncLoadQoi(DfAsyncLoader *loader, char const *filename, int priority) {
+    return MakeRequest(loader, REQUEST_QOI, filename, 0, priority);
+}
+
+
+DfLoadRequest *AsyncLoadFont(DfAsyncLoader *loader, char const *filename, int pixHeight, int priority) {
+    return MakeRequest(loader, REQUEST_FONT, filename, pixHeight, priority);
+}
+
+
+DfLoadRequest *AsyncListFontSizes(DfAsyncLoader *loader, char const *filename, int priority) {
+    return MakeRequest(loader, REQUEST_FONT_SIZES, filename, 0, priority);
+}
+
+
+int AsyncLoaderCollectFinished(DfAsyncLoader *loader, DfLoadRequest **results, int maxResults) {
+    MutexLock(loader->mutex);
+    int num = 0;
+    while (num < maxResults && loader->finishedHead) {
+        DfLoadRequest *req = loader->finishedHead;
+        RemoveFromFinishedList(loader, req);
+        results[num] = req;
+        num++;
+    }
+    MutexUnlock(loader->mutex);
+    return num;
+}
+
+
+int AsyncLoaderGetNumPending(DfAsyncLoader *loader) {
+    MutexLock(loader->mutex);
+    int num = loader->numPending;
+    MutexUnlock(loader->mutex);
+    return num;
+}
+
+
+DfLoadState LoadRequestGetState(DfLoadRequest *req) {
+    MutexLock(req->loader->mutex);
+    DfLoadState state = req->state;
+    MutexUnlock(req->loader->mutex);
+    return state;
+}
+
+
+bool LoadRequestIsFinished(DfLoadRequest *req) {
+    DfLoadState state = LoadRequestGetState(req);
+    return state == DF_LOAD_DONE || state == DF_LOAD_FAILED || state == DF_LOAD_CANCELLED;
+}
+
+
+void LoadRequestSetPriority(DfLoadRequest *req, int priority) {
+    MutexLock(req->loader->mutex);
+    req->priority = priority;
+    MutexUnlock(req->loader->mutex);
+}
+
+
+void LoadRequestCancel(DfLoadRequest *req) {
+    DfAsyncLoader *loader = req->loader;
+    MutexLock(loader->mutex);
+    if (req->state == DF_LOAD_PENDING) {
+        RemovePending(loader, req);
+        req->state = DF_LOAD_CANCELLED;
+    }
+    else if (req->state == DF_LOAD_RUNNING) {
+        req->cancelled = true;
+    }
+    MutexUnlock(loader->mutex);
+}
+
+
+DfBitmap *LoadRequestTakeBitmap(DfLoadRequest *req) {
+    MutexLock(req->loader->mutex);
+    DfBitmap *bitmap = NULL;
+    if (req->state == DF_LOAD_DONE) {
+        bitmap = req->bitmap;
+        req->bitmap = NULL;
+    }
+    MutexUnlock(req->loader->mutex);
+    return bitmap;
+}
+
+
+DfFont *LoadRequestTakeFont(DfLoadRequest *req) {
+    MutexLock(req->loader->mutex);
+    DfFont *font = NULL;
+    if (req->state == DF_LOAD_DONE) {
+        font = req->font;
+        req->font = NULL;
+    }
+    MutexUnlock(req->loader->mutex);
+    return font;
+}
+
+
+int LoadRequestGetFontSizes(DfLoadRequest *req, int result[16]) {
+    MutexLock(req->loader->mutex);
+    int num = -1;
+    if (req->state == DF_LOAD_DONE && req->type == REQUEST_FONT_SIZES) {
+        num = req->numFontSizes;
+        memcpy(result, req->fontSizes, num * sizeof(int));
+    }
+    MutexUnlock(req->loader->mutex);
+    return num;
+}
+
+
+void LoadRequestRelease(DfLoadRequest *req) {
+    DfAsyncLoader *loader = req->loader;
+    MutexLock(loader->mutex);
+    if (req->state == DF_LOAD_RUNNING) {
+        // The worker frees it when it has finished.
+        req->released = true;
+        req->cancelled = true;
+    }
+    else {
+        FreeRequest(loader, req);
+    }
+    MutexUnlock(loader->mutex);
+}
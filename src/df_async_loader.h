@@ -0,0 +1,94 @@
+// An async loader loads images and fonts on worker threads, so that the
+// thread that draws the frames never waits for a file. Each request returns a
+// DfLoadRequest handle straight away. The app can then either poll the
+// handles it cares about from its frame loop, or collect whatever has
+// finished in a batch with AsyncLoaderCollectFinished().
+//
+// Pending requests are started highest priority first, and in the order they
+// were made when the priorities are equal. A thumbnail browser, for example,
+// can raise the priority of the thumbnails that are on screen, and cancel the
+// requests for the ones that have scrolled a long way off.
+//
+// Images are loaded with TryLoadBmp() and TryLoadQoi(), so a corrupt image
+// gives DF_LOAD_FAILED rather than stopping the program from a worker thread.
+
+#pragma once
+
+
+#include "df_bitmap.h"
+#include "df_font.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+typedef struct _DfAsyncLoader DfAsyncLoader;
+typedef struct _DfLoadRequest DfLoadRequest;
+
+typedef enum {
+    DF_LOAD_PENDING,    // Waiting for a worker.
+    DF_LOAD_RUNNING,
+    DF_LOAD_DONE,
+    DF_LOAD_FAILED,     // The load function returned NULL or an error.
+    DF_LOAD_CANCELLED
+} DfLoadState;
+
+
+// numThreads is the number of worker threads. 0 means one less than the
+// number of CPU cores, but at least 1.
+DLL_API DfAsyncLoader *AsyncLoaderCreate    (int numThreads);
+
+// Cancels the pending requests, waits for the running ones and then deletes
+// every request and any results that haven't been taken. All the loader's
+// DfLoadRequest handles are invalid afterwards.
+DLL_API void        AsyncLoaderDelete       (DfAsyncLoader *loader);
+
+// These make a copy of filename. Bigger priorities are loaded first.
+DLL_API DfLoadRequest *AsyncLoadBmp         (DfAsyncLoader *loader, char const *filename, int priority);
+DLL_API DfLoadRequest *AsyncLoadQoi         (DfAsyncLoader *loader, char const *filename, int priority);
+DLL_API DfLoadRequest *AsyncLoadFont        (DfAsyncLoader *loader, char const *filename, int pixHeight, int priority);
+DLL_API DfLoadRequest *AsyncListFontSizes   (DfAsyncLoader *loader, char const *filename, int priority);
+
+// Fills results with requests that have finished, as DONE or FAILED, since
+// they were last collected, oldest first. Each request is only returned once.
+// Returns the number written. Collecting a request doesn't release it.
+DLL_API int         AsyncLoaderCollectFinished(DfAsyncLoader *loader, DfLoadRequest **results, int maxResults);
+
+DLL_API int         AsyncLoaderGetNumPending(DfAsyncLoader *loader);
+
+
+DLL_API DfLoadState LoadRequestGetState     (DfLoadRequest *req);
+
+// True if the state is DONE, FAILED or CANCELLED.
+DLL_API bool        LoadRequestIsFinished   (DfLoadRequest *req);
+
+// Only has an effect while the request is pending.
+DLL_API void        LoadRequestSetPriority  (DfLoadRequest *req, int priority);
+
+// A pending request is never started. A running one finishes, but its result
+// is thrown away. Either way the state becomes CANCELLED and the request is
+// not returned by AsyncLoaderCollectFinished(). Finished requests are left
+// alone.
+DLL_API void        LoadRequestCancel       (DfLoadRequest *req);
+
+// These return NULL unless the request is DONE. They pass ownership of the
+// result to the caller, so the second call for the same request returns NULL.
+DLL_API DfBitmap   *LoadRequestTakeBitmap   (DfLoadRequest *req);
+DLL_API DfFont     *LoadRequestTakeFont     (DfLoadRequest *req);
+
+// Copies the result of AsyncListFontSizes() into result and returns the
+// number of sizes, or -1 unless the request is DONE.
+DLL_API int         LoadRequestGetFontSizes (DfLoadRequest *req, int result[16]);
+
+// Cancels the request if it hasn't finished, deletes any result that hasn't
+// been taken, and invalidates the handle. Every request must be released, or
+// left for AsyncLoaderDelete().
+DLL_API void        LoadRequestRelease      (DfLoadRequest *req);
+
+
+#ifdef __cplusplus
+}
+#endif
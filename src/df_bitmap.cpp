@@ -1,9 +1,13 @@
 #include "df_bitmap.h"
 
+#include "df_blend.h"
 #include "df_colour.h"
 #include "df_common.h"
+#include "df_scaler.h"
+#include "df_thread.h"
 
 //#include <algorithm>
+#include <limits.h>
 #include <math.h>
 #include <memory.h>
 #include <stdint.h>
@@ -19,30 +23,225 @@ static inline void __movsb(unsigned char *dst, unsigned char *src, size_t n) {
 #endif
 
 
+// Rows are padded to a multiple of this many bytes and the pixel data is
+// aligned to it, so that every row starts on a cache line boundary.
+enum { ROW_ALIGNMENT = 64 };
+
+
+static DfBitmap *BitmapAlloc(int width, int height) {
+    DfBitmap *bmp = new DfBitmap;
+    bmp->width = width;
+    bmp->height = height;
+    ClearClipRect(bmp);
+    bmp->damage = NULL;
+    bmp->_allocation = NULL;
+    return bmp;
+}
+
+
 DfBitmap *BitmapCreate(int width, int height) {
-	DfBitmap *bmp = new DfBitmap;
-	bmp->width = width;
-	bmp->height = height;
+    DfBitmap *bmp = BitmapAlloc(width, height);
+
+    int const pixelsPerAlignment = ROW_ALIGNMENT / sizeof(DfColour);
+    bmp->stride = (width + pixelsPerAlignment - 1) & ~(pixelsPerAlignment - 1);
 
-    bmp->clipLeft = 0;
-    bmp->clipRight = width;
-    bmp->clipTop = 0;
-    bmp->clipBottom = height;
+    size_t numBytes = (size_t)bmp->stride * height * sizeof(DfColour);
+    char *allocation = new char[numBytes + ROW_ALIGNMENT - 1];
+    DebugAssert(allocation);
+    bmp->_allocation = allocation;
 
-	bmp->pixels = new DfColour[width * height];
-	DebugAssert(bmp->pixels);
+    uintptr_t alignedAddr = ((uintptr_t)allocation + ROW_ALIGNMENT - 1) & ~(uintptr_t)(ROW_ALIGNMENT - 1);
+    bmp->pixels = (DfColour *)alignedAddr;
 
     return bmp;
 }
 
 
+DfBitmap *BitmapWrap(DfColour *pixels, int width, int height, int stride) {
+    DebugAssert(stride >= width);
+    DfBitmap *bmp = BitmapAlloc(width, height);
+    bmp->stride = stride;
+    bmp->pixels = pixels;
+    return bmp;
+}
+
+
+DfBitmap *BitmapCreateView(DfBitmap *parent, int x, int y, int w, int h) {
+    ReleaseAssert(x >= 0 && y >= 0 && w >= 0 && h >= 0 &&
+                  x + w <= parent->width && y + h <= parent->height,
+                  "BitmapCreateView: %dx%d at %d,%d is outside %dx%d parent",
+                  w, h, x, y, parent->width, parent->height);
+    return BitmapWrap(parent->pixels + parent->stride * y + x, w, h, parent->stride);
+}
+
+
 void BitmapDelete(DfBitmap *bmp) {
-	delete [] bmp->pixels;
-	bmp->pixels = NULL;
+    delete [] (char *)bmp->_allocation;
+    delete bmp->damage;
     delete bmp;
 }
 
 
+// ****************************************************************************
+// Damage tracking
+// ****************************************************************************
+
+// If merging two damage rects would add fewer than this many undamaged pixels
+// to the region, they are merged. Sending a few thousand extra pixels to the
+// screen is cheaper than the overhead of an extra request.
+enum { DAMAGE_MERGE_SLACK = 4096 };
+
+
+static int RectArea(DfRect const *r) {
+    return r->w * r->h;
+}
+
+
+static DfRect RectUnion(DfRect const *a, DfRect const *b) {
+    DfRect u;
+    u.x = IntMin(a->x, b->x);
+    u.y = IntMin(a->y, b->y);
+    u.w = IntMax(a->x + a->w, b->x + b->w) - u.x;
+    u.h = IntMax(a->y + a->h, b->y + b->h) - u.y;
+    return u;
+}
+
+
+void BitmapEnableDamageTracking(DfBitmap *bmp, bool enable) {
+    if (!enable) {
+        delete bmp->damage;
+        bmp->damage = NULL;
+        return;
+    }
+
+    if (!bmp->damage)
+        bmp->damage = new DfDamage;
+    bmp->damage->numRects = 0;
+    bmp->damage->hasScroll = false;
+    BitmapAddDamage(bmp, 0, 0, bmp->width, bmp->height);
+}
+
+
+void BitmapAddDamage(DfBitmap *bmp, int x, int y, int w, int h) {
+    DfDamage *damage = bmp->damage;
+    if (!damage) return;
+
+    // Clip against the bitmap. Not against the clip rect, so that a primitive
+    // that doesn't honour the clip rect can't leave stale pixels on screen.
+    int x2 = IntMin(x + w, bmp->width);
+    int y2 = IntMin(y + h, bmp->height);
+    DfRect r;
+    r.x = IntMax(x, 0);
+    r.y = IntMax(y, 0);
+    r.w = x2 - r.x;
+    r.h = y2 - r.y;
+    if (r.w <= 0 || r.h <= 0) return;
+
+    // Fast path - the rect is inside or next to the last rect that was added
+    // to. This is the common case when something is drawn a pixel at a time,
+    // or when a primitive adds its bounding box and then plots pixels in it.
+    if (damage->numRects > 0) {
+        DfRect *last = &damage->rects[damage->lastRect];
+        DfRect u = RectUnion(&r, last);
+        if (RectArea(&u) - RectArea(&r) - RectArea(last) <= DAMAGE_MERGE_SLACK) {
+            *last = u;
+            return;
+        }
+    }
+
+    // The rect might be covered by one of the others. This is common when a
+    // primitive adds its bounding box and then draws with other primitives.
+    for (int i = 0; i < damage->numRects; i++) {
+        DfRect *d = &damage->rects[i];
+        if (r.x >= d->x && r.y >= d->y && r.x + r.w <= d->x + d->w && r.y + r.h <= d->y + d->h)
+            return;
+    }
+
+    // Merge with any existing rects that are close enough. The merged rect
+    // might now be close enough to rects we've already looked at, so start
+    // again after each merge.
+    for (int i = 0; i < damage->numRects;) {
+        DfRect u = RectUnion(&r, &damage->rects[i]);
+        if (RectArea(&u) - RectArea(&r) - RectArea(&damage->rects[i]) <= DAMAGE_MERGE_SLACK) {
+            r = u;
+            damage->numRects--;
+            damage->rects[i] = damage->rects[damage->numRects];
+            i = 0;
+        }
+        else {
+            i++;
+        }
+    }
+
+    // If the list is full, merge with the rect that grows least.
+    if (damage->numRects == DF_MAX_DAMAGE_RECTS) {
+        int bestIdx = 0;
+        int bestGrowth = INT_MAX;
+        for (int i = 0; i < damage->numRects; i++) {
+            DfRect u = RectUnion(&r, &damage->rects[i]);
+            int growth = RectArea(&u) - RectArea(&damage->rects[i]);
+            if (growth < bestGrowth) {
+                bestGrowth = growth;
+                bestIdx = i;
+            }
+        }
+
+        damage->rects[bestIdx] = RectUnion(&r, &damage->rects[bestIdx]);
+        damage->lastRect = bestIdx;
+        return;
+    }
+
+    damage->rects[damage->numRects] = r;
+    damage->lastRect = damage->numRects;
+    damage->numRects++;
+}
+
+
+void BitmapClearDamage(DfBitmap *bmp) {
+    if (bmp->damage) {
+        bmp->damage->numRects = 0;
+        bmp->damage->hasScroll = false;
+    }
+}
+
+
+static bool RectsIntersect(DfRect const *a, DfRect const *b) {
+    return a->x < b->x + b->w && b->x < a->x + a->w &&
+           a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+
+// Records the move if the screen can repeat it. It can't if there's already
+// a move recorded, or if the pixels being moved have been drawn since the
+// last UpdateWin(), because then the screen doesn't have them yet.
+static void AddScrollDamage(DfBitmap *bmp, DfRect const *src, int x, int y, int w, int h, int dx, int dy) {
+    DfDamage *damage = bmp->damage;
+    bool canRecord = !damage->hasScroll;
+    for (int i = 0; i < damage->numRects && canRecord; i++)
+        canRecord = !RectsIntersect(&damage->rects[i], src);
+
+    if (!canRecord) {
+        BitmapAddDamage(bmp, x, y, w, h);
+        return;
+    }
+
+    damage->hasScroll = true;
+    damage->scrollRect = *src;
+    damage->scrollDx = dx;
+    damage->scrollDy = dy;
+
+    if (dy > 0) BitmapAddDamage(bmp, x, y, w, dy);
+    else if (dy < 0) BitmapAddDamage(bmp, x, y + h + dy, w, -dy);
+    if (dx > 0) BitmapAddDamage(bmp, x, y, dx, h);
+    else if (dx < 0) BitmapAddDamage(bmp, x + w + dx, y, -dx, h);
+}
+
+
+// ****************************************************************************
+// Drawing functions
+// ****************************************************************************
+
+
 void SetClipRect(DfBitmap *bmp, int x, int y, int w, int h) {
     bmp->clipLeft = IntMax(0, x);
     bmp->clipTop = IntMax(0, y);
@@ -66,7 +265,7 @@ void ClearClipRect(DfBitmap *bmp) {
 }
 
 
-#define GetLine(bmp, y) ((bmp)->pixels + (bmp)->width * (y))
+#define GetLine(bmp, y) ((bmp)->pixels + (bmp)->stride * (y))
 
 
 void BitmapClear(DfBitmap *bmp, DfColour colour) {
@@ -74,6 +273,46 @@ void BitmapClear(DfBitmap *bmp, DfColour colour) {
 }
 
 
+void BitmapScroll(DfBitmap *bmp, int x, int y, int w, int h, int dx, int dy) {
+    int x2 = IntMin(x + w, bmp->clipRight);
+    int y2 = IntMin(y + h, bmp->clipBottom);
+    x = IntMax(x, bmp->clipLeft);
+    y = IntMax(y, bmp->clipTop);
+    w = x2 - x;
+    h = y2 - y;
+    if (w <= 0 || h <= 0 || (dx == 0 && dy == 0))
+        return;
+
+    // Nothing stays inside the rect.
+    if (abs(dx) >= w || abs(dy) >= h) {
+        BitmapAddDamage(bmp, x, y, w, h);
+        return;
+    }
+
+    // The part of the rect whose pixels are still inside it after the move.
+    DfRect src;
+    src.x = x + IntMax(-dx, 0);
+    src.y = y + IntMax(-dy, 0);
+    src.w = w - abs(dx);
+    src.h = h - abs(dy);
+
+    // memmove() copes with the overlap within a row. Moving down, the rows
+    // are copied bottom up so that each is read before it is overwritten.
+    int rowBytes = src.w * sizeof(DfColour);
+    if (dy > 0) {
+        for (int i = src.h - 1; i >= 0; i--)
+            memmove(GetLine(bmp, src.y + dy + i) + src.x + dx, GetLine(bmp, src.y + i) + src.x, rowBytes);
+    }
+    else {
+        for (int i = 0; i < src.h; i++)
+            memmove(GetLine(bmp, src.y + dy + i) + src.x + dx, GetLine(bmp, src.y + i) + src.x, rowBytes);
+    }
+
+    if (bmp->damage)
+        AddScrollDamage(bmp, &src, x, y, w, h, dx, dy);
+}
+
+
 DfColour GetPixUnclipped(DfBitmap *bmp, int x, int y) {
 	return GetLine(bmp, y)[x];
 }
@@ -96,6 +335,9 @@ DfColour GetPix(DfBitmap *bmp, int x, int y) {
 
 
 void HLineUnclipped(DfBitmap *bmp, int x, int y, int len, DfColour c) {
+    if (bmp->damage)
+        BitmapAddDamage(bmp, x, y, len, 1);
+
     DfColour * __restrict row = GetLine(bmp, y) + x;
     if (c.a == 255) {
 #ifdef _MSC_VER
@@ -106,18 +348,7 @@ void HLineUnclipped(DfBitmap *bmp, int x, int y, int len, DfColour c) {
 #endif
     }
     else {
-        unsigned crb = (c.c & 0xff00ff) * c.a;
-        unsigned cg = c.g * c.a;
-
-        unsigned char invA = 255 - c.a;
-        for (int i = 0; i < len; i++) {
-            DfColour *pixel = row + i;
-            unsigned rb = (pixel->c & 0xff00ff) * invA + crb;
-            unsigned g = pixel->g * invA + cg;
-
-            pixel->c = rb >> 8;
-            pixel->g = g >> 8;
-        }
+        BlendSpan(row, len, c);
     }
 }
 
@@ -147,8 +378,11 @@ void HLine(DfBitmap *bmp, int x, int y, int len, DfColour c) {
 
 
 void VLineUnclipped(DfBitmap *bmp, int x, int y, int len, DfColour c) {
+    if (bmp->damage)
+        BitmapAddDamage(bmp, x, y, 1, len);
+
     DfColour * __restrict pixel = GetLine(bmp, y) + x;
-    int const bw = bmp->width;
+    int const bw = bmp->stride;
     if (c.a == 255) {
         for (int i = 0; i < len; i++) {
             *pixel = c;
@@ -318,16 +552,23 @@ void DrawLine(DfBitmap *bmp, int x1, int y1, int x2, int y2, DfColour colour) {
         }
     }
 
+    if (bmp->damage)
+        BitmapAddDamage(bmp, IntMin(x1, x2), y1, abs(xDelta) + 1, yDelta + 1);
+
     int xAdvance = 1;
     if (xDelta < 0) {
         xAdvance = -1;
         xDelta = -xDelta;
     }
 
-    // Special case diagonal line
+    // Special case diagonal line. The damage has already been added, so it
+    // isn't recorded again for each pixel.
     if (xDelta == yDelta) {
+        DfDamage *damage = bmp->damage;
+        bmp->damage = NULL;
         for (int i = 0; i <= xDelta; i++)
             PutPixUnclipped(bmp, x1 + i * xAdvance, y1 + i, colour);
+        bmp->damage = damage;
         return;
     }
 
@@ -375,7 +616,7 @@ void DrawLine(DfBitmap *bmp, int x1, int y1, int x2, int y2, DfColour colour) {
             *pixel = colour;
             pixel += xAdvance;
         }
-        pixel += bmp->width;
+        pixel += bmp->stride;
 
         // Do the main loop
         for (int i = 0; i < yDelta - 1; i++) {
@@ -389,7 +630,7 @@ void DrawLine(DfBitmap *bmp, int x1, int y1, int x2, int y2, DfColour colour) {
                 *pixel = colour;
                 pixel += xAdvance;
             }
-            pixel += bmp->width;
+            pixel += bmp->stride;
         }
 
         // Draw the last partial run
@@ -415,7 +656,7 @@ void DrawLine(DfBitmap *bmp, int x1, int y1, int x2, int y2, DfColour colour) {
             errorTerm += xDelta;
 
         // Draw vertical run
-        int lineInc = bmp->width;
+        int lineInc = bmp->stride;
         for (; initialPixelCount; initialPixelCount--) {
             *pixel = colour;
             pixel += lineInc;
@@ -535,6 +776,9 @@ void RectFill(DfBitmap *bmp, int x1, int y1, int w, int h, DfColour c) {
     w = x2 - x1;
     if (w <= 0) return;
 
+    if (bmp->damage)
+        BitmapAddDamage(bmp, x1, y1, w, y2 - y1);
+
     DfColour * __restrict line = GetLine(bmp, y1) + x1;
     if (c.a == 255) {
         for (int a = y1; a < y2; a++) {
@@ -544,13 +788,15 @@ void RectFill(DfBitmap *bmp, int x1, int y1, int w, int h, DfColour c) {
             for (int b = 0; b < w; b++)
                 line[b].c = c.c;
 #endif
-            line += bmp->width;
+            line += bmp->stride;
         }
     }
     else
     {
-        for (int a = y1; a < y2; a++)
-            HLineUnclipped(bmp, x1, a, w, c);
+        for (int a = y1; a < y2; a++) {
+            BlendSpan(line, w, c);
+            line += bmp->stride;
+        }
     }
 }
 
@@ -564,6 +810,13 @@ void RectOutline(DfBitmap *bmp, int x, int y, int w, int h, DfColour c) {
 
 
 void CircleOutline(DfBitmap *bmp, int x0, int y0, int radius, DfColour c) {
+    // Add the bounding box once, instead of recording damage for each pixel.
+    DfDamage *damage = bmp->damage;
+    if (damage) {
+        BitmapAddDamage(bmp, x0 - radius, y0 - radius, radius * 2 + 1, radius * 2 + 1);
+        bmp->damage = NULL;
+    }
+
     // This is the standard Bresenham or Mid-point circle algorithm
     int x = radius;
     int y = 0;
@@ -587,10 +840,15 @@ void CircleOutline(DfBitmap *bmp, int x0, int y0, int radius, DfColour c) {
             radiusError += 2 * (y - x + 1);
         }
     } while (x >= y);
+
+    bmp->damage = damage;
 }
 
 
 void CircleFill(DfBitmap *bmp, int x0, int y0, int radius, DfColour c) {
+    if (bmp->damage)
+        BitmapAddDamage(bmp, x0 - radius, y0 - radius, radius * 2 + 1, radius * 2 + 1);
+
     int x = radius;
     int y = 0;
     int radiusError = 1 - x;
@@ -624,6 +882,13 @@ static void EllipsePlotPoints(DfBitmap *bmp, int x0, int y0, int x, int y, DfCol
 
 
 void EllipseOutline(DfBitmap *bmp, int x0, int y0, int rx, int ry, DfColour c) {
+    // Add the bounding box once, instead of recording damage for each pixel.
+    DfDamage *damage = bmp->damage;
+    if (damage) {
+        BitmapAddDamage(bmp, x0 - rx, y0 - ry, rx * 2 + 1, ry * 2 + 1);
+        bmp->damage = NULL;
+    }
+
     int rxSqrd = rx * rx;
     int rySqrd = ry * ry;
     int x = 0;
@@ -665,6 +930,8 @@ void EllipseOutline(DfBitmap *bmp, int x0, int y0, int rx, int ry, DfColour c) {
 
         EllipsePlotPoints(bmp, x0, y0, x, y, c);
     }
+
+    bmp->damage = damage;
 }
 
 
@@ -675,6 +942,9 @@ static void EllipsePlotHlines(DfBitmap *bmp, int x0, int y0, int x, int y, DfCol
 
 
 void EllipseFill(DfBitmap *bmp, int x0, int y0, int rx, int ry, DfColour c) {
+    if (bmp->damage)
+        BitmapAddDamage(bmp, x0 - rx, y0 - ry, rx * 2 + 1, ry * 2 + 1);
+
     int rxSqrd = rx * rx;
     int rySqrd = ry * ry;
     int x = 0;
@@ -746,6 +1016,9 @@ static void BlitClip(DfBitmap *destBmp, int *dx, int *dy, DfBitmap *srcBmp,
 
     if (*w <= 0)
         *h = 0;
+
+    if (destBmp->damage)
+        BitmapAddDamage(destBmp, *dx, *dy, *w, *h);
 }
 
 
@@ -780,6 +1053,9 @@ void Blit(DfBitmap *destBmp, int dx, int dy, DfBitmap *srcBmp) {
 
 
 void BlitEx(DfBitmap *destBmp, int dx, int dy, DfBitmap *srcBmp, int sx, int sy, int w, int h) {
+    if (destBmp->damage)
+        BitmapAddDamage(destBmp, dx, dy, w, h);
+
     for (int y = 0; y < h; y++) {
         DfColour *srcLine = GetLine(srcBmp, sy + y) + sx;
         DfColour *destLine = GetLine(destBmp, dy + y) + dx;
@@ -796,8 +1072,11 @@ void ScaleDownBlit(DfBitmap *dest, int x, int y, int scale, DfBitmap *src) {
     int outH = src->height / scale;
     float scaleSqrd = 1.0 / (scale * scale);
 
+    if (dest->damage)
+        BitmapAddDamage(dest, x, y, outW, outH);
+
     for (int dy = 0; dy < outH; dy++) {
-        DfColour *pixel = dest->pixels + (y + dy) * dest->width;
+        DfColour *pixel = GetLine(dest, y + dy);
         for (int dx = 0; dx < outW; dx++) {
             int r = 0, g = 0, b = 0;
             for (int sy = dy * scale; sy < (dy+1) * scale; sy++) {
@@ -823,8 +1102,11 @@ void ScaleDownBlit(DfBitmap *dest, int x, int y, int scale, DfBitmap *src) {
 
 
 void ScaleUpBlit(DfBitmap *dest, int x, int y, int scale, DfBitmap *src) {
-    int maxSx = IntMin(src->width, (dest->width + x) / scale);
-    int maxSy = IntMin(src->height, (dest->clipBottom + y) / scale);
+    int maxSx = IntMin(src->width, (dest->clipRight - x) / scale);
+    int maxSy = IntMin(src->height, (dest->clipBottom - y + scale - 1) / scale);
+
+    if (dest->damage)
+        BitmapAddDamage(dest, x, y, maxSx * scale, maxSy * scale);
 
     for (int sy = 0; sy < maxSy; sy++) {
         for (int j = 0; j < scale; j++) {
@@ -847,199 +1129,85 @@ void ScaleUpBlit(DfBitmap *dest, int x, int y, int scale, DfBitmap *src) {
 }
 
 
-struct SrcXandWeights {
-    uint8_t weightX, weightX2;
-    uint16_t srcX;
+// StretchBlit() keeps the scalers for the last few sizes it was used with, so
+// that drawing the same bitmap at the same size every frame doesn't rebuild
+// the tables. Any thread can use an entry. refCount stops an entry from being
+// replaced while a blit is using it.
+struct StretchCacheEntry {
+    DfScaler *scaler;       // NULL if the entry is empty.
+    int srcW, srcH, dstW, dstH;
+    int refCount;
+    unsigned lastUsed;
 };
 
-void StretchBlit(DfBitmap *dstBmp, int dstX, int dstY, int dstW, int dstH, DfBitmap *srcBmp) {
-    if (srcBmp->width < dstW && srcBmp->height < dstH) {
-        // *** Bilinear upscale ***
-
-        unsigned heightRatio = (double)(1 << 8) * 255.5 * srcBmp->height / dstH;
-        unsigned widthRatio = (double)(1 << 8) * 255.5 * srcBmp->width / dstW;
-
-        // Start of clipping.
-        if (dstX + dstW <= dstBmp->clipLeft || dstX >= dstBmp->clipRight) return;
-
-        double widthRatioFloat = (double)srcBmp->width / dstW;
-        int srcXMin = 0;
-        int srcXMax = srcBmp->width;
-        int srcXErr = 0;
-        if (dstX < dstBmp->clipLeft) {
-            int amtToClip = dstBmp->clipLeft - dstX;
-            dstW -= amtToClip;
-            dstX += amtToClip;
-            double tmp = amtToClip * widthRatioFloat;
-            srcXMin = tmp;
-            srcXErr = (tmp - srcXMin) * 256.0;
-        }
-
-        if (dstX + dstW >= dstBmp->clipRight) {
-            int amtToClip = dstX + dstW - dstBmp->clipRight;
-            dstW -= amtToClip;
-            srcXMax -= amtToClip * widthRatioFloat - 1.5;
-            if (srcXMax > srcBmp->width) srcXMax = srcBmp->width;
-        }
-
-        if (dstY + dstH >= dstBmp->clipBottom) {
-            int amtToClip = dstY + dstH - dstBmp->clipBottom;
-            dstH -= amtToClip;
-        }
-        // End of clipping.
-
-        // (Re)allocate LUT if needed.
-        static SrcXandWeights *lut = NULL;
-        static int lutSize = 0;
-        if (lutSize < dstW) {
-            delete [] lut;
-            lut = new SrcXandWeights [dstW];
-            lutSize = dstW;
-        }
-
-        // Populate LUT.
-        for (int x = 0; x < dstW; x++) {
-            int srcXAndWeight = ((x * widthRatio) >> 8) + srcXErr;
-            lut[x].srcX = srcXAndWeight >> 8;
-            lut[x].weightX2 = srcXAndWeight & 0xFF;
-            lut[x].weightX = 255 - lut[x].weightX2;
+enum { STRETCH_CACHE_SIZE = 8 };
+static StretchCacheEntry g_stretchCache[STRETCH_CACHE_SIZE];
+static unsigned g_stretchCacheClock = 0;
+static DfMutex *g_stretchCacheMutex = MutexCreate();
+
+
+// Returns a scaler for the sizes, and sets *entry to its cache entry, or to
+// NULL if it isn't cached and must be deleted after use.
+static DfScaler *AcquireScaler(int srcW, int srcH, int dstW, int dstH, StretchCacheEntry **entry) {
+    MutexLock(g_stretchCacheMutex);
+    for (int i = 0; i < STRETCH_CACHE_SIZE; i++) {
+        StretchCacheEntry *e = g_stretchCache + i;
+        if (e->scaler && e->srcW == srcW && e->srcH == srcH && e->dstW == dstW && e->dstH == dstH) {
+            e->refCount++;
+            e->lastUsed = ++g_stretchCacheClock;
+            MutexUnlock(g_stretchCacheMutex);
+            *entry = e;
+            return e->scaler;
         }
+    }
+    MutexUnlock(g_stretchCacheMutex);
+
+    // Built without the lock, so that other threads' blits don't wait for it.
+    DfScaler *scaler = ScalerCreate(srcW, srcH, dstW, dstH);
+
+    // Replace the least recently used entry that isn't in use.
+    MutexLock(g_stretchCacheMutex);
+    StretchCacheEntry *victim = NULL;
+    for (int i = 0; i < STRETCH_CACHE_SIZE; i++) {
+        StretchCacheEntry *e = g_stretchCache + i;
+        if (e->refCount == 0 && (!victim || e->lastUsed < victim->lastUsed))
+            victim = e;
+    }
 
-        for (int y = 0; y < dstH; y++) {
-            if (dstY + y < 0) continue;
-
-            int srcYAndWeight = (y * heightRatio) >> 8;
-            int srcY = (srcYAndWeight) >> 8;
-
-            DfColour *dstRow = &dstBmp->pixels[(y + dstY) * dstBmp->width + dstX];
-            DfColour *srcRow = &srcBmp->pixels[srcY * srcBmp->width];
-
-            unsigned weightY2 = srcYAndWeight & 0xFF;
-            unsigned weightY = 255 - weightY2;
-
-            for (int x = 0; x < srcXMax; x++) {
-                if (x < srcXMin) continue;
-
-                // Pixel 0,0
-                DfColour *srcPixel = &srcRow[x];
-                unsigned rb = (srcPixel->c & 0xff00ff) * weightY;
-                unsigned g = srcPixel->g * weightY;
-
-                // Pixel 1,0
-                srcPixel += srcBmp->width;
-                rb += (srcPixel->c & 0xff00ff) * weightY2;
-                g += srcPixel->g * weightY2;
+    if (victim) {
+        if (victim->scaler)
+            ScalerDelete(victim->scaler);
+        victim->scaler = scaler;
+        victim->srcW = srcW;
+        victim->srcH = srcH;
+        victim->dstW = dstW;
+        victim->dstH = dstH;
+        victim->refCount = 1;
+        victim->lastUsed = ++g_stretchCacheClock;
+    }
+    MutexUnlock(g_stretchCacheMutex);
 
-                dstRow[x - srcXMin].c = rb >> 8;
-                dstRow[x - srcXMin].g = g >> 8;
-            }
+    *entry = victim;
+    return scaler;
+}
 
-            for (int x = dstW - 1; x; x--) {
-                SrcXandWeights *sw = lut + x;
 
-                // Pixel 0,0
-                DfColour *srcPixel = &dstRow[sw->srcX];
-                unsigned rb = (srcPixel->c & 0xff00ff) * sw->weightX;
-                unsigned g = srcPixel->g * sw->weightX;
+static void ReleaseScaler(DfScaler *scaler, StretchCacheEntry *entry) {
+    if (!entry) {
+        ScalerDelete(scaler);
+        return;
+    }
 
-                // Pixel 0,1
-                srcPixel++;
-                rb += (srcPixel->c & 0xff00ff) * sw->weightX2;
-                g += srcPixel->g * sw->weightX2;
+    MutexLock(g_stretchCacheMutex);
+    entry->refCount--;
+    MutexUnlock(g_stretchCacheMutex);
+}
 
-                dstRow[x].c = rb >> 8;
-                dstRow[x].g = g >> 8;
-            }
-        }
-    }
-    else {
-        // Based on Ryan Geiss's code from http://www.geisswerks.com/ryan/FAQS/resize.html
-
-        // NOTE: THIS WILL OVERFLOW for really major downsizing (2800x2800 to 1x1 or more)
-        // (2800 ~= sqrt(2^23)) - for a lazy fix, just call this in two passes.
-
-        int srcW = srcBmp->width;
-        int srcH = srcBmp->height;
-
-        float heightRatio = 256 * srcH / (float)dstH;
-        float widthRatio = 256 * srcBmp->width / (float)dstW;
-
-        // If too many input pixels map to one output pixel, our 32-bit accumulation values
-        // could overflow - so, if we have huge mappings like that, cut down the weights:
-        //    256 max color value
-        //   *256 weight_x
-        //   *256 weight_y
-        //   *256 (16*16) maximum # of input pixels (x,y) - unless we cut the weights down...
-        int weightShift = 0;
-        float sourceTexelsPerOutPixel = (srcW / (float)dstW + 1) * (srcH / (float)dstH + 1);
-        float weightPerPixel = sourceTexelsPerOutPixel * 256 * 256;  //weight_x * weight_y
-        float accumPerPixel = weightPerPixel * 256; //color value is 0-255
-        float weightDiv = accumPerPixel / 4294967000.0f;
-        if (weightDiv > 1)
-            weightShift = (int)ceilf(logf((float)weightDiv) / logf(2.0f));
-        weightShift = IntMin(15, weightShift);  // this could go to 15 and still be ok.
-
-        // For every output pixel...
-        for (int y2 = 0; y2 < dstH; y2++) {
-            if (dstY + y2 < dstBmp->clipTop) continue;
-            if (dstY + y2 >= dstBmp->clipBottom) break;
-
-            DfColour *dstRow = dstBmp->pixels + (dstY + y2) * dstBmp->width;
-            DfColour *dest = dstRow + dstX;
-
-            // Find the y-range of input pixels that will contribute.
-            int y1a = (int)((y2)* heightRatio);
-            int y1b = (int)((y2 + 1) * heightRatio);
-            y1b = IntMin(y1b, 256 * srcH - 1);
-            int y1c = y1a >> 8;
-            int y1d = y1b >> 8;
-
-            for (int x2 = 0; x2 < dstW; x2++, dest++) {
-                if (dstX + x2 < dstBmp->clipLeft) continue;
-                if (dstX + x2 >= dstBmp->clipRight) break;
-
-                // Find the x-range of input pixels that will contribute.
-                int x1a = (int)((x2)*widthRatio);
-                int x1b = (int)((x2 + 1)*widthRatio);
-                x1b = IntMin(x1b, 256 * srcW - 1);
-                int x1c = x1a >> 8;
-                int x1d = x1b >> 8;
-
-                // Add up all input pixels contributing to this output pixel.
-                unsigned r = 0, g = 0, b = 0, a = 0;
-                for (int y = y1c; y <= y1d; y++) {
-                    unsigned weightY = 256;
-                    if (y1c != y1d) {
-                        if (y == y1c)
-                            weightY = 256 - (y1a & 0xFF);
-                        else if (y == y1d)
-                            weightY = (y1b & 0xFF);
-                    }
-
-                    DfColour *src2 = &srcBmp->pixels[y * srcW + x1c];
-                    for (int x = x1c; x <= x1d; x++) {
-                        unsigned weightX = 256;
-                        if (x1c != x1d) {
-                            if (x == x1c)
-                                weightX = 256 - (x1a & 0xFF);
-                            else if (x == x1d)
-                                weightX = (x1b & 0xFF);
-                        }
-
-                        DfColour c = *src2++;
-                        unsigned w = (weightX * weightY) >> weightShift;
-                        r += c.r * w;
-                        g += c.g * w;
-                        b += c.b * w;
-                        a += w;
-                    }
-                }
 
-                // Write results.
-                dest->r = r / a;
-                dest->g = g / a;
-                dest->b = b / a;
-            }
-        }
-    }
+void StretchBlit(DfBitmap *dstBmp, int dstX, int dstY, int dstW, int dstH, DfBitmap *srcBmp) {
+    if (dstW <= 0 || dstH <= 0) return;
+    StretchCacheEntry *entry;
+    DfScaler *scaler = AcquireScaler(srcBmp->width, srcBmp->height, dstW, dstH, &entry);
+    ScalerBlit(scaler, dstBmp, dstX, dstY, srcBmp);
+    ReleaseScaler(scaler, entry);
 }
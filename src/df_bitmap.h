@@ -17,6 +17,34 @@ extern "C"
 #endif
 
 
+enum { DF_MAX_DAMAGE_RECTS = 16 };
+
+
+typedef struct {
+    int x, y, w, h;
+} DfRect;
+
+
+// A list of the areas of a bitmap that have been drawn to. Rects that are near
+// each other are merged, so that the list stays short.
+//
+// If hasScroll is set, BitmapScroll() has moved the pixels in scrollRect by
+// (scrollDx, scrollDy) since the damage was last cleared, and the area they
+// moved to is not in the list. Something that keeps a copy of the bitmap,
+// like the screen, can repeat the move on its copy and then update the rects.
+// Anything else must treat the moved area as damaged too.
+typedef struct {
+    int numRects;
+    DfRect rects[DF_MAX_DAMAGE_RECTS];
+    int lastRect;   // Index of the rect that was added to most recently.
+
+    bool hasScroll;
+    DfRect scrollRect;
+    int scrollDx;
+    int scrollDy;
+} DfDamage;
+
+
 typedef struct _DfBitmap {
     int width;
     int height;
@@ -28,13 +56,51 @@ typedef struct _DfBitmap {
     int clipTop;
     int clipBottom;
 
+    // Number of DfColours from the start of one row to the start of the next.
+    // It is at least width. Rows can be padded, and a view into another bitmap
+    // has its parent's stride.
+    int stride;
     DfColour *pixels;
+
+    // NULL unless damage tracking is enabled. See BitmapEnableDamageTracking().
+    DfDamage *damage;
+
+    // The block that BitmapDelete() frees. NULL if the pixels are owned by
+    // someone else.
+    void *_allocation;
 } DfBitmap;
 
 
 DLL_API DfBitmap   *BitmapCreate(int width, int height);
 DLL_API void        BitmapDelete(DfBitmap *bmp);
 
+// Creates a bitmap that draws into pixel memory owned by the caller. The
+// memory must outlive the bitmap. stride is in DfColours, not bytes.
+DLL_API DfBitmap   *BitmapWrap(DfColour *pixels, int width, int height, int stride);
+
+// Creates a bitmap that aliases the specified rectangle of the parent bitmap.
+// Drawing to the view draws to the parent. The view must be deleted before the
+// parent. Damage is recorded on the view, not the parent.
+DLL_API DfBitmap   *BitmapCreateView(DfBitmap *parent, int x, int y, int w, int h);
+
+// When damage tracking is enabled, all the drawing functions record which
+// areas of the bitmap they changed. If the bitmap is a window's back buffer,
+// UpdateWin() then only sends those areas to the screen and clears the damage
+// list. This is a big saving for apps that only redraw the parts of the
+// window that have changed. The whole bitmap is marked as damaged when
+// tracking is enabled.
+DLL_API void        BitmapEnableDamageTracking(DfBitmap *bmp, bool enable);
+DLL_API void        BitmapAddDamage (DfBitmap *bmp, int x, int y, int w, int h);
+DLL_API void        BitmapClearDamage(DfBitmap *bmp);
+
+// Moves the pixels inside the rect by (dx, dy), like scrolling a text view.
+// The rect is clipped to the clip rect. Pixels moved out of it are lost, and
+// the strips that are uncovered keep their old pixels for the caller to
+// redraw. With damage tracking, only the uncovered strips are damaged and
+// the move is recorded in the DfDamage, so the window can do it on the
+// screen instead of sending every moved pixel again.
+DLL_API void        BitmapScroll    (DfBitmap *bmp, int x, int y, int w, int h, int dx, int dy);
+
 DLL_API void        SetClipRect     (DfBitmap *bmp, int x, int y, int w, int h);
 DLL_API void        GetClipRect     (DfBitmap *bmp, int *x, int *y, int *w, int *h);
 DLL_API void        ClearClipRect   (DfBitmap *bmp); // Sets bitmap's full size as the clip rect.
@@ -91,12 +157,17 @@ DLL_API void        ScaleUpBlit     (DfBitmap *destBmp, int x, int y, int scale,
 
 // Blit with arbitrary resizing. dstWidth and dstHeight specify how large the
 // output should be. Does box sampling downscale and bilinear upscale.
+// If you draw the same bitmap at the same size repeatedly, a DfScaler from
+// df_scaler.h avoids rebuilding the scaling tables each time.
 DLL_API void        StretchBlit     (DfBitmap *dst_bmp, int dstX, int dstY, int dstWidth, int dstHeight, DfBitmap *src_bmp);
 
 
 inline void PutPixUnclipped(DfBitmap *bmp, int x, int y, DfColour c)
 {
-    DfColour *pixel = (bmp->pixels + y * bmp->width) + x;
+    if (bmp->damage)
+        BitmapAddDamage(bmp, x, y, 1, 1);
+
+    DfColour *pixel = (bmp->pixels + y * bmp->stride) + x;
     if (c.a == 255)
         *pixel = c;
     else {
@@ -0,0 +1,320 @@
+#include "df_bitmap_pack.h"
+
+#include "df_common.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+#define PACK_MAGIC          0x4d424644  // "DFBM"
+#define PACK_VERSION        1
+#define PACK_ALIGNMENT      64
+#define PACK_MAX_NAME_LEN   39
+
+
+struct PackHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numImages;
+    uint32_t directoryOffset;
+    uint8_t  reserved[48];
+};
+
+
+struct PackDirEntry {
+    uint64_t pixelsOffset;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;        // In DfColours.
+    uint32_t reserved;
+    char     name[PACK_MAX_NAME_LEN + 1];
+};
+
+
+struct _DfBitmapPack {
+    uint8_t const *data;
+    size_t size;
+    PackDirEntry const *directory;
+    int numImages;
+
+#ifdef _WIN32
+    HANDLE mappingHandle;
+#endif
+};
+
+
+// ****************************************************************************
+// Private Functions
+// ****************************************************************************
+
+static size_t AlignUp(size_t val) {
+    return (val + PACK_ALIGNMENT - 1) & ~(size_t)(PACK_ALIGNMENT - 1);
+}
+
+
+static bool WriteZeros(FILE *f, size_t numBytes) {
+    static uint8_t const zeros[PACK_ALIGNMENT] = { 0 };
+    while (numBytes > 0) {
+        size_t n = numBytes < PACK_ALIGNMENT ? numBytes : PACK_ALIGNMENT;
+        if (fwrite(zeros, 1, n, f) != n)
+            return false;
+        numBytes -= n;
+    }
+    return true;
+}
+
+
+// Checks that everything the directory points at is inside the file, so that
+// nothing that is read from the pack later can go outside the mapping.
+static bool IsPackValid(uint8_t const *data, size_t size) {
+    if (size < sizeof(PackHeader))
+        return false;
+
+    PackHeader const *header = (PackHeader const *)data;
+    if (header->magic != PACK_MAGIC || header->version != PACK_VERSION)
+        return false;
+
+    uint64_t dirEnd = header->directoryOffset + (uint64_t)header->numImages * sizeof(PackDirEntry);
+    if (header->directoryOffset % PACK_ALIGNMENT != 0 || dirEnd > size)
+        return false;
+
+    PackDirEntry const *directory = (PackDirEntry const *)(data + header->directoryOffset);
+    for (unsigned i = 0; i < header->numImages; i++) {
+        PackDirEntry const *e = directory + i;
+        if (e->width == 0 || e->height == 0 || e->stride < e->width || e->width > INT32_MAX ||
+            e->height > INT32_MAX || e->stride > INT32_MAX)
+            return false;
+        if (e->pixelsOffset % PACK_ALIGNMENT != 0 || e->pixelsOffset > size)
+            return false;
+        uint64_t numBytes = (uint64_t)e->stride * e->height * sizeof(DfColour);
+        if (numBytes > size - e->pixelsOffset)
+            return false;
+        if (memchr(e->name, '\0', sizeof(e->name)) == NULL)
+            return false;
+    }
+
+    return true;
+}
+
+
+// Makes a new file next to filename to write the pack to. The name has the
+// process id and a counter in it, and "x" makes fopen() fail if the file
+// already exists, so two threads or processes saving the same pack never
+// write to the same temporary file.
+static FILE *CreateTempFile(char const *filename, char *tmpFilename, int tmpFilenameSize) {
+#ifdef _WIN32
+    unsigned pid = GetCurrentProcessId();
+#else
+    unsigned pid = getpid();
+#endif
+    static unsigned counter = 0;
+
+    for (int i = 0; i < 100; i++) {
+        int len = snprintf(tmpFilename, tmpFilenameSize, "%s.%u.%u.tmp", filename, pid, counter++);
+        if (len < 0 || len >= tmpFilenameSize)
+            return NULL;
+
+        FILE *f = fopen(tmpFilename, "wbx");
+        if (f || errno != EEXIST)
+            return f;
+    }
+
+    return NULL;
+}
+
+
+static void UnmapPack(DfBitmapPack *pack) {
+#ifdef _WIN32
+    UnmapViewOfFile(pack->data);
+    CloseHandle(pack->mappingHandle);
+#else
+    munmap((void *)pack->data, pack->size);
+#endif
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+bool BitmapPackSave(char const *filename, DfBitmap **bmps, char const **names, int numBitmaps) {
+    char tmpFilename[1024];
+    FILE *f = CreateTempFile(filename, tmpFilename, sizeof(tmpFilename));
+    if (!f)
+        return false;
+
+    PackHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PACK_MAGIC;
+    header.version = PACK_VERSION;
+    header.numImages = numBitmaps;
+    header.directoryOffset = sizeof(PackHeader);
+
+    PackDirEntry *directory = new PackDirEntry [numBitmaps];
+    memset(directory, 0, numBitmaps * sizeof(PackDirEntry));
+    size_t directoryEnd = sizeof(PackHeader) + numBitmaps * sizeof(PackDirEntry);
+    uint64_t offset = AlignUp(directoryEnd);
+    for (int i = 0; i < numBitmaps; i++) {
+        PackDirEntry *e = directory + i;
+        e->pixelsOffset = offset;
+        e->width = bmps[i]->width;
+        e->height = bmps[i]->height;
+        e->stride = AlignUp(bmps[i]->width * sizeof(DfColour)) / sizeof(DfColour);
+        if (names && names[i])
+            strncpy(e->name, names[i], PACK_MAX_NAME_LEN);
+        offset += (uint64_t)e->stride * e->height * sizeof(DfColour);
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fwrite(directory, sizeof(PackDirEntry), numBitmaps, f) == (size_t)numBitmaps;
+    ok = ok && WriteZeros(f, AlignUp(directoryEnd) - directoryEnd);
+
+    // Every image's size is a multiple of 64 bytes, so padding each row is
+    // all that's needed to keep the next image aligned.
+    for (int i = 0; i < numBitmaps && ok; i++) {
+        DfBitmap *bmp = bmps[i];
+        size_t rowBytes = bmp->width * sizeof(DfColour);
+        size_t paddingBytes = directory[i].stride * sizeof(DfColour) - rowBytes;
+        for (int y = 0; y < bmp->height && ok; y++) {
+            ok = fwrite(bmp->pixels + y * bmp->stride, rowBytes, 1, f) == 1;
+            ok = ok && WriteZeros(f, paddingBytes);
+        }
+    }
+
+    delete [] directory;
+    if (fclose(f) != 0)
+        ok = false;
+
+    if (ok) {
+#ifdef _WIN32
+        // rename() won't replace an existing file on Windows. MoveFileEx()
+        // will, but it can fail while another process has the old pack
+        // mapped. Then the old pack is left as it was and we return false.
+        ok = MoveFileExA(tmpFilename, filename, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        ok = rename(tmpFilename, filename) == 0;
+#endif
+    }
+
+    if (!ok)
+        remove(tmpFilename);
+    return ok;
+}
+
+
+DfBitmapPack *BitmapPackOpen(char const *filename) {
+    uint8_t const *data = NULL;
+    size_t size = 0;
+
+#ifdef _WIN32
+    // FILE_SHARE_DELETE gives BitmapPackSave() a chance to replace the file
+    // while it is open here.
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    LARGE_INTEGER fileSize;
+    HANDLE mappingHandle = NULL;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 && (uint64_t)fileSize.QuadPart <= SIZE_MAX) {
+        size = (size_t)fileSize.QuadPart;
+        mappingHandle = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    }
+    CloseHandle(file);
+    if (!mappingHandle)
+        return NULL;
+
+    data = (uint8_t const *)MapViewOfFile(mappingHandle, FILE_MAP_COPY, 0, 0, 0);
+    if (!data) {
+        CloseHandle(mappingHandle);
+        return NULL;
+    }
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    // The mapping is copy on write, so that drawing into a mapped bitmap only
+    // changes this process's copy of the page. Pages that aren't written to
+    // are the ones in the page cache, shared by every process that opens the
+    // pack.
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX) {
+        size = st.st_size;
+        mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return NULL;
+    data = (uint8_t const *)mapping;
+#endif
+
+    DfBitmapPack *pack = new DfBitmapPack;
+    memset(pack, 0, sizeof(DfBitmapPack));
+    pack->data = data;
+    pack->size = size;
+#ifdef _WIN32
+    pack->mappingHandle = mappingHandle;
+#endif
+
+    if (!IsPackValid(data, size)) {
+        UnmapPack(pack);
+        delete pack;
+        return NULL;
+    }
+
+    PackHeader const *header = (PackHeader const *)data;
+    pack->directory = (PackDirEntry const *)(data + header->directoryOffset);
+    pack->numImages = header->numImages;
+    return pack;
+}
+
+
+void BitmapPackClose(DfBitmapPack *pack) {
+    UnmapPack(pack);
+    delete pack;
+}
+
+
+int BitmapPackGetNumImages(DfBitmapPack *pack) {
+    return pack->numImages;
+}
+
+
+char const *BitmapPackGetName(DfBitmapPack *pack, int index) {
+    ReleaseAssert(index >= 0 && index < pack->numImages, "BitmapPackGetName: Invalid index %i", index);
+    return pack->directory[index].name;
+}
+
+
+int BitmapPackFind(DfBitmapPack *pack, char const *name) {
+    for (int i = 0; i < pack->numImages; i++) {
+        if (strcmp(pack->directory[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+
+DfBitmap *LoadBitmapMapped(DfBitmapPack *pack, int index) {
+    ReleaseAssert(index >= 0 && index < pack->numImages, "LoadBitmapMapped: Invalid index %i", index);
+    PackDirEntry const *e = pack->directory + index;
+
+    // BitmapWrap() leaves _allocation NULL, so BitmapDelete() won't try to
+    // free the mapping.
+    DfColour *pixels = (DfColour *)(pack->data + e->pixelsOffset);
+    return BitmapWrap(pixels, e->width, e->height, e->stride);
+}
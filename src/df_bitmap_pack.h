@@ -0,0 +1,65 @@
+// A bitmap pack is a file holding one or more bitmaps in exactly the layout
+// that DfBitmap uses in memory, so that loading them involves no decoding and
+// no copying. The file is memory mapped, and each bitmap's pixels point
+// straight into the mapping. The operating system shares the pages between all
+// the processes that have the pack open, and only reads in the parts that are
+// used. Packs are meant as a cache of decoded assets, made once with
+// BitmapPackSave() and then opened on each launch.
+//
+// The file extension is .dfbm. The layout is:
+//   * A 64 byte header: "DFBM", then the version, the number of images and
+//     the offset of the directory, as little-endian uint32s.
+//   * The directory: one 64 byte entry per image, holding the offset of its
+//     pixels, its width, height and stride, and its name.
+//   * The pixels of each image, in BGRA order, top row first. Each image
+//     starts at a multiple of 64 bytes and each row is padded to a multiple
+//     of 64 bytes, like the rows of a bitmap from BitmapCreate().
+
+#pragma once
+
+
+#include "df_bitmap.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+typedef struct _DfBitmapPack DfBitmapPack;
+
+
+// Writes the bitmaps to a new pack. names can be NULL, and so can any of the
+// names in it. Names longer than 39 characters are cut short. The pack is
+// written to a temporary file that then replaces the old one, so processes
+// that have the old one open aren't affected. On Windows, replacing can fail
+// while another process has the old pack open. Returns false if the pack
+// couldn't be written or the old one couldn't be replaced, and the old one is
+// then left as it was.
+DLL_API bool        BitmapPackSave          (char const *filename, DfBitmap **bmps, char const **names, int numBitmaps);
+
+// Returns NULL if the file can't be opened or isn't a valid pack, in which
+// case the caller can make a new one from the original assets.
+DLL_API DfBitmapPack *BitmapPackOpen        (char const *filename);
+
+// All the bitmaps from LoadBitmapMapped() must be deleted first.
+DLL_API void        BitmapPackClose         (DfBitmapPack *pack);
+
+DLL_API int         BitmapPackGetNumImages  (DfBitmapPack *pack);
+DLL_API char const *BitmapPackGetName       (DfBitmapPack *pack, int index);
+
+// Returns the index of the first image with that name, or -1.
+DLL_API int         BitmapPackFind          (DfBitmapPack *pack, char const *name);
+
+// Returns a bitmap whose pixels are in the pack's mapping. Delete it with
+// BitmapDelete() as usual. The mapping is copy on write, so drawing into the
+// bitmap works, but the changes aren't saved to the pack, and each page that
+// is drawn on stops being shared with other processes. Bitmaps for the same
+// image share their pixels.
+DLL_API DfBitmap   *LoadBitmapMapped        (DfBitmapPack *pack, int index);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,240 @@
+#include "df_blend.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BLEND_X64 1
+#include <immintrin.h>
+#if _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+
+typedef void BlendSpanFunc(DfColour *row, int len, DfColour c);
+typedef void BlendSpanAlphasFunc(DfColour *row, int len, DfColour c, unsigned char const *alphas);
+
+
+// ****************************************************************************
+// Scalar
+// ****************************************************************************
+
+// This is the reference. The red and blue channels are blended at the same
+// time, using the 0xff00ff trick. Note that the resulting alpha is 0. The
+// SIMD versions must match this exactly.
+static inline void BlendPixel(DfColour *pixel, DfColour c, unsigned a) {
+    unsigned invA = 255 - a;
+    unsigned rb = (pixel->c & 0xff00ff) * invA + (c.c & 0xff00ff) * a;
+    unsigned g = pixel->g * invA + c.g * a;
+    pixel->c = rb >> 8;
+    pixel->g = g >> 8;
+}
+
+
+static void BlendSpanScalar(DfColour *row, int len, DfColour c) {
+    for (int i = 0; i < len; i++)
+        BlendPixel(row + i, c, c.a);
+}
+
+
+static void BlendSpanAlphasScalar(DfColour *row, int len, DfColour c, unsigned char const *alphas) {
+    for (int i = 0; i < len; i++)
+        BlendPixel(row + i, c, alphas[i]);
+}
+
+
+#if BLEND_X64
+
+// ****************************************************************************
+// SSE2
+// ****************************************************************************
+
+// Each channel is widened to 16 bits and computed as
+// (dst * (255 - a) + src * a) >> 8. That sum is at most 255 * 255, so it fits
+// in 16 bits, and the channels can't carry into each other, which is why this
+// matches the scalar version bit for bit. The alpha channel is masked to 0.
+
+static void BlendSpanSse2(DfColour *row, int len, DfColour c) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i rgbMask = _mm_set1_epi32(0x00ffffff);
+    __m128i invA = _mm_set1_epi16(255 - c.a);
+    __m128i srcTimesA = _mm_mullo_epi16(_mm_unpacklo_epi8(_mm_set1_epi32(c.c), zero),
+                                        _mm_set1_epi16(c.a));
+
+    int i = 0;
+    for (; i + 4 <= len; i += 4) {
+        __m128i dst = _mm_loadu_si128((__m128i *)(row + i));
+        __m128i lo = _mm_unpacklo_epi8(dst, zero);
+        __m128i hi = _mm_unpackhi_epi8(dst, zero);
+        lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(lo, invA), srcTimesA), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(hi, invA), srcTimesA), 8);
+        __m128i result = _mm_and_si128(_mm_packus_epi16(lo, hi), rgbMask);
+        _mm_storeu_si128((__m128i *)(row + i), result);
+    }
+
+    BlendSpanScalar(row + i, len - i, c);
+}
+
+
+static void BlendSpanAlphasSse2(DfColour *row, int len, DfColour c, unsigned char const *alphas) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i rgbMask = _mm_set1_epi32(0x00ffffff);
+    __m128i all255 = _mm_set1_epi16(255);
+    __m128i src = _mm_unpacklo_epi8(_mm_set1_epi32(c.c), zero);
+
+    int i = 0;
+    for (; i + 4 <= len; i += 4) {
+        // Spread the 4 alphas out so that each 16-bit channel has its pixel's alpha.
+        int fourAlphas;
+        memcpy(&fourAlphas, alphas + i, 4);
+        __m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(fourAlphas), zero);
+        a = _mm_unpacklo_epi16(a, a);
+        __m128i aLo = _mm_unpacklo_epi32(a, a);
+        __m128i aHi = _mm_unpackhi_epi32(a, a);
+
+        __m128i dst = _mm_loadu_si128((__m128i *)(row + i));
+        __m128i lo = _mm_unpacklo_epi8(dst, zero);
+        __m128i hi = _mm_unpackhi_epi8(dst, zero);
+        lo = _mm_add_epi16(_mm_mullo_epi16(lo, _mm_sub_epi16(all255, aLo)), _mm_mullo_epi16(src, aLo));
+        hi = _mm_add_epi16(_mm_mullo_epi16(hi, _mm_sub_epi16(all255, aHi)), _mm_mullo_epi16(src, aHi));
+        lo = _mm_srli_epi16(lo, 8);
+        hi = _mm_srli_epi16(hi, 8);
+        __m128i result = _mm_and_si128(_mm_packus_epi16(lo, hi), rgbMask);
+        _mm_storeu_si128((__m128i *)(row + i), result);
+    }
+
+    BlendSpanAlphasScalar(row + i, len - i, c, alphas + i);
+}
+
+
+// ****************************************************************************
+// AVX2
+// ****************************************************************************
+
+// Same as the SSE2 versions, but 8 pixels at a time. The unpacks and packs
+// work within each 128-bit lane, so the pixel order is preserved.
+
+TARGET_AVX2 static void BlendSpanAvx2(DfColour *row, int len, DfColour c) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i rgbMask = _mm256_set1_epi32(0x00ffffff);
+    __m256i invA = _mm256_set1_epi16(255 - c.a);
+    __m256i srcTimesA = _mm256_mullo_epi16(_mm256_unpacklo_epi8(_mm256_set1_epi32(c.c), zero),
+                                           _mm256_set1_epi16(c.a));
+
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m256i dst = _mm256_loadu_si256((__m256i *)(row + i));
+        __m256i lo = _mm256_unpacklo_epi8(dst, zero);
+        __m256i hi = _mm256_unpackhi_epi8(dst, zero);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(lo, invA), srcTimesA), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(hi, invA), srcTimesA), 8);
+        __m256i result = _mm256_and_si256(_mm256_packus_epi16(lo, hi), rgbMask);
+        _mm256_storeu_si256((__m256i *)(row + i), result);
+    }
+
+    BlendSpanSse2(row + i, len - i, c);
+}
+
+
+TARGET_AVX2 static void BlendSpanAlphasAvx2(DfColour *row, int len, DfColour c, unsigned char const *alphas) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i rgbMask = _mm256_set1_epi32(0x00ffffff);
+    __m256i all255 = _mm256_set1_epi16(255);
+    __m256i src = _mm256_unpacklo_epi8(_mm256_set1_epi32(c.c), zero);
+    __m256i alphaToBothHalves = _mm256_set1_epi32(0x00010001);
+
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        // Pixels 0-3 are in the low lane and 4-7 in the high lane. Put each
+        // alpha in both halves of its 32-bit slot, then duplicate the slots
+        // to match the unpacked pixels.
+        __m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(alphas + i)));
+        a = _mm256_mullo_epi32(a, alphaToBothHalves);
+        __m256i aLo = _mm256_unpacklo_epi32(a, a);
+        __m256i aHi = _mm256_unpackhi_epi32(a, a);
+
+        __m256i dst = _mm256_loadu_si256((__m256i *)(row + i));
+        __m256i lo = _mm256_unpacklo_epi8(dst, zero);
+        __m256i hi = _mm256_unpackhi_epi8(dst, zero);
+        lo = _mm256_add_epi16(_mm256_mullo_epi16(lo, _mm256_sub_epi16(all255, aLo)), _mm256_mullo_epi16(src, aLo));
+        hi = _mm256_add_epi16(_mm256_mullo_epi16(hi, _mm256_sub_epi16(all255, aHi)), _mm256_mullo_epi16(src, aHi));
+        lo = _mm256_srli_epi16(lo, 8);
+        hi = _mm256_srli_epi16(hi, 8);
+        __m256i result = _mm256_and_si256(_mm256_packus_epi16(lo, hi), rgbMask);
+        _mm256_storeu_si256((__m256i *)(row + i), result);
+    }
+
+    BlendSpanAlphasSse2(row + i, len - i, c, alphas + i);
+}
+
+
+static bool CpuHasAvx2() {
+#if _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    bool osSavesYmm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+    bool hasAvx = info[2] & (1 << 28);
+    __cpuidex(info, 7, 0);
+    bool hasAvx2 = info[1] & (1 << 5);
+    return osSavesYmm && hasAvx && hasAvx2;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // BLEND_X64
+
+
+// ****************************************************************************
+// Dispatch
+// ****************************************************************************
+
+static BlendSpanFunc *g_blendSpan = BlendSpanScalar;
+static BlendSpanAlphasFunc *g_blendSpanAlphas = BlendSpanAlphasScalar;
+static char const *g_implName = "scalar";
+
+
+// Set the DF_BLEND environment variable to "sse2" or "scalar" to use a slower
+// version than the CPU supports. Useful for testing and benchmarking.
+static bool ChooseImplementation() {
+#if BLEND_X64
+    char const *forced = getenv("DF_BLEND");
+    if (forced && strcmp(forced, "scalar") == 0)
+        return true;
+
+    g_blendSpan = BlendSpanSse2;
+    g_blendSpanAlphas = BlendSpanAlphasSse2;
+    g_implName = "sse2";
+    if (forced && strcmp(forced, "sse2") == 0)
+        return true;
+
+    if (CpuHasAvx2()) {
+        g_blendSpan = BlendSpanAvx2;
+        g_blendSpanAlphas = BlendSpanAlphasAvx2;
+        g_implName = "avx2";
+    }
+#endif
+    return true;
+}
+
+static bool g_implChosen = ChooseImplementation();
+
+
+void BlendSpan(DfColour *row, int len, DfColour c) {
+    g_blendSpan(row, len, c);
+}
+
+
+void BlendSpanAlphas(DfColour *row, int len, DfColour c, unsigned char const *alphas) {
+    g_blendSpanAlphas(row, len, c, alphas);
+}
+
+
+char const *BlendGetImplName() {
+    return g_implName;
+}
@@ -0,0 +1,31 @@
+// Alpha blending kernels used by the drawing functions. The fastest version
+// that the CPU supports (AVX2, SSE2 or plain C) is chosen once at startup. All
+// versions give exactly the same results as the blend in PutPixUnclipped().
+
+#pragma once
+
+
+#include "df_colour.h"
+#include "df_common.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+// Blends c over len pixels, starting at row. c.a must be less than 255.
+DLL_API void        BlendSpan           (DfColour *row, int len, DfColour c);
+
+// Blends c over len pixels, starting at row, using alphas[i] instead of c.a
+// for pixel i. All the alphas must be less than 255.
+DLL_API void        BlendSpanAlphas     (DfColour *row, int len, DfColour c, unsigned char const *alphas);
+
+// Returns "avx2", "sse2" or "scalar".
+DLL_API char const *BlendGetImplName    ();
+
+
+#ifdef __cplusplus
+}
+#endif
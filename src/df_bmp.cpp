@@ -2,44 +2,54 @@
 
 #include "df_bitmap.h"
 
+#include <limits.h>
 #include <memory.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#endif
+
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BMP_X64 1
+#include <tmmintrin.h>
+#if _MSC_VER
+#include <intrin.h>
+#define TARGET_SSSE3
+#else
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif
 
 
 #define BMP_RGB             0
-#define OS2INFOHEADERSIZE  12
+#define BMP_BITFIELDS       3
+#define BMP_ALPHABITFIELDS  6
+#define FILEHEADERSIZE     14
 #define WININFOHEADERSIZE  40
+#define BMP_HEADERS_SIZE   (FILEHEADERSIZE + WININFOHEADERSIZE)
+#define ERROR_MSG_SIZE     128
 
 
-struct BitmapFileHeader {
-    uint16_t type;
-    uint32_t size;
-    uint16_t reserved1;
-    uint16_t reserved2;
-    uint32_t offBits;
-};
-
-
-struct BitmapInfoHeader {
-    uint32_t width;
-    uint32_t height;
-    uint16_t bitCount;
-    uint32_t compression;
-};
-
-
-struct WinBmpInfoHeader {
-    uint32_t width;
-    uint32_t height;
-    uint16_t planes;
-    uint16_t bitCount;
-    uint32_t compression;
-    uint32_t sizeImage;
-    uint32_t xPelsPerMeter;
-    uint32_t biYPelsPerMeter;
-    uint32_t biClrUsed;
-    uint32_t biClrImportant;
+// How to get each channel out of a 32-bit pixel. A channel whose mask has
+// fewer than 8 bits is scaled up to 0-255.
+struct ChannelMask {
+    uint32_t mask;
+    int shift;
+    uint32_t max;       // mask >> shift
 };
 
 
@@ -47,189 +57,471 @@ struct WinBmpInfoHeader {
 // Private Functions
 // ****************************************************************************
 
-static uint8_t ReadU8(FILE *file) {
-    return fgetc(file);
+static uint16_t ReadU16(uint8_t const *p) {
+    return p[0] | (p[1] << 8);
 }
 
 
-static short ReadS16(FILE *file) {
-    int b1 = fgetc(file);
-    int b2 = fgetc(file);
-    return ((b2 << 8) | b1);
+static uint32_t ReadU32(uint8_t const *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
 }
 
 
-static int ReadS32(FILE *file) {
-    int b1 = fgetc(file);
-    int b2 = fgetc(file);
-    int b3 = fgetc(file);
-    int b4 = fgetc(file);
-    return ((b4 << 24) | (b3 << 16) | (b2 << 8) | b1);
+static void WriteU16(uint8_t *p, uint16_t val) {
+    p[0] = val;
+    p[1] = val >> 8;
 }
 
 
-// Reads a BMP file header and check that it has the BMP magic number.
-static void ReadBmpFileHeader(FILE *f, BitmapFileHeader *fileheader) {
-    fileheader->type = ReadS16(f);
-    fileheader->size = ReadS32(f);
-    fileheader->reserved1 = ReadS16(f);
-    fileheader->reserved2 = ReadS16(f);
-    fileheader->offBits = ReadS32(f);
+static void WriteU32(uint8_t *p, uint32_t val) {
+    p[0] = val;
+    p[1] = val >> 8;
+    p[2] = val >> 16;
+    p[3] = val >> 24;
+}
+
 
-    ReleaseAssert(fileheader->type == 19778, "BMP file seems corrupt");
+static void InitChannelMask(ChannelMask *cm, uint32_t mask) {
+    cm->mask = mask;
+    cm->shift = 0;
+    while (mask && !(mask & 1)) {
+        mask >>= 1;
+        cm->shift++;
+    }
+    cm->max = mask;
 }
 
 
-// Reads information from a BMP file header.
-static void ReadWinBmpInfoHeader(FILE *f, BitmapInfoHeader *infoheader) {
-    WinBmpInfoHeader win_infoheader;
-
-    win_infoheader.width = ReadS32(f);
-    win_infoheader.height = ReadS32(f);
-    win_infoheader.planes = ReadS16(f);
-    win_infoheader.bitCount = ReadS16(f);
-    win_infoheader.compression = ReadS32(f);
-    win_infoheader.sizeImage = ReadS32(f);
-    win_infoheader.xPelsPerMeter = ReadS32(f);
-    win_infoheader.biYPelsPerMeter = ReadS32(f);
-    win_infoheader.biClrUsed = ReadS32(f);
-    win_infoheader.biClrImportant = ReadS32(f);
-
-    infoheader->width = win_infoheader.width;
-    infoheader->height = win_infoheader.height;
-    infoheader->bitCount = win_infoheader.bitCount;
-    infoheader->compression = win_infoheader.compression;
+static inline unsigned GetChannel(ChannelMask const *cm, uint32_t pixel) {
+    uint32_t val = (pixel & cm->mask) >> cm->shift;
+    if (cm->max == 255)
+        return val;
+    return cm->max ? (uint64_t)val * 255 / cm->max : 255;
 }
 
 
-static void ReadBmpPalette(int ncols, DfColour pal[256], FILE *f) {
+// Reads the palette entries that the file has. The rest are opaque black.
+static void ReadBmpPalette(uint8_t const *p, int ncols, DfColour pal[256]) {
+    for (int i = 0; i < 256; i++)
+        pal[i].c = 0xff000000;
+
     for (int i = 0; i < ncols; i++) {
-        pal[i].b = ReadU8(f);
-        pal[i].g = ReadU8(f);
-        pal[i].r = ReadU8(f);
-        pal[i].a = 255;
-        ReadU8(f);
+        pal[i].b = p[0];
+        pal[i].g = p[1];
+        pal[i].r = p[2];
+        p += 4;
+    }
+}
+
+
+// ****************************************************************************
+// Row converters
+// ****************************************************************************
+
+// Each of these converts one row of the file into the row of the bitmap it
+// belongs in, except PackBgrRow, which does the opposite for SaveBmp().
+
+static void Convert1BitRow(uint8_t const *src, DfColour *dst, int width, DfColour const pal[256]) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        unsigned i = *src++;
+        for (int j = 0; j < 8; j++)
+            dst[x + j] = pal[(i >> (7 - j)) & 1];
     }
+
+    for (int j = 0; x < width; x++, j++)
+        dst[x] = pal[(*src >> (7 - j)) & 1];
 }
 
 
-static void SkipPadding(FILE *f, int width, int pixels_per_byte) {
-    // Skip any padding until we've read a multiple of 4 bytes.
-    int num_bytes = (width + pixels_per_byte - 1) / pixels_per_byte;
-    while (num_bytes & 3) {
-        ReadU8(f);
-        num_bytes++;
+static void Convert4BitRow(uint8_t const *src, DfColour *dst, int width, DfColour const pal[256]) {
+    int x = 0;
+    for (; x + 2 <= width; x += 2) {
+        unsigned i = *src++;
+        dst[x] = pal[i >> 4];
+        dst[x + 1] = pal[i & 15];
     }
+
+    if (x < width)
+        dst[x] = pal[*src >> 4];
 }
 
 
-static void Read1BitLine(DfBitmap *bitmap, int length, FILE *f, DfColour pal[256], int y) {
-    for (int x = 0; x < length; x += 8) {
-        uint8_t i = ReadU8(f);
-        for (int j = 0; j < 8; j++) {
-            int idx = (i >> 7) & 1;
-            PutPix(bitmap, x + j, y, pal[idx]);
-            i <<= 1;
-        }
+static void Convert8BitRow(uint8_t const *src, DfColour *dst, int width, DfColour const pal[256]) {
+    for (int x = 0; x < width; x++)
+        dst[x] = pal[src[x]];
+}
+
+
+static void Convert24BitRowScalar(uint8_t const *src, DfColour *dst, int width) {
+    for (int x = 0; x < width; x++) {
+        dst[x].c = src[0] | (src[1] << 8) | (src[2] << 16) | 0xff000000;
+        src += 3;
     }
+}
 
-    SkipPadding(f, length, 8);
+
+static void PackBgrRowScalar(DfColour const *src, uint8_t *dst, int width) {
+    for (int x = 0; x < width; x++) {
+        dst[0] = src[x].b;
+        dst[1] = src[x].g;
+        dst[2] = src[x].r;
+        dst += 3;
+    }
 }
 
 
-static void Read4BitLine(DfBitmap *bitmap, int length, FILE *f, DfColour pal[256], int y) {
-    for (int x = 0; x < length; x += 2) {
-        uint8_t i = ReadU8(f);
-        unsigned idx1 = i & 15;
-        unsigned idx2 = (i >> 4) & 15;
-        PutPix(bitmap, x+1, y, pal[idx1]);
-        PutPix(bitmap, x, y, pal[idx2]);
+#if BMP_X64
+
+// 16 pixels are 48 bytes, which are read as 3 loads. The 4 groups of 12 bytes
+// are lined up with alignr and each is spread out to 4 pixels with pshufb.
+TARGET_SSSE3
+static void Convert24BitRowSsse3(uint8_t const *src, DfColour *dst, int width) {
+    __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    __m128i alpha = _mm_set1_epi32(0xff000000);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i a = _mm_loadu_si128((__m128i const *)src);
+        __m128i b = _mm_loadu_si128((__m128i const *)(src + 16));
+        __m128i c = _mm_loadu_si128((__m128i const *)(src + 32));
+        __m128i p0 = _mm_shuffle_epi8(a, spread);
+        __m128i p1 = _mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), spread);
+        __m128i p2 = _mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), spread);
+        __m128i p3 = _mm_shuffle_epi8(_mm_srli_si128(c, 4), spread);
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_or_si128(p0, alpha));
+        _mm_storeu_si128((__m128i *)(dst + x + 4), _mm_or_si128(p1, alpha));
+        _mm_storeu_si128((__m128i *)(dst + x + 8), _mm_or_si128(p2, alpha));
+        _mm_storeu_si128((__m128i *)(dst + x + 12), _mm_or_si128(p3, alpha));
+        src += 48;
     }
 
-    SkipPadding(f, length, 2);
+    Convert24BitRowScalar(src, dst + x, width - x);
 }
 
 
-static void Read8BitLine(DfBitmap *bitmap, int length, FILE *f, DfColour pal[256], int y) {
-    for (int x = 0; x < length; ++x) {
-        uint8_t i = ReadU8(f);
-        PutPix(bitmap, x, y, pal[i]);
+// The reverse of Convert24BitRowSsse3(). Each group of 4 pixels is squashed
+// into its low 12 bytes and the groups are joined with byte shifts.
+TARGET_SSSE3
+static void PackBgrRowSsse3(DfColour const *src, uint8_t *dst, int width) {
+    __m128i squash = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(src + x)), squash);
+        __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(src + x + 4)), squash);
+        __m128i p2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(src + x + 8)), squash);
+        __m128i p3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(src + x + 12)), squash);
+        _mm_storeu_si128((__m128i *)dst, _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+        _mm_storeu_si128((__m128i *)(dst + 16), _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+        _mm_storeu_si128((__m128i *)(dst + 32), _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
+        dst += 48;
     }
 
-    SkipPadding(f, length, 1);
+    PackBgrRowScalar(src + x, dst, width - x);
+}
+
+
+static bool CpuHasSsse3() {
+#if _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return info[2] & (1 << 9);
+#else
+    return __builtin_cpu_supports("ssse3");
+#endif
 }
 
+#endif // BMP_X64
 
-static void Read24BitLine(DfBitmap *bitmap, int length, FILE *f, int y) {
-    DfColour c;
-    int nbytes = 0;
-    c.a = 255;
 
-    for (int i = 0; i < length; i++) {
-        c.b = ReadU8(f);
-        c.g = ReadU8(f);
-        c.r = ReadU8(f);
-        PutPix(bitmap, i, y, c);
-        nbytes += 3;
+typedef void Convert24BitRowFunc(uint8_t const *src, DfColour *dst, int width);
+typedef void PackBgrRowFunc(DfColour const *src, uint8_t *dst, int width);
+
+static Convert24BitRowFunc *g_convert24BitRow = Convert24BitRowScalar;
+static PackBgrRowFunc *g_packBgrRow = PackBgrRowScalar;
+
+
+static bool ChooseImplementation() {
+#if BMP_X64
+    if (CpuHasSsse3()) {
+        g_convert24BitRow = Convert24BitRowSsse3;
+        g_packBgrRow = PackBgrRowSsse3;
     }
+#endif
+    return true;
+}
+
+static bool g_implChosen = ChooseImplementation();
 
-    for (int padding = (4 - nbytes) & 3; padding; --padding) 
-        ReadU8(f);
+
+static void Convert32BitRow(uint8_t const *src, DfColour *dst, int width, ChannelMask const masks[4]) {
+    bool rgbIsStandard = masks[0].mask == 0xff0000 && masks[1].mask == 0xff00 && masks[2].mask == 0xff;
+    if (rgbIsStandard && masks[3].mask == 0xff000000) {
+        memcpy(dst, src, width * 4);
+    }
+    else if (rgbIsStandard && masks[3].mask == 0) {
+        for (int x = 0; x < width; x++)
+            dst[x].c = ReadU32(src + x * 4) | 0xff000000;
+    }
+    else {
+        for (int x = 0; x < width; x++) {
+            uint32_t pixel = ReadU32(src + x * 4);
+            dst[x].r = GetChannel(&masks[0], pixel);
+            dst[x].g = GetChannel(&masks[1], pixel);
+            dst[x].b = GetChannel(&masks[2], pixel);
+            dst[x].a = GetChannel(&masks[3], pixel);
+        }
+    }
 }
 
 
-// ****************************************************************************
-// Public Functions
-// ****************************************************************************
+// Fills in the file header and a 40 byte info header for an uncompressed
+// bitmap that is stored bottom row first.
+static void MakeBmpHeaders(uint8_t headers[BMP_HEADERS_SIZE], int w, int h, int bitCount, int imageBytes) {
+    memset(headers, 0, BMP_HEADERS_SIZE);
+    WriteU16(headers, 19778);
+    WriteU32(headers + 2, BMP_HEADERS_SIZE + imageBytes);
+    WriteU32(headers + 10, BMP_HEADERS_SIZE);
+
+    uint8_t *info = headers + FILEHEADERSIZE;
+    WriteU32(info, WININFOHEADERSIZE);
+    WriteU32(info + 4, w);
+    WriteU32(info + 8, h);
+    WriteU16(info + 12, 1);
+    WriteU16(info + 14, bitCount);
+    WriteU32(info + 20, imageBytes);
+}
 
-DfBitmap *LoadBmp(char const *filename) {
-    FILE *f = fopen(filename, "rb");
-    if (!f)
-        return NULL;
 
-    BitmapFileHeader fileheader;
-    ReadBmpFileHeader(f, &fileheader);
+#ifndef _WIN32
+// Writes all the data that the iovecs point to, in as few writev() calls as
+// possible.
+static bool WriteAllIovs(int fd, struct iovec *iovs, int numIovs) {
+    while (numIovs > 0) {
+        int numThisTime = numIovs < IOV_MAX ? numIovs : IOV_MAX;
+        ssize_t numWritten = writev(fd, iovs, numThisTime);
+        if (numWritten < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        // Skip past what was written. A short write can stop part way
+        // through an iovec.
+        while (numIovs > 0 && (size_t)numWritten >= iovs->iov_len) {
+            numWritten -= iovs->iov_len;
+            iovs++;
+            numIovs--;
+        }
+        if (numIovs > 0) {
+            iovs->iov_base = (char *)iovs->iov_base + numWritten;
+            iovs->iov_len -= numWritten;
+        }
+    }
+
+    return true;
+}
+#endif
+
+
+static DfBitmap *Fail(char errorMsg[ERROR_MSG_SIZE], char const *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(errorMsg, ERROR_MSG_SIZE, fmt, ap);
+    va_end(ap);
+    return NULL;
+}
 
-    uint32_t infoHeaderSize = ReadS32(f);
-    ReleaseAssert(infoHeaderSize == WININFOHEADERSIZE, "Bitmap header size invalid (%i bytes). Is it a Windows BMP?", infoHeaderSize); 
 
-    BitmapInfoHeader infoheader;
-    ReadWinBmpInfoHeader(f, &infoheader);
-    ReleaseAssert(infoheader.compression == BMP_RGB, "Bitmap loader does not support RLE compressed bitmaps"); 
+// Returns NULL, with a message in errorMsg, if the file is corrupt or uses a
+// format that isn't supported.
+static DfBitmap *DecodeBmp(void const *data, int numBytes, char errorMsg[ERROR_MSG_SIZE]) {
+    uint8_t const *file = (uint8_t const *)data;
+    if (numBytes < FILEHEADERSIZE + WININFOHEADERSIZE || ReadU16(file) != 19778)
+        return Fail(errorMsg, "BMP file seems corrupt");
+    uint32_t offBits = ReadU32(file + 10);
+
+    uint8_t const *info = file + FILEHEADERSIZE;
+    uint32_t infoHeaderSize = ReadU32(info);
+    bool sizeOk = infoHeaderSize == WININFOHEADERSIZE || infoHeaderSize == 52 ||
+                  infoHeaderSize == 56 || infoHeaderSize == 108 || infoHeaderSize == 124;
+    if (!sizeOk)
+        return Fail(errorMsg, "Bitmap header size invalid (%i bytes). Is it a Windows BMP?", infoHeaderSize);
+    if (FILEHEADERSIZE + infoHeaderSize > (uint32_t)numBytes)
+        return Fail(errorMsg, "BMP file seems corrupt");
+
+    int width = (int32_t)ReadU32(info + 4);
+    int height = (int32_t)ReadU32(info + 8);
+    int bitCount = ReadU16(info + 14);
+    uint32_t compression = ReadU32(info + 16);
+    uint32_t clrUsed = ReadU32(info + 32);
+
+    // A negative height means the rows are stored top row first.
+    bool topDown = height < 0;
+    if (topDown)
+        height = -height;
+    if (width <= 0 || height <= 0)
+        return Fail(errorMsg, "BMP file seems corrupt");
+
+    if (bitCount != 1 && bitCount != 4 && bitCount != 8 && bitCount != 24 && bitCount != 32)
+        return Fail(errorMsg, "Bitmap loader does not support %i bits per pixel", bitCount);
+    bool bitfields = compression == BMP_BITFIELDS || compression == BMP_ALPHABITFIELDS;
+    if (compression != BMP_RGB && !bitfields)
+        return Fail(errorMsg, "Bitmap loader does not support RLE compressed bitmaps");
+    if (bitfields && bitCount != 32)
+        return Fail(errorMsg, "Bitmap loader only supports BI_BITFIELDS with 32 bits per pixel");
+
+    // In BI_RGB 32-bit bitmaps, the top byte is unused.
+    ChannelMask masks[4];
+    InitChannelMask(&masks[0], 0xff0000);
+    InitChannelMask(&masks[1], 0xff00);
+    InitChannelMask(&masks[2], 0xff);
+    InitChannelMask(&masks[3], 0);
+    if (bitfields) {
+        // The masks follow the 40 byte header. The bigger headers include
+        // them. The alpha mask is only there in the bigger headers, or if
+        // the compression says so.
+        bool hasAlphaMask = infoHeaderSize >= 56 || compression == BMP_ALPHABITFIELDS;
+        int numMasks = hasAlphaMask ? 4 : 3;
+        if (FILEHEADERSIZE + WININFOHEADERSIZE + numMasks * 4 > numBytes)
+            return Fail(errorMsg, "BMP file seems corrupt");
+        for (int i = 0; i < numMasks; i++)
+            InitChannelMask(&masks[i], ReadU32(info + WININFOHEADERSIZE + i * 4));
+    }
 
-    int ncol = (fileheader.offBits - 54) / 4; // Calc num colours in palette.
     DfColour palette[256];
-    ReadBmpPalette(ncol, palette, f);
+    if (bitCount <= 8) {
+        uint32_t paletteOffset = FILEHEADERSIZE + infoHeaderSize;
+        uint32_t ncol = clrUsed ? clrUsed : 1u << bitCount;
+        if (ncol > 256)
+            ncol = 256;
+        if (offBits < paletteOffset + ncol * 4)
+            ncol = offBits > paletteOffset ? (offBits - paletteOffset) / 4 : 0;
+        if (paletteOffset + ncol * 4 > (uint32_t)numBytes)
+            return Fail(errorMsg, "BMP file seems corrupt");
+        ReadBmpPalette(file + paletteOffset, ncol, palette);
+    }
 
-    DfBitmap *bitmap = BitmapCreate(infoheader.width, infoheader.height);
+    // Rows are padded to a multiple of 4 bytes.
+    size_t rowBytes = (((size_t)width * bitCount + 31) / 32) * 4;
+    if (offBits + rowBytes * height > (size_t)numBytes)
+        return Fail(errorMsg, "BMP file seems corrupt");
 
-    // Read the image
-    for (int i = 0; i < (int)infoheader.height; ++i) {
-        int y = bitmap->height - i - 1;
-        switch (infoheader.bitCount) {
+    DfBitmap *bitmap = BitmapCreate(width, height);
+
+    for (int i = 0; i < height; i++) {
+        uint8_t const *src = file + offBits + rowBytes * i;
+        int y = topDown ? i : height - i - 1;
+        DfColour *dst = bitmap->pixels + y * bitmap->stride;
+        switch (bitCount) {
         case 1:
-            Read1BitLine(bitmap, infoheader.width, f, palette, y);
+            Convert1BitRow(src, dst, width, palette);
             break;
         case 4:
-            Read4BitLine(bitmap, infoheader.width, f, palette, y);
+            Convert4BitRow(src, dst, width, palette);
             break;
         case 8:
-            Read8BitLine(bitmap, infoheader.width, f, palette, y);
+            Convert8BitRow(src, dst, width, palette);
             break;
         case 24:
-            Read24BitLine(bitmap, infoheader.width, f, y);
+            g_convert24BitRow(src, dst, width);
             break;
-        default:
-            DebugAssert(0);
+        case 32:
+            Convert32BitRow(src, dst, width, masks);
             break;
         }
     }
 
+    return bitmap;
+}
+
+
+// Stops the program if stopOnError is set and the file couldn't be decoded.
+static DfBitmap *DecodeBmpOrStop(void const *data, int numBytes, bool stopOnError) {
+    char errorMsg[ERROR_MSG_SIZE];
+    DfBitmap *bitmap = DecodeBmp(data, numBytes, errorMsg);
+    if (stopOnError)
+        ReleaseAssert(bitmap != NULL, "%s", errorMsg);
+    return bitmap;
+}
+
+
+// Reads the whole file in one go. The decoder then only touches memory.
+static DfBitmap *ReadAndDecodeBmp(char const *filename, bool stopOnError) {
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long numBytes = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (numBytes <= 0 || numBytes > INT_MAX) {
+        fclose(f);
+        return NULL;
+    }
+
+    uint8_t *data = new uint8_t [numBytes];
+    size_t numRead = fread(data, 1, numBytes, f);
     fclose(f);
+
+    DfBitmap *bitmap = NULL;
+    if (numRead == (size_t)numBytes)
+        bitmap = DecodeBmpOrStop(data, numBytes, stopOnError);
+    delete [] data;
     return bitmap;
 }
 
 
+static DfBitmap *LoadBmpFile(char const *filename, bool stopOnError) {
+#ifndef _WIN32
+    // Mapping the file saves copying it. If it can't be mapped, it is read
+    // instead.
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= INT_MAX)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data != MAP_FAILED) {
+        DfBitmap *bitmap = DecodeBmpOrStop(data, st.st_size, stopOnError);
+        munmap(data, st.st_size);
+        return bitmap;
+    }
+#endif
+
+    return ReadAndDecodeBmp(filename, stopOnError);
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+DfBitmap *LoadBmp(char const *filename) {
+    return LoadBmpFile(filename, true);
+}
+
+
+DfBitmap *TryLoadBmp(char const *filename) {
+    return LoadBmpFile(filename, false);
+}
+
+
+DfBitmap *LoadBmpFromMemory(void const *data, int numBytes) {
+    return DecodeBmpOrStop(data, numBytes, true);
+}
+
+
+DfBitmap *TryLoadBmpFromMemory(void const *data, int numBytes) {
+    return DecodeBmpOrStop(data, numBytes, false);
+}
+
+
 bool SaveBmp(DfBitmap *bmp, char const *filename) {
     FILE *f = fopen(filename, "wb");
     if (!f)
@@ -237,45 +529,80 @@ bool SaveBmp(DfBitmap *bmp, char const *filename) {
 
     int w = bmp->width;
     int h = bmp->height;
-    int fileSize = 54 + 3*w*h;  //w is your image width, h is image height, both int
-    uint8_t *img = new uint8_t [3*w*h];
-
-    for (int x = 0; x < w; x++) {
-        for (int j = 0; j < h; j++) {
-            int y = (h-1) - j;
-            DfColour c = GetPix(bmp, x, y);
-            img[(x+y*w)*3+2] = c.r;
-            img[(x+y*w)*3+1] = c.g;
-            img[(x+y*w)*3+0] = c.b;
+    int rowBytes = (w * 3 + 3) & ~3;
+
+    uint8_t headers[BMP_HEADERS_SIZE];
+    MakeBmpHeaders(headers, w, h, 24, rowBytes * h);
+    bool ok = fwrite(headers, 1, BMP_HEADERS_SIZE, f) == BMP_HEADERS_SIZE;
+
+    // Rows are packed, bottom row first, into a buffer that holds about 64 KB
+    // of them, which is written whenever it is full. The rows of a bitmap
+    // with no width are empty, so there is nothing to divide by.
+    int rowsPerChunk = 65536 / (rowBytes > 0 ? rowBytes : 1);
+    if (rowsPerChunk < 1)
+        rowsPerChunk = 1;
+    if (rowsPerChunk > h)
+        rowsPerChunk = h;
+    uint8_t *buf = new uint8_t [rowsPerChunk * rowBytes];
+
+    for (int i = 0; i < h && ok; i += rowsPerChunk) {
+        int numRows = h - i < rowsPerChunk ? h - i : rowsPerChunk;
+        for (int j = 0; j < numRows; j++) {
+            int y = h - 1 - (i + j);
+            uint8_t *row = buf + j * rowBytes;
+            g_packBgrRow(bmp->pixels + y * bmp->stride, row, w);
+            memset(row + w * 3, 0, rowBytes - w * 3);
         }
+        size_t chunkBytes = (size_t)rowBytes * numRows;
+        ok = fwrite(buf, 1, chunkBytes, f) == chunkBytes;
     }
 
-    uint8_t fileHeader[14] = {'B','M', 0,0,0,0, 0,0, 0,0, 54,0,0,0};
-    uint8_t infoHeader[40] = {40,0,0,0, 0,0,0,0, 0,0,0,0, 1,0, 24,0};
-    uint8_t bmppad[3] = {0,0,0};
-
-    fileHeader[2] = (uint8_t)(fileSize    );
-    fileHeader[3] = (uint8_t)(fileSize>> 8);
-    fileHeader[4] = (uint8_t)(fileSize>>16);
-    fileHeader[5] = (uint8_t)(fileSize>>24);
-
-    infoHeader[4] = (uint8_t)w;
-    infoHeader[5] = (uint8_t)(w >> 8);
-    infoHeader[6] = (uint8_t)(w >> 16);
-    infoHeader[7] = (uint8_t)(w >> 24);
-    infoHeader[8] = (uint8_t)h;
-    infoHeader[9] = (uint8_t)(h >> 8);
-    infoHeader[10] = (uint8_t)(h >> 16);
-    infoHeader[11] = (uint8_t)(h >> 24);
-
-    fwrite(fileHeader, 1, 14, f);
-    fwrite(infoHeader, 1, 40, f);
+    delete [] buf;
+    if (fclose(f) != 0)
+        ok = false;
+    return ok;
+}
+
+
+bool SaveBmp32(DfBitmap *bmp, char const *filename) {
+    int w = bmp->width;
+    int h = bmp->height;
+    int rowBytes = w * 4;
+
+    uint8_t headers[BMP_HEADERS_SIZE];
+    MakeBmpHeaders(headers, w, h, 32, rowBytes * h);
+
+#ifndef _WIN32
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return false;
+
+    // One iovec for the headers and one for each row, bottom row first.
+    int numIovs = h + 1;
+    struct iovec *iovs = new struct iovec [numIovs];
+    iovs[0].iov_base = headers;
+    iovs[0].iov_len = BMP_HEADERS_SIZE;
     for (int i = 0; i < h; i++) {
-        fwrite(img+(w*(h-i-1)*3), 3, w, f);
-        fwrite(bmppad, 1, (4-(w*3)%4)%4, f);
+        iovs[i + 1].iov_base = bmp->pixels + (h - 1 - i) * bmp->stride;
+        iovs[i + 1].iov_len = rowBytes;
     }
-    fclose(f);
 
-    delete[] img;
-    return true;
+    bool ok = WriteAllIovs(fd, iovs, numIovs);
+    delete [] iovs;
+    if (close(fd) != 0)
+        ok = false;
+    return ok;
+#else
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+        return false;
+
+    bool ok = fwrite(headers, 1, BMP_HEADERS_SIZE, f) == BMP_HEADERS_SIZE;
+    for (int y = h - 1; y >= 0 && ok; y--)
+        ok = fwrite(bmp->pixels + y * bmp->stride, 1, rowBytes, f) == (size_t)rowBytes;
+
+    if (fclose(f) != 0)
+        ok = false;
+    return ok;
+#endif
 }
@@ -11,8 +11,25 @@ typedef struct _DfBitmap DfBitmap;
 
 
 DfBitmap *LoadBmp(char const *filename);
+
+// Decodes a BMP file that is already in memory. The data isn't needed after
+// this returns.
+DfBitmap *LoadBmpFromMemory(void const *data, int numBytes);
+
+// LoadBmp() and LoadBmpFromMemory() stop the program if the file is corrupt,
+// or uses a format that isn't supported. These return NULL instead, which is
+// better for files that the user chose.
+DfBitmap *TryLoadBmp(char const *filename);
+DfBitmap *TryLoadBmpFromMemory(void const *data, int numBytes);
+
 bool SaveBmp(DfBitmap *bmp, char const *filename);
 
+// Saves a 32 bits per pixel BMP. The pixels are written straight from the
+// bitmap without being converted, so this is quicker than SaveBmp(), but the
+// file is a third bigger. The alpha bytes are written, but readers,
+// including LoadBmp(), treat the image as opaque.
+bool SaveBmp32(DfBitmap *bmp, char const *filename);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,610 @@
+#include "df_command_list.h"
+
+#include "df_common.h"
+#include "df_font.h"
+#include "df_polygon.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+
+// ****************************************************************************
+// Command encoding
+// ****************************************************************************
+
+// Commands are stored back to back in one buffer. Each starts with a
+// CmdHeader and is padded to a multiple of CMD_ALIGNMENT bytes, so that the
+// pointers in blit commands are aligned.
+
+enum { CMD_ALIGNMENT = 8 };
+
+enum CommandType {
+    CMD_BITMAP_CLEAR,
+    CMD_PUT_PIX,
+    CMD_HLINE,
+    CMD_VLINE,
+    CMD_DRAW_LINE,
+    CMD_RECT_FILL,
+    CMD_RECT_OUTLINE,
+    CMD_CIRCLE_OUTLINE,
+    CMD_CIRCLE_FILL,
+    CMD_TEXT,
+    CMD_POLYGON,
+    CMD_BLIT,
+    CMD_MASKED_BLIT,
+    CMD_STRETCH_BLIT
+};
+
+
+struct CmdHeader {
+    uint16_t type;
+    uint16_t size; // In bytes, including this header.
+};
+
+
+// Used by all the commands that take up to 4 ints and a colour. The meaning of
+// v[] is the same as the parameters of the matching drawing function.
+struct CmdShape {
+    CmdHeader header;
+    int v[4];
+    DfColour colour;
+};
+
+
+struct CmdBlit {
+    CmdHeader header;
+    int x, y, w, h;
+    DfBitmap *srcBmp;
+};
+
+
+// Followed by len chars. Not NULL terminated.
+struct CmdText {
+    CmdHeader header;
+    int x, y;
+    DfColour colour;
+    int width;
+    int len;
+    DfFont *font;
+};
+
+
+// Followed by numPoints PolyVerts.
+struct CmdPolygon {
+    CmdHeader header;
+    int xOffset, yOffset;
+    DfColour colour;
+    int numPoints;
+};
+
+
+struct Bounds {
+    int x1, y1, x2, y2; // x2 and y2 are exclusive.
+};
+
+
+struct TileBin {
+    int *cmdOffsets;
+    int numCmds;
+    int capacity;
+};
+
+
+struct _DfCommandList {
+    char *buf;
+    int bufUsed;
+    int bufCapacity;
+
+    // Union of the bounds of all the commands.
+    Bounds bounds;
+
+    // Used by CommandListReplayTiled(). Kept here so that the memory is reused
+    // from frame to frame. Both arrays have numBins entries.
+    TileBin *bins;
+    int *activeTiles;
+    int numBins;
+};
+
+
+// Gets a rectangle that contains every pixel the command could draw.
+static Bounds GetCommandBounds(CmdHeader const *header) {
+    CmdShape const *shape = (CmdShape const *)header;
+    CmdBlit const *blit = (CmdBlit const *)header;
+    int const *v = shape->v;
+    Bounds b;
+
+    switch (header->type) {
+    case CMD_BITMAP_CLEAR:
+        b.x1 = b.y1 = INT_MIN;
+        b.x2 = b.y2 = INT_MAX;
+        break;
+    case CMD_PUT_PIX:
+        b.x1 = v[0]; b.y1 = v[1]; b.x2 = v[0] + 1; b.y2 = v[1] + 1;
+        break;
+    case CMD_HLINE:
+        b.x1 = v[0]; b.y1 = v[1]; b.x2 = v[0] + v[2]; b.y2 = v[1] + 1;
+        break;
+    case CMD_VLINE:
+        b.x1 = v[0]; b.y1 = v[1]; b.x2 = v[0] + 1; b.y2 = v[1] + v[2];
+        break;
+    case CMD_DRAW_LINE:
+        b.x1 = IntMin(v[0], v[2]);
+        b.y1 = IntMin(v[1], v[3]);
+        b.x2 = IntMax(v[0], v[2]) + 1;
+        b.y2 = IntMax(v[1], v[3]) + 1;
+        break;
+    case CMD_RECT_FILL:
+    case CMD_RECT_OUTLINE:
+        b.x1 = v[0]; b.y1 = v[1]; b.x2 = v[0] + v[2]; b.y2 = v[1] + v[3];
+        break;
+    case CMD_CIRCLE_OUTLINE:
+    case CMD_CIRCLE_FILL:
+        b.x1 = v[0] - v[2]; b.y1 = v[1] - v[2]; b.x2 = v[0] + v[2] + 1; b.y2 = v[1] + v[2] + 1;
+        break;
+    case CMD_TEXT: {
+        CmdText const *text = (CmdText const *)header;
+        b.x1 = text->x; b.y1 = text->y; b.x2 = text->x + text->width; b.y2 = text->y + text->font->charHeight;
+        break;
+    }
+    case CMD_POLYGON: {
+        CmdPolygon const *poly = (CmdPolygon const *)header;
+        PolyVert const *points = (PolyVert const *)(poly + 1);
+        if (poly->numPoints == 0) {
+            b.x1 = b.y1 = b.x2 = b.y2 = 0;
+            break;
+        }
+        b.x1 = b.y1 = INT_MAX;
+        b.x2 = b.y2 = INT_MIN;
+        for (int i = 0; i < poly->numPoints; i++) {
+            b.x1 = IntMin(b.x1, points[i].x);
+            b.y1 = IntMin(b.y1, points[i].y);
+            b.x2 = IntMax(b.x2, points[i].x + 1);
+            b.y2 = IntMax(b.y2, points[i].y + 1);
+        }
+        b.x1 += poly->xOffset; b.x2 += poly->xOffset;
+        b.y1 += poly->yOffset; b.y2 += poly->yOffset;
+        break;
+    }
+    default:
+        b.x1 = blit->x; b.y1 = blit->y; b.x2 = blit->x + blit->w; b.y2 = blit->y + blit->h;
+        break;
+    }
+
+    return b;
+}
+
+
+static void *AddCommand(DfCommandList *cl, CommandType type, int size) {
+    size = (size + CMD_ALIGNMENT - 1) & ~(CMD_ALIGNMENT - 1);
+    if (cl->bufUsed + size > cl->bufCapacity) {
+        int newCapacity = IntMax(cl->bufCapacity * 2, 4096);
+        char *newBuf = new char [newCapacity];
+        if (cl->buf)
+            memcpy(newBuf, cl->buf, cl->bufUsed);
+        delete [] cl->buf;
+        cl->buf = newBuf;
+        cl->bufCapacity = newCapacity;
+    }
+
+    CmdHeader *header = (CmdHeader *)(cl->buf + cl->bufUsed);
+    header->type = type;
+    header->size = size;
+    cl->bufUsed += size;
+    return header;
+}
+
+
+// Must be called once the command's parameters have been filled in.
+static void AddToBounds(DfCommandList *cl, CmdHeader const *header) {
+    Bounds b = GetCommandBounds(header);
+    if (b.x1 >= b.x2 || b.y1 >= b.y2)
+        return;
+
+    cl->bounds.x1 = IntMin(cl->bounds.x1, b.x1);
+    cl->bounds.y1 = IntMin(cl->bounds.y1, b.y1);
+    cl->bounds.x2 = IntMax(cl->bounds.x2, b.x2);
+    cl->bounds.y2 = IntMax(cl->bounds.y2, b.y2);
+}
+
+
+static void AddShape(DfCommandList *cl, CommandType type, int a, int b, int c, int d, DfColour colour) {
+    CmdShape *cmd = (CmdShape *)AddCommand(cl, type, sizeof(CmdShape));
+    cmd->v[0] = a;
+    cmd->v[1] = b;
+    cmd->v[2] = c;
+    cmd->v[3] = d;
+    cmd->colour = colour;
+    AddToBounds(cl, &cmd->header);
+}
+
+
+static void AddBlit(DfCommandList *cl, CommandType type, int x, int y, int w, int h, DfBitmap *srcBmp) {
+    CmdBlit *cmd = (CmdBlit *)AddCommand(cl, type, sizeof(CmdBlit));
+    cmd->x = x;
+    cmd->y = y;
+    cmd->w = w;
+    cmd->h = h;
+    cmd->srcBmp = srcBmp;
+    AddToBounds(cl, &cmd->header);
+}
+
+
+// ****************************************************************************
+// Public recording functions
+// ****************************************************************************
+
+DfCommandList *CommandListCreate() {
+    DfCommandList *cl = new DfCommandList;
+    memset(cl, 0, sizeof(DfCommandList));
+    CommandListClear(cl);
+    return cl;
+}
+
+
+void CommandListDelete(DfCommandList *cl) {
+    for (int i = 0; i < cl->numBins; i++)
+        delete [] cl->bins[i].cmdOffsets;
+    delete [] cl->bins;
+    delete [] cl->activeTiles;
+    delete [] cl->buf;
+    delete cl;
+}
+
+
+void CommandListClear(DfCommandList *cl) {
+    cl->bufUsed = 0;
+    cl->bounds.x1 = cl->bounds.y1 = INT_MAX;
+    cl->bounds.x2 = cl->bounds.y2 = INT_MIN;
+}
+
+
+void CommandListBitmapClear(DfCommandList *cl, DfColour c) {
+    AddShape(cl, CMD_BITMAP_CLEAR, 0, 0, 0, 0, c);
+}
+
+
+void CommandListPutPix(DfCommandList *cl, int x, int y, DfColour c) {
+    AddShape(cl, CMD_PUT_PIX, x, y, 0, 0, c);
+}
+
+
+void CommandListHLine(DfCommandList *cl, int x, int y, int len, DfColour c) {
+    // An empty line draws nothing, and isn't in the list's bounds, so it must
+    // not reach HLineUnclipped() on replay.
+    if (len <= 0)
+        return;
+    AddShape(cl, CMD_HLINE, x, y, len, 0, c);
+}
+
+
+void CommandListVLine(DfCommandList *cl, int x, int y, int len, DfColour c) {
+    if (len <= 0)
+        return;
+    AddShape(cl, CMD_VLINE, x, y, len, 0, c);
+}
+
+
+void CommandListDrawLine(DfCommandList *cl, int x1, int y1, int x2, int y2, DfColour c) {
+    AddShape(cl, CMD_DRAW_LINE, x1, y1, x2, y2, c);
+}
+
+
+void CommandListRectFill(DfCommandList *cl, int x, int y, int w, int h, DfColour c) {
+    AddShape(cl, CMD_RECT_FILL, x, y, w, h, c);
+}
+
+
+void CommandListRectOutline(DfCommandList *cl, int x, int y, int w, int h, DfColour c) {
+    AddShape(cl, CMD_RECT_OUTLINE, x, y, w, h, c);
+}
+
+
+void CommandListCircleOutline(DfCommandList *cl, int x, int y, int r, DfColour c) {
+    AddShape(cl, CMD_CIRCLE_OUTLINE, x, y, r, 0, c);
+}
+
+
+void CommandListCircleFill(DfCommandList *cl, int x, int y, int r, DfColour c) {
+    AddShape(cl, CMD_CIRCLE_FILL, x, y, r, 0, c);
+}
+
+
+int CommandListDrawTextSimple(DfCommandList *cl, DfFont *font, DfColour c, int x, int y, char const *text) {
+    return CommandListDrawTextSimpleLen(cl, font, c, x, y, text, INT_MAX);
+}
+
+
+int CommandListDrawTextSimpleLen(DfCommandList *cl, DfFont *font, DfColour c, int x, int y,
+                                 char const *text, int maxChars) {
+    // The command's size has to fit in its 16-bit size field.
+    int len = 0;
+    int const maxLen = 65535 - sizeof(CmdText) - CMD_ALIGNMENT;
+    while (len < maxChars && len < maxLen && text[len])
+        len++;
+
+    CmdText *cmd = (CmdText *)AddCommand(cl, CMD_TEXT, sizeof(CmdText) + len);
+    cmd->x = x;
+    cmd->y = y;
+    cmd->colour = c;
+    cmd->width = GetTextWidthNumChars(font, text, len);
+    cmd->len = len;
+    cmd->font = font;
+    memcpy(cmd + 1, text, len);
+    AddToBounds(cl, &cmd->header);
+    return cmd->width;
+}
+
+
+void CommandListFillConvexPolygon(DfCommandList *cl, PolyVertList *vertList, DfColour c,
+                                  int xOffset, int yOffset) {
+    int numPoints = vertList->numPoints;
+    CmdPolygon *cmd = (CmdPolygon *)AddCommand(cl, CMD_POLYGON, sizeof(CmdPolygon) + numPoints * sizeof(PolyVert));
+    cmd->xOffset = xOffset;
+    cmd->yOffset = yOffset;
+    cmd->colour = c;
+    cmd->numPoints = numPoints;
+    memcpy(cmd + 1, vertList->points, numPoints * sizeof(PolyVert));
+    AddToBounds(cl, &cmd->header);
+}
+
+
+void CommandListBlit(DfCommandList *cl, int x, int y, DfBitmap *srcBmp) {
+    AddBlit(cl, CMD_BLIT, x, y, srcBmp->width, srcBmp->height, srcBmp);
+}
+
+
+void CommandListMaskedBlit(DfCommandList *cl, int x, int y, DfBitmap *srcBmp) {
+    AddBlit(cl, CMD_MASKED_BLIT, x, y, srcBmp->width, srcBmp->height, srcBmp);
+}
+
+
+void CommandListStretchBlit(DfCommandList *cl, int x, int y, int w, int h, DfBitmap *srcBmp) {
+    AddBlit(cl, CMD_STRETCH_BLIT, x, y, w, h, srcBmp);
+}
+
+
+// ****************************************************************************
+// Replay
+// ****************************************************************************
+
+// Most drawing functions draw exactly the same pixels whatever the clip rect
+// is, apart from the ones that are clipped. DrawLine() doesn't, because it
+// moves the end points of a clipped line and then steps from those.
+static bool IsClipSensitive(CmdHeader const *header) {
+    if (header->type != CMD_DRAW_LINE)
+        return false;
+    int const *v = ((CmdShape const *)header)->v;
+    return v[0] != v[2] && v[1] != v[3];
+}
+
+
+// Draws the command, moved by dx,dy. If unclipped is true, the caller has
+// checked that the command is entirely inside the clip rect, so the functions
+// that have unclipped versions can skip their clip checks.
+static void ExecuteCommand(CmdHeader const *header, DfBitmap *bmp, int dx, int dy, bool unclipped) {
+    CmdShape const *shape = (CmdShape const *)header;
+    CmdBlit const *blit = (CmdBlit const *)header;
+    int const *v = shape->v;
+    DfColour col = shape->colour;
+
+    switch (header->type) {
+    case CMD_BITMAP_CLEAR:
+        BitmapClear(bmp, col);
+        break;
+    case CMD_PUT_PIX:
+        if (unclipped) PutPixUnclipped(bmp, v[0] + dx, v[1] + dy, col);
+        else PutPix(bmp, v[0] + dx, v[1] + dy, col);
+        break;
+    case CMD_HLINE:
+        if (unclipped) HLineUnclipped(bmp, v[0] + dx, v[1] + dy, v[2], col);
+        else HLine(bmp, v[0] + dx, v[1] + dy, v[2], col);
+        break;
+    case CMD_VLINE:
+        if (unclipped) VLineUnclipped(bmp, v[0] + dx, v[1] + dy, v[2], col);
+        else VLine(bmp, v[0] + dx, v[1] + dy, v[2], col);
+        break;
+    case CMD_DRAW_LINE:     DrawLine(bmp, v[0] + dx, v[1] + dy, v[2] + dx, v[3] + dy, col); break;
+    case CMD_RECT_FILL:     RectFill(bmp, v[0] + dx, v[1] + dy, v[2], v[3], col); break;
+    case CMD_RECT_OUTLINE:  RectOutline(bmp, v[0] + dx, v[1] + dy, v[2], v[3], col); break;
+    case CMD_CIRCLE_OUTLINE: CircleOutline(bmp, v[0] + dx, v[1] + dy, v[2], col); break;
+    case CMD_CIRCLE_FILL:   CircleFill(bmp, v[0] + dx, v[1] + dy, v[2], col); break;
+    case CMD_TEXT: {
+        CmdText const *text = (CmdText const *)header;
+        DrawTextSimpleLen(text->font, text->colour, bmp, text->x + dx, text->y + dy,
+                          (char const *)(text + 1), text->len);
+        break;
+    }
+    case CMD_POLYGON: {
+        CmdPolygon const *poly = (CmdPolygon const *)header;
+        PolyVertList vertList;
+        vertList.numPoints = poly->numPoints;
+        memcpy(vertList.points, poly + 1, poly->numPoints * sizeof(PolyVert));
+        FillConvexPolygon(bmp, &vertList, poly->colour, poly->xOffset + dx, poly->yOffset + dy);
+        break;
+    }
+    case CMD_BLIT:          Blit(bmp, blit->x + dx, blit->y + dy, blit->srcBmp); break;
+    case CMD_MASKED_BLIT:   MaskedBlit(bmp, blit->x + dx, blit->y + dy, blit->srcBmp); break;
+    case CMD_STRETCH_BLIT:  StretchBlit(bmp, blit->x + dx, blit->y + dy, blit->w, blit->h, blit->srcBmp); break;
+    }
+}
+
+
+void CommandListReplay(DfCommandList *cl, DfBitmap *bmp) {
+    CommandListReplayAt(cl, bmp, 0, 0);
+}
+
+
+void CommandListReplayAt(DfCommandList *cl, DfBitmap *bmp, int x, int y) {
+    // If everything is inside the clip rect, none of the commands need clipping.
+    // The sums are done in 64 bits because BitmapClear()'s bounds are infinite.
+    bool unclipped = (int64_t)cl->bounds.x1 + x >= bmp->clipLeft && (int64_t)cl->bounds.x2 + x <= bmp->clipRight &&
+                     (int64_t)cl->bounds.y1 + y >= bmp->clipTop && (int64_t)cl->bounds.y2 + y <= bmp->clipBottom;
+
+    for (int offset = 0; offset < cl->bufUsed;) {
+        CmdHeader const *header = (CmdHeader const *)(cl->buf + offset);
+        ExecuteCommand(header, bmp, x, y, unclipped);
+        offset += header->size;
+    }
+}
+
+
+// ****************************************************************************
+// Tiled replay
+// ****************************************************************************
+
+// Wide tiles keep the writes to each row long, which matters for the
+// memory-bound fills and blits.
+enum { TILE_WIDTH = 256, TILE_HEIGHT = 64 };
+
+
+struct TiledReplay {
+    DfCommandList *cl;
+    DfBitmap *bmp;
+    int tilesAcross;
+    int tilesDown;
+
+    // Indices of the tiles that have commands in the current batch.
+    int *activeTiles;
+    int numActiveTiles;
+};
+
+
+static void AddToBin(TileBin *bin, int cmdOffset) {
+    if (bin->numCmds == bin->capacity) {
+        int newCapacity = IntMax(bin->capacity * 2, 64);
+        int *newOffsets = new int [newCapacity];
+        if (bin->cmdOffsets)
+            memcpy(newOffsets, bin->cmdOffsets, bin->numCmds * sizeof(int));
+        delete [] bin->cmdOffsets;
+        bin->cmdOffsets = newOffsets;
+        bin->capacity = newCapacity;
+    }
+
+    bin->cmdOffsets[bin->numCmds] = cmdOffset;
+    bin->numCmds++;
+}
+
+
+// Tiles on the edges of the grid are treated as extending to infinity, so
+// that commands that hang off the edge of the bitmap are binned with them.
+static int TileX(TiledReplay *tr, int x) {
+    return ClampInt(x / TILE_WIDTH, 0, tr->tilesAcross - 1);
+}
+
+
+static int TileY(TiledReplay *tr, int y) {
+    return ClampInt(y / TILE_HEIGHT, 0, tr->tilesDown - 1);
+}
+
+
+static void DrawTile(void *context, int jobIndex) {
+    TiledReplay *tr = (TiledReplay *)context;
+    int tileIdx = tr->activeTiles[jobIndex];
+    TileBin *bin = &tr->cl->bins[tileIdx];
+    DfBitmap *bmp = tr->bmp;
+
+    // Draw through a copy of the bitmap that is clipped to the tile. The copy
+    // has no damage list, because the main thread records the damage.
+    DfBitmap tileBmp = *bmp;
+    tileBmp.damage = NULL;
+    tileBmp._allocation = NULL;
+    int tileX = (tileIdx % tr->tilesAcross) * TILE_WIDTH;
+    int tileY = (tileIdx / tr->tilesAcross) * TILE_HEIGHT;
+    tileBmp.clipLeft = IntMax(bmp->clipLeft, tileX);
+    tileBmp.clipTop = IntMax(bmp->clipTop, tileY);
+    tileBmp.clipRight = IntMin(bmp->clipRight, tileX + TILE_WIDTH);
+    tileBmp.clipBottom = IntMin(bmp->clipBottom, tileY + TILE_HEIGHT);
+
+    for (int i = 0; i < bin->numCmds; i++) {
+        CmdHeader const *header = (CmdHeader const *)(tr->cl->buf + bin->cmdOffsets[i]);
+        ExecuteCommand(header, &tileBmp, 0, 0, false);
+    }
+
+    bin->numCmds = 0;
+}
+
+
+// Draws all the commands that have been binned, then empties the bins.
+static void DrawBinnedCommands(TiledReplay *tr, DfThreadPool *pool) {
+    tr->numActiveTiles = 0;
+    int numTiles = tr->tilesAcross * tr->tilesDown;
+    for (int i = 0; i < numTiles; i++) {
+        if (tr->cl->bins[i].numCmds > 0) {
+            tr->activeTiles[tr->numActiveTiles] = i;
+            tr->numActiveTiles++;
+        }
+    }
+
+    ThreadPoolRun(pool, tr->numActiveTiles, DrawTile, tr);
+}
+
+
+void CommandListReplayTiled(DfCommandList *cl, DfBitmap *bmp, DfThreadPool *pool) {
+    if (!pool)
+        pool = ThreadPoolGetDefault();
+
+    if (bmp->clipLeft >= bmp->clipRight || bmp->clipTop >= bmp->clipBottom)
+        return;
+
+    TiledReplay tr;
+    tr.cl = cl;
+    tr.bmp = bmp;
+    tr.tilesAcross = (bmp->width + TILE_WIDTH - 1) / TILE_WIDTH;
+    tr.tilesDown = (bmp->height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+
+    int numTiles = tr.tilesAcross * tr.tilesDown;
+    if (cl->numBins < numTiles) {
+        TileBin *newBins = new TileBin [numTiles];
+        memset(newBins, 0, sizeof(TileBin) * numTiles);
+        if (cl->bins)
+            memcpy(newBins, cl->bins, sizeof(TileBin) * cl->numBins);
+        delete [] cl->bins;
+        cl->bins = newBins;
+        delete [] cl->activeTiles;
+        cl->activeTiles = new int [numTiles];
+        cl->numBins = numTiles;
+    }
+
+    tr.activeTiles = cl->activeTiles;
+
+    // Commands are binned until one is found that has to be drawn by itself.
+    // Then the binned commands are drawn in parallel, followed by that one.
+    for (int offset = 0; offset < cl->bufUsed;) {
+        CmdHeader const *header = (CmdHeader const *)(cl->buf + offset);
+        Bounds b = GetCommandBounds(header);
+
+        int tx1 = TileX(&tr, b.x1);
+        int ty1 = TileY(&tr, b.y1);
+        int tx2 = TileX(&tr, b.x2 - 1);
+        int ty2 = TileY(&tr, b.y2 - 1);
+        if (IsClipSensitive(header) && (tx1 != tx2 || ty1 != ty2)) {
+            DrawBinnedCommands(&tr, pool);
+            ExecuteCommand(header, bmp, 0, 0, false);
+            offset += header->size;
+            continue;
+        }
+
+        // Only bin the command in the tiles it can draw to.
+        b.x1 = IntMax(b.x1, bmp->clipLeft);
+        b.y1 = IntMax(b.y1, bmp->clipTop);
+        b.x2 = IntMin(b.x2, bmp->clipRight);
+        b.y2 = IntMin(b.y2, bmp->clipBottom);
+        if (b.x1 < b.x2 && b.y1 < b.y2) {
+            if (bmp->damage)
+                BitmapAddDamage(bmp, b.x1, b.y1, b.x2 - b.x1, b.y2 - b.y1);
+
+            tx1 = TileX(&tr, b.x1);
+            ty1 = TileY(&tr, b.y1);
+            tx2 = TileX(&tr, b.x2 - 1);
+            ty2 = TileY(&tr, b.y2 - 1);
+            for (int ty = ty1; ty <= ty2; ty++)
+                for (int tx = tx1; tx <= tx2; tx++)
+                    AddToBin(&cl->bins[ty * tr.tilesAcross + tx], offset);
+        }
+
+        offset += header->size;
+    }
+
+    DrawBinnedCommands(&tr, pool);
+}
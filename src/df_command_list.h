@@ -0,0 +1,75 @@
+// A command list records drawing calls so that they can be replayed onto a
+// bitmap later. It's useful for things that are drawn the same way every
+// frame, like grids, axes and other static parts of a GUI. A list can be
+// replayed at any offset, onto any bitmap, as many times as you like.
+// Replaying with CommandListReplayTiled() splits the bitmap into tiles and
+// draws them on a pool of threads, which is much faster for large bitmaps on
+// multi-core machines. The result is identical to drawing the same calls
+// directly.
+//
+// Bitmaps and fonts passed to the record functions are referenced, not
+// copied, so they must not be deleted until the command list has been
+// replayed. Text and polygon vertices are copied.
+//
+// CommandListReplay() and CommandListReplayAt() don't modify the list, so
+// several threads can replay the same list at once, as long as nothing is
+// recording into it. CommandListReplayTiled() keeps its working
+// memory in the list, so only one tiled replay of a list can run at a time.
+
+#pragma once
+
+
+#include "df_bitmap.h"
+#include "df_font.h"
+#include "df_polygon.h"
+#include "df_thread.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+typedef struct _DfCommandList DfCommandList;
+
+
+DLL_API DfCommandList *CommandListCreate();
+DLL_API void        CommandListDelete   (DfCommandList *cl);
+
+// Removes all the commands, but keeps the memory for reuse.
+DLL_API void        CommandListClear    (DfCommandList *cl);
+
+// Draw onto bmp. Drawing is clipped to bmp's clip rect, as usual.
+DLL_API void        CommandListReplay   (DfCommandList *cl, DfBitmap *bmp);
+
+// Like CommandListReplay(), but everything is moved x pixels right and y
+// pixels down. If the whole list lands inside the clip rect, the clip checks
+// are skipped for the commands that allow it.
+DLL_API void        CommandListReplayAt (DfCommandList *cl, DfBitmap *bmp, int x, int y);
+
+// Draw onto bmp, using the pool's threads. If pool is NULL, the pool from
+// ThreadPoolGetDefault() is used.
+DLL_API void        CommandListReplayTiled(DfCommandList *cl, DfBitmap *bmp, DfThreadPool *pool);
+
+// These record calls to the drawing functions with the same names in df_bitmap.h.
+DLL_API void        CommandListBitmapClear  (DfCommandList *cl, DfColour c);
+DLL_API void        CommandListPutPix       (DfCommandList *cl, int x, int y, DfColour c);
+DLL_API void        CommandListHLine        (DfCommandList *cl, int x, int y, int len, DfColour c);
+DLL_API void        CommandListVLine        (DfCommandList *cl, int x, int y, int len, DfColour c);
+DLL_API void        CommandListDrawLine     (DfCommandList *cl, int x1, int y1, int x2, int y2, DfColour c);
+DLL_API void        CommandListRectFill     (DfCommandList *cl, int x, int y, int w, int h, DfColour c);
+DLL_API void        CommandListRectOutline  (DfCommandList *cl, int x, int y, int w, int h, DfColour c);
+DLL_API void        CommandListCircleOutline(DfCommandList *cl, int x, int y, int r, DfColour c);
+DLL_API void        CommandListCircleFill   (DfCommandList *cl, int x, int y, int r, DfColour c);
+DLL_API int         CommandListDrawTextSimple   (DfCommandList *cl, DfFont *font, DfColour c, int x, int y, char const *text);
+DLL_API int         CommandListDrawTextSimpleLen(DfCommandList *cl, DfFont *font, DfColour c, int x, int y, char const *text, int maxChars);
+DLL_API void        CommandListFillConvexPolygon(DfCommandList *cl, PolyVertList *vertList, DfColour c, int xOffset, int yOffset);
+DLL_API void        CommandListBlit         (DfCommandList *cl, int x, int y, DfBitmap *srcBmp);
+DLL_API void        CommandListMaskedBlit   (DfCommandList *cl, int x, int y, DfBitmap *srcBmp);
+DLL_API void        CommandListStretchBlit  (DfCommandList *cl, int x, int y, int w, int h, DfBitmap *srcBmp);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,7 +1,8 @@
 // This module implements a bitmap font renderer.
 // The supported font file format is custom.
 // Variable width fonts are supported.
-// The renderer currently does not attempt any form of anti-aliasing.
+// Font files only contain 1-bit glyphs, but an anti-aliased font can be made
+// by loading a large size and shrinking it with LoadFontFromMemoryAA().
 // See docs/fonts.txt for more info.
 
 #pragma once
@@ -10,6 +11,8 @@
 #include "df_colour.h"
 #include "df_common.h"
 
+#include <stdint.h>
+
 
 #ifdef __cplusplus
 extern "C"
@@ -18,14 +21,45 @@ extern "C"
 
 
 typedef struct _DfBitmap DfBitmap;
-typedef struct _Glyph Glyph;
 
 
+// Glyphs are at most 255 pixels wide and high, so a run fits in 4 bytes.
+typedef struct _EncodedRun {
+    uint8_t startX;
+    uint8_t startY;
+    uint8_t runLen;
+
+    // Zero if all the pixels are fully covered. Otherwise the run's coverage
+    // values are the next runLen bytes of the glyph's coverage. Only
+    // anti-aliased fonts have partially covered runs.
+    uint8_t partial;
+} EncodedRun;
+
+
+typedef struct _Glyph {
+    uint16_t width;
+    uint16_t numRuns;
+    unsigned firstRun;          // Index into DfFont::runs.
+    unsigned firstCoverage;     // Index into DfFont::coverage.
+} Glyph;
+
+
+// A font is one 64-byte aligned block of memory. The glyphs, their runs and
+// coverage values follow the DfFont struct, so that drawing lots of text only
+// touches a few contiguous cache lines.
 typedef struct _DfFont {
-    Glyph *glyphs[256];   // TODO remove the *, so the glyphs are contiguous in memory.
+    Glyph *glyphs;      // 256 glyphs, one for each char value.
+    EncodedRun *runs;   // The runs of all the glyphs.
+
+    // NULL unless the font is anti-aliased. Holds the coverage values of all
+    // the partially covered pixels of all the glyphs.
+    unsigned char *coverage;
+
     bool fixedWidth;
     int maxCharWidth;
     int charHeight; // in pixels
+
+    void *_allocation;  // Private. Start of the memory block, before alignment.
 } DfFont;
 
 typedef struct _DfFontSource {
@@ -53,6 +87,13 @@ DLL_API DfFont *LoadFontFromFile(char const *filename, int pixHeight);
 // a font in C code format that was #include'd.
 DLL_API DfFont *LoadFontFromMemory(void const *buf, int numBytes);
 
+// Like LoadFontFromMemory(), but the glyphs are shrunk to pixHeight with a box
+// filter, giving an anti-aliased font. pixHeight must not be larger than the
+// font in buf. Pick a font in buf that is at least twice as tall as pixHeight
+// for the smoothest results. Drawing text in an anti-aliased font blends it
+// with the background, using the colour's alpha as well as the coverage.
+DLL_API DfFont *LoadFontFromMemoryAA(void const *buf, int numBytes, int pixHeight);
+
 DLL_API void FontDelete(DfFont *font);
 
 // All the DrawText... functions below return rendered text length in pixels.
@@ -0,0 +1,450 @@
+#include "df_frame_recorder.h"
+
+#include "df_common.h"
+#include "df_thread.h"
+#include "df_time.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define RECORDER_X64 1
+#include <emmintrin.h>
+#endif
+
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#define PIPE_WRITE_MODE "wb"
+#else
+#define PIPE_WRITE_MODE "w"
+#endif
+
+
+struct _DfFrameRecorder {
+    FILE           *file;
+    bool            isPipe;
+
+    int             width;
+    int             height;
+    DfRecordFormat  format;
+    DfRecordPolicy  policy;
+
+    DfThread       *thread;
+    DfMutex        *mutex;
+    DfCondVar      *condVar;    // Broadcast when a frame is queued or written, or quit is set.
+
+    // A ring of frames. The writer thread owns the numQueued frames starting
+    // at firstQueued, including the one it is converting. The rest are free.
+    int             numBuffers;
+    DfColour      **buffers;    // Each is width * height pixels, with no padding.
+    int             firstQueued;
+    int             numQueued;
+
+    // A converted frame. Only the writer thread touches it.
+    unsigned char  *outBuf;
+    int             outBufSize;
+
+    bool            quit;
+
+    DfFrameRecorderStats stats; // Protected by mutex.
+};
+
+
+// ****************************************************************************
+// Scalar conversion
+// ****************************************************************************
+
+// This is the reference. The SIMD versions must match it exactly.
+//
+// The BT.601 limited range matrix, in 8.8 fixed point. The chroma rows work on
+// the sum of a 2x2 block of pixels, so they are shifted down by 10 instead of
+// 8. The 128 offset is added before the shift to keep the sums positive.
+static inline unsigned RgbToY(unsigned r, unsigned g, unsigned b) {
+    return (66 * r + 129 * g + 25 * b + (16 << 8) + 128) >> 8;
+}
+
+static inline unsigned SumsToU(int sumR, int sumG, int sumB) {
+    return (-38 * sumR - 74 * sumG + 112 * sumB + (128 << 10) + 512) >> 10;
+}
+
+static inline unsigned SumsToV(int sumR, int sumG, int sumB) {
+    return (112 * sumR - 94 * sumG - 18 * sumB + (128 << 10) + 512) >> 10;
+}
+
+
+static void ConvertRowToYScalar(DfColour const *row, unsigned char *y, int start, int width) {
+    for (int x = start; x < width; x++)
+        y[x] = RgbToY(row[x].r, row[x].g, row[x].b);
+}
+
+
+// Each chroma sample covers 2x2 pixels from row0 and row1. If the width is
+// odd, the last sample uses the last column twice.
+static void ConvertRowsToUvScalar(DfColour const *row0, DfColour const *row1,
+                                  unsigned char *u, unsigned char *v, int start, int width) {
+    int chromaWidth = (width + 1) / 2;
+    for (int cx = start; cx < chromaWidth; cx++) {
+        int x0 = cx * 2;
+        int x1 = x0 + 1 < width ? x0 + 1 : x0;
+        int sumR = row0[x0].r + row0[x1].r + row1[x0].r + row1[x1].r;
+        int sumG = row0[x0].g + row0[x1].g + row1[x0].g + row1[x1].g;
+        int sumB = row0[x0].b + row0[x1].b + row1[x0].b + row1[x1].b;
+        u[cx] = SumsToU(sumR, sumG, sumB);
+        v[cx] = SumsToV(sumR, sumG, sumB);
+    }
+}
+
+
+static void ConvertRowToRgbaScalar(DfColour const *row, uint32_t *out, int start, int width) {
+    for (int x = start; x < width; x++) {
+        unsigned c = row[x].c;
+        out[x] = (c & 0xff00) | ((c >> 16) & 0xff) | ((c & 0xff) << 16) | 0xff000000;
+    }
+}
+
+
+#if RECORDER_X64
+
+// ****************************************************************************
+// SSE2 conversion
+// ****************************************************************************
+
+// lo and hi hold 4 pixels, or 2x2 sums, widened to 16 bits per channel in
+// BGRA order. Returns the 4 dot products of them with coef, as 32-bit ints.
+static inline __m128i DotBgra(__m128i lo, __m128i hi, __m128i coef) {
+    __m128 a = _mm_castsi128_ps(_mm_madd_epi16(lo, coef)); // b*cb + g*cg, r*cr + a*ca, ...
+    __m128 b = _mm_castsi128_ps(_mm_madd_epi16(hi, coef));
+    __m128i even = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i odd = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    return _mm_add_epi32(even, odd);
+}
+
+
+// Returns where the scalar version needs to carry on from.
+static int ConvertRowToYSse2(DfColour const *row, unsigned char *y, int width) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i coef = _mm_set_epi16(0, 66, 129, 25, 0, 66, 129, 25);
+    __m128i offset = _mm_set1_epi32((16 << 8) + 128);
+
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i p0 = _mm_loadu_si128((__m128i const *)(row + x));
+        __m128i p1 = _mm_loadu_si128((__m128i const *)(row + x + 4));
+        __m128i y0 = DotBgra(_mm_unpacklo_epi8(p0, zero), _mm_unpackhi_epi8(p0, zero), coef);
+        __m128i y1 = DotBgra(_mm_unpacklo_epi8(p1, zero), _mm_unpackhi_epi8(p1, zero), coef);
+        y0 = _mm_srli_epi32(_mm_add_epi32(y0, offset), 8);
+        y1 = _mm_srli_epi32(_mm_add_epi32(y1, offset), 8);
+        __m128i packed = _mm_packs_epi32(y0, y1);
+        _mm_storel_epi64((__m128i *)(y + x), _mm_packus_epi16(packed, packed));
+    }
+
+    return x;
+}
+
+
+// Returns the 2x2 sums of 4 pixels from each of row0 and row1. The result
+// holds 2 of them, each 4 16-bit channels.
+static inline __m128i SumBlocks(DfColour const *row0, DfColour const *row1) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_loadu_si128((__m128i const *)row0);
+    __m128i b = _mm_loadu_si128((__m128i const *)row1);
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+    lo = _mm_add_epi16(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+    hi = _mm_add_epi16(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_unpacklo_epi64(lo, hi);
+}
+
+
+static inline void StoreChroma(unsigned char *dst, __m128i sums, __m128i offset) {
+    sums = _mm_srai_epi32(_mm_add_epi32(sums, offset), 10);
+    sums = _mm_packs_epi32(sums, sums);
+    uint32_t four = _mm_cvtsi128_si32(_mm_packus_epi16(sums, sums));
+    memcpy(dst, &four, 4);
+}
+
+
+static int ConvertRowsToUvSse2(DfColour const *row0, DfColour const *row1,
+                               unsigned char *u, unsigned char *v, int width) {
+    __m128i coefU = _mm_set_epi16(0, -38, -74, 112, 0, -38, -74, 112);
+    __m128i coefV = _mm_set_epi16(0, 112, -94, -18, 0, 112, -94, -18);
+    __m128i offset = _mm_set1_epi32((128 << 10) + 512);
+
+    int cx = 0;
+    for (; cx * 2 + 8 <= width; cx += 4) {
+        __m128i s01 = SumBlocks(row0 + cx * 2, row1 + cx * 2);
+        __m128i s23 = SumBlocks(row0 + cx * 2 + 4, row1 + cx * 2 + 4);
+        StoreChroma(u + cx, DotBgra(s01, s23, coefU), offset);
+        StoreChroma(v + cx, DotBgra(s01, s23, coefV), offset);
+    }
+
+    return cx;
+}
+
+
+static int ConvertRowToRgbaSse2(DfColour const *row, uint32_t *out, int width) {
+    __m128i greenMask = _mm_set1_epi32(0xff00);
+    __m128i lowMask = _mm_set1_epi32(0xff);
+    __m128i alpha = _mm_set1_epi32(0xff000000);
+
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i c = _mm_loadu_si128((__m128i const *)(row + x));
+        __m128i r = _mm_and_si128(_mm_srli_epi32(c, 16), lowMask);
+        __m128i b = _mm_slli_epi32(_mm_and_si128(c, lowMask), 16);
+        __m128i result = _mm_or_si128(_mm_or_si128(_mm_and_si128(c, greenMask), alpha), _mm_or_si128(r, b));
+        _mm_storeu_si128((__m128i *)(out + x), result);
+    }
+
+    return x;
+}
+
+#endif // RECORDER_X64
+
+
+// ****************************************************************************
+// Frame conversion
+// ****************************************************************************
+
+static char const g_y4mFrameHeader[] = "FRAME\n";
+static int const Y4M_FRAME_HEADER_LEN = sizeof(g_y4mFrameHeader) - 1;
+
+
+static void ConvertToY4m(DfFrameRecorder *rec, DfColour const *pixels) {
+    int w = rec->width;
+    int h = rec->height;
+    int chromaW = (w + 1) / 2;
+    int chromaH = (h + 1) / 2;
+    unsigned char *y = rec->outBuf + Y4M_FRAME_HEADER_LEN;
+    unsigned char *u = y + w * h;
+    unsigned char *v = u + chromaW * chromaH;
+
+    memcpy(rec->outBuf, g_y4mFrameHeader, Y4M_FRAME_HEADER_LEN);
+
+    for (int row = 0; row < h; row++) {
+        DfColour const *src = pixels + row * w;
+        int x = 0;
+#if RECORDER_X64
+        x = ConvertRowToYSse2(src, y + row * w, w);
+#endif
+        ConvertRowToYScalar(src, y + row * w, x, w);
+    }
+
+    for (int cy = 0; cy < chromaH; cy++) {
+        DfColour const *row0 = pixels + cy * 2 * w;
+        DfColour const *row1 = cy * 2 + 1 < h ? row0 + w : row0;
+        int cx = 0;
+#if RECORDER_X64
+        cx = ConvertRowsToUvSse2(row0, row1, u + cy * chromaW, v + cy * chromaW, w);
+#endif
+        ConvertRowsToUvScalar(row0, row1, u + cy * chromaW, v + cy * chromaW, cx, w);
+    }
+}
+
+
+static void ConvertToRgba(DfFrameRecorder *rec, DfColour const *pixels) {
+    int numPixels = rec->width * rec->height;
+    uint32_t *out = (uint32_t *)rec->outBuf;
+    int i = 0;
+#if RECORDER_X64
+    i = ConvertRowToRgbaSse2(pixels, out, numPixels);
+#endif
+    ConvertRowToRgbaScalar(pixels, out, i, numPixels);
+}
+
+
+// ****************************************************************************
+// Writer thread
+// ****************************************************************************
+
+static void WriterThreadFunc(void *arg) {
+    DfFrameRecorder *rec = (DfFrameRecorder *)arg;
+
+    MutexLock(rec->mutex);
+    while (1) {
+        while (rec->numQueued == 0 && !rec->quit)
+            CondVarWait(rec->condVar, rec->mutex);
+        if (rec->numQueued == 0)
+            break;
+
+        // The frame stays queued until it has been written, so
+        // FrameRecorderAddFrame() won't reuse its buffer while the mutex is
+        // unlocked.
+        DfColour const *pixels = rec->buffers[rec->firstQueued];
+        bool failed = rec->stats.writeFailed;
+        MutexUnlock(rec->mutex);
+
+        if (!failed) {
+            if (rec->format == DF_RECORD_Y4M)
+                ConvertToY4m(rec, pixels);
+            else
+                ConvertToRgba(rec, pixels);
+            failed = fwrite(rec->outBuf, 1, rec->outBufSize, rec->file) != (size_t)rec->outBufSize;
+        }
+
+        MutexLock(rec->mutex);
+        if (failed)
+            rec->stats.writeFailed = true;
+        else
+            rec->stats.framesWritten++;
+        rec->firstQueued = (rec->firstQueued + 1) % rec->numBuffers;
+        rec->numQueued--;
+        CondVarBroadcast(rec->condVar);
+    }
+    MutexUnlock(rec->mutex);
+}
+
+
+// ****************************************************************************
+// Public functions
+// ****************************************************************************
+
+static DfFrameRecorder *CreateRecorder(FILE *file, bool isPipe, int width, int height, int fps,
+                                       DfRecordFormat format, DfRecordPolicy policy, int numBuffers) {
+    DfFrameRecorder *rec = new DfFrameRecorder;
+    memset(rec, 0, sizeof(DfFrameRecorder));
+    rec->file = file;
+    rec->isPipe = isPipe;
+    rec->width = width;
+    rec->height = height;
+    rec->format = format;
+    rec->policy = policy;
+
+    rec->numBuffers = numBuffers;
+    rec->buffers = new DfColour *[numBuffers];
+    for (int i = 0; i < numBuffers; i++)
+        rec->buffers[i] = new DfColour[width * height];
+
+    if (format == DF_RECORD_Y4M) {
+        int chromaSize = ((width + 1) / 2) * ((height + 1) / 2);
+        rec->outBufSize = Y4M_FRAME_HEADER_LEN + width * height + chromaSize * 2;
+
+        // C420jpeg is the usual chroma siting for I420, and what ffmpeg
+        // assumes when there's no C tag.
+        if (fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, fps) < 0)
+            rec->stats.writeFailed = true;
+    }
+    else {
+        rec->outBufSize = width * height * 4;
+    }
+    rec->outBuf = new unsigned char[rec->outBufSize];
+
+    rec->mutex = MutexCreate();
+    rec->condVar = CondVarCreate();
+    rec->thread = ThreadCreate(WriterThreadFunc, rec);
+
+    return rec;
+}
+
+
+static void CheckArgs(int width, int height, int fps, DfRecordFormat format, int numBuffers) {
+    ReleaseAssert(width > 0 && height > 0, "FrameRecorder: Invalid frame size %ix%i", width, height);
+    ReleaseAssert(fps > 0, "FrameRecorder: fps must be positive");
+    ReleaseAssert(format == DF_RECORD_Y4M || format == DF_RECORD_RGBA, "FrameRecorder: Unknown format");
+    ReleaseAssert(numBuffers >= 1, "FrameRecorder: numBuffers must be at least 1");
+}
+
+
+DfFrameRecorder *FrameRecorderCreate(char const *filename, int width, int height, int fps,
+                                     DfRecordFormat format, DfRecordPolicy policy, int numBuffers) {
+    CheckArgs(width, height, fps, format, numBuffers);
+    FILE *file = fopen(filename, "wb");
+    if (!file)
+        return NULL;
+    return CreateRecorder(file, false, width, height, fps, format, policy, numBuffers);
+}
+
+
+DfFrameRecorder *FrameRecorderCreatePipe(char const *command, int width, int height, int fps,
+                                         DfRecordFormat format, DfRecordPolicy policy, int numBuffers) {
+    CheckArgs(width, height, fps, format, numBuffers);
+    FILE *file = popen(command, PIPE_WRITE_MODE);
+    if (!file)
+        return NULL;
+    return CreateRecorder(file, true, width, height, fps, format, policy, numBuffers);
+}
+
+
+bool FrameRecorderAddFrame(DfFrameRecorder *rec, DfBitmap *bmp) {
+    ReleaseAssert(bmp->width == rec->width && bmp->height == rec->height,
+        "FrameRecorderAddFrame: Frame is %ix%i but the recorder is %ix%i",
+        bmp->width, bmp->height, rec->width, rec->height);
+
+    MutexLock(rec->mutex);
+    rec->stats.framesAdded++;
+
+    double stallStartTime = 0.0;
+    while (rec->numQueued == rec->numBuffers) {
+        if (rec->policy == DF_RECORD_DROP) {
+            rec->stats.framesDropped++;
+            MutexUnlock(rec->mutex);
+            return false;
+        }
+
+        if (stallStartTime == 0.0) {
+            stallStartTime = GetRealTime();
+            rec->stats.stalls++;
+        }
+        CondVarWait(rec->condVar, rec->mutex);
+    }
+
+    if (stallStartTime != 0.0)
+        rec->stats.stallSeconds += GetRealTime() - stallStartTime;
+
+    int i = (rec->firstQueued + rec->numQueued) % rec->numBuffers;
+    MutexUnlock(rec->mutex);
+
+    // Only this thread touches free buffers, so the copy can be done without
+    // the lock.
+    DfColour *dst = rec->buffers[i];
+    for (int y = 0; y < bmp->height; y++)
+        memcpy(dst + y * rec->width, bmp->pixels + y * bmp->stride, rec->width * sizeof(DfColour));
+
+    MutexLock(rec->mutex);
+    rec->numQueued++;
+    CondVarBroadcast(rec->condVar);
+    MutexUnlock(rec->mutex);
+
+    return true;
+}
+
+
+bool FrameRecorderClose(DfFrameRecorder *rec) {
+    MutexLock(rec->mutex);
+    rec->quit = true;
+    CondVarBroadcast(rec->condVar);
+    MutexUnlock(rec->mutex);
+    ThreadJoin(rec->thread);
+
+    bool ok = !rec->stats.writeFailed;
+    if (rec->isPipe) {
+        if (pclose(rec->file) != 0)
+            ok = false;
+    }
+    else {
+        if (fclose(rec->file) != 0)
+            ok = false;
+    }
+
+    for (int i = 0; i < rec->numBuffers; i++)
+        delete [] rec->buffers[i];
+    delete [] rec->buffers;
+    delete [] rec->outBuf;
+    CondVarDelete(rec->condVar);
+    MutexDelete(rec->mutex);
+    delete rec;
+
+    return ok;
+}
+
+
+void FrameRecorderGetStats(DfFrameRecorder *rec, DfFrameRecorderStats *stats) {
+    MutexLock(rec->mutex);
+    *stats = rec->stats;
+    MutexUnlock(rec->mutex);
+}
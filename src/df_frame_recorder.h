@@ -0,0 +1,85 @@
+// A frame recorder writes a sequence of bitmaps to a video file, or to a pipe
+// into a program like ffmpeg, without holding up the thread that draws them.
+// FrameRecorderAddFrame() copies the bitmap into one of a fixed number of
+// buffers that are allocated up front. A writer thread converts the buffered
+// frames and writes them in the order they were added.
+//
+// Two formats are supported:
+//   * Y4M - A YUV4MPEG2 stream with 4:2:0 chroma, which is what ffmpeg,
+//     mpv and x264 call I420. The colours are converted with the BT.601
+//     limited range matrix that these programs assume.
+//   * RGBA - Raw 8-bit RGBA, with no header. Alpha is always written as
+//     255, because the drawing functions don't keep it meaningful. ffmpeg
+//     needs to be told the size and rate, eg:
+//         ffmpeg -f rawvideo -pix_fmt rgba -s 640x480 -r 60 -i - out.mp4
+//
+// Example of recording straight to an mp4:
+//     DfFrameRecorder *rec = FrameRecorderCreatePipe(
+//         "ffmpeg -y -i - -pix_fmt yuv420p out.mp4", 640, 480, 60,
+//         DF_RECORD_Y4M, DF_RECORD_BLOCK, 4);
+
+#pragma once
+
+
+#include "df_bitmap.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+typedef struct _DfFrameRecorder DfFrameRecorder;
+
+typedef enum {
+    DF_RECORD_Y4M,
+    DF_RECORD_RGBA
+} DfRecordFormat;
+
+// What FrameRecorderAddFrame() does when all the buffers are waiting to be
+// written, because the writer can't keep up.
+typedef enum {
+    DF_RECORD_BLOCK,    // Wait for a buffer to become free. Every frame is recorded.
+    DF_RECORD_DROP      // Return immediately without recording the frame.
+} DfRecordPolicy;
+
+typedef struct _DfFrameRecorderStats {
+    unsigned framesAdded;   // Including the dropped ones.
+    unsigned framesWritten;
+    unsigned framesDropped;
+    unsigned stalls;        // Times FrameRecorderAddFrame() had to wait for a free buffer.
+    double   stallSeconds;  // Total time spent waiting.
+    bool     writeFailed;   // True if a write has failed. Later frames are thrown away.
+} DfFrameRecorderStats;
+
+
+// Every frame must be width by height pixels. fps is only written into the
+// Y4M header. numBuffers is the number of frames that can be waiting to be
+// written, and must be at least 1. Returns NULL if the file can't be opened.
+DLL_API DfFrameRecorder *FrameRecorderCreate    (char const *filename, int width, int height, int fps,
+                                                 DfRecordFormat format, DfRecordPolicy policy, int numBuffers);
+
+// The same, but the frames are written to the standard input of a shell
+// command. Returns NULL if the command couldn't be started. A command that
+// exits early shows up as writeFailed, except that on Linux the process is
+// killed by SIGPIPE unless it ignores that signal.
+DLL_API DfFrameRecorder *FrameRecorderCreatePipe(char const *command, int width, int height, int fps,
+                                                 DfRecordFormat format, DfRecordPolicy policy, int numBuffers);
+
+// Returns false if the frame was dropped. bmp's clip rect and damage are
+// ignored. Must not be called from more than one thread at once.
+DLL_API bool        FrameRecorderAddFrame       (DfFrameRecorder *rec, DfBitmap *bmp);
+
+// Waits for the buffered frames to be written, closes the file or pipe and
+// deletes the recorder. For a pipe, this waits for the command to exit.
+// Returns false if anything failed to be written.
+DLL_API bool        FrameRecorderClose          (DfFrameRecorder *rec);
+
+// The counters count up from when the recorder was created.
+DLL_API void        FrameRecorderGetStats       (DfFrameRecorder *rec, DfFrameRecorderStats *stats);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -109,6 +109,37 @@ void DfGuiDoFrame(DfWindow *win) {
 }
 
 
+// Returns true if nothing has drawn in the rect since the last UpdateWin(),
+// so it still has the pixels that were drawn there last frame. Without damage
+// tracking, there's no way to know.
+static int AreaIsUndamaged(DfBitmap *bmp, int x, int y, int w, int h) {
+    if (!bmp->damage)
+        return 0;
+
+    for (int i = 0; i < bmp->damage->numRects; i++) {
+        DfRect *r = &bmp->damage->rects[i];
+        if (r->x < x + w && x < r->x + r->w && r->y < y + h && y < r->y + r->h)
+            return 0;
+    }
+
+    return 1;
+}
+
+
+// Scrolls the rect by dy and sets the clip rect to the strip that was
+// uncovered, filled with the background colour, ready for it to be drawn.
+static void ScrollAndClipToStrip(DfBitmap *bmp, int x, int y, int w, int h, int dy) {
+    BitmapScroll(bmp, x, y, w, h, 0, dy);
+    if (dy > 0)
+        SetClipRect(bmp, x, y, w, IntMin(dy, h));
+    else if (dy < 0)
+        SetClipRect(bmp, x, IntMax(y + h + dy, y), w, IntMin(-dy, h));
+    else
+        SetClipRect(bmp, x, y, w, 0);
+    RectFill(bmp, x, y, w, h, g_backgroundColour);
+}
+
+
 void DfDrawSunkenBox(DfBitmap *bmp, int x, int y, int w, int h) {
     // The specified w and h is the external size of the box.
     //
@@ -300,6 +331,7 @@ int DfEditBoxDo(DfWindow *win, DfEditBox *eb, int x, int y, int w, int h) {
         eb->cursorOn = !eb->cursorOn;
         eb->nextCursorToggleTime = now + CURSOR_TOGGLE_PERIOD;
     }
+    RequestWakeUp(win, eb->nextCursorToggleTime);
 
     // Do we need to scroll to keep the cursor visible?
     {
@@ -475,13 +507,25 @@ int DfEditBoxDo(DfWindow *win, DfEditBox *eb, int x, int y, int w, int h) {
 // List View
 // ****************************************************************************
 
+void DfListViewSetItems(DfListView *lv, char const **items, int numItems) {
+    lv->items = items;
+    lv->numItems = numItems;
+    lv->itemsGeneration++;
+}
+
+
+void DfListViewSetItem(DfListView *lv, int i, char const *item) {
+    lv->items[i] = item;
+    lv->itemsGeneration++;
+}
+
+
 int DfListViewDo(DfWindow *win, DfListView *lv, int x, int y, int w, int h) {
-    DfDrawSunkenBox(win->bmp, x, y, w, h);
+    int outerX = x, outerY = y, outerW = w, outerH = h;
     x += 2 * g_drawScale;
     y += 2 * g_drawScale;
     w -= 4 * g_drawScale;
     h -= 4 * g_drawScale;
-    SetClipRect(win->bmp, x, y, w, h);
 
     const int numRows = RoundToInt(h / (double)g_defaultFont->charHeight - 0.9);
 
@@ -516,16 +560,45 @@ int DfListViewDo(DfWindow *win, DfListView *lv, int x, int y, int w, int h) {
     lv->firstDisplayItem = ClampInt(lv->firstDisplayItem, 0, lv->numItems - numRows);
     if (lv->numItems <= numRows) lv->firstDisplayItem = 0;
 
+    int canReuse = win->bmp->damage && lv->itemsGeneration == lv->lastItemsGeneration &&
+        lv->items == lv->lastItems && lv->numItems == lv->lastNumItems &&
+        lv->selectedItem == lv->lastSelectedItem && g_defaultFont == lv->lastFont &&
+        outerX == lv->lastX && outerY == lv->lastY && outerW == lv->lastW && outerH == lv->lastH &&
+        AreaIsUndamaged(win->bmp, outerX, outerY, outerW, outerH);
+
+    if (canReuse) {
+        int dy = (lv->lastFirstDisplayItem - lv->firstDisplayItem) * g_defaultFont->charHeight;
+        ScrollAndClipToStrip(win->bmp, x, y, w, h, dy);
+    }
+    else {
+        DfDrawSunkenBox(win->bmp, outerX, outerY, outerW, outerH);
+        SetClipRect(win->bmp, x, y, w, h);
+    }
+
+    lv->lastItems = lv->items;
+    lv->lastNumItems = lv->numItems;
+    lv->lastItemsGeneration = lv->itemsGeneration;
+    lv->lastSelectedItem = lv->selectedItem;
+    lv->lastFirstDisplayItem = lv->firstDisplayItem;
+    lv->lastX = outerX;
+    lv->lastY = outerY;
+    lv->lastW = outerW;
+    lv->lastH = outerH;
+    lv->lastFont = g_defaultFont;
+
     int last_y = y + h;
     for (int i = lv->firstDisplayItem; i < lv->numItems; i++) {
         if (y > last_y) break;
 
-        if (i == lv->selectedItem) {
-            RectFill(win->bmp, x, y, w, g_defaultFont->charHeight, g_selectionColour);
-        }
+        // Only draw the rows that are inside the clip rect.
+        if (y + g_defaultFont->charHeight > win->bmp->clipTop && y < win->bmp->clipBottom) {
+            if (i == lv->selectedItem) {
+                RectFill(win->bmp, x, y, w, g_defaultFont->charHeight, g_selectionColour);
+            }
 
-        DrawTextSimple(g_defaultFont, g_normalTextColour, win->bmp,
-            x + 2 * g_drawScale, y, lv->items[i]);
+            DrawTextSimple(g_defaultFont, g_normalTextColour, win->bmp,
+                x + 2 * g_drawScale, y, lv->items[i]);
+        }
         y += g_defaultFont->charHeight;
     }
 
@@ -541,6 +614,7 @@ int DfListViewDo(DfWindow *win, DfListView *lv, int x, int y, int w, int h) {
 
 void DfTextViewEmpty(DfTextView *tv) {
     tv->text[0] = '\0';
+    tv->textChanged = 1;
     tv->selectionStartX = tv->selectionEndX;
     tv->selectionStartY = tv->selectionEndY;
 }
@@ -553,6 +627,7 @@ void DfTextViewAddText(DfTextView *tv, char const *text) {
     int amtToCopy = IntMin(space, additionalLen);
     memcpy(tv->text + currentLen, text, amtToCopy);
     tv->text[currentLen + amtToCopy] = '\0';
+    tv->textChanged = 1;
 }
 
 
@@ -657,7 +732,24 @@ void DfTextViewDo(DfWindow *win, DfTextView *tv, int x, int y, int w, int h) {
     int mouseInRect = DfMouseInRect(win, x, y, w, h);
     if (mouseInRect)
         SetMouseCursor(win, MCT_IBEAM);
-    DfDrawSunkenBox(win->bmp, x, y, w, h);
+
+    // The selection can change while the lines are drawn, so decide now
+    // whether last frame's pixels can be used.
+    int selecting = tv->dragSelecting || (mouseInRect &&
+        (win->input.lmb || win->input.lmbClicked || win->input.lmbDoubleClicked));
+    int canReuse = !tv->textChanged && !selecting && g_defaultFont == tv->lastFont &&
+        x == tv->lastX && y == tv->lastY && w == tv->lastW && h == tv->lastH &&
+        AreaIsUndamaged(win->bmp, x, y, w, h);
+
+    tv->textChanged = 0;
+    tv->lastX = x;
+    tv->lastY = y;
+    tv->lastW = w;
+    tv->lastH = h;
+    tv->lastFont = g_defaultFont;
+
+    if (!canReuse)
+        DfDrawSunkenBox(win->bmp, x, y, w, h);
 
     int borderWidth = 2 * g_drawScale;
     x += 2 * borderWidth;
@@ -683,6 +775,12 @@ void DfTextViewDo(DfWindow *win, DfTextView *tv, int x, int y, int w, int h) {
         tv->vScrollbar.maximum = scrollbar_h;
     DfVScrollbarDo(win, &tv->vScrollbar, scrollbar_x, scrollbar_y, scrollbar_w, scrollbar_h, mouseInRect);
 
+    if (canReuse) {
+        int dy = tv->lastScrollVal - tv->vScrollbar.currentVal;
+        ScrollAndClipToStrip(win->bmp, x, y, textRight - x, h, dy);
+    }
+    tv->lastScrollVal = tv->vScrollbar.currentVal;
+
     int sel_start_x, sel_start_y, sel_end_x, sel_end_y;
     GetSelectionCoords(tv, &sel_start_x, &sel_start_y, &sel_end_x, &sel_end_y);
 
@@ -717,6 +815,13 @@ void DfTextViewDo(DfWindow *win, DfTextView *tv, int x, int y, int w, int h) {
         if (!end_of_line) break;
         int line_len = end_of_line - line - 1;
 
+        // Skip drawing lines that are outside the clip rect.
+        if (y + g_defaultFont->charHeight <= win->bmp->clipTop || y >= win->bmp->clipBottom) {
+            line = end_of_line + 1;
+            y += g_defaultFont->charHeight;
+            continue;
+        }
+
         // Draw selection block
         if (line_num >= sel_start_y && line_num <= sel_end_y) {
             int start_idx = 0;
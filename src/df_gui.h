@@ -2,6 +2,7 @@
 
 // Deadfrog lib headers.
 #include "df_bitmap.h"
+#include "df_font.h"
 #include "df_window.h"
 
 extern DfColour g_backgroundColour;
@@ -87,9 +88,29 @@ typedef struct {
     int numItems;
     int selectedItem;
     int firstDisplayItem;
+
+    // Bumped by DfListViewSetItems() and DfListViewSetItem().
+    unsigned itemsGeneration;
+
+    // What was drawn last frame. If the window's back buffer has damage
+    // tracking on and only firstDisplayItem has changed, the rows that are
+    // still visible are moved with BitmapScroll() instead of being redrawn.
+    // Without damage tracking, the whole list is redrawn every frame.
+    char const **lastItems;
+    int lastNumItems;
+    unsigned lastItemsGeneration;
+    int lastSelectedItem;
+    int lastFirstDisplayItem;
+    int lastX, lastY, lastW, lastH;
+    DfFont *lastFont;
 } DfListView;
 
 
+// Change the items with these, so that the list view knows to redraw them.
+// The strings are referenced, not copied.
+void DfListViewSetItems(DfListView *lv, char const **items, int numItems);
+void DfListViewSetItem(DfListView *lv, int i, char const *item);
+
 // Returns id of item that was selected, or -1 if none were.
 int DfListViewDo(DfWindow *win, DfListView *lv, int x, int y, int w, int h);
 
@@ -112,6 +133,17 @@ typedef struct {
     int selectionEndY;
 
     int dragSelecting; // True if we're creating a selection with the mouse.
+
+    // Set by DfTextViewEmpty() and DfTextViewAddText().
+    int textChanged;
+
+    // What was drawn last frame. If the window's back buffer has damage
+    // tracking on and only the scroll position has changed, the lines that
+    // are still visible are moved with BitmapScroll() instead of being
+    // redrawn.
+    int lastScrollVal;
+    int lastX, lastY, lastW, lastH;
+    DfFont *lastFont;
 } DfTextView;
 
 
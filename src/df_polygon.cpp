@@ -183,28 +183,21 @@ static void ScanEdge(int x1, int y1, int x2, int y2, int setXStart,
 static void DrawHorizontalLineList(DfBitmap *bmp, HLineList *hLines, DfColour col) {
     int startY = hLines->startY;
     int len = hLines->numLines;
-    int endY = startY + len;
-
-    // Clip against the top of the bitmap
-    if (startY < 0) {
-        if (endY < 0)
-            return;
+    HLineData *firstLine = hLines->hline;
 
-        hLines -= startY;
-        len += startY;
-        startY = 0;
+    // Clip against the top and bottom of the clip rect
+    if (startY < bmp->clipTop) {
+        int amtClipped = bmp->clipTop - startY;
+        firstLine += amtClipped;
+        len -= amtClipped;
+        startY = bmp->clipTop;
     }
 
-    // Clip against the bottom of the bitmap
-    if (endY >= (int)bmp->height) {
-        if (startY >= (int)bmp->height)
-            return;
-
-        len = bmp->height - startY;
-    }
+    len = IntMin(len, bmp->clipBottom - startY);
+    if (len <= 0)
+        return;
 
     // Draw the hlines
-    HLineData *firstLine = hLines->hline;
     HLineData *lastLine = firstLine + len;
     if (col.a != 255) {
         // Alpha blended path...
@@ -214,17 +207,14 @@ static void DrawHorizontalLineList(DfBitmap *bmp, HLineList *hLines, DfColour co
     }
     else {
         // Solid colour path...
-        DfColour * __restrict row = bmp->pixels + bmp->width * hLines->startY;
+        DfColour * __restrict row = bmp->pixels + bmp->stride * startY;
         for (HLineData * __restrict line = firstLine; line < lastLine; line++) {
-            // Clip against sides of bitmap
-            int startX = IntMax(0, line->startX);
-            int endX = IntMin(bmp->width, line->endX);
-            if (startX >= (int)bmp->width || endX < 0)
-                continue;
-
+            // Clip against sides of the clip rect
+            int startX = IntMax(bmp->clipLeft, line->startX);
+            int endX = IntMin(bmp->clipRight, line->endX);
             for (int x = startX; x < endX; x++)
                 row[x] = col;
-            row += bmp->width;
+            row += bmp->stride;
         }
     }
 }
@@ -241,11 +231,15 @@ int FillConvexPolygon(DfBitmap *bmp, PolyVertList *vertexList, DfColour col,
 
     int minIndexL, maxIndex, minPointY;
     int maxPointY = minPointY = vertices[minIndexL = maxIndex = 0].y;
+    int minPointX = vertices[0].x;
+    int maxPointX = minPointX;
     for (int i = 1; i < vertexList->numPoints; i++) {
         if (vertices[i].y < minPointY)
             minPointY = vertices[minIndexL = i].y; // new top
         else if (vertices[i].y > maxPointY)
             maxPointY = vertices[maxIndex = i].y; // new bottom
+        minPointX = IntMin(minPointX, vertices[i].x);
+        maxPointX = IntMax(maxPointX, vertices[i].x);
     }
 
     if (minPointY == maxPointY)
@@ -356,6 +350,10 @@ int FillConvexPolygon(DfBitmap *bmp, PolyVertList *vertexList, DfColour col,
         skipFirst = 0; // scan convert the first point from now on
     } while (currentIndex != maxIndex);
 
+    if (bmp->damage)
+        BitmapAddDamage(bmp, minPointX + xOffset, minPointY + yOffset,
+                        maxPointX - minPointX + 1, maxPointY - minPointY + 1);
+
     // Draw the line list representing the scan converted polygon
     DrawHorizontalLineList(bmp, &workingHLineList, col);
 
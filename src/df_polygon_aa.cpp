@@ -9,6 +9,7 @@
 #include "df_polygon_aa.h"
 
 #include "df_bitmap.h"
+#include "df_blend.h"
 #include "df_common.h"
 
 #include <limits.h>
@@ -56,26 +57,77 @@ static int ComputePixelCoverage(int x) {
 }
 
 
+// Edge pixels are blended in runs of up to this many.
+enum { MAX_EDGE_RUN = 64 };
+
+
+// Blends a run of edge pixels, each with its own alpha, clipping against the
+// bitmap's clip rect.
+static void BlendEdgeRun(DfBitmap *bmp, int x, int y, int len, DfColour col,
+                         unsigned char const *alphas) {
+    if (y < bmp->clipTop || y >= bmp->clipBottom)
+        return;
+
+    int amtClipped = bmp->clipLeft - x;
+    if (amtClipped > 0) {
+        x += amtClipped;
+        len -= amtClipped;
+        alphas += amtClipped;
+    }
+
+    len = IntMin(len, bmp->clipRight - x);
+    if (len <= 0)
+        return;
+
+    if (bmp->damage)
+        BitmapAddDamage(bmp, x, y, len, 1);
+
+    BlendSpanAlphas(bmp->pixels + y * bmp->stride + x, len, col, alphas);
+}
+
+
 static void RenderScanline(DfBitmap *bmp, int y, DfColour col) {
-    DfColour tmp = col;
+    // Coverage of less than 255 gives an alpha of less than 255, as
+    // BlendSpanAlphas() requires.
+    unsigned char alphas[MAX_EDGE_RUN];
+
+    // Left edge. Alphas are stored from the start of the buffer.
     int x;
+    int runStart = leftMin / SUBXRES;
+    int runLen = 0;
     for (x = leftMin / SUBXRES; x <= (rightMax / SUBXRES); x++) {
         int coverage = ComputePixelCoverage(x);
         if (coverage == 255) {
             break;
         }
-        tmp.a = (col.a * coverage) >> 8;
-        PutPix(bmp, x, y, tmp);
+        if (runLen == MAX_EDGE_RUN) {
+            BlendEdgeRun(bmp, runStart, y, runLen, col, alphas);
+            runStart += runLen;
+            runLen = 0;
+        }
+        alphas[runLen++] = (col.a * coverage) >> 8;
     }
+    BlendEdgeRun(bmp, runStart, y, runLen, col, alphas);
+
+    // Right edge. We walk leftwards, so alphas are stored from the end of the
+    // buffer.
     int x2;
+    int runEnd = rightMax / SUBXRES + 1;
+    runLen = 0;
     for (x2 = (rightMax / SUBXRES); x2 > x; x2--) {
         int coverage = ComputePixelCoverage(x2);
         if (coverage == 255) {
             break;
         }
-        tmp.a = (col.a * coverage) >> 8;
-        PutPix(bmp, x2, y, tmp);
+        if (runLen == MAX_EDGE_RUN) {
+            BlendEdgeRun(bmp, runEnd - runLen, y, runLen, col, alphas);
+            runEnd -= runLen;
+            runLen = 0;
+        }
+        runLen++;
+        alphas[MAX_EDGE_RUN - runLen] = (col.a * coverage) >> 8;
     }
+    BlendEdgeRun(bmp, runEnd - runLen, y, runLen, col, alphas + MAX_EDGE_RUN - runLen);
 
     if (x2 >= x) {
         HLine(bmp, x, y, x2 - x + 1, col);
@@ -107,6 +159,19 @@ void FillPolygonAa(DfBitmap *bmp, DfVertex *verts, int numVerts, DfColour col)
     if (!IsConvexAndAnticlockwise(verts, numVerts))
         return;
 
+    if (bmp->damage) {
+        int minX = INT_MAX, minY = INT_MAX, maxX = INT_MIN, maxY = INT_MIN;
+        for (int i = 0; i < numVerts; i++) {
+            minX = IntMin(minX, verts[i].x);
+            minY = IntMin(minY, verts[i].y);
+            maxX = IntMax(maxX, verts[i].x);
+            maxY = IntMax(maxY, verts[i].y);
+        }
+        minX /= SUBXRES;
+        minY /= SUBXRES;
+        BitmapAddDamage(bmp, minX, minY, maxX / SUBXRES - minX + 1, maxY / SUBXRES - minY + 1);
+    }
+
     // Convert the verts passed in into the format we use internally,
     // find the max vertex y value and the vertex with minimum y.
     DfVertex *vertLeft = verts;
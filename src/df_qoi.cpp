@@ -0,0 +1,420 @@
+#include "df_qoi.h"
+
+#include "df_common.h"
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+
+#define QOI_OP_INDEX    0x00    // 00xxxxxx
+#define QOI_OP_DIFF     0x40    // 01xxxxxx
+#define QOI_OP_LUMA     0x80    // 10xxxxxx
+#define QOI_OP_RUN      0xc0    // 11xxxxxx
+#define QOI_OP_RGB      0xfe    // 11111110
+#define QOI_OP_RGBA     0xff    // 11111111
+#define QOI_MASK_2      0xc0
+
+#define QOI_MAGIC       0x716f6966  // "qoif"
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+#define QOI_MAX_RUN     62
+#define QOI_MAX_PIXELS  400000000   // The limit in the reference decoder.
+
+static uint8_t const g_qoiPadding[QOI_PADDING_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+// The most a pixel can add is a QOI_OP_RUN that ends before it, followed by
+// its own QOI_OP_RGBA, which is 5 bytes.
+#define MAX_BYTES_PER_PIXEL 6
+#define ENCODER_BUF_SIZE 8192
+#define ERROR_MSG_SIZE  128
+
+
+struct _DfQoiEncoder {
+    QoiWriteCallback *callback;
+    void       *context;
+    bool        withAlpha;
+    bool        failed;
+
+    int         width;
+    int         rowsLeft;
+
+    DfColour    prev;
+    DfColour    index[64];
+    int         run;
+
+    uint8_t     buf[ENCODER_BUF_SIZE];
+    int         bufUsed;
+};
+
+
+// ****************************************************************************
+// Private Functions
+// ****************************************************************************
+
+static inline unsigned QoiHash(DfColour c) {
+    return (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) & 63;
+}
+
+
+static uint32_t ReadU32BigEndian(uint8_t const *p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+static void WriteU32BigEndian(uint8_t *p, uint32_t val) {
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+}
+
+
+static void FlushEncoderBuf(DfQoiEncoder *enc) {
+    if (enc->bufUsed > 0 && !enc->failed)
+        enc->failed = !enc->callback(enc->context, enc->buf, enc->bufUsed);
+    enc->bufUsed = 0;
+}
+
+
+static bool FileWriteCallback(void *context, void const *data, int numBytes) {
+    return fwrite(data, 1, numBytes, (FILE *)context) == (size_t)numBytes;
+}
+
+
+struct MemoryWriter {
+    unsigned char *data;
+    int size;
+    int capacity;
+};
+
+
+static bool MemoryWriteCallback(void *context, void const *data, int numBytes) {
+    MemoryWriter *mw = (MemoryWriter *)context;
+    if (mw->size + numBytes > mw->capacity) {
+        int newCapacity = mw->capacity * 2;
+        if (newCapacity < mw->size + numBytes)
+            newCapacity = mw->size + numBytes;
+        unsigned char *newData = new unsigned char [newCapacity];
+        memcpy(newData, mw->data, mw->size);
+        delete [] mw->data;
+        mw->data = newData;
+        mw->capacity = newCapacity;
+    }
+
+    memcpy(mw->data + mw->size, data, numBytes);
+    mw->size += numBytes;
+    return true;
+}
+
+
+static DfBitmap *Fail(char errorMsg[ERROR_MSG_SIZE], char const *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(errorMsg, ERROR_MSG_SIZE, fmt, ap);
+    va_end(ap);
+    return NULL;
+}
+
+
+// Returns NULL, with a message in errorMsg, if the file is corrupt or the
+// image is too big.
+static DfBitmap *DecodeQoi(void const *data, int numBytes, char errorMsg[ERROR_MSG_SIZE]) {
+    uint8_t const *p = (uint8_t const *)data;
+    if (numBytes < QOI_HEADER_SIZE + QOI_PADDING_SIZE || ReadU32BigEndian(p) != QOI_MAGIC)
+        return Fail(errorMsg, "QOI file seems corrupt");
+
+    uint32_t width = ReadU32BigEndian(p + 4);
+    uint32_t height = ReadU32BigEndian(p + 8);
+    if (width == 0 || height == 0 || (uint64_t)width * height > QOI_MAX_PIXELS)
+        return Fail(errorMsg, "QOI image size %ux%u not supported", width, height);
+
+    DfBitmap *bmp = BitmapCreate(width, height);
+
+    // Every op is at most 5 bytes, and the padding is 8 bytes, so checking
+    // that an op starts before the padding is enough to not read past the end.
+    uint8_t const *end = p + numBytes - QOI_PADDING_SIZE;
+    p += QOI_HEADER_SIZE;
+
+    DfColour index[64];
+    memset(index, 0, sizeof(index));
+    DfColour px;
+    px.c = 0xff000000;
+    int run = 0;
+
+    for (uint32_t y = 0; y < height; y++) {
+        DfColour *row = bmp->pixels + y * bmp->stride;
+        for (uint32_t x = 0; x < width; x++) {
+            if (run > 0) {
+                run--;
+            }
+            else {
+                if (p >= end) {
+                    BitmapDelete(bmp);
+                    return Fail(errorMsg, "QOI file seems corrupt");
+                }
+                unsigned b1 = *p++;
+
+                if (b1 == QOI_OP_RGB) {
+                    px.r = p[0];
+                    px.g = p[1];
+                    px.b = p[2];
+                    p += 3;
+                }
+                else if (b1 == QOI_OP_RGBA) {
+                    px.r = p[0];
+                    px.g = p[1];
+                    px.b = p[2];
+                    px.a = p[3];
+                    p += 4;
+                }
+                else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+                    px = index[b1];
+                }
+                else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+                    px.r += ((b1 >> 4) & 3) - 2;
+                    px.g += ((b1 >> 2) & 3) - 2;
+                    px.b += (b1 & 3) - 2;
+                }
+                else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+                    unsigned b2 = *p++;
+                    int vg = (b1 & 0x3f) - 32;
+                    px.r += vg - 8 + ((b2 >> 4) & 15);
+                    px.g += vg;
+                    px.b += vg - 8 + (b2 & 15);
+                }
+                else {
+                    run = b1 & 0x3f;
+                }
+
+                index[QoiHash(px)] = px;
+            }
+
+            row[x] = px;
+        }
+    }
+
+    return bmp;
+}
+
+
+// Stops the program if stopOnError is set and the file couldn't be decoded.
+static DfBitmap *DecodeQoiOrStop(void const *data, int numBytes, bool stopOnError) {
+    char errorMsg[ERROR_MSG_SIZE];
+    DfBitmap *bitmap = DecodeQoi(data, numBytes, errorMsg);
+    if (stopOnError)
+        ReleaseAssert(bitmap != NULL, "%s", errorMsg);
+    return bitmap;
+}
+
+
+static DfBitmap *LoadQoiFile(char const *filename, bool stopOnError) {
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long numBytes = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (numBytes <= 0 || numBytes > INT_MAX) {
+        fclose(f);
+        return NULL;
+    }
+
+    uint8_t *data = new uint8_t [numBytes];
+    size_t numRead = fread(data, 1, numBytes, f);
+    fclose(f);
+
+    DfBitmap *bitmap = NULL;
+    if (numRead == (size_t)numBytes)
+        bitmap = DecodeQoiOrStop(data, numBytes, stopOnError);
+    delete [] data;
+    return bitmap;
+}
+
+
+// ****************************************************************************
+// Encoder
+// ****************************************************************************
+
+DfQoiEncoder *QoiEncoderCreate(int width, int height, bool withAlpha,
+                               QoiWriteCallback *callback, void *context) {
+    ReleaseAssert(width > 0 && height > 0, "QoiEncoderCreate: Invalid size %ix%i", width, height);
+
+    DfQoiEncoder *enc = new DfQoiEncoder;
+    memset(enc, 0, sizeof(DfQoiEncoder));
+    enc->callback = callback;
+    enc->context = context;
+    enc->withAlpha = withAlpha;
+    enc->width = width;
+    enc->rowsLeft = height;
+    enc->prev.c = 0xff000000;
+
+    uint8_t *header = enc->buf;
+    WriteU32BigEndian(header, QOI_MAGIC);
+    WriteU32BigEndian(header + 4, width);
+    WriteU32BigEndian(header + 8, height);
+    header[12] = withAlpha ? 4 : 3;
+    header[13] = 0;     // sRGB with linear alpha
+    enc->bufUsed = QOI_HEADER_SIZE;
+
+    return enc;
+}
+
+
+bool QoiEncoderAddRows(DfQoiEncoder *enc, DfColour const *pixels, int stride, int numRows) {
+    ReleaseAssert(numRows <= enc->rowsLeft, "QoiEncoderAddRows: Too many rows");
+    enc->rowsLeft -= numRows;
+
+    // Keeping the state in locals lets the compiler keep it in registers.
+    DfColour prev = enc->prev;
+    int run = enc->run;
+    unsigned alphaOr = enc->withAlpha ? 0 : 0xff000000;
+    uint8_t *out = enc->buf + enc->bufUsed;
+    uint8_t *outEnd = enc->buf + ENCODER_BUF_SIZE - MAX_BYTES_PER_PIXEL;
+
+    for (int y = 0; y < numRows; y++) {
+        DfColour const *row = pixels + y * stride;
+        for (int x = 0; x < enc->width; x++) {
+            DfColour px;
+            px.c = row[x].c | alphaOr;
+
+            if (px.c == prev.c) {
+                run++;
+                if (run == QOI_MAX_RUN) {
+                    *out++ = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+            }
+            else {
+                if (run > 0) {
+                    *out++ = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+
+                unsigned hash = QoiHash(px);
+                if (enc->index[hash].c == px.c) {
+                    *out++ = QOI_OP_INDEX | hash;
+                }
+                else {
+                    enc->index[hash] = px;
+
+                    if (px.a == prev.a) {
+                        signed char vr = px.r - prev.r;
+                        signed char vg = px.g - prev.g;
+                        signed char vb = px.b - prev.b;
+                        signed char vgr = vr - vg;
+                        signed char vgb = vb - vg;
+
+                        if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                            *out++ = QOI_OP_DIFF | ((vr + 2) << 4) | ((vg + 2) << 2) | (vb + 2);
+                        }
+                        else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8) {
+                            *out++ = QOI_OP_LUMA | (vg + 32);
+                            *out++ = ((vgr + 8) << 4) | (vgb + 8);
+                        }
+                        else {
+                            *out++ = QOI_OP_RGB;
+                            *out++ = px.r;
+                            *out++ = px.g;
+                            *out++ = px.b;
+                        }
+                    }
+                    else {
+                        *out++ = QOI_OP_RGBA;
+                        *out++ = px.r;
+                        *out++ = px.g;
+                        *out++ = px.b;
+                        *out++ = px.a;
+                    }
+                }
+
+                prev = px;
+            }
+
+            if (out > outEnd) {
+                enc->bufUsed = out - enc->buf;
+                FlushEncoderBuf(enc);
+                out = enc->buf;
+            }
+        }
+    }
+
+    enc->bufUsed = out - enc->buf;
+    enc->prev = prev;
+    enc->run = run;
+    return !enc->failed;
+}
+
+
+bool QoiEncoderFinish(DfQoiEncoder *enc) {
+    if (enc->bufUsed + 1 + QOI_PADDING_SIZE > ENCODER_BUF_SIZE)
+        FlushEncoderBuf(enc);
+
+    if (enc->run > 0)
+        enc->buf[enc->bufUsed++] = QOI_OP_RUN | (enc->run - 1);
+    memcpy(enc->buf + enc->bufUsed, g_qoiPadding, QOI_PADDING_SIZE);
+    enc->bufUsed += QOI_PADDING_SIZE;
+    FlushEncoderBuf(enc);
+
+    bool ok = !enc->failed && enc->rowsLeft == 0;
+    delete enc;
+    return ok;
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+DfBitmap *LoadQoi(char const *filename) {
+    return LoadQoiFile(filename, true);
+}
+
+
+DfBitmap *TryLoadQoi(char const *filename) {
+    return LoadQoiFile(filename, false);
+}
+
+
+DfBitmap *LoadQoiFromMemory(void const *data, int numBytes) {
+    return DecodeQoiOrStop(data, numBytes, true);
+}
+
+
+DfBitmap *TryLoadQoiFromMemory(void const *data, int numBytes) {
+    return DecodeQoiOrStop(data, numBytes, false);
+}
+
+
+bool SaveQoi(DfBitmap *bmp, char const *filename) {
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+        return false;
+
+    DfQoiEncoder *enc = QoiEncoderCreate(bmp->width, bmp->height, false, FileWriteCallback, f);
+    QoiEncoderAddRows(enc, bmp->pixels, bmp->stride, bmp->height);
+    bool ok = QoiEncoderFinish(enc);
+
+    if (fclose(f) != 0)
+        ok = false;
+    return ok;
+}
+
+
+unsigned char *SaveQoiToMemory(DfBitmap *bmp, int *numBytes) {
+    // Most images compress to less than half their raw size.
+    MemoryWriter mw;
+    mw.size = 0;
+    mw.capacity = QOI_HEADER_SIZE + bmp->width * bmp->height * 2 + QOI_PADDING_SIZE;
+    mw.data = new unsigned char [mw.capacity];
+
+    DfQoiEncoder *enc = QoiEncoderCreate(bmp->width, bmp->height, false, MemoryWriteCallback, &mw);
+    QoiEncoderAddRows(enc, bmp->pixels, bmp->stride, bmp->height);
+    QoiEncoderFinish(enc);
+
+    *numBytes = mw.size;
+    return mw.data;
+}
@@ -0,0 +1,59 @@
+// Loads and saves images in the QOI format (https://qoiformat.org). QOI is
+// lossless, and files are usually a quarter to a half the size of a BMP, but
+// they still encode and decode at hundreds of megabytes per second.
+//
+// Like the BMP functions, SaveQoi() treats the bitmap as opaque. Use a
+// DfQoiEncoder with withAlpha set to keep the alpha channel.
+
+#pragma once
+
+
+#include "df_bitmap.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+typedef struct _DfQoiEncoder DfQoiEncoder;
+
+// Called with each chunk of encoded data, in order. Returns false to report a
+// failed write.
+typedef bool QoiWriteCallback(void *context, void const *data, int numBytes);
+
+
+// Returns NULL if the file can't be read. Stops the program if it is corrupt.
+DLL_API DfBitmap   *LoadQoi             (char const *filename);
+DLL_API DfBitmap   *LoadQoiFromMemory   (void const *data, int numBytes);
+
+// Like the above, but return NULL if the file is corrupt too.
+DLL_API DfBitmap   *TryLoadQoi          (char const *filename);
+DLL_API DfBitmap   *TryLoadQoiFromMemory(void const *data, int numBytes);
+
+DLL_API bool        SaveQoi             (DfBitmap *bmp, char const *filename);
+
+// Returns the encoded file, which must be freed with delete [].
+DLL_API unsigned char *SaveQoiToMemory  (DfBitmap *bmp, int *numBytes);
+
+
+// A streaming encoder takes the image a few rows at a time and writes the
+// encoded data through the callback as it goes. It holds no more than a few
+// KB of output. Encoders share nothing, so one can run on a background thread,
+// eg. to save a copy of one frame while the next is drawn.
+DLL_API DfQoiEncoder *QoiEncoderCreate  (int width, int height, bool withAlpha,
+                                         QoiWriteCallback *callback, void *context);
+
+// Encodes the next numRows rows of the image. stride is in DfColours. Returns
+// false if a write has failed.
+DLL_API bool        QoiEncoderAddRows   (DfQoiEncoder *enc, DfColour const *pixels, int stride, int numRows);
+
+// Writes the end of the file and deletes the encoder. Returns false if a write
+// failed, or if fewer rows were added than the image has.
+DLL_API bool        QoiEncoderFinish    (DfQoiEncoder *enc);
+
+
+#ifdef __cplusplus
+}
+#endif
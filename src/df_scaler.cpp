@@ -0,0 +1,338 @@
+#include "df_scaler.h"
+
+#include "df_common.h"
+
+#include <math.h>
+#include <stdint.h>
+
+
+#define GetLine(bmp, y) ((bmp)->pixels + (bmp)->stride * (y))
+
+
+// Bilinear upscale uses one of these for each destination column and row. The
+// output is weight * pixel[src] + weight2 * pixel[src + 1].
+struct SrcXandWeights {
+    uint8_t weightX, weightX2;
+    uint16_t srcX;
+};
+
+struct SrcYandWeights {
+    unsigned weightY, weightY2;
+    int srcY;
+};
+
+// Box sampling downscale uses one of these for each destination column and
+// row. The destination pixel is the weighted average of the source pixels from
+// first to last inclusive. The pixels in between have a weight of 256.
+struct SrcSpan {
+    int first, last;
+    unsigned firstWeight, lastWeight;
+};
+
+struct _DfScaler {
+    int srcW, srcH;
+    int dstW, dstH;
+    bool upscale;
+
+    // Used when upscaling.
+    SrcXandWeights *cols;
+    SrcYandWeights *rows;
+
+    // Used when downscaling.
+    SrcSpan *colSpans;
+    SrcSpan *rowSpans;
+    int weightShift;
+};
+
+
+static void BuildSpans(SrcSpan *spans, int dstLen, int srcLen) {
+    float ratio = 256 * srcLen / (float)dstLen;
+    for (int i = 0; i < dstLen; i++) {
+        int a = (int)(i * ratio);
+        int b = (int)((i + 1) * ratio);
+        b = IntMin(b, 256 * srcLen - 1);
+
+        SrcSpan *span = spans + i;
+        span->first = a >> 8;
+        span->last = b >> 8;
+        if (span->first == span->last) {
+            span->firstWeight = 256;
+            span->lastWeight = 256;
+        }
+        else {
+            span->firstWeight = 256 - (a & 0xFF);
+            span->lastWeight = b & 0xFF;
+        }
+    }
+}
+
+
+DfScaler *ScalerCreate(int srcW, int srcH, int dstW, int dstH) {
+    ReleaseAssert(srcW > 0 && srcH > 0 && dstW > 0 && dstH > 0,
+        "ScalerCreate: invalid size %dx%d -> %dx%d", srcW, srcH, dstW, dstH);
+
+    DfScaler *scaler = new DfScaler;
+    scaler->srcW = srcW;
+    scaler->srcH = srcH;
+    scaler->dstW = dstW;
+    scaler->dstH = dstH;
+    scaler->upscale = srcW < dstW && srcH < dstH;
+    scaler->cols = NULL;
+    scaler->rows = NULL;
+    scaler->colSpans = NULL;
+    scaler->rowSpans = NULL;
+    scaler->weightShift = 0;
+
+    if (scaler->upscale) {
+        ReleaseAssert(srcW <= 65536, "ScalerCreate: source too wide to upscale (%d)", srcW);
+
+        unsigned widthRatio = (double)(1 << 8) * 255.5 * srcW / dstW;
+        scaler->cols = new SrcXandWeights [dstW];
+        for (int i = 0; i < dstW; i++) {
+            int srcXAndWeight = (i * widthRatio) >> 8;
+            scaler->cols[i].srcX = srcXAndWeight >> 8;
+            scaler->cols[i].weightX2 = srcXAndWeight & 0xFF;
+            scaler->cols[i].weightX = 255 - scaler->cols[i].weightX2;
+        }
+
+        unsigned heightRatio = (double)(1 << 8) * 255.5 * srcH / dstH;
+        scaler->rows = new SrcYandWeights [dstH];
+        for (int i = 0; i < dstH; i++) {
+            int srcYAndWeight = (i * heightRatio) >> 8;
+            scaler->rows[i].srcY = srcYAndWeight >> 8;
+            scaler->rows[i].weightY2 = srcYAndWeight & 0xFF;
+            scaler->rows[i].weightY = 255 - scaler->rows[i].weightY2;
+        }
+    }
+    else {
+        // Based on Ryan Geiss's code from http://www.geisswerks.com/ryan/FAQS/resize.html
+
+        // NOTE: THIS WILL OVERFLOW for really major downsizing (2800x2800 to 1x1 or more)
+        // (2800 ~= sqrt(2^23)) - for a lazy fix, just call this in two passes.
+
+        scaler->colSpans = new SrcSpan [dstW];
+        scaler->rowSpans = new SrcSpan [dstH];
+        BuildSpans(scaler->colSpans, dstW, srcW);
+        BuildSpans(scaler->rowSpans, dstH, srcH);
+
+        // If too many input pixels map to one output pixel, our 32-bit accumulation values
+        // could overflow - so, if we have huge mappings like that, cut down the weights:
+        //    256 max color value
+        //   *256 weight_x
+        //   *256 weight_y
+        //   *256 (16*16) maximum # of input pixels (x,y) - unless we cut the weights down...
+        float sourceTexelsPerOutPixel = (srcW / (float)dstW + 1) * (srcH / (float)dstH + 1);
+        float weightPerPixel = sourceTexelsPerOutPixel * 256 * 256;  //weight_x * weight_y
+        float accumPerPixel = weightPerPixel * 256; //color value is 0-255
+        float weightDiv = accumPerPixel / 4294967000.0f;
+        if (weightDiv > 1)
+            scaler->weightShift = (int)ceilf(logf((float)weightDiv) / logf(2.0f));
+        scaler->weightShift = IntMin(15, scaler->weightShift);  // this could go to 15 and still be ok.
+    }
+
+    return scaler;
+}
+
+
+void ScalerDelete(DfScaler *scaler) {
+    delete [] scaler->cols;
+    delete [] scaler->rows;
+    delete [] scaler->colSpans;
+    delete [] scaler->rowSpans;
+    delete scaler;
+}
+
+
+// ****************************************************************************
+// Blitting
+// ****************************************************************************
+
+// The part of the destination that is inside the clip rect. Every output pixel
+// is calculated from its position in the unclipped output, so clipping doesn't
+// change the pixels that are drawn. That's what lets the rows be split between
+// threads, and tiled rendering split a blit across tiles.
+struct ScaleJob {
+    DfScaler *scaler;
+    DfBitmap *dstBmp;
+    DfBitmap *srcBmp;
+    int dstX, dstY;
+    int x1, x2;             // Visible destination columns, relative to dstX.
+    int y1, y2;             // Visible destination rows, relative to dstY.
+    int rowsPerBand;
+};
+
+
+static void UpscaleRows(ScaleJob *job, int y1, int y2) {
+    DfScaler *scaler = job->scaler;
+    DfBitmap *srcBmp = job->srcBmp;
+    SrcXandWeights *cols = scaler->cols + job->x1;
+    int numCols = job->x2 - job->x1;
+    int srcLastX = scaler->srcW - 1;
+
+    // Range of source columns the visible columns read from. Most blits
+    // read few enough for the stack.
+    int srcXMin = cols[0].srcX;
+    int srcXMax = IntMin(cols[numCols - 1].srcX + 1, srcLastX);
+    int numSrcCols = srcXMax - srcXMin + 1;
+    DfColour stackColumn[2048];
+    DfColour *column = stackColumn;
+    if (numSrcCols > 2048)
+        column = new DfColour [numSrcCols];
+
+    for (int y = y1; y < y2; y++) {
+        SrcYandWeights *row = scaler->rows + y;
+        DfColour *dstRow = GetLine(job->dstBmp, job->dstY + y) + job->dstX + job->x1;
+        DfColour *srcRow = GetLine(srcBmp, row->srcY);
+
+        // The last output rows sample the last source row. Don't read the
+        // row below it, which is outside the bitmap, or belongs to the
+        // parent if the source is a view.
+        int nextRowOffset = row->srcY + 1 < scaler->srcH ? srcBmp->stride : 0;
+
+        // Interpolate vertically between the two source rows.
+        for (int x = srcXMin; x <= srcXMax; x++) {
+            // Pixel 0,0
+            DfColour *srcPixel = &srcRow[x];
+            unsigned rb = (srcPixel->c & 0xff00ff) * row->weightY;
+            unsigned g = srcPixel->g * row->weightY;
+
+            // Pixel 1,0
+            srcPixel += nextRowOffset;
+            rb += (srcPixel->c & 0xff00ff) * row->weightY2;
+            g += srcPixel->g * row->weightY2;
+
+            column[x - srcXMin].c = rb >> 8;
+            column[x - srcXMin].g = g >> 8;
+        }
+
+        // Then horizontally between the results.
+        for (int i = 0; i < numCols; i++) {
+            SrcXandWeights *sw = cols + i;
+
+            // Pixel 0,0
+            DfColour *srcPixel = &column[sw->srcX - srcXMin];
+            unsigned rb = (srcPixel->c & 0xff00ff) * sw->weightX;
+            unsigned g = srcPixel->g * sw->weightX;
+
+            // Pixel 0,1
+            if (sw->srcX < srcLastX)
+                srcPixel++;
+            rb += (srcPixel->c & 0xff00ff) * sw->weightX2;
+            g += srcPixel->g * sw->weightX2;
+
+            dstRow[i].c = rb >> 8;
+            dstRow[i].g = g >> 8;
+        }
+    }
+
+    if (column != stackColumn)
+        delete [] column;
+}
+
+
+static void DownscaleRows(ScaleJob *job, int y1, int y2) {
+    DfScaler *scaler = job->scaler;
+    int weightShift = scaler->weightShift;
+
+    for (int y = y1; y < y2; y++) {
+        SrcSpan *rowSpan = scaler->rowSpans + y;
+        DfColour *dest = GetLine(job->dstBmp, job->dstY + y) + job->dstX + job->x1;
+
+        for (int x = job->x1; x < job->x2; x++, dest++) {
+            SrcSpan *colSpan = scaler->colSpans + x;
+
+            // Add up all input pixels contributing to this output pixel.
+            unsigned r = 0, g = 0, b = 0, a = 0;
+            for (int sy = rowSpan->first; sy <= rowSpan->last; sy++) {
+                unsigned weightY = 256;
+                if (sy == rowSpan->first)
+                    weightY = rowSpan->firstWeight;
+                else if (sy == rowSpan->last)
+                    weightY = rowSpan->lastWeight;
+
+                DfColour *src = GetLine(job->srcBmp, sy) + colSpan->first;
+                for (int sx = colSpan->first; sx <= colSpan->last; sx++) {
+                    unsigned weightX = 256;
+                    if (sx == colSpan->first)
+                        weightX = colSpan->firstWeight;
+                    else if (sx == colSpan->last)
+                        weightX = colSpan->lastWeight;
+
+                    DfColour c = *src++;
+                    unsigned w = (weightX * weightY) >> weightShift;
+                    r += c.r * w;
+                    g += c.g * w;
+                    b += c.b * w;
+                    a += w;
+                }
+            }
+
+            // Write results.
+            dest->r = r / a;
+            dest->g = g / a;
+            dest->b = b / a;
+        }
+    }
+}
+
+
+static void DoScaleJob(void *context, int jobIndex) {
+    ScaleJob *job = (ScaleJob *)context;
+    int y1 = job->y1 + jobIndex * job->rowsPerBand;
+    int y2 = IntMin(y1 + job->rowsPerBand, job->y2);
+
+    if (job->scaler->upscale)
+        UpscaleRows(job, y1, y2);
+    else
+        DownscaleRows(job, y1, y2);
+}
+
+
+// Returns false if nothing is visible.
+static bool InitScaleJob(ScaleJob *job, DfScaler *scaler, DfBitmap *dstBmp, int dstX, int dstY, DfBitmap *srcBmp) {
+    ReleaseAssert(srcBmp->width == scaler->srcW && srcBmp->height == scaler->srcH,
+        "ScalerBlit: source bitmap is %dx%d but scaler expects %dx%d",
+        srcBmp->width, srcBmp->height, scaler->srcW, scaler->srcH);
+
+    if (dstBmp->damage)
+        BitmapAddDamage(dstBmp, dstX, dstY, scaler->dstW, scaler->dstH);
+
+    job->scaler = scaler;
+    job->dstBmp = dstBmp;
+    job->srcBmp = srcBmp;
+    job->dstX = dstX;
+    job->dstY = dstY;
+    job->x1 = IntMax(dstX, dstBmp->clipLeft) - dstX;
+    job->x2 = IntMin(dstX + scaler->dstW, dstBmp->clipRight) - dstX;
+    job->y1 = IntMax(dstY, dstBmp->clipTop) - dstY;
+    job->y2 = IntMin(dstY + scaler->dstH, dstBmp->clipBottom) - dstY;
+    job->rowsPerBand = job->y2 - job->y1;
+    return job->x1 < job->x2 && job->y1 < job->y2;
+}
+
+
+void ScalerBlit(DfScaler *scaler, DfBitmap *dstBmp, int dstX, int dstY, DfBitmap *srcBmp) {
+    ScaleJob job;
+    if (InitScaleJob(&job, scaler, dstBmp, dstX, dstY, srcBmp))
+        DoScaleJob(&job, 0);
+}
+
+
+void ScalerBlitThreaded(DfScaler *scaler, DfBitmap *dstBmp, int dstX, int dstY, DfBitmap *srcBmp, DfThreadPool *pool) {
+    ScaleJob job;
+    if (!InitScaleJob(&job, scaler, dstBmp, dstX, dstY, srcBmp))
+        return;
+
+    if (!pool)
+        pool = ThreadPoolGetDefault();
+
+    // A few bands per thread, so that a thread that gets descheduled doesn't
+    // hold everyone else up. Small blits aren't worth splitting.
+    enum { MIN_ROWS_PER_BAND = 8 };
+    int numRows = job.y2 - job.y1;
+    int numBands = ThreadPoolGetNumThreads(pool) * 4;
+    job.rowsPerBand = IntMax(MIN_ROWS_PER_BAND, (numRows + numBands - 1) / numBands);
+    numBands = (numRows + job.rowsPerBand - 1) / job.rowsPerBand;
+
+    ThreadPoolRun(pool, numBands, DoScaleJob, &job);
+}
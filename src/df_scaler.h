@@ -0,0 +1,39 @@
+// A scaler holds the tables that StretchBlit() needs to resize a bitmap of one
+// size to another. Building the tables is cheap compared to the blit, but if
+// you draw the same bitmap at the same size every frame, like a grid of
+// thumbnails, it's worth creating a scaler once and reusing it.
+//
+// A scaler isn't modified after it is created, so any number of threads can
+// use it at once. The results are identical to StretchBlit().
+
+#pragma once
+
+
+#include "df_bitmap.h"
+#include "df_thread.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+typedef struct _DfScaler DfScaler;
+
+
+DLL_API DfScaler   *ScalerCreate        (int srcWidth, int srcHeight, int dstWidth, int dstHeight);
+DLL_API void        ScalerDelete        (DfScaler *scaler);
+
+// Draws srcBmp onto dstBmp at dstX,dstY, resized to the scaler's destination
+// size. srcBmp must be the scaler's source size.
+DLL_API void        ScalerBlit          (DfScaler *scaler, DfBitmap *dstBmp, int dstX, int dstY, DfBitmap *srcBmp);
+
+// Like ScalerBlit(), but the destination rows are split between the pool's
+// threads. If pool is NULL, the pool from ThreadPoolGetDefault() is used.
+DLL_API void        ScalerBlitThreaded  (DfScaler *scaler, DfBitmap *dstBmp, int dstX, int dstY, DfBitmap *srcBmp, DfThreadPool *pool);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,343 @@
+#include "df_text_cache.h"
+
+#include "df_common.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// A horizontal line of pixels, relative to the top left of the text.
+struct TextSpan {
+    uint16_t x;
+    uint16_t len;
+    uint8_t y;
+};
+
+
+struct CacheEntry {
+    DfFont *font;
+    unsigned hash;
+    int textLen;
+    int width;
+
+    // The spans are sorted by y and then x. numSpans is -1 if the text is
+    // drawn with DrawTextSimpleLen() instead, because the font is
+    // anti-aliased or the text is too wide for a TextSpan.
+    int numSpans;
+    int right;          // Largest x + len of the spans.
+
+    char *text;         // Not NULL terminated. Followed by the spans in the same allocation.
+    TextSpan *spans;
+
+    int lruPrev;        // More recently used entry, or -1.
+    int lruNext;        // Less recently used entry, or -1.
+    int bucketNext;     // Next entry in the same hash bucket, or -1.
+};
+
+
+struct _DfTextCache {
+    CacheEntry *entries;
+    int maxEntries;
+    int numEntries;
+
+    int *buckets;
+    unsigned bucketMask;
+
+    int lruHead;        // Most recently used entry.
+    int lruTail;        // Least recently used entry.
+
+    DfTextCacheStats stats;
+
+    // Somewhere to collect the runs of a string before they are merged.
+    TextSpan *scratch;
+    int scratchSize;
+};
+
+
+DfTextCache *TextCacheCreate(int maxEntries) {
+    ReleaseAssert(maxEntries > 0, "TextCacheCreate: maxEntries must be positive");
+
+    DfTextCache *cache = new DfTextCache;
+    cache->entries = new CacheEntry [maxEntries];
+    cache->maxEntries = maxEntries;
+
+    // At least twice as many buckets as entries keeps the chains short.
+    unsigned numBuckets = 16;
+    while (numBuckets < (unsigned)maxEntries * 2)
+        numBuckets *= 2;
+    cache->buckets = new int [numBuckets];
+    cache->bucketMask = numBuckets - 1;
+
+    cache->scratch = NULL;
+    cache->scratchSize = 0;
+    cache->numEntries = 0;
+    TextCacheClear(cache);
+    TextCacheResetStats(cache);
+
+    return cache;
+}
+
+
+void TextCacheDelete(DfTextCache *cache) {
+    TextCacheClear(cache);
+    delete [] cache->scratch;
+    delete [] cache->buckets;
+    delete [] cache->entries;
+    delete cache;
+}
+
+
+void TextCacheClear(DfTextCache *cache) {
+    for (int i = 0; i < cache->numEntries; i++)
+        delete [] cache->entries[i].text;
+    cache->numEntries = 0;
+    cache->lruHead = -1;
+    cache->lruTail = -1;
+    for (unsigned i = 0; i <= cache->bucketMask; i++)
+        cache->buckets[i] = -1;
+}
+
+
+void TextCacheGetStats(DfTextCache *cache, DfTextCacheStats *stats) {
+    *stats = cache->stats;
+    stats->numEntries = cache->numEntries;
+}
+
+
+void TextCacheResetStats(DfTextCache *cache) {
+    memset(&cache->stats, 0, sizeof(cache->stats));
+}
+
+
+// ****************************************************************************
+// Lookup
+// ****************************************************************************
+
+// FNV-1a, with the font's address mixed in.
+static unsigned CalcHash(DfFont *font, char const *text, int len) {
+    unsigned hash = 2166136261u ^ (unsigned)((uintptr_t)font >> 4);
+    for (int i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    return hash;
+}
+
+
+static void LruUnlink(DfTextCache *cache, int i) {
+    CacheEntry *e = cache->entries + i;
+    if (e->lruPrev >= 0) cache->entries[e->lruPrev].lruNext = e->lruNext;
+    else cache->lruHead = e->lruNext;
+    if (e->lruNext >= 0) cache->entries[e->lruNext].lruPrev = e->lruPrev;
+    else cache->lruTail = e->lruPrev;
+}
+
+
+static void LruPushFront(DfTextCache *cache, int i) {
+    CacheEntry *e = cache->entries + i;
+    e->lruPrev = -1;
+    e->lruNext = cache->lruHead;
+    if (cache->lruHead >= 0) cache->entries[cache->lruHead].lruPrev = i;
+    else cache->lruTail = i;
+    cache->lruHead = i;
+}
+
+
+static void BucketUnlink(DfTextCache *cache, int i) {
+    int *link = &cache->buckets[cache->entries[i].hash & cache->bucketMask];
+    while (*link != i)
+        link = &cache->entries[*link].bucketNext;
+    *link = cache->entries[i].bucketNext;
+}
+
+
+static int CompareSpans(void const *_a, void const *_b) {
+    TextSpan const *a = (TextSpan const *)_a;
+    TextSpan const *b = (TextSpan const *)_b;
+    if (a->y != b->y) return a->y - b->y;
+    return a->x - b->x;
+}
+
+
+// Collects the runs of every glyph, sorts them and merges the ones that touch
+// or overlap. Returns the number of spans in cache->scratch.
+static int BuildSpans(DfTextCache *cache, DfFont *font, char const *text, int len) {
+    int numRuns = 0;
+    for (int i = 0; i < len; i++)
+        numRuns += font->glyphs[(unsigned char)text[i]].numRuns;
+
+    if (numRuns > cache->scratchSize) {
+        delete [] cache->scratch;
+        cache->scratchSize = IntMax(numRuns, cache->scratchSize * 2);
+        cache->scratch = new TextSpan [cache->scratchSize];
+    }
+
+    TextSpan *span = cache->scratch;
+    int x = 0;
+    for (int i = 0; i < len; i++) {
+        Glyph *glyph = font->glyphs + (unsigned char)text[i];
+        EncodedRun *run = font->runs + glyph->firstRun;
+        for (int j = 0; j < glyph->numRuns; j++, run++, span++) {
+            span->x = x + run->startX;
+            span->len = run->runLen;
+            span->y = run->startY;
+        }
+        x += glyph->width;
+    }
+
+    qsort(cache->scratch, numRuns, sizeof(TextSpan), CompareSpans);
+
+    int numSpans = 0;
+    for (int i = 0; i < numRuns; i++) {
+        TextSpan *s = cache->scratch + i;
+        TextSpan *prev = cache->scratch + numSpans - 1;
+        if (numSpans > 0 && prev->y == s->y && prev->x + prev->len >= s->x) {
+            prev->len = IntMax(prev->x + prev->len, s->x + s->len) - prev->x;
+        }
+        else {
+            cache->scratch[numSpans] = *s;
+            numSpans++;
+        }
+    }
+
+    return numSpans;
+}
+
+
+static CacheEntry *Lookup(DfTextCache *cache, DfFont *font, char const *text, int maxChars) {
+    int len = 0;
+    while (len < maxChars && text[len])
+        len++;
+
+    unsigned hash = CalcHash(font, text, len);
+    int *bucket = &cache->buckets[hash & cache->bucketMask];
+    for (int i = *bucket; i >= 0; i = cache->entries[i].bucketNext) {
+        CacheEntry *e = cache->entries + i;
+        if (e->hash == hash && e->font == font && e->textLen == len &&
+                memcmp(e->text, text, len) == 0) {
+            cache->stats.hits++;
+            if (cache->lruHead != i) {
+                LruUnlink(cache, i);
+                LruPushFront(cache, i);
+            }
+            return e;
+        }
+    }
+
+    cache->stats.misses++;
+
+    // Find a slot, evicting the least recently used entry if the cache is full.
+    int i;
+    if (cache->numEntries < cache->maxEntries) {
+        i = cache->numEntries;
+        cache->numEntries++;
+    }
+    else {
+        i = cache->lruTail;
+        LruUnlink(cache, i);
+        BucketUnlink(cache, i);
+        delete [] cache->entries[i].text;
+        cache->stats.evictions++;
+    }
+
+    CacheEntry *e = cache->entries + i;
+    e->font = font;
+    e->hash = hash;
+    e->textLen = len;
+    e->width = GetTextWidthNumChars(font, text, len);
+    e->right = 0;
+
+    if (font->coverage || e->width + font->maxCharWidth > 0xffff) {
+        e->numSpans = -1;
+        e->text = new char [len];
+        e->spans = NULL;
+    }
+    else {
+        e->numSpans = BuildSpans(cache, font, text, len);
+        int textBytes = (len + 1) & ~1;  // Keeps the spans 2-byte aligned.
+        e->text = new char [textBytes + e->numSpans * sizeof(TextSpan)];
+        e->spans = (TextSpan *)(e->text + textBytes);
+        memcpy(e->spans, cache->scratch, e->numSpans * sizeof(TextSpan));
+        for (int j = 0; j < e->numSpans; j++)
+            e->right = IntMax(e->right, e->spans[j].x + e->spans[j].len);
+    }
+    memcpy(e->text, text, len);
+
+    e->bucketNext = *bucket;
+    *bucket = i;
+    LruPushFront(cache, i);
+
+    return e;
+}
+
+
+// ****************************************************************************
+// Drawing
+// ****************************************************************************
+
+static void DrawEntry(CacheEntry *e, DfColour col, DfBitmap *bmp, int x, int y) {
+    if (e->numSpans < 0) {
+        DrawTextSimpleLen(e->font, col, bmp, x, y, e->text, e->textLen);
+        return;
+    }
+
+    if (bmp->damage)
+        BitmapAddDamage(bmp, x, y, e->width, e->font->charHeight);
+
+    int stride = bmp->stride;
+    DfColour *startRow = bmp->pixels + y * stride + x;
+    TextSpan *span = e->spans;
+
+    if (x >= bmp->clipLeft && x + e->right <= bmp->clipRight &&
+            y >= bmp->clipTop && y + e->font->charHeight <= bmp->clipBottom) {
+        for (int i = 0; i < e->numSpans; i++, span++) {
+            DfColour *pixel = startRow + span->y * stride + span->x;
+            for (int k = 0; k < span->len; k++)
+                pixel[k] = col;
+        }
+        return;
+    }
+
+    for (int i = 0; i < e->numSpans; i++, span++) {
+        int y3 = y + span->y;
+        if (y3 < bmp->clipTop || y3 >= bmp->clipBottom)
+            continue;
+
+        int x1 = IntMax(x + span->x, bmp->clipLeft);
+        int x2 = IntMin(x + span->x + span->len, bmp->clipRight);
+        DfColour *row = bmp->pixels + y3 * stride;
+        for (int k = x1; k < x2; k++)
+            row[k] = col;
+    }
+}
+
+
+int TextCacheDrawTextSimple(DfTextCache *cache, DfFont *font, DfColour c, DfBitmap *bmp, int x, int y, char const *text) {
+    return TextCacheDrawTextSimpleLen(cache, font, c, bmp, x, y, text, INT_MAX);
+}
+
+
+int TextCacheDrawTextSimpleLen(DfTextCache *cache, DfFont *font, DfColour c, DfBitmap *bmp, int x, int y, char const *text, int maxChars) {
+    CacheEntry *e = Lookup(cache, font, text, maxChars);
+    DrawEntry(e, c, bmp, x, y);
+    return e->width;
+}
+
+
+int TextCacheDrawTextRight(DfTextCache *cache, DfFont *font, DfColour c, DfBitmap *bmp, int x, int y, char const *text) {
+    CacheEntry *e = Lookup(cache, font, text, INT_MAX);
+    DrawEntry(e, c, bmp, x - e->width, y);
+    return e->width;
+}
+
+
+int TextCacheDrawTextCentre(DfTextCache *cache, DfFont *font, DfColour c, DfBitmap *bmp, int x, int y, char const *text) {
+    CacheEntry *e = Lookup(cache, font, text, INT_MAX);
+    DrawEntry(e, c, bmp, x - e->width / 2, y);
+    return e->width;
+}
+
+
+int TextCacheGetTextWidth(DfTextCache *cache, DfFont *font, char const *text) {
+    return Lookup(cache, font, text, INT_MAX)->width;
+}
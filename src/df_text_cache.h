@@ -0,0 +1,59 @@
+// A text cache remembers the width and pixel spans of strings that have been
+// drawn before, so that drawing the same string again, like the lines of a log
+// viewer that are drawn every frame, is a hash lookup followed by writing the
+// spans. Each entry is keyed on the font and the string. When the cache is
+// full, the least recently used entry is thrown away.
+//
+// The spans of all the glyphs in a string are merged, so a string often needs
+// fewer, longer writes than drawing it glyph by glyph. Anti-aliased fonts
+// aren't split into spans. Only their widths are cached.
+//
+// Entries refer to fonts by address. Call TextCacheClear() after deleting a
+// font that has been drawn through the cache.
+
+#pragma once
+
+
+#include "df_bitmap.h"
+#include "df_font.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+typedef struct _DfTextCache DfTextCache;
+
+typedef struct _DfTextCacheStats {
+    unsigned hits;
+    unsigned misses;
+    unsigned evictions;
+    int numEntries;
+} DfTextCacheStats;
+
+
+DLL_API DfTextCache *TextCacheCreate    (int maxEntries);
+DLL_API void        TextCacheDelete     (DfTextCache *cache);
+DLL_API void        TextCacheClear      (DfTextCache *cache);
+
+// These draw exactly the same pixels as the DrawText... functions with the
+// same names in df_font.h. They return the full width of the text, even if
+// some of it was clipped.
+DLL_API int         TextCacheDrawTextSimple     (DfTextCache *cache, DfFont *font, DfColour c, DfBitmap *bmp, int x, int y, char const *text);
+DLL_API int         TextCacheDrawTextSimpleLen  (DfTextCache *cache, DfFont *font, DfColour c, DfBitmap *bmp, int x, int y, char const *text, int maxChars);
+DLL_API int         TextCacheDrawTextRight      (DfTextCache *cache, DfFont *font, DfColour c, DfBitmap *bmp, int x, int y, char const *text);
+DLL_API int         TextCacheDrawTextCentre     (DfTextCache *cache, DfFont *font, DfColour c, DfBitmap *bmp, int x, int y, char const *text);
+
+DLL_API int         TextCacheGetTextWidth       (DfTextCache *cache, DfFont *font, char const *text);
+
+// The hit, miss and eviction counters count up from when the cache was created
+// or TextCacheResetStats() was last called.
+DLL_API void        TextCacheGetStats   (DfTextCache *cache, DfTextCacheStats *stats);
+DLL_API void        TextCacheResetStats (DfTextCache *cache);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,358 @@
+#include "df_thread.h"
+
+
+#if _WIN32
+
+
+// Windows specific code ******************************************************
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+
+struct _DfThread {
+    HANDLE handle;
+    DfThreadFunc *func;
+    void *arg;
+};
+
+struct _DfMutex {
+    CRITICAL_SECTION criticalSection;
+};
+
+struct _DfCondVar {
+    CONDITION_VARIABLE conditionVariable;
+};
+
+
+int GetNumCpuCores() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+
+static DWORD WINAPI ThreadTrampoline(void *param) {
+    DfThread *thread = (DfThread *)param;
+    thread->func(thread->arg);
+    return 0;
+}
+
+
+DfThread *ThreadCreate(DfThreadFunc *func, void *arg) {
+    DfThread *thread = new DfThread;
+    thread->func = func;
+    thread->arg = arg;
+    thread->handle = CreateThread(NULL, 0, ThreadTrampoline, thread, 0, NULL);
+    ReleaseAssert(thread->handle != NULL, "CreateThread failed");
+    return thread;
+}
+
+
+void ThreadJoin(DfThread *thread) {
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+    delete thread;
+}
+
+
+DfMutex *MutexCreate() {
+    DfMutex *mutex = new DfMutex;
+    InitializeCriticalSection(&mutex->criticalSection);
+    return mutex;
+}
+
+
+void MutexDelete(DfMutex *mutex) {
+    DeleteCriticalSection(&mutex->criticalSection);
+    delete mutex;
+}
+
+
+void MutexLock(DfMutex *mutex) {
+    EnterCriticalSection(&mutex->criticalSection);
+}
+
+
+void MutexUnlock(DfMutex *mutex) {
+    LeaveCriticalSection(&mutex->criticalSection);
+}
+
+
+DfCondVar *CondVarCreate() {
+    DfCondVar *condVar = new DfCondVar;
+    InitializeConditionVariable(&condVar->conditionVariable);
+    return condVar;
+}
+
+
+void CondVarDelete(DfCondVar *condVar) {
+    delete condVar;
+}
+
+
+void CondVarWait(DfCondVar *condVar, DfMutex *mutex) {
+    SleepConditionVariableCS(&condVar->conditionVariable, &mutex->criticalSection, INFINITE);
+}
+
+
+void CondVarSignal(DfCondVar *condVar) {
+    WakeConditionVariable(&condVar->conditionVariable);
+}
+
+
+void CondVarBroadcast(DfCondVar *condVar) {
+    WakeAllConditionVariable(&condVar->conditionVariable);
+}
+
+
+#else
+
+
+// Linux specific code ******************************************************
+
+#include <pthread.h>
+#include <unistd.h>
+
+
+struct _DfThread {
+    pthread_t handle;
+    DfThreadFunc *func;
+    void *arg;
+};
+
+struct _DfMutex {
+    pthread_mutex_t mutex;
+};
+
+struct _DfCondVar {
+    pthread_cond_t cond;
+};
+
+
+int GetNumCpuCores() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+
+static void *ThreadTrampoline(void *param) {
+    DfThread *thread = (DfThread *)param;
+    thread->func(thread->arg);
+    return NULL;
+}
+
+
+DfThread *ThreadCreate(DfThreadFunc *func, void *arg) {
+    DfThread *thread = new DfThread;
+    thread->func = func;
+    thread->arg = arg;
+    int rv = pthread_create(&thread->handle, NULL, ThreadTrampoline, thread);
+    ReleaseAssert(rv == 0, "pthread_create failed with error %d", rv);
+    return thread;
+}
+
+
+void ThreadJoin(DfThread *thread) {
+    pthread_join(thread->handle, NULL);
+    delete thread;
+}
+
+
+DfMutex *MutexCreate() {
+    DfMutex *mutex = new DfMutex;
+    pthread_mutex_init(&mutex->mutex, NULL);
+    return mutex;
+}
+
+
+void MutexDelete(DfMutex *mutex) {
+    pthread_mutex_destroy(&mutex->mutex);
+    delete mutex;
+}
+
+
+void MutexLock(DfMutex *mutex) {
+    pthread_mutex_lock(&mutex->mutex);
+}
+
+
+void MutexUnlock(DfMutex *mutex) {
+    pthread_mutex_unlock(&mutex->mutex);
+}
+
+
+DfCondVar *CondVarCreate() {
+    DfCondVar *condVar = new DfCondVar;
+    pthread_cond_init(&condVar->cond, NULL);
+    return condVar;
+}
+
+
+void CondVarDelete(DfCondVar *condVar) {
+    pthread_cond_destroy(&condVar->cond);
+    delete condVar;
+}
+
+
+void CondVarWait(DfCondVar *condVar, DfMutex *mutex) {
+    pthread_cond_wait(&condVar->cond, &mutex->mutex);
+}
+
+
+void CondVarSignal(DfCondVar *condVar) {
+    pthread_cond_signal(&condVar->cond);
+}
+
+
+void CondVarBroadcast(DfCondVar *condVar) {
+    pthread_cond_broadcast(&condVar->cond);
+}
+
+
+#endif
+
+
+// Thread pool ******************************************************
+
+struct _DfThreadPool {
+    DfMutex *mutex;
+
+    // Held for the whole of ThreadPoolRun(), so that calls from different
+    // threads take turns instead of overwriting each other's batch.
+    DfMutex *runMutex;
+    DfCondVar *workAvailable;
+    DfCondVar *workDone;
+
+    int numWorkers;
+    DfThread **workers;
+
+    // Incremented by each call to ThreadPoolRun(), so that the workers can
+    // tell new work from work they have already seen.
+    unsigned generation;
+    bool quit;
+
+    // The current batch of jobs. Protected by mutex.
+    DfJobFunc *func;
+    void *context;
+    int numJobs;
+    int nextJob;
+    int numJobsDone;
+};
+
+
+// Does jobs until there are none left to start. The mutex must be locked.
+static void DoJobs(DfThreadPool *pool) {
+    while (pool->nextJob < pool->numJobs) {
+        int jobIndex = pool->nextJob;
+        pool->nextJob++;
+
+        MutexUnlock(pool->mutex);
+        pool->func(pool->context, jobIndex);
+        MutexLock(pool->mutex);
+
+        pool->numJobsDone++;
+        if (pool->numJobsDone == pool->numJobs)
+            CondVarBroadcast(pool->workDone);
+    }
+}
+
+
+static void WorkerThreadFunc(void *arg) {
+    DfThreadPool *pool = (DfThreadPool *)arg;
+    unsigned seenGeneration = 0;
+
+    MutexLock(pool->mutex);
+    while (1) {
+        while (!pool->quit && pool->generation == seenGeneration)
+            CondVarWait(pool->workAvailable, pool->mutex);
+        if (pool->quit)
+            break;
+
+        seenGeneration = pool->generation;
+        DoJobs(pool);
+    }
+    MutexUnlock(pool->mutex);
+}
+
+
+DfThreadPool *ThreadPoolCreate(int numThreads) {
+    if (numThreads <= 0)
+        numThreads = GetNumCpuCores();
+
+    DfThreadPool *pool = new DfThreadPool;
+    pool->mutex = MutexCreate();
+    pool->runMutex = MutexCreate();
+    pool->workAvailable = CondVarCreate();
+    pool->workDone = CondVarCreate();
+    pool->generation = 0;
+    pool->quit = false;
+    pool->func = NULL;
+    pool->context = NULL;
+    pool->numJobs = 0;
+    pool->nextJob = 0;
+    pool->numJobsDone = 0;
+
+    pool->numWorkers = numThreads - 1;
+    pool->workers = new DfThread *[pool->numWorkers];
+    for (int i = 0; i < pool->numWorkers; i++)
+        pool->workers[i] = ThreadCreate(WorkerThreadFunc, pool);
+
+    return pool;
+}
+
+
+void ThreadPoolDelete(DfThreadPool *pool) {
+    MutexLock(pool->mutex);
+    pool->quit = true;
+    CondVarBroadcast(pool->workAvailable);
+    MutexUnlock(pool->mutex);
+
+    for (int i = 0; i < pool->numWorkers; i++)
+        ThreadJoin(pool->workers[i]);
+    delete [] pool->workers;
+
+    CondVarDelete(pool->workDone);
+    CondVarDelete(pool->workAvailable);
+    MutexDelete(pool->runMutex);
+    MutexDelete(pool->mutex);
+    delete pool;
+}
+
+
+int ThreadPoolGetNumThreads(DfThreadPool *pool) {
+    return pool->numWorkers + 1;
+}
+
+
+DfThreadPool *ThreadPoolGetDefault() {
+    // Initialising a local static is thread safe, so two threads that ask
+    // for the pool at the same time get the same one.
+    static DfThreadPool *defaultPool = ThreadPoolCreate(0);
+    return defaultPool;
+}
+
+
+void ThreadPoolRun(DfThreadPool *pool, int numJobs, DfJobFunc *func, void *context) {
+    if (pool->numWorkers == 0 || numJobs <= 1) {
+        for (int i = 0; i < numJobs; i++)
+            func(context, i);
+        return;
+    }
+
+    MutexLock(pool->runMutex);
+    MutexLock(pool->mutex);
+    pool->func = func;
+    pool->context = context;
+    pool->numJobs = numJobs;
+    pool->nextJob = 0;
+    pool->numJobsDone = 0;
+    pool->generation++;
+    CondVarBroadcast(pool->workAvailable);
+
+    DoJobs(pool);
+    while (pool->numJobsDone < pool->numJobs)
+        CondVarWait(pool->workDone, pool->mutex);
+    MutexUnlock(pool->mutex);
+    MutexUnlock(pool->runMutex);
+}
@@ -0,0 +1,69 @@
+// Minimal threading primitives and a worker pool. Threads are created with
+// the platform's native API. Nothing here is needed for single-threaded
+// programs.
+
+#pragma once
+
+
+#include "df_common.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+typedef struct _DfThread DfThread;
+typedef struct _DfMutex DfMutex;
+typedef struct _DfCondVar DfCondVar;
+typedef struct _DfThreadPool DfThreadPool;
+
+typedef void DfThreadFunc(void *arg);
+
+// Called once for each job. jobIndex is in the range 0 to numJobs-1.
+typedef void DfJobFunc(void *context, int jobIndex);
+
+
+DLL_API int          GetNumCpuCores     ();
+
+DLL_API DfThread    *ThreadCreate       (DfThreadFunc *func, void *arg);
+
+// Waits for the thread to return from its DfThreadFunc and then deletes the DfThread.
+DLL_API void         ThreadJoin         (DfThread *thread);
+
+DLL_API DfMutex     *MutexCreate        ();
+DLL_API void         MutexDelete        (DfMutex *mutex);
+DLL_API void         MutexLock          (DfMutex *mutex);
+DLL_API void         MutexUnlock        (DfMutex *mutex);
+
+// The mutex must be locked when calling CondVarWait(). It is unlocked while
+// waiting and locked again before returning. Spurious wake-ups can happen, so
+// always wait in a loop that checks the condition.
+DLL_API DfCondVar   *CondVarCreate      ();
+DLL_API void         CondVarDelete      (DfCondVar *condVar);
+DLL_API void         CondVarWait        (DfCondVar *condVar, DfMutex *mutex);
+DLL_API void         CondVarSignal      (DfCondVar *condVar);
+DLL_API void         CondVarBroadcast   (DfCondVar *condVar);
+
+// numThreads includes the thread that calls ThreadPoolRun(), so a pool with 4
+// threads creates 3 worker threads. 0 means one thread per CPU core.
+DLL_API DfThreadPool *ThreadPoolCreate  (int numThreads);
+DLL_API void         ThreadPoolDelete   (DfThreadPool *pool);
+DLL_API int          ThreadPoolGetNumThreads(DfThreadPool *pool);
+
+// Returns a pool with one thread per CPU core, which is created the first time
+// this is called. It is shared by everything in the library that takes an
+// optional pool. Don't delete it.
+DLL_API DfThreadPool *ThreadPoolGetDefault();
+
+// Calls func once for each job, spread across the pool's threads, and returns
+// when they have all finished. The calling thread does some of the jobs too.
+// If several threads call it on the same pool at once, their batches are run
+// one after another. Must not be called from inside a job on the same pool.
+DLL_API void         ThreadPoolRun      (DfThreadPool *pool, int numJobs, DfJobFunc *func, void *context);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,10 +3,12 @@
 
 // Project headers
 #include "df_bitmap.h"
+#include "df_thread.h"
 #include "df_time.h"
 
 // Standard includes
 #include <ctype.h>
+#include <math.h>
 #include <memory.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -14,6 +16,32 @@
 
 
 struct WindowPlatformSpecific;
+struct HeadlessWindow;
+
+
+// The spare buffers and present thread used by EnableAsyncPresent().
+struct AsyncPresent {
+    DfWindow   *win;
+    DfThread   *thread;
+    DfMutex    *mutex;
+    DfCondVar  *condVar;        // Broadcast when a frame is queued or presented, or quit is set.
+
+    int         numBuffers;
+    DfBitmap   *buffers[3];
+    DfDamage    damage[3];      // Areas of each buffer to present.
+    bool        busy[3];        // True from when a buffer is queued until it has been presented.
+
+    int         queue[3];       // Indices of the buffers waiting to be presented, oldest first.
+    int         numQueued;
+
+    bool        quit;
+};
+
+
+struct _DfServerImage {
+    DfBitmap   *bmp;          // Copy of the pixels, for when the image is drawn in software.
+    unsigned    serverId;     // Display server's id for its copy, or 0 if it doesn't have one.
+};
 
 
 struct _DfWindowPrivate {
@@ -29,7 +57,13 @@ struct _DfWindowPrivate {
     double      endOfSecond;
     double      lastUpdateTime;
 
+    double      wakeUpTime;           // Earliest time passed to RequestWakeUp() since the last WaitForEvents(), or 0.0.
+
+    AsyncPresent   *asyncPresent;     // NULL unless EnableAsyncPresent() has been called.
+    DfPresentStats  presentStats;     // Protected by asyncPresent->mutex if asyncPresent is set.
+
     WindowPlatformSpecific *platSpec;
+    HeadlessWindow *headless;         // NULL unless this is a headless window. See df_window_headless.cpp.
 };
 
 
@@ -39,6 +73,13 @@ DfWindow *g_window = NULL;
 static void InitInput(DfWindow *);
 static void InputPollInternal(DfWindow *win);
 
+static bool HeadlessModeEnabled();
+static bool GetDesktopResHeadless(int *width, int *height);
+static DfWindow *CreateWinHeadless(int x, int y, int width, int height);
+static void DestroyWinHeadless(DfWindow *win);
+static void SetWindowRectHeadless(DfWindow *win, int x, int y, int width, int height);
+static bool InputPollHeadless(DfWindow *win);
+
 
 static void HandleFocusInEvent(DfWindow *win) {
     win->input.windowHasFocus = true;
@@ -59,6 +100,8 @@ static void HandleFocusOutEvent(DfWindow *win) {
 # include "df_window_x11.cpp"
 #endif
 
+#include "df_window_headless.cpp"
+
 
 static void InitInput(DfWindow *win) {
     win->input.eventSinceAdvance = true;
@@ -220,6 +263,157 @@ static void InputPollInternal(DfWindow *win) {
 }
 
 
+static void PresentThreadFunc(void *arg) {
+    AsyncPresent *ap = (AsyncPresent *)arg;
+
+    MutexLock(ap->mutex);
+    while (1) {
+        while (ap->numQueued == 0 && !ap->quit)
+            CondVarWait(ap->condVar, ap->mutex);
+        if (ap->numQueued == 0)
+            break;
+
+        // The buffer is busy until it has been presented, so UpdateWin()
+        // won't touch it while the mutex is unlocked.
+        int i = ap->queue[0];
+        MutexUnlock(ap->mutex);
+        PresentBitmap(ap->win, ap->buffers[i], ap->damage[i].rects, ap->damage[i].numRects);
+        MutexLock(ap->mutex);
+
+        ap->numQueued--;
+        memmove(ap->queue, ap->queue + 1, ap->numQueued * sizeof(int));
+        ap->busy[i] = false;
+        ap->win->_private->presentStats.framesPresented++;
+        CondVarBroadcast(ap->condVar);
+    }
+    MutexUnlock(ap->mutex);
+}
+
+
+// Copies the damaged areas of win->bmp into a free buffer and queues it for
+// the present thread.
+static void QueueAsyncPresent(DfWindow *win) {
+    AsyncPresent *ap = win->_private->asyncPresent;
+    DfBitmap *bmp = win->bmp;
+
+    // The present thread only sends rects, so an area that BitmapScroll()
+    // moved has to be copied and sent like any other damage.
+    DfDamage *damage = bmp->damage;
+    if (damage && damage->hasScroll) {
+        DfRect const *r = &damage->scrollRect;
+        BitmapAddDamage(bmp, r->x + damage->scrollDx, r->y + damage->scrollDy, r->w, r->h);
+    }
+
+    DfDamage fullDamage;
+    if (!damage) {
+        fullDamage.numRects = 1;
+        fullDamage.rects[0].x = 0;
+        fullDamage.rects[0].y = 0;
+        fullDamage.rects[0].w = bmp->width;
+        fullDamage.rects[0].h = bmp->height;
+        damage = &fullDamage;
+    }
+
+    if (damage->numRects == 0)
+        return;
+
+    MutexLock(ap->mutex);
+
+    double stallStartTime = 0.0;
+    int i;
+    while (1) {
+        for (i = 0; i < ap->numBuffers; i++)
+            if (!ap->busy[i]) break;
+        if (i < ap->numBuffers)
+            break;
+
+        if (stallStartTime == 0.0) {
+            stallStartTime = GetRealTime();
+            win->_private->presentStats.stalls++;
+        }
+        CondVarWait(ap->condVar, ap->mutex);
+    }
+
+    if (stallStartTime != 0.0)
+        win->_private->presentStats.stallSeconds += GetRealTime() - stallStartTime;
+
+    MutexUnlock(ap->mutex);
+
+    // The buffers follow the size of the back buffer. A buffer that has just
+    // been recreated must be sent in full, because only the damaged areas
+    // are copied into it.
+    DfBitmap *buf = ap->buffers[i];
+    if (!buf || buf->width != bmp->width || buf->height != bmp->height) {
+        if (buf) BitmapDelete(buf);
+        buf = ap->buffers[i] = BitmapCreate(bmp->width, bmp->height);
+        fullDamage.numRects = 1;
+        fullDamage.rects[0].x = 0;
+        fullDamage.rects[0].y = 0;
+        fullDamage.rects[0].w = bmp->width;
+        fullDamage.rects[0].h = bmp->height;
+        damage = &fullDamage;
+    }
+
+    for (int j = 0; j < damage->numRects; j++) {
+        DfRect const *r = damage->rects + j;
+        BlitEx(buf, r->x, r->y, bmp, r->x, r->y, r->w, r->h);
+    }
+    ap->damage[i] = *damage;
+
+    MutexLock(ap->mutex);
+    ap->busy[i] = true;
+    ap->queue[ap->numQueued] = i;
+    ap->numQueued++;
+    CondVarBroadcast(ap->condVar);
+    MutexUnlock(ap->mutex);
+}
+
+
+bool EnableAsyncPresent(DfWindow *win, int numBuffers) {
+    ReleaseAssert(numBuffers == 2 || numBuffers == 3,
+        "EnableAsyncPresent: numBuffers must be 2 or 3");
+
+    if (win->_private->asyncPresent)
+        DisableAsyncPresent(win);
+
+    // Headless windows don't present, so there's nothing to overlap.
+    if (win->_private->headless || !SetAsyncPresentPlatform(win, true))
+        return false;
+
+    AsyncPresent *ap = new AsyncPresent;
+    memset(ap, 0, sizeof(AsyncPresent));
+    ap->win = win;
+    ap->numBuffers = numBuffers;
+    ap->mutex = MutexCreate();
+    ap->condVar = CondVarCreate();
+    win->_private->asyncPresent = ap;
+    ap->thread = ThreadCreate(PresentThreadFunc, ap);
+
+    return true;
+}
+
+
+void DisableAsyncPresent(DfWindow *win) {
+    AsyncPresent *ap = win->_private->asyncPresent;
+    if (!ap) return;
+
+    MutexLock(ap->mutex);
+    ap->quit = true;
+    CondVarBroadcast(ap->condVar);
+    MutexUnlock(ap->mutex);
+    ThreadJoin(ap->thread);
+
+    win->_private->asyncPresent = NULL;
+    SetAsyncPresentPlatform(win, false);
+
+    for (int i = 0; i < ap->numBuffers; i++)
+        if (ap->buffers[i]) BitmapDelete(ap->buffers[i]);
+    CondVarDelete(ap->condVar);
+    MutexDelete(ap->mutex);
+    delete ap;
+}
+
+
 void UpdateWin(DfWindow *win) {
     // *** FPS Meter ***
 
@@ -248,7 +442,108 @@ void UpdateWin(DfWindow *win) {
 
     // *** Swap buffers ***
 
-    BlitBitmapToWindow(win);
+    if (win->_private->headless)
+        UpdateWinHeadless(win);
+    else if (win->_private->asyncPresent)
+        QueueAsyncPresent(win);
+    else {
+        BlitBitmapToWindow(win);
+        win->_private->presentStats.framesPresented++;
+    }
+    BitmapClearDamage(win->bmp);
+}
+
+
+void GetPresentStats(DfWindow *win, DfPresentStats *stats) {
+    AsyncPresent *ap = win->_private->asyncPresent;
+    if (ap) MutexLock(ap->mutex);
+    *stats = win->_private->presentStats;
+    stats->framesQueued = ap ? ap->numQueued : 0;
+    if (ap) MutexUnlock(ap->mutex);
+}
+
+
+DfServerImage *ServerImageCreate(DfWindow *win, DfBitmap *bmp) {
+    DfServerImage *img = new DfServerImage;
+    img->bmp = BitmapCreate(bmp->width, bmp->height);
+    BlitEx(img->bmp, 0, 0, bmp, 0, 0, bmp->width, bmp->height);
+    img->serverId = 0;
+    if (!win->_private->headless)
+        img->serverId = UploadServerImage(win, img->bmp);
+    return img;
+}
+
+
+void ServerImageDelete(DfServerImage *img) {
+    if (img->serverId)
+        FreeServerImage(img->serverId);
+    BitmapDelete(img->bmp);
+    delete img;
+}
+
+
+void ServerImageDraw(DfWindow *win, DfServerImage *img, int x, int y) {
+    DfBitmap *bmp = win->bmp;
+
+    // Queued copies are applied by BlitBitmapToWindow(), which the present
+    // thread doesn't use.
+    if (!img->serverId || win->_private->asyncPresent) {
+        Blit(bmp, x, y, img->bmp);
+        return;
+    }
+
+    int srcX = 0, srcY = 0;
+    DfRect dst = { x, y, img->bmp->width, img->bmp->height };
+    if (dst.x < bmp->clipLeft) {
+        srcX = bmp->clipLeft - dst.x;
+        dst.w -= srcX;
+        dst.x = bmp->clipLeft;
+    }
+    if (dst.y < bmp->clipTop) {
+        srcY = bmp->clipTop - dst.y;
+        dst.h -= srcY;
+        dst.y = bmp->clipTop;
+    }
+    if (dst.x + dst.w > bmp->clipRight)
+        dst.w = bmp->clipRight - dst.x;
+    if (dst.y + dst.h > bmp->clipBottom)
+        dst.h = bmp->clipBottom - dst.y;
+    if (dst.w <= 0 || dst.h <= 0)
+        return;
+
+    if (!QueueServerImageDraw(win, img->serverId, srcX, srcY, &dst))
+        Blit(bmp, x, y, img->bmp);
+}
+
+
+void RequestWakeUp(DfWindow *win, double wakeUpTime) {
+    double current = win->_private->wakeUpTime;
+    if (current == 0.0 || wakeUpTime < current)
+        win->_private->wakeUpTime = wakeUpTime;
+}
+
+
+bool WaitForEvents(DfWindow *win, double timeoutSeconds) {
+    double wakeUpTime = win->_private->wakeUpTime;
+    win->_private->wakeUpTime = 0.0;
+
+    if (wakeUpTime != 0.0) {
+        double untilWakeUp = wakeUpTime - GetRealTime();
+        if (untilWakeUp < 0.0)
+            untilWakeUp = 0.0;
+        if (timeoutSeconds < 0.0 || untilWakeUp < timeoutSeconds)
+            timeoutSeconds = untilWakeUp;
+    }
+
+    // Rounded up, so that we don't wake up just before the deadline and
+    // have to sleep again.
+    int timeoutMillisec = -1;
+    if (timeoutSeconds >= 0.0)
+        timeoutMillisec = (int)ceil(timeoutSeconds * 1000.0);
+
+    if (win->_private->headless)
+        return WaitForEventsHeadless(win, timeoutMillisec);
+    return WaitForEventsPlatform(win, timeoutMillisec);
 }
 
 
@@ -27,6 +27,7 @@ extern "C"
 
 typedef void (RedrawCallback)(void);
 typedef void (FileDropCallback)(char const *path);
+typedef void (FrameSinkCallback)(struct _DfWindow *win, void *context);
 typedef struct _DfWindowPrivate DfWindowPrivate;
 
 
@@ -65,6 +66,8 @@ typedef struct {
     signed char keys[KEY_MAX];      // Is the key currently pressed
     signed char keyDowns[KEY_MAX];  // Was the key pressed this frame (includes key repeats)
     signed char keyUps[KEY_MAX];    // Was the key released this frame
+
+    int         numEvents;          // Number of events handled since the previous InputPoll(win)
 } DfInput;
 
 
@@ -110,6 +113,36 @@ typedef enum {
 
 DLL_API bool GetDesktopRes(int *width, int *height);
 
+// Headless windows have a back buffer and input like any other window, but
+// nothing is shown and no display server is needed, so apps can render in
+// batch jobs and on CI machines. CreateWin() makes headless windows after
+// SetHeadlessMode(true), or if the DF_HEADLESS environment variable is set
+// to anything but "0". GetDesktopRes() then returns 1920x1080, or the value
+// of DF_HEADLESS_DESKTOP_RES (like "2560x1440"), or what was passed to
+// SetHeadlessDesktopRes().
+DLL_API void SetHeadlessMode(bool enable);
+DLL_API void SetHeadlessDesktopRes(int width, int height);
+DLL_API bool IsWindowHeadless(DfWindow *win);
+
+// UpdateWin() on a headless window calls callback with win->bmp holding the
+// finished frame, before its damage is cleared.
+DLL_API void SetFrameSink(DfWindow *win, FrameSinkCallback *callback, void *context);
+
+// Loads input events for a headless window from a text file. Each line is
+// the InputPoll() call to deliver it on, counting from 0, and an event:
+//     10 mouse 200 150     Moves the mouse to (200, 150).
+//     11 lmb down          lmb, mmb or rmb, then down or up. "lmb double"
+//                          is a double click.
+//     12 wheel -3          Changes mouseZ.
+//     13 key down Enter    Any name that GetKeyId() accepts.
+//     14 type hello        Adds the characters to keysTyped.
+//     99 close             Sets windowClosed.
+// Blank lines and lines starting with # are ignored. Returns false if the
+// file can't be opened. If DF_INPUT_SCRIPT is set, that file is loaded into
+// each headless window when it is created. WaitForEvents() doesn't sleep
+// while the script has events left, and sleeps for its timeout after that.
+DLL_API bool LoadInputScript(DfWindow *win, char const *filename);
+
 // Creates a Window (fullscreen is really just a big window) and a bitmap the size of the window
 // to use as the back buffer of a double buffer. Position of the window is determined by the
 // system. This function is not thread safe. DO NOT call it from multiple threads simultaneously.
@@ -130,9 +163,52 @@ DLL_API void GetMonitorWorkArea(DfWindow *win, int *x, int *y, int *width, int *
 
 DLL_API void SetWindowRect(DfWindow *win, int x, int y, int width, int height);
 
-// Blit back buffer to screen and update FPS counter.
+// Blit back buffer to screen and update FPS counter. On X11 with MIT-SHM,
+// win->bmp->pixels moves between two buffers each time, so views made with
+// BitmapCreateView(win->bmp, ...) must be made again after this.
 DLL_API void UpdateWin(DfWindow *win);
 
+// Normally UpdateWin() returns once the back buffer has been sent to the
+// screen. With async present, it copies the back buffer, or just its damaged
+// areas if damage tracking is on, into one of numBuffers (2 or 3) spare
+// buffers and returns, and a present thread sends that buffer while the app
+// draws the next frame. win->bmp stays the same bitmap either way. If all the
+// spare buffers are waiting to be presented, UpdateWin() blocks until one is
+// free. GetPresentStats() reports how often and for how long that happens.
+// Returns false if the window doesn't benefit from async present, like an X11
+// window whose back buffer is in memory shared with the Xserver.
+DLL_API bool EnableAsyncPresent(DfWindow *win, int numBuffers);
+
+// Waits for the queued frames to be presented and stops the present thread.
+// DestroyWin() calls this.
+DLL_API void DisableAsyncPresent(DfWindow *win);
+
+typedef struct _DfPresentStats {
+    unsigned framesPresented;
+    unsigned stalls;        // Times UpdateWin() had to wait for a free buffer.
+    double   stallSeconds;  // Total time spent waiting.
+    int      framesQueued;  // Frames not yet presented.
+} DfPresentStats;
+
+// The counters count up from when the window was created.
+DLL_API void GetPresentStats(DfWindow *win, DfPresentStats *stats);
+
+// A server image is a copy of a bitmap that the display server keeps, so that
+// drawing it into a window doesn't send its pixels again every frame. On X11
+// it is a Pixmap. ServerImageDraw() queues a copy from it that the next
+// UpdateWin() applies after sending the back buffer, and the covered area of
+// the back buffer isn't sent. The image is opaque and is clipped to
+// win->bmp's clip rect. The back buffer's pixels under it aren't changed, so
+// like anything else drawn into the window, it needs drawing again in any
+// frame where something else touches that area. On Windows, and for windows
+// with async present, it is drawn into win->bmp with Blit() instead.
+typedef struct _DfServerImage DfServerImage;
+
+// bmp can be deleted once this returns.
+DLL_API DfServerImage *ServerImageCreate(DfWindow *win, DfBitmap *bmp);
+DLL_API void ServerImageDelete(DfServerImage *img);
+DLL_API void ServerImageDraw(DfWindow *win, DfServerImage *img, int x, int y);
+
 // Windows only. Returns the Window handle because lots of things on Windows
 // need this. Cast the return value to HWND.
 DLL_API void *GetWindowHandle(DfWindow *win);
@@ -153,6 +229,20 @@ DLL_API void SetWindowTitle(DfWindow *win, char const *title);
 
 DLL_API bool WaitVsync();   // Returns false if not supported.
 
+// Sleeps until there are events for InputPoll() to handle, timeoutSeconds
+// have passed, or the time given to RequestWakeUp() since the last call is
+// reached, whichever is soonest. A negative timeout means no limit. Returns
+// true if events arrived. Apps that only need to redraw when something
+// changes can call this at the top of their main loop to use no CPU while
+// idle.
+DLL_API bool WaitForEvents(DfWindow *win, double timeoutSeconds);
+
+// Makes the next WaitForEvents() return by wakeUpTime, a GetRealTime() value.
+// Widgets that change on their own, like a blinking cursor, call this every
+// frame with the time they next need to be redrawn. Calls with a time later
+// than an earlier call are ignored.
+DLL_API void RequestWakeUp(DfWindow *win, double wakeUpTime);
+
 // Register a callback that will be called when the window is resized. This gives the
 // app a chance to redraw the window contents immediately. Without this, when the
 // window is enlarged, the new part of the window will appear blank until the resize
@@ -164,7 +254,11 @@ DLL_API void RegisterRedrawCallback(DfWindow *win, RedrawCallback *proc);
 
 DLL_API char const *GetKeyName(int i);
 DLL_API int         GetKeyId(char const *name);
-DLL_API bool        InputPoll(DfWindow *win);  // Returns true if any events occurred since last call
+
+// Handles the window's events and updates win->input. Returns true if any
+// events occurred since the last call. Whether the window has been closed is
+// in win->windowClosed, and the number of events in win->input.numEvents.
+DLL_API bool        InputPoll(DfWindow *win);
 
 
 // Defines for indexes into win->input.keys[], keyDowns[] and keyUps[].
@@ -0,0 +1,371 @@
+// Headless windows. This file is #included by df_window.cpp, after the
+// platform's window code, and is used on every platform.
+//
+// A headless window has a back buffer and input like any other window, but it
+// doesn't need a display server. UpdateWin() passes the frame to the frame
+// sink, if there is one, and input comes from a script file, if there is one.
+
+
+enum {
+    SCRIPT_MOUSE,       // a, b = x, y
+    SCRIPT_BUTTON,      // a = 0, 1 or 2 for lmb, mmb or rmb. b = 0 for up, 1 for down, 2 for double click.
+    SCRIPT_WHEEL,       // a = change in mouseZ
+    SCRIPT_KEY,         // a = key id. b = 1 for down, 0 for up.
+    SCRIPT_TYPE,        // text = characters to add to keysTyped
+    SCRIPT_CLOSE
+};
+
+
+struct ScriptEvent {
+    int frameNum;
+    int type;
+    int a;
+    int b;
+    char text[MAX_KEYS_TYPED_PER_FRAME + 1];
+};
+
+
+struct HeadlessWindow {
+    FrameSinkCallback *frameSink;
+    void *frameSinkContext;
+
+    ScriptEvent *events;    // Sorted by frameNum.
+    int numEvents;
+    int nextEvent;
+    int frameNum;           // Number of calls of InputPoll() so far.
+};
+
+
+static int g_headlessMode = -1;     // -1 until the environment has been read.
+static int g_headlessDesktopWidth = 1920;
+static int g_headlessDesktopHeight = 1080;
+
+
+static bool HeadlessModeEnabled() {
+    if (g_headlessMode < 0) {
+        char const *env = getenv("DF_HEADLESS");
+        g_headlessMode = env && env[0] && strcmp(env, "0") != 0;
+
+        env = getenv("DF_HEADLESS_DESKTOP_RES");
+        int w, h;
+        if (env && sscanf(env, "%dx%d", &w, &h) == 2 && w > 0 && h > 0) {
+            g_headlessDesktopWidth = w;
+            g_headlessDesktopHeight = h;
+        }
+    }
+
+    return g_headlessMode;
+}
+
+
+void SetHeadlessMode(bool enable) {
+    HeadlessModeEnabled(); // Reads DF_HEADLESS_DESKTOP_RES, if we haven't yet.
+    g_headlessMode = enable;
+}
+
+
+void SetHeadlessDesktopRes(int width, int height) {
+    HeadlessModeEnabled();
+    g_headlessDesktopWidth = width;
+    g_headlessDesktopHeight = height;
+}
+
+
+static bool GetDesktopResHeadless(int *width, int *height) {
+    if (width)
+        *width = g_headlessDesktopWidth;
+    if (height)
+        *height = g_headlessDesktopHeight;
+    return true;
+}
+
+
+bool IsWindowHeadless(DfWindow *win) {
+    return win->_private->headless != NULL;
+}
+
+
+void SetFrameSink(DfWindow *win, FrameSinkCallback *callback, void *context) {
+    HeadlessWindow *hw = win->_private->headless;
+    ReleaseAssert(hw != NULL, "SetFrameSink: window isn't headless");
+    hw->frameSink = callback;
+    hw->frameSinkContext = context;
+}
+
+
+static DfWindow *CreateWinHeadless(int x, int y, int width, int height) {
+    DfWindow *win = new DfWindow;
+    memset(win, 0, sizeof(DfWindow));
+    win->_private = new DfWindowPrivate;
+    memset(win->_private, 0, sizeof(DfWindowPrivate));
+
+    // The platform's code never touches a headless window's platSpec, but
+    // it is zeroed in case something is missed.
+    win->_private->platSpec = new WindowPlatformSpecific;
+    memset(win->_private->platSpec, 0, sizeof(WindowPlatformSpecific));
+
+    HeadlessWindow *hw = new HeadlessWindow;
+    memset(hw, 0, sizeof(HeadlessWindow));
+    win->_private->headless = hw;
+
+    win->left = x;
+    win->top = y;
+    win->bmp = BitmapCreate(width, height);
+
+    double now = GetRealTime();
+    win->_private->lastUpdateTime = now;
+    win->_private->endOfSecond = now + 1.0;
+
+    InitInput(win);
+
+    char const *scriptFilename = getenv("DF_INPUT_SCRIPT");
+    if (scriptFilename && scriptFilename[0]) {
+        ReleaseAssert(LoadInputScript(win, scriptFilename),
+            "Couldn't load input script '%s'", scriptFilename);
+    }
+
+    return win;
+}
+
+
+static void DestroyWinHeadless(DfWindow *win) {
+    delete [] win->_private->headless->events;
+    delete win->_private->headless;
+    BitmapDelete(win->bmp);
+    delete win->_private->platSpec;
+    delete win->_private;
+    delete win;
+}
+
+
+static void SetWindowRectHeadless(DfWindow *win, int x, int y, int width, int height) {
+    win->left = x;
+    win->top = y;
+    if (win->bmp->width == width && win->bmp->height == height)
+        return;
+
+    bool trackDamage = win->bmp->damage != NULL;
+    BitmapDelete(win->bmp);
+    win->bmp = BitmapCreate(width, height);
+    BitmapEnableDamageTracking(win->bmp, trackDamage);
+    if (win->redrawCallback)
+        win->redrawCallback();
+}
+
+
+// Calls the frame sink instead of presenting.
+static void UpdateWinHeadless(DfWindow *win) {
+    HeadlessWindow *hw = win->_private->headless;
+    if (hw->frameSink)
+        hw->frameSink(win, hw->frameSinkContext);
+}
+
+
+// ****************************************************************************
+// Input scripts
+// ****************************************************************************
+
+// Parses one line of a script. Returns false if it isn't an event.
+static bool ParseScriptLine(char *line, ScriptEvent *e) {
+    char verb[16], arg[64];
+    int numChars = 0;
+    memset(e, 0, sizeof(ScriptEvent));
+    if (sscanf(line, "%d %15s %n", &e->frameNum, verb, &numChars) < 2)
+        return false;
+    char *rest = line + numChars;
+
+    if (strcmp(verb, "mouse") == 0) {
+        e->type = SCRIPT_MOUSE;
+        return sscanf(rest, "%d %d", &e->a, &e->b) == 2;
+    }
+
+    if (strcmp(verb, "lmb") == 0 || strcmp(verb, "mmb") == 0 || strcmp(verb, "rmb") == 0) {
+        e->type = SCRIPT_BUTTON;
+        e->a = verb[0] == 'l' ? 0 : verb[0] == 'm' ? 1 : 2;
+        if (sscanf(rest, "%63s", arg) != 1) return false;
+        if (strcmp(arg, "double") == 0 && e->a == 0) e->b = 2;
+        else e->b = strcmp(arg, "down") == 0;
+        return e->b || strcmp(arg, "up") == 0;
+    }
+
+    if (strcmp(verb, "wheel") == 0) {
+        e->type = SCRIPT_WHEEL;
+        return sscanf(rest, "%d", &e->a) == 1;
+    }
+
+    if (strcmp(verb, "key") == 0) {
+        e->type = SCRIPT_KEY;
+        char keyName[64];
+        if (sscanf(rest, "%63s %63s", arg, keyName) != 2) return false;
+        e->a = GetKeyId(keyName);
+        e->b = strcmp(arg, "down") == 0;
+        return e->a >= 0 && e->a < KEY_MAX && (e->b || strcmp(arg, "up") == 0);
+    }
+
+    if (strcmp(verb, "type") == 0) {
+        e->type = SCRIPT_TYPE;
+        int len = strcspn(rest, "\r\n");
+        if (len > MAX_KEYS_TYPED_PER_FRAME) len = MAX_KEYS_TYPED_PER_FRAME;
+        memcpy(e->text, rest, len);
+        e->text[len] = '\0';
+        return true;
+    }
+
+    if (strcmp(verb, "close") == 0) {
+        e->type = SCRIPT_CLOSE;
+        return true;
+    }
+
+    return false;
+}
+
+
+bool LoadInputScript(DfWindow *win, char const *filename) {
+    HeadlessWindow *hw = win->_private->headless;
+    ReleaseAssert(hw != NULL, "LoadInputScript: window isn't headless");
+
+    FILE *f = fopen(filename, "r");
+    if (!f)
+        return false;
+
+    int maxEvents = 64;
+    int numEvents = 0;
+    ScriptEvent *events = new ScriptEvent [maxEvents];
+
+    char line[256];
+    int lineNum = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineNum++;
+        char *c = line + strspn(line, " \t");
+        if (*c == '#' || *c == '\r' || *c == '\n' || *c == '\0')
+            continue;
+
+        if (numEvents == maxEvents) {
+            ScriptEvent *newEvents = new ScriptEvent [maxEvents * 2];
+            memcpy(newEvents, events, numEvents * sizeof(ScriptEvent));
+            delete [] events;
+            events = newEvents;
+            maxEvents *= 2;
+        }
+
+        if (!ParseScriptLine(c, &events[numEvents])) {
+            printf("%s:%d: Couldn't parse input script line\n", filename, lineNum);
+            continue;
+        }
+        numEvents++;
+    }
+    fclose(f);
+
+    // Sort by frame number. Insertion sort keeps the events for the same
+    // frame in file order, and scripts are nearly always in order already.
+    for (int i = 1; i < numEvents; i++) {
+        ScriptEvent e = events[i];
+        int j = i;
+        while (j > 0 && events[j - 1].frameNum > e.frameNum) {
+            events[j] = events[j - 1];
+            j--;
+        }
+        events[j] = e;
+    }
+
+    delete [] hw->events;
+    hw->events = events;
+    hw->numEvents = numEvents;
+    hw->nextEvent = 0;
+    return true;
+}
+
+
+static void ApplyScriptEvent(DfWindow *win, ScriptEvent const *e) {
+    DfInput *input = &win->input;
+    switch (e->type) {
+    case SCRIPT_MOUSE:
+        input->mouseX = e->a;
+        input->mouseY = e->b;
+        break;
+
+    case SCRIPT_BUTTON:
+        {
+            bool *buttons[3] = { &input->lmb, &input->mmb, &input->rmb };
+            bool *clicked[3] = { &input->lmbClicked, &input->mmbClicked, &input->rmbClicked };
+            bool *unClicked[3] = { &input->lmbUnClicked, &input->mmbUnClicked, &input->rmbUnClicked };
+            *buttons[e->a] = e->b != 0;
+            if (e->b) *clicked[e->a] = true;
+            else *unClicked[e->a] = true;
+
+            // InputPollInternal() decides whether a click is a double click
+            // by how long it was since the last one. Scripts run much faster
+            // than a person clicks, so they say which they want instead.
+            if (e->a == 0 && e->b)
+                win->_private->lastClickTime = e->b == 2 ? GetRealTime() : -1e9;
+            break;
+        }
+
+    case SCRIPT_WHEEL:
+        input->mouseZ += e->a;
+        break;
+
+    case SCRIPT_KEY:
+        input->keys[e->a] = e->b;
+        if (e->b) input->keyDowns[e->a] = 1;
+        else input->keyUps[e->a] = 1;
+        break;
+
+    case SCRIPT_TYPE:
+        for (int i = 0; e->text[i] && input->numKeysTyped < MAX_KEYS_TYPED_PER_FRAME; i++) {
+            input->keysTyped[input->numKeysTyped] = e->text[i];
+            input->numKeysTyped++;
+        }
+        break;
+
+    case SCRIPT_CLOSE:
+        win->windowClosed = true;
+        break;
+    }
+}
+
+
+static bool InputPollHeadless(DfWindow *win) {
+    HeadlessWindow *hw = win->_private->headless;
+
+    win->input.lmbClicked = false;
+    win->input.mmbClicked = false;
+    win->input.rmbClicked = false;
+    win->input.lmbUnClicked = false;
+    win->input.mmbUnClicked = false;
+    win->input.rmbUnClicked = false;
+    memset(win->input.keyDowns, 0, KEY_MAX);
+    memset(win->input.keyUps, 0, KEY_MAX);
+    win->input.numKeysTyped = 0;
+
+    win->input.numEvents = 0;
+    while (hw->nextEvent < hw->numEvents && hw->events[hw->nextEvent].frameNum <= hw->frameNum) {
+        ApplyScriptEvent(win, &hw->events[hw->nextEvent]);
+        hw->nextEvent++;
+        win->input.numEvents++;
+    }
+    hw->frameNum++;
+
+    InputPollInternal(win);
+    return win->input.numEvents > 0;
+}
+
+
+// Script events are numbered by InputPoll() call rather than by time, so
+// while the script has events left, this returns straight away, true if there
+// are events for the next InputPoll(). Once the script has run out, nothing
+// else can arrive, so it sleeps for the whole timeout. A negative timeout
+// sleeps for ever, like a real window that gets no input.
+static bool WaitForEventsHeadless(DfWindow *win, int timeoutMillisec) {
+    HeadlessWindow *hw = win->_private->headless;
+    if (hw->nextEvent < hw->numEvents)
+        return hw->events[hw->nextEvent].frameNum <= hw->frameNum;
+
+    if (timeoutMillisec < 0) {
+        while (1)
+            SleepMillisec(1000);
+    }
+
+    SleepMillisec(timeoutMillisec);
+    return false;
+}
@@ -214,6 +214,9 @@ static int EventHandler(DfWindow *win, unsigned int message, unsigned int wParam
 
 
 bool InputPoll(DfWindow *win) {
+    if (win->_private->headless)
+        return InputPollHeadless(win);
+
     win->input.lmbClicked = false;
     win->input.mmbClicked = false;
     win->input.rmbClicked = false;
@@ -225,7 +228,10 @@ bool InputPoll(DfWindow *win) {
     win->input.numKeysTyped = 0;
 
     MSG msg;
+    win->input.numEvents = 0;
     while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+        win->input.numEvents++;
+
         // handle or dispatch messages
         TranslateMessage(&msg);
         DispatchMessage(&msg);
@@ -338,8 +344,10 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             int w = LOWORD(lParam);
             int h = HIWORD(lParam);
             if (win->bmp->width != w || win->bmp->height != h) {
+                bool trackDamage = win->bmp->damage != NULL;
                 BitmapDelete(win->bmp);
                 win->bmp = BitmapCreate(w, h);
+                BitmapEnableDamageTracking(win->bmp, trackDamage);
                 if (win->redrawCallback) {
                     win->redrawCallback();
                 }
@@ -348,6 +356,16 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             break;
         }
 
+        case WM_PAINT:
+        {
+            // Part of the window needs to be redrawn. The back buffer still
+            // has the right pixels, so mark them to be re-sent.
+            RECT r;
+            if (GetUpdateRect(hWnd, &r, FALSE))
+                BitmapAddDamage(win->bmp, r.left, r.top, r.right - r.left, r.bottom - r.top);
+            goto _default; // Let DefWindowProc() validate the area.
+        }
+
         case WM_CLOSE:
             win->windowClosed = true;
             win->input.eventSinceAdvance = true;
@@ -364,6 +382,9 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 
 
 bool GetDesktopRes(int *width, int *height) {
+    if (HeadlessModeEnabled())
+        return GetDesktopResHeadless(width, height);
+
     HWND desktopWindow = GetDesktopWindow();
     RECT desktopRect;
 
@@ -385,6 +406,9 @@ DfWindow *CreateWin(int width, int height, WindowType winType, char const *winNa
 
 
 DfWindow *CreateWinPos(int x, int y, int width, int height, WindowType winType, char const *winName) {
+    if (HeadlessModeEnabled())
+        return CreateWinHeadless(x == CW_USEDEFAULT ? 0 : x, y == CW_USEDEFAULT ? 0 : y, width, height);
+
     EnsureFunctionPointers();
     g_setProcessDpiAwareness(PROCESS_PER_MONITOR_DPI_AWARE);
 
@@ -500,6 +524,12 @@ DfWindow *CreateWinPos(int x, int y, int width, int height, WindowType winType,
 
 
 void DestroyWin(DfWindow *win) {
+    if (win->_private->headless) {
+        DestroyWinHeadless(win);
+        return;
+    }
+
+    DisableAsyncPresent(win);
     DestroyWindow(win->_private->platSpec->hWnd);
     BitmapDelete(win->bmp);
     delete win;
@@ -507,6 +537,9 @@ void DestroyWin(DfWindow *win) {
 
 
 int GetMonitorDpi(DfWindow *win) {
+    if (win->_private->headless)
+        return 96;
+
     EnsureFunctionPointers();
     HMONITOR hmon = MonitorFromWindow(win->_private->platSpec->hWnd, MONITOR_DEFAULTTONEAREST);
     unsigned dpiX, dpiY;
@@ -516,6 +549,12 @@ int GetMonitorDpi(DfWindow *win) {
 
 
 void GetMonitorWorkArea(DfWindow *win, int *x, int *y, int *width, int *height) {
+    if (win->_private->headless) {
+        *x = *y = 0;
+        GetDesktopResHeadless(width, height);
+        return;
+    }
+
     HMONITOR hmon = MonitorFromWindow(win->_private->platSpec->hWnd, MONITOR_DEFAULTTONEAREST);
     MONITORINFO info = {};
     info.cbSize = sizeof(MONITORINFO);
@@ -528,6 +567,11 @@ void GetMonitorWorkArea(DfWindow *win, int *x, int *y, int *width, int *height)
 
 
 void SetWindowRect(DfWindow *win, int x, int y, int width, int height) {
+    if (win->_private->headless) {
+        SetWindowRectHeadless(win, x, y, width, height);
+        return;
+    }
+
     RECT rectWithShadow;
     GetWindowRect(win->_private->platSpec->hWnd, &rectWithShadow);
     int withShadowWidth = rectWithShadow.right - rectWithShadow.left;
@@ -547,28 +591,78 @@ void SetWindowRect(DfWindow *win, int x, int y, int width, int height) {
 }
 
 
-// This function copies a DfBitmap to the window, so you can actually see it.
-// SetBIBitsToDevice seems to be the fastest way to achieve this on most hardware.
+// This function copies areas of a DfBitmap to the window, so you can actually
+// see them. SetBIBitsToDevice seems to be the fastest way to achieve this on
+// most hardware. This is called from the async present threads as well as the
+// main thread.
+static void PresentBitmap(DfWindow *win, DfBitmap *bmp, DfRect const *rects, int numRects) {
+    HDC dc = GetDC(win->_private->platSpec->hWnd);
+
+    for (int i = 0; i < numRects; i++) {
+        DfRect const *r = rects + i;
+
+        // Each rect is sent as a top-down DIB that starts at the rect's first
+        // row.
+        BITMAPINFO binfo = {};
+        binfo.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+        binfo.bmiHeader.biWidth = bmp->stride;
+        binfo.bmiHeader.biHeight = -r->h;
+        binfo.bmiHeader.biPlanes = 1;
+        binfo.bmiHeader.biBitCount = 32;
+        binfo.bmiHeader.biCompression = BI_RGB;
+        binfo.bmiHeader.biSizeImage = r->h * bmp->stride * 4;
+
+        SetDIBitsToDevice(dc,
+            r->x, r->y, r->w, r->h,
+            r->x, 0, 0, r->h,
+            bmp->pixels + r->y * bmp->stride, &binfo, DIB_RGB_COLORS
+        );
+    }
+
+    ReleaseDC(win->_private->platSpec->hWnd, dc);
+}
+
+
+// If damage tracking is enabled, only the damaged areas are sent. There's no
+// cheap way to repeat a BitmapScroll() on the window, so the area it moved is
+// sent like any other damage.
 static void BlitBitmapToWindow(DfWindow *win) {
     DfBitmap *bmp = win->bmp;
-    BITMAPINFO binfo = {};
-    binfo.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-    binfo.bmiHeader.biWidth = bmp->width;
-    binfo.bmiHeader.biHeight = -(int)bmp->height;
-    binfo.bmiHeader.biPlanes = 1;
-    binfo.bmiHeader.biBitCount = 32;
-    binfo.bmiHeader.biCompression = BI_RGB;
-    binfo.bmiHeader.biSizeImage = bmp->height * bmp->width * 4;
+    DfDamage *damage = bmp->damage;
+    if (!damage) {
+        DfRect fullRect = { 0, 0, bmp->width, bmp->height };
+        PresentBitmap(win, bmp, &fullRect, 1);
+        return;
+    }
 
-    HDC dc = GetDC(win->_private->platSpec->hWnd);
+    if (damage->hasScroll) {
+        DfRect const *r = &damage->scrollRect;
+        BitmapAddDamage(bmp, r->x + damage->scrollDx, r->y + damage->scrollDy, r->w, r->h);
+    }
 
-    SetDIBitsToDevice(dc,
-        0, 0, bmp->width, bmp->height,
-        0, 0, 0, bmp->height,
-        bmp->pixels, &binfo, DIB_RGB_COLORS
-    );
+    PresentBitmap(win, bmp, damage->rects, damage->numRects);
+}
 
-    ReleaseDC(win->_private->platSpec->hWnd, dc);
+
+// Returns false if async present can't be enabled for the window.
+static bool SetAsyncPresentPlatform(DfWindow *win, bool enable) {
+    return true;
+}
+
+
+// There is no server side copy of images on Windows. ServerImageDraw() always
+// draws them into the back buffer.
+static unsigned UploadServerImage(DfWindow *win, DfBitmap *bmp) {
+    return 0;
+}
+
+
+static void FreeServerImage(unsigned serverId) {
+}
+
+
+static bool QueueServerImageDraw(DfWindow *win, unsigned serverId, int srcX, int srcY, DfRect const *dst) {
+    return false;
 }
 
 
@@ -665,3 +759,11 @@ bool WaitVsync() {
     DwmFlush();
     return true;
 }
+
+
+// A negative timeout means wait forever.
+static bool WaitForEventsPlatform(DfWindow *win, int timeoutMillisec) {
+    DWORD timeout = timeoutMillisec < 0 ? INFINITE : timeoutMillisec;
+    DWORD result = MsgWaitForMultipleObjects(0, NULL, FALSE, timeout, QS_ALLINPUT);
+    return result == WAIT_OBJECT_0;
+}
@@ -1,6 +1,9 @@
 // Platform includes
 #include <linux/limits.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include <errno.h>
@@ -30,6 +33,24 @@
 // You will also see other X11 applications' traffic if they are launched with
 // the same DISPLAY string.
 
+// If the Xserver supports the MIT-SHM extension, the back buffer is allocated
+// in a SysV shared memory segment that the Xserver also maps. Presenting a
+// frame is then a single ShmPutImage request and no pixel data is sent down
+// the socket. There are two segments, so that the app can draw the next frame
+// while the Xserver is still reading the last one. If the extension is missing, or the Xserver refuses to attach
+// our segment (eg because it is on another machine), we fall back to sending
+// the pixels with PutImage. To test with no real display:
+//    Xvfb :1 &
+//    DISPLAY=:1 ./benchmark
+
+// Requests aren't written to the socket as soon as they are made. Small ones
+// are appended to sendBuf and the whole lot is written in one go when we next
+// need something from the Xserver: a reply, the next batch of events or the
+// end of a frame. PutImage requests are written straight from the back buffer
+// with writev(), along with anything already queued. If the Xserver has the
+// BIG-REQUESTS extension, a PutImage can be much bigger than the normal 256KB
+// limit, so most frames only need one.
+
 
 
 //
@@ -38,11 +59,27 @@
 enum {
     X11_OPCODE_CREATE_WINDOW = 1,
     X11_OPCODE_MAP_WINDOW = 8,
+    X11_OPCODE_CONFIGURE_WINDOW = 12,
     X11_OPCODE_CHANGE_PROPERTY = 18,
     X11_OPCODE_SET_SELECTION_OWNER = 22,
+    X11_OPCODE_GET_INPUT_FOCUS = 43,
     X11_OPCODE_QUERY_KEYMAP = 44,
+    X11_OPCODE_CREATE_PIXMAP = 53,
+    X11_OPCODE_FREE_PIXMAP = 54,
     X11_OPCODE_CREATE_GC = 55,
+    X11_OPCODE_FREE_GC = 60,
+    X11_OPCODE_COPY_AREA = 62,
     X11_OPCODE_PUT_IMAGE = 72,
+    X11_OPCODE_QUERY_EXTENSION = 98,
+
+    // Minor opcode of the BIG-REQUESTS extension's only request.
+    X11_BIG_REQUESTS_OPCODE_ENABLE = 0,
+
+    // Minor opcodes of the MIT-SHM extension. The major opcode is assigned
+    // by the Xserver and is returned by QueryExtension.
+    X11_SHM_OPCODE_ATTACH = 1,
+    X11_SHM_OPCODE_DETACH = 2,
+    X11_SHM_OPCODE_PUT_IMAGE = 3,
 
     X11_EVENT_CODE_SELECTION_NOTIFY = 31,
 
@@ -62,6 +99,7 @@ enum {
     X11_EVENT_LEAVEWINDOW = 0x20,
     X11_EVENT_POINTERMOTION = 0x40,
     X11_EVENT_POINTERMOTIONHINT = 0x80,
+    X11_EVENT_EXPOSURE = 0x8000,
     X11_EVENT_STRUCTURE_NOTIFY = 0x20000,
 //     X11_EVENT_RESIZEREDIRECT = 0x40000,
     X11_EVENT_FOCUSCHANGE = 0x200000,
@@ -157,11 +195,35 @@ typedef struct __attribute__((packed)) {
 //
 
 
-struct WindowPlatformSpecific {
+// The connection to the Xserver. There is only one and it is shared by all the
+// windows and the clipboard functions. It is opened the first time one of them
+// needs it and stays open until the process exits.
+struct X11Connection {
     int socketFd;
+
+    // Messages from the Xserver are read in place. recvMsg points at the
+    // first one that hasn't been consumed and recvBufNumBytesAvailable counts
+    // from there. See ReadFromXServer().
     unsigned char recvBuf[10000];
+    unsigned char *recvMsg;
     int recvBufNumBytesAvailable;
 
+    // Requests waiting to be written to the socket. See QueueRequest().
+    // sendMutex is held while sendBuf is changed or anything is written to
+    // the socket, because async present threads send PutImage requests too.
+    // See EnableAsyncPresent().
+    unsigned char sendBuf[16384];
+    int sendBufNumBytes;
+    DfMutex *sendMutex;
+    int numAsyncPresentWindows;
+
+    // The longest request the Xserver accepts, in 4-byte units. If
+    // bigRequestsEnabled, requests longer than 65535 units have a zero in
+    // their 16-bit length field and the real length in an extra 32-bit word
+    // after it.
+    uint32_t maxRequestLenWords;
+    bool bigRequestsEnabled;
+
     connectionReplyHeader_t connectionReplyHeader;
     connectionReplySuccessBody_t *connectionReplySuccessBody;
 
@@ -169,8 +231,6 @@ struct WindowPlatformSpecific {
     screen_t *screens; // Points into connectionReplySuccessBody.
 
     uint32_t nextResourceId;
-    uint32_t graphicsContextId;
-    uint32_t windowId;
 
     // Atom values.
     int clipboardId;
@@ -180,21 +240,79 @@ struct WindowPlatformSpecific {
     int wmDeleteWindowId;
     int wmProtocolsId;
 
+    // MIT-SHM state. shmMajorOpcode is 0 if the Xserver doesn't have the
+    // extension. shmAvailable becomes false if the Xserver rejects one of
+    // our shm requests.
+    uint8_t shmMajorOpcode;
+    uint8_t shmCompletionEventCode;
+    bool shmAvailable;
+
+    // All the windows that haven't been destroyed, linked through
+    // WindowPlatformSpecific::nextWindow. Events are passed to the window
+    // whose id they contain.
+    DfWindow *windows;
+
+    // An unmapped window that owns the CLIPBOARD selection when we have set
+    // its contents, and that the contents are delivered to when we request
+    // them. Zero until the clipboard is first used.
+    uint32_t clipboardWindowId;
+
     char *clipboardRxData;  // NULL except between calls of X11InternalClipboardRequestData() and ClipboardReleaseReceivedData()
     char *clipboardTxData;
     unsigned clipboardTxDataNumChars;
 };
 
 
-// Not a visible window. Just used to store a connection to the XServer. Used
-// for things like GetDesktopRes() and the clipboard routines which need to
-// even if not real window exists.
-static DfWindow g_fakeWindow = { 0 };
+// A ServerImageDraw() that will be sent as a CopyArea from the image's pixmap
+// by the next UpdateWin().
+struct QueuedCopyArea {
+    uint32_t pixmapId;
+    int srcX;
+    int srcY;
+    DfRect dst;
+};
+
+
+// One of the two shared memory segments behind an MIT-SHM back buffer.
+struct ShmSegment {
+    uint32_t segId;             // Xserver's id for the segment, or 0.
+    DfColour *pixels;
+    bool completionPending;     // True between sending ShmPutImage and receiving ShmCompletion.
+};
+
+
+struct WindowPlatformSpecific {
+    uint32_t windowId;
+    uint32_t graphicsContextId;
+    uint32_t scrollGraphicsContextId;   // Has graphics-exposures on. See BlitBitmapToWindow().
+    DfWindow *nextWindow;
+
+    QueuedCopyArea *copyAreas;
+    int numCopyAreas;
+    int maxCopyAreas;
+
+    int numEventsHandled;   // Since the last InputPoll().
+
+    // If the back buffer is shm backed, win->bmp->pixels points into
+    // shm[shmCurrent]. UpdateWin() presents that segment and moves win->bmp
+    // to the other one, so the app can draw while the Xserver reads.
+    ShmSegment shm[2];
+    int shmCurrent;
+
+    // Size from the last ConfigureNotify event. The back buffer is resized
+    // by the next InputPoll().
+    bool resizePending;
+    int newWidth;
+    int newHeight;
+};
+
+
+static X11Connection *g_x11 = NULL;
 
 
-static void ReceiveClipboardData(DfWindow *);
-static void SendChangePropertyRequest(WindowPlatformSpecific *, uint32_t destWindow, uint32_t target, uint32_t property);
-static void SendSendEventSelectionNotify(WindowPlatformSpecific *, uint32_t destWindow, uint32_t target, uint32_t property, uint32_t time);
+static void ReceiveClipboardData(X11Connection *x11);
+static void SendChangePropertyRequest(X11Connection *x11, uint32_t destWindow, uint32_t target, uint32_t property);
+static void SendSendEventSelectionNotify(X11Connection *x11, uint32_t destWindow, uint32_t target, uint32_t property, uint32_t time);
 
 
 static int x11KeycodeToDfKeycode(int i) {
@@ -421,11 +539,23 @@ static char dfKeycodeToAscii(unsigned char keycode, char modifiers) {
 // 2. In combination with ConsumeMessage, it allows PDUs that are split across
 // a recv() to be remerged into a single contiguous block.
 //
+// ConsumeMessage() just moves recvMsg forwards, so all the messages from one
+// recv() are handled without copying. The only copy is here, when the free
+// space at the end of the buffer runs low: the few bytes of a PDU that
+// didn't fully arrive are moved back to the start.
+//
 // Returns the number of bytes received.
-static int ReadFromXServer(WindowPlatformSpecific *platSpec) {
-    unsigned char *buf = platSpec->recvBuf + platSpec->recvBufNumBytesAvailable;
-    ssize_t bufLen = sizeof(platSpec->recvBuf) - platSpec->recvBufNumBytesAvailable;
-    ssize_t numBytesRecvd = recv(platSpec->socketFd, buf, bufLen, 0);
+static int ReadFromXServer(X11Connection *x11) {
+    unsigned char *bufEnd = x11->recvBuf + sizeof(x11->recvBuf);
+    unsigned char *buf = x11->recvMsg + x11->recvBufNumBytesAvailable;
+    if (bufEnd - buf < (ssize_t)sizeof(x11->recvBuf) / 4) {
+        memmove(x11->recvBuf, x11->recvMsg, x11->recvBufNumBytesAvailable);
+        x11->recvMsg = x11->recvBuf;
+        buf = x11->recvBuf + x11->recvBufNumBytesAvailable;
+    }
+
+    ssize_t bufLen = bufEnd - buf;
+    ssize_t numBytesRecvd = recv(x11->socketFd, buf, bufLen, 0);
     if (numBytesRecvd == 0) {
         // Treat this as a FATAL_ERROR because if it happened when we were
         // doing a write to the socket, we'd get a SIGPIPE fatal exception. In
@@ -444,104 +574,230 @@ static int ReadFromXServer(WindowPlatformSpecific *platSpec) {
         return 0;
     }
 
-    platSpec->recvBufNumBytesAvailable += numBytesRecvd;
+    x11->recvBufNumBytesAvailable += numBytesRecvd;
 
     return numBytesRecvd;
 }
 
 
-static void ConsumeMessage(WindowPlatformSpecific *platSpec, int len) {
-    memmove(platSpec->recvBuf, platSpec->recvBuf + len, platSpec->recvBufNumBytesAvailable - len);
-    platSpec->recvBufNumBytesAvailable -= len;
-    if (platSpec->recvBufNumBytesAvailable > sizeof(platSpec->recvBuf)) {
+static void ConsumeMessage(X11Connection *x11, int len) {
+    if (len < 0 || len > x11->recvBufNumBytesAvailable) {
         FATAL_ERROR("bad num bytes");
     }
+
+    x11->recvMsg += len;
+    x11->recvBufNumBytesAvailable -= len;
+    if (x11->recvBufNumBytesAvailable == 0)
+        x11->recvMsg = x11->recvBuf;
 }
 
 
-static void SendBuf(WindowPlatformSpecific *platSpec, const void *_buf, int len) {
-    const char *buf = (const char *)_buf;
-    while (1) {
-        struct pollfd pollFd = { platSpec->socketFd, POLLOUT };
+// Writes all the buffers to the socket, waiting for space if it is full.
+// The iovecs are modified.
+static void SendIovecs(X11Connection *x11, struct iovec *iov, int numIov) {
+    while (numIov > 0) {
+        struct pollfd pollFd = { x11->socketFd, POLLOUT };
         int pollResult = poll(&pollFd, 1, -1);
         if (pollResult == -1)
             FATAL_ERROR("Poll gave an error %i", pollResult);
 
-        int sizeSent = write(platSpec->socketFd, buf, len);
+        ssize_t sizeSent = writev(x11->socketFd, iov, numIov);
         if (sizeSent < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
             FATAL_ERROR("Couldn't send buf");
         }
 
-        len -= sizeSent;
+        // Skip the buffers that were sent completely and move the start of
+        // the first one that wasn't.
+        while (numIov > 0 && sizeSent >= (ssize_t)iov->iov_len) {
+            sizeSent -= iov->iov_len;
+            iov++;
+            numIov--;
+        }
+
+        if (numIov > 0) {
+            iov->iov_base = (char *)iov->iov_base + sizeSent;
+            iov->iov_len -= sizeSent;
+        }
+    }
+}
+
+
+static void SendBuf(X11Connection *x11, const void *buf, int len) {
+    struct iovec iov = { (void *)buf, (size_t)len };
+    SendIovecs(x11, &iov, 1);
+}
 
-        if (len < 0) FATAL_ERROR("SendBuf bug");
-        if (len == 0) break;
 
-        buf += sizeSent;
+// The ...Locked() functions must be called with sendMutex locked.
+static void FlushSendBufLocked(X11Connection *x11) {
+    if (x11->sendBufNumBytes == 0) return;
+    SendBuf(x11, x11->sendBuf, x11->sendBufNumBytes);
+    x11->sendBufNumBytes = 0;
+}
+
+
+static void QueueRequestLocked(X11Connection *x11, const void *buf, int len) {
+    if (x11->sendBufNumBytes + len > (int)sizeof(x11->sendBuf)) {
+        FlushSendBufLocked(x11);
+        if (len > (int)sizeof(x11->sendBuf)) {
+            SendBuf(x11, buf, len);
+            return;
+        }
     }
+
+    memcpy(x11->sendBuf + x11->sendBufNumBytes, buf, len);
+    x11->sendBufNumBytes += len;
 }
 
 
-static void FatalRead(WindowPlatformSpecific *platSpec, void *buf, size_t count) {
-    if (recvfrom(platSpec->socketFd, buf, count, 0, NULL, NULL) != count) {
+static void FlushSendBuf(X11Connection *x11) {
+    MutexLock(x11->sendMutex);
+    FlushSendBufLocked(x11);
+    MutexUnlock(x11->sendMutex);
+}
+
+
+// Appends a request to sendBuf. Nothing is written to the socket until
+// sendBuf is full or FlushSendBuf() is called.
+static void QueueRequest(X11Connection *x11, const void *buf, int len) {
+    MutexLock(x11->sendMutex);
+    QueueRequestLocked(x11, buf, len);
+    MutexUnlock(x11->sendMutex);
+}
+
+
+static void FatalRead(X11Connection *x11, void *buf, size_t count) {
+    if (recvfrom(x11->socketFd, buf, count, 0, NULL, NULL) != count) {
         FATAL_ERROR("Failed to read.");
     }
 }
 
 
-// static void HandleErrorMessage(WindowPlatformSpecific *platSpec) {
+// static void HandleErrorMessage(X11Connection *x11) {
 //     // See https://www.x.org/releases/X11R7.7/doc/xproto/x11protocol.html#Encoding::Errors
 //     printf("Error message from X11 server - ");
-//     switch (platSpec->recvBuf[1]) {
-//         case 2: printf("Bad value. %x %x", platSpec->recvBuf[2], platSpec->recvBuf[3]); break;
+//     switch (x11->recvMsg[1]) {
+//         case 2: printf("Bad value. %x %x", x11->recvMsg[2], x11->recvMsg[3]); break;
 //         case 9: printf("Bad drawable\n"); break;
 //         case 16: printf("Bad length\n"); break;
-//         default: printf("Unknown error code %i\n", platSpec->recvBuf[1]);
+//         default: printf("Unknown error code %i\n", x11->recvMsg[1]);
 //     }
 //     exit(-1);
 // }
 
 
-static bool IsEventPending(WindowPlatformSpecific *platSpec) {
-    if (platSpec->recvBufNumBytesAvailable >= 2 && platSpec->recvBuf[0] == 0)
-        return true; // Error message event is pending.
+// Errors and events are always 32 bytes long.
+static bool IsEventPending(X11Connection *x11) {
+    if (x11->recvBufNumBytesAvailable < 32)
+        return false;
 
-    if (platSpec->recvBuf[0] == 1)
+    if (x11->recvMsg[0] == 1)
         return false;   // Reply is pending.
 
-    if (platSpec->recvBufNumBytesAvailable >= 32)
-        return true;
+    return true;
+}
 
-    return false;
+
+static uint32_t GetU32FromRecvBuf(X11Connection *x11, int offset) {
+    return x11->recvMsg[offset] +
+        (x11->recvMsg[offset + 1] << 8) +
+        (x11->recvMsg[offset + 2] << 16) +
+        (x11->recvMsg[offset + 3] << 24);
 }
 
 
-static uint32_t GetU32FromRecvBuf(WindowPlatformSpecific *platSpec, int offset) {
-    return platSpec->recvBuf[offset] +
-        (platSpec->recvBuf[offset + 1] << 8) +
-        (platSpec->recvBuf[offset + 2] << 16) +
-        (platSpec->recvBuf[offset + 3] << 24);
+static DfWindow *FindWindow(X11Connection *x11, uint32_t windowId) {
+    for (DfWindow *win = x11->windows; win; win = win->_private->platSpec->nextWindow) {
+        if (win->_private->platSpec->windowId == windowId)
+            return win;
+    }
+
+    return NULL;
 }
 
 
-static void HandleEvent(DfWindow *win) {
-    WindowPlatformSpecific *platSpec = win->_private->platSpec;
-    if (platSpec->recvBuf[0] == 1) {
+// Returns the id of the window that the pending event is about, or 0 if the
+// event isn't about a window.
+static uint32_t GetEventWindowId(X11Connection *x11) {
+    uint8_t eventCode = x11->recvMsg[0] & 0x7f;
+    if (x11->shmMajorOpcode && eventCode == x11->shmCompletionEventCode)
+        return GetU32FromRecvBuf(x11, 4); // Drawable.
+
+    switch (eventCode) {
+    case 2: case 3: case 4: case 5: case 6: // Key, button and pointer motion events.
+        return GetU32FromRecvBuf(x11, 12);
+    case 9: case 10: case 12: case 13: case 14: case 22: case 33: // Focus, expose, configure and client message events.
+        return GetU32FromRecvBuf(x11, 4);
+    }
+
+    return 0;
+}
+
+
+static void HandleEvent(X11Connection *x11) {
+    if (x11->recvMsg[0] == 1) {
         FATAL_ERROR("Got unexpected reply.");
     }
 
     bool selectionNotifyReceived = false;
 
-    platSpec->recvBuf[0] &= 0x7f; // Clear the seemingly useless "Generated" flag.
+    // Events for windows that have been destroyed can still be in flight.
+    uint32_t windowId = GetEventWindowId(x11);
+    DfWindow *win = NULL;
+    if (windowId) {
+        win = FindWindow(x11, windowId);
+        if (!win || (x11->recvMsg[0] & 0x7f) == 14) { // 14 is NoExpose, which means there's nothing to do.
+            ConsumeMessage(x11, 32);
+            return;
+        }
+    }
+
+    x11->recvMsg[0] &= 0x7f; // Clear the seemingly useless "Generated" flag.
+
+    // ShmCompletion events come back for every frame we present, so they
+    // aren't counted. Otherwise InputPoll() would always say there had been
+    // events.
+    if (x11->shmMajorOpcode && x11->recvMsg[0] == x11->shmCompletionEventCode) {
+        // ShmCompletion event. The Xserver has finished reading a segment.
+        // Events for segments that a resize has freed match neither.
+        uint32_t segId = GetU32FromRecvBuf(x11, 12);
+        for (int i = 0; i < 2; i++) {
+            ShmSegment *seg = &win->_private->platSpec->shm[i];
+            if (seg->segId == segId)
+                seg->completionPending = false;
+        }
+        ConsumeMessage(x11, 32);
+        return;
+    }
+
+    if (win)
+        win->_private->platSpec->numEventsHandled++;
+
+    switch (x11->recvMsg[0]) {
+    case 0: // Error.
+        if (x11->shmMajorOpcode && x11->recvMsg[10] == x11->shmMajorOpcode) {
+            printf("MIT-SHM request failed (error code %d). Falling back to PutImage.\n",
+                x11->recvMsg[1]);
+            x11->shmAvailable = false;
+            for (DfWindow *w = x11->windows; w; w = w->_private->platSpec->nextWindow) {
+                w->_private->platSpec->shm[0].completionPending = false;
+                w->_private->platSpec->shm[1].completionPending = false;
+            }
+        }
+        else {
+            printf("Got an unknown message type (%d).\n", x11->recvMsg[0]);
+        }
+        break;
 
-    switch (platSpec->recvBuf[0]) {
     case 2: // KeyPress event.
         {
-            unsigned char x11_keycode = platSpec->recvBuf[1];
+            unsigned char x11_keycode = x11->recvMsg[1];
             unsigned char df_keycode = x11KeycodeToDfKeycode(x11_keycode);
             win->_private->newKeyDowns[df_keycode] = 1;
             win->input.keys[df_keycode] = 1;
-            int modifiers = platSpec->recvBuf[28];
+            int modifiers = x11->recvMsg[28];
             char ascii = dfKeycodeToAscii(df_keycode, modifiers);
     //printf("Key down. x11_keycode:%i. df_keycode:%i. Ascii:%c. Modifiers: 0x%x\n", x11_keycode, df_keycode, ascii, modifiers);
 
@@ -554,7 +810,7 @@ static void HandleEvent(DfWindow *win) {
 
     case 3: // KeyRelease event.
         {
-            unsigned char x11_keycode = platSpec->recvBuf[1];
+            unsigned char x11_keycode = x11->recvMsg[1];
             unsigned char df_keycode = x11KeycodeToDfKeycode(x11_keycode);
             win->_private->newKeyUps[df_keycode] = 1;
             win->input.keys[df_keycode] = 0;
@@ -563,7 +819,7 @@ static void HandleEvent(DfWindow *win) {
         }
 
     case 4: // Mouse down button event (includes scroll motion).
-        switch (platSpec->recvBuf[1]) {
+        switch (x11->recvMsg[1]) {
             case 1:
                 win->input.lmb = 1;
                 win->_private->lmbPrivate = true;
@@ -573,11 +829,11 @@ static void HandleEvent(DfWindow *win) {
             case 4: win->input.mouseZ++; break;
             case 5: win->input.mouseZ--; break;
         }
-        //printf("down:%i\n", platSpec->recvBuf[1]);
+        //printf("down:%i\n", x11->recvMsg[1]);
         break;
 
     case 5: // Mouse button up event.
-        switch (platSpec->recvBuf[1]) {
+        switch (x11->recvMsg[1]) {
             case 1:
                 win->input.lmb = 0;
                 win->_private->lmbPrivate = false;
@@ -585,14 +841,14 @@ static void HandleEvent(DfWindow *win) {
             case 2: win->input.mmb = 0; break;
             case 3: win->input.rmb = 0; break;
         }
-        //printf("up:%i\n", platSpec->recvBuf[1]);
+        //printf("up:%i\n", x11->recvMsg[1]);
         break;
 
     case 6: // Pointer motion event.
         {
-            int16_t *x = (int16_t*)&platSpec->recvBuf[24];
-            int16_t *y = (int16_t*)&platSpec->recvBuf[26];
-            //printf("detail:%i rx=%i ry=%i\n", platSpec->recvBuf[1], *x, *y);
+            int16_t *x = (int16_t*)&x11->recvMsg[24];
+            int16_t *y = (int16_t*)&x11->recvMsg[26];
+            //printf("detail:%i rx=%i ry=%i\n", x11->recvMsg[1], *x, *y);
             win->input.mouseX = *x;
             win->input.mouseY = *y;
             break;
@@ -606,12 +862,34 @@ static void HandleEvent(DfWindow *win) {
         HandleFocusOutEvent(win);
         break;
 
+    case 12: // Expose event.
+        {
+            // Part of the window needs to be redrawn. The back buffer still
+            // has the right pixels, so mark them to be re-sent. There is no
+            // back buffer yet if this arrived while CreateWinPos() was
+            // waiting for the Xserver, but then nothing has been drawn.
+            uint16_t *rect = (uint16_t *)&x11->recvMsg[8];
+            if (win->bmp)
+                BitmapAddDamage(win->bmp, rect[0], rect[1], rect[2], rect[3]);
+            break;
+        }
+
+    case 13: // Graphics expose event.
+        {
+            // Part of the source of a scroll copy wasn't visible, so the
+            // destination didn't get the right pixels. Send them next time.
+            uint16_t *rect = (uint16_t *)&x11->recvMsg[8];
+            if (win->bmp)
+                BitmapAddDamage(win->bmp, rect[0], rect[1], rect[2], rect[3]);
+            break;
+        }
+
     case 22: // Configure notify event.
         {
-            int w = platSpec->recvBuf[20] + (platSpec->recvBuf[21] << 8);
-            int h = platSpec->recvBuf[22] + (platSpec->recvBuf[23] << 8);
-            BitmapDelete(win->bmp);
-            win->bmp = BitmapCreate(w, h);
+            WindowPlatformSpecific *platSpec = win->_private->platSpec;
+            platSpec->newWidth = x11->recvMsg[20] + (x11->recvMsg[21] << 8);
+            platSpec->newHeight = x11->recvMsg[22] + (x11->recvMsg[23] << 8);
+            platSpec->resizePending = true;
 //             if (win->redrawCallback) {
 //                 win->redrawCallback();
 //             }
@@ -620,17 +898,17 @@ static void HandleEvent(DfWindow *win) {
 
     case 30: // Selection Request
         {
-            uint32_t time = GetU32FromRecvBuf(platSpec, 4);
-            uint32_t requestor = GetU32FromRecvBuf(platSpec, 12);
-            uint32_t selection = GetU32FromRecvBuf(platSpec, 16);
-            ReleaseAssert(selection == platSpec->clipboardId, "selection was %x", selection);
-            uint32_t target = GetU32FromRecvBuf(platSpec, 20);
-            uint32_t property = GetU32FromRecvBuf(platSpec, 24);
+            uint32_t time = GetU32FromRecvBuf(x11, 4);
+            uint32_t requestor = GetU32FromRecvBuf(x11, 12);
+            uint32_t selection = GetU32FromRecvBuf(x11, 16);
+            ReleaseAssert(selection == x11->clipboardId, "selection was %x", selection);
+            uint32_t target = GetU32FromRecvBuf(x11, 20);
+            uint32_t property = GetU32FromRecvBuf(x11, 24);
             printf("Recv'd Selection request. Time=%x Requestor=%x target=%x property=%x\n",
                 time, requestor, target, property);
 
-            SendChangePropertyRequest(platSpec, requestor, target, property);
-            SendSendEventSelectionNotify(platSpec, requestor, target, property, time);
+            SendChangePropertyRequest(x11, requestor, target, property);
+            SendSendEventSelectionNotify(x11, requestor, target, property, time);
         }
         break;
 
@@ -648,24 +926,26 @@ static void HandleEvent(DfWindow *win) {
         break;
 
     default:
-        printf("Got an unknown message type (%d).\n", platSpec->recvBuf[0]);
+        printf("Got an unknown message type (%d).\n", x11->recvMsg[0]);
     }
 
-    ConsumeMessage(platSpec, 32);
+    ConsumeMessage(x11, 32);
 
     if (selectionNotifyReceived) {
-        ReceiveClipboardData(win);
+        ReceiveClipboardData(x11);
     }
 }
 
 
-static bool HandleEvents(DfWindow *win) {
-    WindowPlatformSpecific *platSpec = win->_private->platSpec;
-    ReadFromXServer(platSpec);
+// Handles the events for all the windows. Returns true if there were any.
+static bool HandleEvents(X11Connection *x11) {
+    // Anything we're waiting for might depend on requests we haven't sent yet.
+    FlushSendBuf(x11);
+    ReadFromXServer(x11);
 
     bool rv = false;
-    while (IsEventPending(platSpec)) {
-        HandleEvent(win);
+    while (IsEventPending(x11)) {
+        HandleEvent(x11);
         rv = true;
     }
 
@@ -677,17 +957,50 @@ static bool HandleEvents(DfWindow *win) {
 // we are waiting for a response.
 //
 // Returns true if an event was found and false otherwise.
-static bool GetReply(DfWindow *win, int expectedLen) {
-    HandleEvents(win);
+static bool GetReply(X11Connection *x11, int expectedLen) {
+    HandleEvents(x11);
 
-    WindowPlatformSpecific *platSpec = win->_private->platSpec;
-    if (platSpec->recvBuf[0] == 1 && platSpec->recvBufNumBytesAvailable >= expectedLen)
+    if (x11->recvMsg[0] == 1 && x11->recvBufNumBytesAvailable >= expectedLen)
         return true;
 
     return false;
 }
 
 
+// Sends a request that the Xserver must reply to and waits for the reply. Any
+// events that arrive first are handled as normal. Returns false if the Xserver
+// sent an error message in the meantime. This is how we find out whether a
+// request that has no reply of its own was successful.
+static bool SyncWithXServer(X11Connection *x11) {
+    uint32_t packet[1];
+    packet[0] = X11_OPCODE_GET_INPUT_FOCUS | (1<<16);
+    QueueRequest(x11, packet, sizeof(packet));
+    FlushSendBuf(x11);
+
+    bool errorReceived = false;
+    while (1) {
+        if (x11->recvBufNumBytesAvailable < 32) {
+            struct pollfd pollFd = { x11->socketFd, POLLIN };
+            poll(&pollFd, 1, -1);
+            ReadFromXServer(x11);
+            continue;
+        }
+
+        switch (x11->recvMsg[0]) {
+        case 0: // Error.
+            errorReceived = true;
+            ConsumeMessage(x11, 32);
+            break;
+        case 1: // Reply to our GetInputFocus.
+            ConsumeMessage(x11, 32);
+            return !errorReceived;
+        default:
+            HandleEvent(x11);
+        }
+    }
+}
+
+
 // ****************************************************************************
 // End of socket handling code.
 // ****************************************************************************
@@ -699,13 +1012,13 @@ static void MapWindow(DfWindow *win) {
     uint32_t packet[len];
     packet[0] = X11_OPCODE_MAP_WINDOW | (len<<16);
     packet[1] = platSpec->windowId;
-    SendBuf(platSpec, packet, 8);
+    QueueRequest(g_x11, packet, sizeof(packet));
 }
 
 
-static int GetAtomId(DfWindow *win, char const *atomName) {
+static void SendInternAtomRequest(X11Connection *x11, char const *atomName) {
     int atomNameLen = strlen(atomName);
-    if (atomNameLen > 19) return 0;
+    ReleaseAssert(atomNameLen <= 19, "Atom name '%s' too long", atomName);
 
     int requestLenWords = (11 + atomNameLen) / 4;
     int requestLenBytes = requestLenWords * 4;
@@ -716,30 +1029,238 @@ static int GetAtomId(DfWindow *win, char const *atomName) {
     packet[4] = atomNameLen; // Atom name len in bytes.
     memcpy(packet + 8, atomName, atomNameLen);
 
-    WindowPlatformSpecific *platSpec = win->_private->platSpec;
-    SendBuf(platSpec, packet, requestLenBytes);
+    QueueRequest(x11, packet, requestLenBytes);
+}
+
+
+// name must be less than 24 chars.
+static void SendQueryExtensionRequest(X11Connection *x11, char const *name) {
+    int const nameLen = strlen(name);
+    int const requestLenWords = 2 + (nameLen + 3) / 4;
+    uint8_t packet[32] = { 0 };
+    packet[0] = X11_OPCODE_QUERY_EXTENSION;
+    packet[2] = requestLenWords;
+    packet[4] = nameLen;
+    memcpy(packet + 8, name, nameLen);
+
+    QueueRequest(x11, packet, requestLenWords * 4);
+}
+
+
+// Waits for the next reply and returns its sequence number. The Xserver
+// replies in the order that it received the requests. The caller must
+// consume the reply.
+static uint16_t WaitForReply(X11Connection *x11) {
+    while (!GetReply(x11, 32)) {
+        struct pollfd pollFd = { x11->socketFd, POLLIN };
+        poll(&pollFd, 1, -1);
+    }
 
-    while (!GetReply(win, 32))
-        ;
+    return x11->recvMsg[2] | (x11->recvMsg[3] << 8);
+}
+
+
+static uint32_t generateId(X11Connection *x11) {
+    return x11->nextResourceId++;
+}
 
-    uint16_t *id = (uint16_t *)(platSpec->recvBuf + 8);
 
-    ConsumeMessage(platSpec, 32);
+static void EnableBigRequests(X11Connection *x11, uint8_t majorOpcode) {
+    uint32_t packet[1];
+    packet[0] = majorOpcode | (X11_BIG_REQUESTS_OPCODE_ENABLE << 8) | (1<<16);
+    QueueRequest(x11, packet, sizeof(packet));
 
-    return *id;
+    WaitForReply(x11);
+    x11->maxRequestLenWords = GetU32FromRecvBuf(x11, 8);
+    x11->bigRequestsEnabled = true;
+    ConsumeMessage(x11, 32);
 }
 
 
-static uint32_t generateId(DfWindow *win) {
+// Asks for the extensions and atoms we need in one batch, so that they cost
+// one round trip instead of one each. These are the first requests on the
+// connection, so their sequence numbers start at 1.
+static void QueryExtensionsAndAtoms(X11Connection *x11) {
+    char const *atomNames[] = {
+        "CLIPBOARD", "STRING", "XSEL_DATA", "TARGETS", "WM_DELETE_WINDOW", "WM_PROTOCOLS"
+    };
+    int *atomIds[] = {
+        &x11->clipboardId, &x11->stringId, &x11->xselDataId, &x11->targetsId,
+        &x11->wmDeleteWindowId, &x11->wmProtocolsId
+    };
+    int const numAtoms = sizeof(atomNames) / sizeof(atomNames[0]);
+
+    enum { SEQ_SHM = 1, SEQ_BIG_REQUESTS, SEQ_FIRST_ATOM };
+    SendQueryExtensionRequest(x11, "MIT-SHM");
+    SendQueryExtensionRequest(x11, "BIG-REQUESTS");
+    for (int i = 0; i < numAtoms; i++)
+        SendInternAtomRequest(x11, atomNames[i]);
+
+    uint8_t bigRequestsOpcode = 0;
+    int const numReplies = SEQ_FIRST_ATOM - 1 + numAtoms;
+    for (int i = 0; i < numReplies; i++) {
+        uint16_t seq = WaitForReply(x11);
+        bool present = x11->recvMsg[8];
+        if (seq == SEQ_SHM) {
+            if (present) {
+                x11->shmMajorOpcode = x11->recvMsg[9];
+                x11->shmCompletionEventCode = x11->recvMsg[10]; // ShmCompletion is the extension's first event.
+                x11->shmAvailable = true;
+            }
+        }
+        else if (seq == SEQ_BIG_REQUESTS) {
+            if (present)
+                bigRequestsOpcode = x11->recvMsg[9];
+        }
+        else if (seq >= SEQ_FIRST_ATOM && seq < SEQ_FIRST_ATOM + numAtoms) {
+            *atomIds[seq - SEQ_FIRST_ATOM] = GetU32FromRecvBuf(x11, 8);
+        }
+        else {
+            FATAL_ERROR("Got reply with unexpected sequence number %d", seq);
+        }
+        ConsumeMessage(x11, 32);
+    }
+
+    // This needs the opcode from the batch, so it costs another round trip.
+    if (bigRequestsOpcode)
+        EnableBigRequests(x11, bigRequestsOpcode);
+}
+
+
+// Creates a shared memory segment and asks the Xserver to attach to it. The
+// caller finds out whether that worked with SyncWithXServer().
+static bool CreateShmSegment(X11Connection *x11, ShmSegment *seg, int numBytes) {
+    int shmId = shmget(IPC_PRIVATE, numBytes, IPC_CREAT | 0600);
+    if (shmId < 0)
+        return false;
+
+    void *shmAddr = shmat(shmId, NULL, 0);
+    if (shmAddr == (void *)-1) {
+        shmctl(shmId, IPC_RMID, NULL);
+        return false;
+    }
+
+    seg->segId = generateId(x11);
+    seg->pixels = (DfColour *)shmAddr;
+    seg->completionPending = false;
+
+    int const len = 4;
+    uint32_t packet[len];
+    packet[0] = x11->shmMajorOpcode | (X11_SHM_OPCODE_ATTACH << 8) | (len<<16);
+    packet[1] = seg->segId;
+    packet[2] = shmId;
+    packet[3] = 1; // Read-only.
+    QueueRequest(x11, packet, sizeof(packet));
+
+    // The segment isn't freed until both we and the Xserver have detached,
+    // and the Xserver attaches before it handles the next request, so it
+    // can be marked for deletion now. That way it is freed even if we crash.
+    shmctl(shmId, IPC_RMID, NULL);
+    return true;
+}
+
+
+// Creates a bitmap to use as the back buffer. If possible, its pixels are put
+// in two shared memory segments that the Xserver has attached to.
+static DfBitmap *CreateBackBuffer(DfWindow *win, int width, int height) {
+    X11Connection *x11 = g_x11;
     WindowPlatformSpecific *platSpec = win->_private->platSpec;
-    return platSpec->nextResourceId++;
+    if (!x11->shmAvailable || width <= 0 || height <= 0)
+        return BitmapCreate(width, height);
+
+    // Pad rows to 64 bytes, like BitmapCreate() does.
+    int stride = (width + 15) & ~15;
+    int numBytes = stride * height * sizeof(DfColour);
+    ShmSegment *shm = platSpec->shm;
+    memset(shm, 0, sizeof(platSpec->shm));
+    bool created = CreateShmSegment(x11, &shm[0], numBytes) &&
+                   CreateShmSegment(x11, &shm[1], numBytes);
+    bool attached = created && SyncWithXServer(x11);
+
+    if (!attached) {
+        if (created)
+            printf("Xserver couldn't attach shared memory segment. Falling back to PutImage.\n");
+        for (int i = 0; i < 2; i++) {
+            if (shm[i].pixels)
+                shmdt(shm[i].pixels);
+        }
+        memset(shm, 0, sizeof(platSpec->shm));
+        x11->shmAvailable = false;
+        return BitmapCreate(width, height);
+    }
+
+    platSpec->shmCurrent = 0;
+    return BitmapWrap(shm[0].pixels, width, height, stride);
 }
 
 
-// Initialize the connection to the Xserver if we haven't already.
-static void ConnectToXserver(DfWindow *win) {
+static void DeleteBackBuffer(DfWindow *win) {
+    X11Connection *x11 = g_x11;
     WindowPlatformSpecific *platSpec = win->_private->platSpec;
-    if (platSpec->socketFd >= 0) return;
+
+    // Requests are handled in order, so a ShmPutImage that is still in
+    // flight finishes before the Xserver detaches.
+    for (int i = 0; i < 2; i++) {
+        ShmSegment *seg = &platSpec->shm[i];
+        if (!seg->segId)
+            continue;
+
+        if (x11->shmAvailable) {
+            int const len = 2;
+            uint32_t packet[len];
+            packet[0] = x11->shmMajorOpcode | (X11_SHM_OPCODE_DETACH << 8) | (len<<16);
+            packet[1] = seg->segId;
+            QueueRequest(x11, packet, sizeof(packet));
+        }
+
+        shmdt(seg->pixels);
+    }
+
+    memset(platSpec->shm, 0, sizeof(platSpec->shm));
+    BitmapDelete(win->bmp);
+    win->bmp = NULL;
+}
+
+
+// Resizing the back buffer may need a round trip to the Xserver, so it can't
+// be done from inside HandleEvent(). Moving the window also sends a
+// ConfigureNotify, but then the back buffer is left alone.
+static void ApplyPendingResize(DfWindow *win) {
+    WindowPlatformSpecific *platSpec = win->_private->platSpec;
+    if (!platSpec->resizePending) return;
+
+    platSpec->resizePending = false;
+    if (win->bmp->width == platSpec->newWidth && win->bmp->height == platSpec->newHeight)
+        return;
+
+    bool trackDamage = win->bmp->damage != NULL;
+    DeleteBackBuffer(win);
+    win->bmp = CreateBackBuffer(win, platSpec->newWidth, platSpec->newHeight);
+    BitmapEnableDamageTracking(win->bmp, trackDamage);
+}
+
+
+static void MakeSocketNonBlocking(X11Connection *x11) {
+    // Make socket non-blocking.
+    int flags = fcntl(x11->socketFd, F_GETFL, 0);
+    if (flags == -1) {
+        FATAL_ERROR("Couldn't get flags of socket");
+    }
+    flags |= O_NONBLOCK;
+    if (fcntl(x11->socketFd, F_SETFL, flags) != 0) {
+        FATAL_ERROR("Couldn't set socket as non-blocking");
+    }
+}
+
+
+// Opens the connection to the Xserver if we haven't already.
+static X11Connection *ConnectToXserver() {
+    if (g_x11) return g_x11;
+
+    X11Connection *x11 = new X11Connection;
+    memset(x11, 0, sizeof(X11Connection));
+    x11->recvMsg = x11->recvBuf;
+    x11->sendMutex = MutexCreate();
 
     char *displayString = getenv("DISPLAY");
     char socketName[] = "/tmp/.X11-unix/X0";
@@ -747,14 +1268,14 @@ static void ConnectToXserver(DfWindow *win) {
         socketName[16] = displayString[1];
 
     // Open socket and connect.
-    platSpec->socketFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
-    if (platSpec->socketFd < 0) {
+    x11->socketFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (x11->socketFd < 0) {
         FATAL_ERROR("Create socket failed");
     }
     struct sockaddr_un servAddr = { 0 };
     servAddr.sun_family = AF_UNIX;
     strcpy(servAddr.sun_path, socketName);
-    if (connect(platSpec->socketFd, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0) {
+    if (connect(x11->socketFd, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0) {
         FATAL_ERROR("Couldn't connect");
     }
 
@@ -791,57 +1312,68 @@ static void ConnectToXserver(DfWindow *win) {
     request.minor_version = 0;
     request.auth_proto_name_len = 18;
     request.auth_proto_data_len = 16;
-    SendBuf(platSpec, &request, sizeof(connection_request_t));
-    SendBuf(platSpec, "MIT-MAGIC-COOKIE-1\0\0", 20);
-    SendBuf(platSpec, xauthCookie + xauthLen - 16, 16);
+    struct iovec iov[3] = {
+        { &request, sizeof(connection_request_t) },
+        { (void *)"MIT-MAGIC-COOKIE-1\0\0", 20 },
+        { xauthCookie + xauthLen - 16, 16 }
+    };
+    SendIovecs(x11, iov, 3);
 
     // Read connection reply header.
-    FatalRead(platSpec, &platSpec->connectionReplyHeader, sizeof(connectionReplyHeader_t));
-    if (platSpec->connectionReplyHeader.success == 0) {
+    FatalRead(x11, &x11->connectionReplyHeader, sizeof(connectionReplyHeader_t));
+    if (x11->connectionReplyHeader.success == 0) {
         FATAL_ERROR("Connection reply indicated failure.");
     }
 
     // Read rest of connection reply.
-    platSpec->connectionReplySuccessBody = (connectionReplySuccessBody_t*)new char[platSpec->connectionReplyHeader.len * 4];
-    FatalRead(platSpec, platSpec->connectionReplySuccessBody,
-               platSpec->connectionReplyHeader.len * 4);
+    x11->connectionReplySuccessBody = (connectionReplySuccessBody_t*)new char[x11->connectionReplyHeader.len * 4];
+    FatalRead(x11, x11->connectionReplySuccessBody,
+               x11->connectionReplyHeader.len * 4);
 
     // Set some pointers into the connection reply because they'll be convenient later.
-    int vendorLenPlusPadding = (platSpec->connectionReplySuccessBody->vendor_len + 3) & ~3;
-    platSpec->pixmapFormats = (pixmap_format_t *)(platSpec->connectionReplySuccessBody->vendor_string +
+    int vendorLenPlusPadding = (x11->connectionReplySuccessBody->vendor_len + 3) & ~3;
+    x11->pixmapFormats = (pixmap_format_t *)(x11->connectionReplySuccessBody->vendor_string +
                              vendorLenPlusPadding);
-    platSpec->screens = (screen_t *)(platSpec->pixmapFormats +
-                                  platSpec->connectionReplySuccessBody->num_pixmapFormats);
-
-    platSpec->nextResourceId = platSpec->connectionReplySuccessBody->id_base;
-
-    // Get some Atom ids that we will use later.
-    platSpec->clipboardId = GetAtomId(win, "CLIPBOARD");
-    platSpec->stringId = GetAtomId(win, "STRING");
-    platSpec->xselDataId = GetAtomId(win, "XSEL_DATA");
-    platSpec->targetsId = GetAtomId(win, "TARGETS");
-    platSpec->wmDeleteWindowId = GetAtomId(win, "WM_DELETE_WINDOW");
-    platSpec->wmProtocolsId = GetAtomId(win, "WM_PROTOCOLS");
+    x11->screens = (screen_t *)(x11->pixmapFormats +
+                                  x11->connectionReplySuccessBody->num_pixmapFormats);
+
+    x11->nextResourceId = x11->connectionReplySuccessBody->id_base;
+    x11->maxRequestLenWords = x11->connectionReplySuccessBody->request_max;
+
+    // From here on, several replies can arrive in one recv(). We mustn't
+    // block in recv() while some of them are still in recvBuf.
+    MakeSocketNonBlocking(x11);
+
+    QueryExtensionsAndAtoms(x11);
     printf("Atoms: clipboard=0x%x string=0x%x xsel=0x%x targets=0x%x wmDeleteWindow=0x%x "
         "wmProtocols=0x%x\n",
-        platSpec->clipboardId, platSpec->stringId, platSpec->xselDataId, platSpec->targetsId,
-        platSpec->wmDeleteWindowId, platSpec->wmProtocolsId);
+        x11->clipboardId, x11->stringId, x11->xselDataId, x11->targetsId,
+        x11->wmDeleteWindowId, x11->wmProtocolsId);
 
-    platSpec->windowId = generateId(win);
+    g_x11 = x11;
+    return x11;
 }
 
 
 static void CreateGc(DfWindow *win) {
     WindowPlatformSpecific *platSpec = win->_private->platSpec;
-    platSpec->graphicsContextId = generateId(win);
-    int const len = 4;
+    platSpec->graphicsContextId = generateId(g_x11);
+    int const len = 5;
     uint32_t packet[len];
     packet[0] = X11_OPCODE_CREATE_GC | (len<<16);
     packet[1] = platSpec->graphicsContextId;
     packet[2] = platSpec->windowId;
+    packet[3] = 0x10000; // Value mask = graphics-exposures.
+    packet[4] = 0; // Don't send a NoExpose event for every CopyArea.
+    QueueRequest(g_x11, packet, sizeof(packet));
+
+    // Used for copies within the window, so that we hear about any of the
+    // source that was covered by another window.
+    platSpec->scrollGraphicsContextId = generateId(g_x11);
+    packet[0] = X11_OPCODE_CREATE_GC | (4<<16);
+    packet[1] = platSpec->scrollGraphicsContextId;
     packet[3] = 0; // Value mask.
-
-    SendBuf(platSpec, packet, sizeof(packet));
+    QueueRequest(g_x11, packet, 16);
 }
 
 
@@ -851,6 +1383,7 @@ DfWindow *CreateWin(int width, int height, WindowType winType, char const *winNa
 
 
 static void EnableDeleteWindowEvent(DfWindow *win) {
+    X11Connection *x11 = g_x11;
     WindowPlatformSpecific *platSpec = win->_private->platSpec;
 
     // See InterClient Communication Conventions Manual v2.0. The section
@@ -859,49 +1392,42 @@ static void EnableDeleteWindowEvent(DfWindow *win) {
     uint32_t packet[requestLen];
     packet[0] = X11_OPCODE_CHANGE_PROPERTY | (requestLen << 16);
     packet[1] = platSpec->windowId;
-    packet[2] = platSpec->wmProtocolsId; // Property.
+    packet[2] = x11->wmProtocolsId; // Property.
     packet[3] = 4; // Type = ATOM.
     packet[4] = 32; // Format = 32 bits per item.
     packet[5] = 1; // Length = 1 item.
-    packet[6] = platSpec->wmDeleteWindowId; // Item data.
+    packet[6] = x11->wmDeleteWindowId; // Item data.
 
-    SendBuf(platSpec, packet, sizeof(packet));
+    QueueRequest(x11, packet, sizeof(packet));
 }
 
 
-static void MakeSocketNonBlocking(WindowPlatformSpecific *platSpec) {
-    // Make socket non-blocking.
-    int flags = fcntl(platSpec->socketFd, F_GETFL, 0);
-    if (flags == -1) {
-        FATAL_ERROR("Couldn't get flags of socket");
-    }
-    flags |= O_NONBLOCK;
-    if (fcntl(platSpec->socketFd, F_SETFL, flags) != 0) {
-        FATAL_ERROR("Couldn't set socket as non-blocking");
-    }
-}
+DfWindow *CreateWinPos(int x, int y, int width, int height, WindowType windowed, char const *winName) {
+    if (HeadlessModeEnabled())
+        return CreateWinHeadless(x, y, width, height);
 
+    X11Connection *x11 = ConnectToXserver();
 
-DfWindow *CreateWinPos(int x, int y, int width, int height, WindowType windowed, char const *winName) {
     DfWindow *win = new DfWindow;
     memset(win, 0, sizeof(DfWindow));
     win->_private = new DfWindowPrivate;
     memset(win->_private, 0, sizeof(DfWindowPrivate));
     win->_private->platSpec = new WindowPlatformSpecific;
     memset(win->_private->platSpec, 0, sizeof(WindowPlatformSpecific));
-    win->_private->platSpec->socketFd = -1;
-
-    win->bmp = BitmapCreate(width, height);
-
-    ConnectToXserver(win);
 
     WindowPlatformSpecific *platSpec = win->_private->platSpec;
+    platSpec->windowId = generateId(x11);
+    platSpec->nextWindow = x11->windows;
+    x11->windows = win;
 
+    // All the requests to create the window are queued and then sent in one
+    // go. If the back buffer is in shared memory, they are sent along with
+    // the request to attach it, and cost a single round trip between them.
     int const len = 9;
     uint32_t packet[len];
     packet[0] = X11_OPCODE_CREATE_WINDOW | (len<<16);
     packet[1] = platSpec->windowId;
-    packet[2] = platSpec->screens[0].root_id;
+    packet[2] = x11->screens[0].root_id;
     packet[3] = 0; // x,y pos. System will position window. TODO - use x and y
     packet[4] = width | (height<<16);
     packet[5] = 0; // DEFAULT_BORDER and DEFAULT_GROUP.
@@ -909,15 +1435,16 @@ DfWindow *CreateWinPos(int x, int y, int width, int height, WindowType windowed,
     packet[7] = 0x800; // value_mask = event-mask
     packet[8] = X11_EVENT_KEYPRESS | X11_EVENT_KEYRELEASE | X11_EVENT_POINTERMOTION |
                 X11_EVENT_BUTTONPRESS | X11_EVENT_BUTTONRELEASE | X11_EVENT_STRUCTURE_NOTIFY |
-                X11_EVENT_FOCUSCHANGE;
-    SendBuf(platSpec, packet, sizeof(packet));
+                X11_EVENT_FOCUSCHANGE | X11_EVENT_EXPOSURE;
+    QueueRequest(x11, packet, sizeof(packet));
 
     CreateGc(win);
     MapWindow(win);
     SetWindowTitle(win, winName);
     EnableDeleteWindowEvent(win);
+    win->bmp = CreateBackBuffer(win, width, height);
+    FlushSendBuf(x11);
 
-    MakeSocketNonBlocking(platSpec);
     InitInput(win);
 
     return win;
@@ -925,85 +1452,444 @@ DfWindow *CreateWinPos(int x, int y, int width, int height, WindowType windowed,
 
 
 void DestroyWin(DfWindow *win) {
+    if (win->_private->headless) {
+        DestroyWinHeadless(win);
+        return;
+    }
+
+    DisableAsyncPresent(win);
+
+    X11Connection *x11 = g_x11;
     WindowPlatformSpecific *platSpec = win->_private->platSpec;
+
+    DfWindow **link = &x11->windows;
+    while (*link != win)
+        link = &(*link)->_private->platSpec->nextWindow;
+    *link = platSpec->nextWindow;
+
+    // The connection stays open, so free the Xserver's resources for the
+    // window explicitly.
     uint32_t packet[2] = { 0 };
+    packet[0] = X11_OPCODE_FREE_GC | (2 << 16);
+    packet[1] = platSpec->graphicsContextId;
+    QueueRequest(x11, packet, sizeof(packet));
+    packet[1] = platSpec->scrollGraphicsContextId;
+    QueueRequest(x11, packet, sizeof(packet));
     packet[0] = 4; // OPCODE_DESTROY_WINDOW
     packet[0] |= 2 << 16; // Length
     packet[1] = platSpec->windowId;
-    SendBuf(platSpec, packet, sizeof(packet));
+    QueueRequest(x11, packet, sizeof(packet));
 
-    BitmapDelete(win->bmp);
-    delete[] platSpec->connectionReplySuccessBody;
+    DeleteBackBuffer(win);
+    FlushSendBuf(x11);
+    delete [] platSpec->copyAreas;
     delete win->_private->platSpec;
     delete win->_private;
     delete win;
 }
 
 
-static void BlitBitmapToWindow(DfWindow *win) {
-    WindowPlatformSpecific *platSpec = win->_private->platSpec;
+// Waits until the Xserver has finished reading a segment, so that it can be
+// drawn into again.
+static void WaitForShmCompletion(ShmSegment *seg) {
+    X11Connection *x11 = g_x11;
+    while (1) {
+        HandleEvents(x11);
+        if (!seg->completionPending)
+            break;
+
+        struct pollfd pollFd = { x11->socketFd, POLLIN };
+        poll(&pollFd, 1, -1);
+    }
+}
+
 
-    // *** Send back-buffer to Xserver.
-    int W = win->bmp->width;
+// Asks the Xserver to copy an area of the shared memory back buffer to the
+// window. If sendEvent is true, the Xserver will send a ShmCompletion event
+// when it has finished reading the pixels.
+static void ShmPutImageRect(DfWindow *win, int x, int y, int w, int h, bool sendEvent) {
+    X11Connection *x11 = g_x11;
+    WindowPlatformSpecific *platSpec = win->_private->platSpec;
+    int W = win->bmp->stride;
     int H = win->bmp->height;
-    enum { MAX_BYTES_PER_REQUEST = 65535 }; // Len field is 16-bits
-    int num_rows_in_chunk = (MAX_BYTES_PER_REQUEST - 6) / W; // -6 because of packet header
-    DfColour *row = win->bmp->pixels;
-    for (int y = 0; y < H; y += num_rows_in_chunk) {
-        if (y + num_rows_in_chunk > H) {
-            num_rows_in_chunk = H - y;
-        }
 
-        uint32_t packet[6];
+    int const len = 10;
+    uint32_t packet[len];
+    packet[0] = x11->shmMajorOpcode | (X11_SHM_OPCODE_PUT_IMAGE << 8) | (len<<16);
+    packet[1] = platSpec->windowId;
+    packet[2] = platSpec->graphicsContextId;
+    packet[3] = W | (H << 16); // Total width (including row padding) and height.
+    packet[4] = x | (y << 16); // Src X and Y.
+    packet[5] = w | (h << 16); // Src width and height.
+    packet[6] = x | (y << 16); // Dst X and Y.
+    packet[7] = 24 | (2 << 8) | (sendEvent << 16); // Bit depth, format = ZPixmap, send-event.
+    packet[8] = platSpec->shm[platSpec->shmCurrent].segId;
+    packet[9] = 0; // Offset into segment.
+    QueueRequest(x11, packet, sizeof(packet));
+}
+
+
+// Sends an area of bmp to the same area of a window or pixmap in PutImage
+// requests. Each request, and anything already in sendBuf, is written with a
+// single writev() that points straight at the bitmap's rows. This is called
+// from the async present threads as well as the main thread.
+static void PutImageRect(X11Connection *x11, uint32_t drawable, uint32_t gc,
+                         DfBitmap *bmp, int x, int y, int w, int h) {
+    int headerLenWords = x11->bigRequestsEnabled ? 7 : 6;
+
+    // Other threads can't send anything while a request is being written,
+    // so if there are async present threads, keep the requests short.
+    uint32_t maxRequestLenWords = x11->maxRequestLenWords;
+    if (x11->numAsyncPresentWindows > 0 && maxRequestLenWords > 0xffff)
+        maxRequestLenWords = 0xffff;
+
+    int maxRowsPerRequest = (maxRequestLenWords - headerLenWords) / w;
+    if (maxRowsPerRequest > 0xffff)
+        maxRowsPerRequest = 0xffff; // Height field is 16-bits.
+
+    // Rows that aren't contiguous need an iovec each. If there are more than
+    // fit in iov, they are written in several batches.
+    enum { MAX_IOVECS = 64 };
+    struct iovec iov[MAX_IOVECS];
+
+    int endY = y + h;
+    while (y < endY) {
+        int numRows = IntMin(endY - y, maxRowsPerRequest);
+        uint32_t requestLenWords = w * numRows + headerLenWords;
+
+        uint32_t packet[7];
+        uint32_t *header = packet;
         uint32_t bmp_format = 2 << 8;
-        uint32_t request_len = (uint32_t)(W * num_rows_in_chunk + 6) << 16;
-        packet[0] = X11_OPCODE_PUT_IMAGE | bmp_format | request_len;
-        packet[1] = platSpec->windowId;
-        packet[2] = platSpec->graphicsContextId;
-        packet[3] = W | (num_rows_in_chunk << 16); // Width and height.
-        packet[4] = 0 | (y << 16); // Dst X and Y.
-        packet[5] = 24 << 8; // Bit depth.
-
-        SendBuf(platSpec, packet, sizeof(packet));
-        SendBuf(platSpec, row, W * num_rows_in_chunk * 4);
-        row += W * num_rows_in_chunk;
+        if (x11->bigRequestsEnabled) {
+            packet[0] = X11_OPCODE_PUT_IMAGE | bmp_format; // Zero len field means the len is in the next word.
+            packet[1] = requestLenWords;
+            header++;
+        }
+        else {
+            packet[0] = X11_OPCODE_PUT_IMAGE | bmp_format | (requestLenWords << 16);
+        }
+        header[1] = drawable;
+        header[2] = gc;
+        header[3] = w | (numRows << 16); // Width and height.
+        header[4] = x | (y << 16); // Dst X and Y.
+        header[5] = 24 << 8; // Bit depth.
+
+        MutexLock(x11->sendMutex);
+
+        int numIov = 0;
+        iov[numIov].iov_base = x11->sendBuf;
+        iov[numIov].iov_len = x11->sendBufNumBytes;
+        numIov++;
+        iov[numIov].iov_base = packet;
+        iov[numIov].iov_len = headerLenWords * 4;
+        numIov++;
+
+        DfColour *row = bmp->pixels + y * bmp->stride + x;
+        if (w == bmp->stride) {
+            // Rows are contiguous in memory. Send them all at once.
+            iov[numIov].iov_base = row;
+            iov[numIov].iov_len = w * numRows * 4;
+            numIov++;
+        }
+        else {
+            for (int i = 0; i < numRows; i++) {
+                if (numIov == MAX_IOVECS) {
+                    SendIovecs(x11, iov, numIov);
+                    numIov = 0;
+                }
+                iov[numIov].iov_base = row;
+                iov[numIov].iov_len = w * 4;
+                numIov++;
+                row += bmp->stride;
+            }
+        }
+
+        SendIovecs(x11, iov, numIov);
+        x11->sendBufNumBytes = 0;
+
+        MutexUnlock(x11->sendMutex);
+
+        y += numRows;
     }
 }
 
 
-static void CreateFakeWindowIfNeeded() {
-    if (g_fakeWindow._private) return;
+// Sends the listed areas of bmp to the window. Used by the async present
+// threads.
+static void PresentBitmap(DfWindow *win, DfBitmap *bmp, DfRect const *rects, int numRects) {
+    X11Connection *x11 = g_x11;
+    WindowPlatformSpecific *platSpec = win->_private->platSpec;
+    for (int i = 0; i < numRects; i++) {
+        PutImageRect(x11, platSpec->windowId, platSpec->graphicsContextId,
+                     bmp, rects[i].x, rects[i].y, rects[i].w, rects[i].h);
+    }
+    FlushSendBuf(x11);
+}
 
-    g_fakeWindow._private = new DfWindowPrivate;
-    memset(g_fakeWindow._private, 0, sizeof(DfWindowPrivate));
-    g_fakeWindow._private->platSpec = new WindowPlatformSpecific;
-    memset(g_fakeWindow._private->platSpec, 0, sizeof(WindowPlatformSpecific));
-    g_fakeWindow._private->platSpec->socketFd = -1;
-    ConnectToXserver(&g_fakeWindow);
 
-    WindowPlatformSpecific *platSpec = g_fakeWindow._private->platSpec;
-    int const len = 9;
+// Returns false if async present can't be enabled for the window.
+static bool SetAsyncPresentPlatform(DfWindow *win, bool enable) {
+    X11Connection *x11 = g_x11;
+
+    // With MIT-SHM, the Xserver reads the pixels straight from the back
+    // buffer, so there is nothing for a present thread to overlap with.
+    if (enable && win->_private->platSpec->shm[0].segId && x11->shmAvailable)
+        return false;
+
+    MutexLock(x11->sendMutex);
+    x11->numAsyncPresentWindows += enable ? 1 : -1;
+    MutexUnlock(x11->sendMutex);
+    return true;
+}
+
+
+// Appends the parts of r that are outside hole to out, which must have room
+// for 4 rects. Returns the number appended.
+static int SubtractRect(DfRect const *r, DfRect const *hole, DfRect *out) {
+    int x1 = IntMax(r->x, hole->x);
+    int y1 = IntMax(r->y, hole->y);
+    int x2 = IntMin(r->x + r->w, hole->x + hole->w);
+    int y2 = IntMin(r->y + r->h, hole->y + hole->h);
+    if (x1 >= x2 || y1 >= y2) {
+        out[0] = *r;
+        return 1;
+    }
+
+    int n = 0;
+    if (y1 > r->y)
+        out[n++] = { r->x, r->y, r->w, y1 - r->y };
+    if (x1 > r->x)
+        out[n++] = { r->x, y1, x1 - r->x, y2 - y1 };
+    if (x2 < r->x + r->w)
+        out[n++] = { x2, y1, r->x + r->w - x2, y2 - y1 };
+    if (y2 < r->y + r->h)
+        out[n++] = { r->x, y2, r->w, r->y + r->h - y2 };
+    return n;
+}
+
+
+static void SendQueuedCopyAreas(DfWindow *win) {
+    WindowPlatformSpecific *platSpec = win->_private->platSpec;
+    for (int i = 0; i < platSpec->numCopyAreas; i++) {
+        QueuedCopyArea *ca = platSpec->copyAreas + i;
+        int const len = 7;
+        uint32_t packet[len];
+        packet[0] = X11_OPCODE_COPY_AREA | (len<<16);
+        packet[1] = ca->pixmapId;
+        packet[2] = platSpec->windowId;
+        packet[3] = platSpec->graphicsContextId;
+        packet[4] = ca->srcX | (ca->srcY << 16);
+        packet[5] = ca->dst.x | (ca->dst.y << 16);
+        packet[6] = ca->dst.w | (ca->dst.h << 16);
+        QueueRequest(g_x11, packet, sizeof(packet));
+    }
+    platSpec->numCopyAreas = 0;
+}
+
+
+// Repeats the move done by BitmapScroll() on what is already in the window.
+static void SendScrollCopyArea(DfWindow *win, DfDamage const *damage) {
+    WindowPlatformSpecific *platSpec = win->_private->platSpec;
+    DfRect const *r = &damage->scrollRect;
+    int const len = 7;
     uint32_t packet[len];
-    packet[0] = X11_OPCODE_CREATE_WINDOW | (len<<16);
+    packet[0] = X11_OPCODE_COPY_AREA | (len<<16);
     packet[1] = platSpec->windowId;
-    packet[2] = platSpec->screens[0].root_id;
-    packet[3] = 0; // x,y pos. System will position window. TODO - use x and y
-    packet[4] = 1 | (1<<16); // width=1 height=1
-    packet[5] = 0; // DEFAULT_BORDER and DEFAULT_GROUP.
-    packet[6] = 0; // Visual: Copy from parent.
-    packet[7] = 0x800; // value_mask = event-mask
-    packet[8] = 0;
-    SendBuf(platSpec, packet, sizeof(packet));
+    packet[2] = platSpec->windowId;
+    packet[3] = platSpec->scrollGraphicsContextId;
+    packet[4] = r->x | (r->y << 16);
+    packet[5] = (r->x + damage->scrollDx) | ((r->y + damage->scrollDy) << 16);
+    packet[6] = r->w | (r->h << 16);
+    QueueRequest(g_x11, packet, sizeof(packet));
+}
+
+
+// Copies the rects from one shm segment to the other.
+static void CopyShmRects(DfBitmap const *bmp, DfColour const *src, DfColour *dst,
+                         DfRect const *rects, int numRects) {
+    for (int i = 0; i < numRects; i++) {
+        int x1 = IntMax(rects[i].x, 0);
+        int y1 = IntMax(rects[i].y, 0);
+        int x2 = IntMin(rects[i].x + rects[i].w, bmp->width);
+        int y2 = IntMin(rects[i].y + rects[i].h, bmp->height);
+        for (int y = y1; y < y2; y++) {
+            int offset = y * bmp->stride + x1;
+            memcpy(dst + offset, src + offset, (x2 - x1) * sizeof(DfColour));
+        }
+    }
+}
+
+
+// Moves win->bmp to the shm segment that isn't being presented, and brings
+// that segment up to date. The segment still holds the frame before the one
+// just presented, so only the areas that changed since then are copied.
+static void SwapShmSegments(DfWindow *win) {
+    WindowPlatformSpecific *platSpec = win->_private->platSpec;
+    DfBitmap *bmp = win->bmp;
+    DfDamage const *damage = bmp->damage;
+    ShmSegment *presented = &platSpec->shm[platSpec->shmCurrent];
+    ShmSegment *next = &platSpec->shm[!platSpec->shmCurrent];
+
+    // This is the only wait: the segment was presented a frame ago and the
+    // Xserver may not have finished reading it yet.
+    WaitForShmCompletion(next);
+
+    if (!damage) {
+        DfRect fullRect = { 0, 0, bmp->width, bmp->height };
+        CopyShmRects(bmp, presented->pixels, next->pixels, &fullRect, 1);
+    }
+    else {
+        CopyShmRects(bmp, presented->pixels, next->pixels, damage->rects, damage->numRects);
+        if (damage->hasScroll) {
+            DfRect const *r = &damage->scrollRect;
+            DfRect moved = { r->x + damage->scrollDx, r->y + damage->scrollDy, r->w, r->h };
+            CopyShmRects(bmp, presented->pixels, next->pixels, &moved, 1);
+        }
+    }
+
+    platSpec->shmCurrent = !platSpec->shmCurrent;
+    bmp->pixels = next->pixels;
+}
+
+
+static void BlitBitmapToWindow(DfWindow *win) {
+    X11Connection *x11 = g_x11;
+    WindowPlatformSpecific *platSpec = win->_private->platSpec;
+    DfBitmap *bmp = win->bmp;
+    DfDamage *damage = bmp->damage;
+
+    // The copy goes first, so that the damaged areas are drawn over it.
+    if (damage && damage->hasScroll)
+        SendScrollCopyArea(win, damage);
+
+    // If damage tracking is enabled, only send the damaged areas.
+    DfRect fullRect = { 0, 0, bmp->width, bmp->height };
+    DfRect *rects = &fullRect;
+    int numRects = 1;
+    if (damage) {
+        rects = damage->rects;
+        numRects = damage->numRects;
+    }
+
+    // The areas that server images will be copied to don't need sending.
+    // Cutting holes can split a rect into four, so stop cutting if the list
+    // gets too long. Anything sent under an image is just drawn over.
+    enum { MAX_RECTS = 64 };
+    DfRect cutRects[2][MAX_RECTS];
+    for (int i = 0; i < platSpec->numCopyAreas; i++) {
+        DfRect *out = cutRects[i & 1];
+        int numOut = 0;
+        for (int j = 0; j < numRects && numOut + 4 <= MAX_RECTS; j++)
+            numOut += SubtractRect(rects + j, &platSpec->copyAreas[i].dst, out + numOut);
+        if (numOut + 4 > MAX_RECTS)
+            break;
+        rects = out;
+        numRects = numOut;
+    }
+
+    if (platSpec->shm[0].segId && x11->shmAvailable) {
+        if (numRects == 0) {
+            SendQueuedCopyAreas(win);
+            FlushSendBuf(x11);
+            return;
+        }
+
+        for (int i = 0; i < numRects; i++) {
+            bool isLast = i == numRects - 1;
+            ShmPutImageRect(win, rects[i].x, rects[i].y, rects[i].w, rects[i].h, isLast);
+        }
+        SendQueuedCopyAreas(win);
+        FlushSendBuf(x11);
+
+        platSpec->shm[platSpec->shmCurrent].completionPending = true;
+        SwapShmSegments(win);
+        return;
+    }
+
+    for (int i = 0; i < numRects; i++) {
+        PutImageRect(x11, platSpec->windowId, platSpec->graphicsContextId,
+                     bmp, rects[i].x, rects[i].y, rects[i].w, rects[i].h);
+    }
+    SendQueuedCopyAreas(win);
+    FlushSendBuf(x11);
+}
+
 
-    MakeSocketNonBlocking(platSpec);
+// Uploads bmp to a new pixmap. Returns the pixmap's id.
+static unsigned UploadServerImage(DfWindow *win, DfBitmap *bmp) {
+    X11Connection *x11 = g_x11;
+    WindowPlatformSpecific *platSpec = win->_private->platSpec;
+    uint32_t pixmapId = generateId(x11);
+
+    int const len = 4;
+    uint32_t packet[len];
+    packet[0] = X11_OPCODE_CREATE_PIXMAP | (24 << 8) | (len<<16); // Depth 24.
+    packet[1] = pixmapId;
+    packet[2] = platSpec->windowId; // Pixmap is on the same screen as this.
+    packet[3] = bmp->width | (bmp->height << 16);
+    QueueRequest(x11, packet, sizeof(packet));
+
+    // The window's GC can be used because the pixmap has the same root and
+    // depth.
+    PutImageRect(x11, pixmapId, platSpec->graphicsContextId,
+                 bmp, 0, 0, bmp->width, bmp->height);
+    FlushSendBuf(x11);
+
+    return pixmapId;
+}
+
+
+static void FreeServerImage(unsigned serverId) {
+    X11Connection *x11 = g_x11;
+
+    // Drop draws of the image that haven't been sent yet, because the
+    // Xserver would reject them once the pixmap is freed.
+    for (DfWindow *w = x11->windows; w; w = w->_private->platSpec->nextWindow) {
+        WindowPlatformSpecific *platSpec = w->_private->platSpec;
+        int n = 0;
+        for (int i = 0; i < platSpec->numCopyAreas; i++) {
+            if (platSpec->copyAreas[i].pixmapId != serverId)
+                platSpec->copyAreas[n++] = platSpec->copyAreas[i];
+        }
+        platSpec->numCopyAreas = n;
+    }
+
+    uint32_t packet[2];
+    packet[0] = X11_OPCODE_FREE_PIXMAP | (2 << 16);
+    packet[1] = serverId;
+    QueueRequest(x11, packet, sizeof(packet));
+}
+
+
+// Returns false if the draw has to be done in software instead.
+static bool QueueServerImageDraw(DfWindow *win, unsigned serverId, int srcX, int srcY, DfRect const *dst) {
+    WindowPlatformSpecific *platSpec = win->_private->platSpec;
+    if (platSpec->numCopyAreas == platSpec->maxCopyAreas) {
+        int newMax = IntMax(16, platSpec->maxCopyAreas * 2);
+        QueuedCopyArea *newCopyAreas = new QueuedCopyArea [newMax];
+        memcpy(newCopyAreas, platSpec->copyAreas, platSpec->numCopyAreas * sizeof(QueuedCopyArea));
+        delete [] platSpec->copyAreas;
+        platSpec->copyAreas = newCopyAreas;
+        platSpec->maxCopyAreas = newMax;
+    }
+
+    QueuedCopyArea *ca = platSpec->copyAreas + platSpec->numCopyAreas;
+    ca->pixmapId = serverId;
+    ca->srcX = srcX;
+    ca->srcY = srcY;
+    ca->dst = *dst;
+    platSpec->numCopyAreas++;
+    return true;
 }
 
 
 bool GetDesktopRes(int *width, int *height) {
-    CreateFakeWindowIfNeeded();
-    WindowPlatformSpecific *platSpec = g_fakeWindow._private->platSpec;
-    *width = platSpec->screens[0].width;
-    *height = platSpec->screens[0].height;
+    if (HeadlessModeEnabled())
+        return GetDesktopResHeadless(width, height);
+
+    X11Connection *x11 = ConnectToXserver();
+    *width = x11->screens[0].width;
+    *height = x11->screens[0].height;
     return true;
 }
 
@@ -1014,10 +1900,57 @@ bool WaitVsync() {
 }
 
 
+static bool AnyWindowHasEvents(X11Connection *x11) {
+    for (DfWindow *w = x11->windows; w; w = w->_private->platSpec->nextWindow)
+        if (w->_private->platSpec->numEventsHandled > 0)
+            return true;
+    return false;
+}
+
+
+// The events are handled here, rather than left for InputPoll(), so that
+// ShmCompletions, which arrive after every frame we present, don't end the
+// wait. Otherwise an app that redraws after each wait would never sleep.
+// A negative timeout means wait forever.
+static bool WaitForEventsPlatform(DfWindow *win, int timeoutMillisec) {
+    X11Connection *x11 = g_x11;
+    double endTime = GetRealTime() + timeoutMillisec / 1000.0;
+
+    while (1) {
+        // Also sends anything queued. The Xserver won't send anything in
+        // reply to requests it hasn't had.
+        HandleEvents(x11);
+        if (AnyWindowHasEvents(x11))
+            return true;
+
+        int waitMillisec = timeoutMillisec;
+        if (timeoutMillisec >= 0) {
+            waitMillisec = (int)ceil((endTime - GetRealTime()) * 1000.0);
+            if (waitMillisec <= 0)
+                return false;
+        }
+
+        struct pollfd pollFd = { x11->socketFd, POLLIN };
+        int pollResult = poll(&pollFd, 1, waitMillisec);
+        if (pollResult < 0 && errno != EINTR)
+            FATAL_ERROR("Poll gave an error %i", errno);
+        if (pollResult == 0)
+            return false;
+    }
+}
+
+
 bool InputPoll(DfWindow *win) {
-    bool rv = HandleEvents(win);
+    if (win->_private->headless)
+        return InputPollHeadless(win);
+
+    WindowPlatformSpecific *platSpec = win->_private->platSpec;
+    HandleEvents(g_x11);
+    ApplyPendingResize(win);
+    win->input.numEvents = platSpec->numEventsHandled;
+    platSpec->numEventsHandled = 0;
     InputPollInternal(win);
-    return rv;
+    return win->input.numEvents > 0;
 }
 
 
@@ -1046,7 +1979,30 @@ void BringWindowToFront(DfWindow *win) {
 }
 
 
+// The back buffer is resized when the ConfigureNotify event comes back.
+void SetWindowRect(DfWindow *win, int x, int y, int width, int height) {
+    if (win->_private->headless) {
+        SetWindowRectHeadless(win, x, y, width, height);
+        return;
+    }
+
+    WindowPlatformSpecific *platSpec = win->_private->platSpec;
+    int const len = 7;
+    uint32_t packet[len];
+    packet[0] = X11_OPCODE_CONFIGURE_WINDOW | (len<<16);
+    packet[1] = platSpec->windowId;
+    packet[2] = 0xf; // Value mask: x, y, width and height.
+    packet[3] = x;
+    packet[4] = y;
+    packet[5] = width;
+    packet[6] = height;
+    QueueRequest(g_x11, packet, sizeof(packet));
+}
+
+
 void SetWindowTitle(DfWindow *win, char const *title) {
+    if (win->_private->headless) return;
+
     int headerNumBytes = 24;
     int titleLen = strlen(title);
 
@@ -1065,107 +2021,130 @@ void SetWindowTitle(DfWindow *win, char const *title) {
     packet[5] = titleLen;
     memcpy(&packet[6], title, titleLen);
 
-    SendBuf(platSpec, packet, len * 4);
+    QueueRequest(g_x11, packet, len * 4);
 }
 
 
 void SetWindowIcon(DfWindow *win) {}
 
 
-static void SendGetPropertyRequest(DfWindow *win) {
-    WindowPlatformSpecific *platSpec = win->_private->platSpec;
+// ****************************************************************************
+// Clipboard
+// ****************************************************************************
+
+static void CreateClipboardWindowIfNeeded(X11Connection *x11) {
+    if (x11->clipboardWindowId) return;
+
+    x11->clipboardWindowId = generateId(x11);
+    int const len = 9;
+    uint32_t packet[len];
+    packet[0] = X11_OPCODE_CREATE_WINDOW | (len<<16);
+    packet[1] = x11->clipboardWindowId;
+    packet[2] = x11->screens[0].root_id;
+    packet[3] = 0; // x,y pos.
+    packet[4] = 1 | (1<<16); // width=1 height=1
+    packet[5] = 0; // DEFAULT_BORDER and DEFAULT_GROUP.
+    packet[6] = 0; // Visual: Copy from parent.
+    packet[7] = 0x800; // value_mask = event-mask
+    packet[8] = 0;
+    QueueRequest(x11, packet, sizeof(packet));
+}
+
+
+static void SendGetPropertyRequest(X11Connection *x11) {
 //    puts("sending GetProperty request");
     uint32_t packet[6];
     packet[0] = 20 | 6 << 16;
-    packet[1] = platSpec->windowId; // window
-    packet[2] = platSpec->xselDataId;   // property
+    packet[1] = x11->clipboardWindowId; // window
+    packet[2] = x11->xselDataId;   // property
     packet[3] = 0; // Type = any
     packet[4] = 0; // offset = 0
     packet[5] = 0xfffffffful; // length
-    SendBuf(platSpec, packet, sizeof(packet));
+    QueueRequest(x11, packet, sizeof(packet));
 }
 
 
-static void ReceiveClipboardData(DfWindow *win) {
-    SendGetPropertyRequest(win);
+static void ReceiveClipboardData(X11Connection *x11) {
+    SendGetPropertyRequest(x11);
 //    printf("Getting GetProperty response\n");
 
-    while (!GetReply(win, 32))
-        ;
+    WaitForReply(x11);
 
-    WindowPlatformSpecific *platSpec = win->_private->platSpec;
-    uint8_t *buf = platSpec->recvBuf;
+    uint8_t *buf = x11->recvMsg;
     uint32_t type = *((uint32_t *)(buf + 8));
-    if (type == platSpec->stringId) {
+    if (type == x11->stringId) {
         uint32_t replyLen = *((uint32_t *)(buf + 4)) * 4;
 
         uint32_t lenOfValueInFmtUnits = *((uint32_t *)(buf + 16));
 //        printf("len of value in fmt units: %i\n", lenOfValueInFmtUnits);
 
-        ConsumeMessage(platSpec, 32);
+        ConsumeMessage(x11, 32);
 
-        platSpec->clipboardRxData = new char[lenOfValueInFmtUnits + 1];
-        char *nextWritePoint = platSpec->clipboardRxData;
+        x11->clipboardRxData = new char[lenOfValueInFmtUnits + 1];
+        char *nextWritePoint = x11->clipboardRxData;
 
         uint32_t numBytesLeft = lenOfValueInFmtUnits;
         while (numBytesLeft > 0) {
-            ReadFromXServer(platSpec);
+            ReadFromXServer(x11);
 
-            ssize_t stringLen = IntMin(platSpec->recvBufNumBytesAvailable, numBytesLeft);
-            memcpy(nextWritePoint, (char const *)buf, stringLen);
+            ssize_t stringLen = IntMin(x11->recvBufNumBytesAvailable, numBytesLeft);
+            memcpy(nextWritePoint, (char const *)x11->recvMsg, stringLen);
             nextWritePoint += stringLen;
 
-            ConsumeMessage(platSpec, stringLen);
+            ConsumeMessage(x11, stringLen);
             numBytesLeft -= stringLen;
         }
-        platSpec->clipboardRxData[lenOfValueInFmtUnits] = '\0';
+        x11->clipboardRxData[lenOfValueInFmtUnits] = '\0';
 
         uint32_t amtPadding = replyLen - lenOfValueInFmtUnits;
-        ConsumeMessage(platSpec, amtPadding);
+        ConsumeMessage(x11, amtPadding);
     }
 }
 
 
 char *X11InternalClipboardRequestData() {
-    CreateFakeWindowIfNeeded();
-    WindowPlatformSpecific *platSpec = g_fakeWindow._private->platSpec;
+    X11Connection *x11 = ConnectToXserver();
+    CreateClipboardWindowIfNeeded(x11);
 
-    if (platSpec->clipboardRxData) return NULL;
+    if (x11->clipboardRxData) return NULL;
 
 //    puts("Sending ConvertSelection request");
     uint32_t packet[6];
     packet[0] = 24 | 6 << 16;
-    packet[1] = platSpec->windowId; // requestor
-    packet[2] = platSpec->clipboardId; // selection
-    packet[3] = platSpec->stringId; // target
-    packet[4] = platSpec->xselDataId; // property
+    packet[1] = x11->clipboardWindowId; // requestor
+    packet[2] = x11->clipboardId; // selection
+    packet[3] = x11->stringId; // target
+    packet[4] = x11->xselDataId; // property
     packet[5] = 0; // time
-    SendBuf(platSpec, packet, sizeof(packet));
+    QueueRequest(x11, packet, sizeof(packet));
 
+    // Events for the app's windows are handled as normal while we wait.
     double endTime = GetRealTime() + 0.1;
     do {
-        InputPoll(&g_fakeWindow);
+        HandleEvents(x11);
 
-        if (platSpec->clipboardRxData) {
+        if (x11->clipboardRxData) {
             break;
         }
+
+        struct pollfd pollFd = { x11->socketFd, POLLIN };
+        poll(&pollFd, 1, 1);
     } while (GetRealTime() < endTime);
 
-    return platSpec->clipboardRxData;
+    return x11->clipboardRxData;
 }
 
 
 void X11InternalClipboardReleaseReceivedData() {
-    CreateFakeWindowIfNeeded();
-    WindowPlatformSpecific *platSpec = g_fakeWindow._private->platSpec;
-    delete [] platSpec->clipboardRxData;
-    platSpec->clipboardRxData = NULL;
+    X11Connection *x11 = ConnectToXserver();
+    delete [] x11->clipboardRxData;
+    x11->clipboardRxData = NULL;
 }
 
 
-static void SendChangePropertyRequest(WindowPlatformSpecific *platSpec, uint32_t destWindow,
+static void SendChangePropertyRequest(X11Connection *x11, uint32_t destWindow,
                                       uint32_t target, uint32_t property) {
-    if (target == platSpec->targetsId) {
+    if (target == x11->targetsId) {
         // This branch sends a change property request that is used as the
         // response to a SelectionRequest. It tells the recipient what format the
         // clipboard data that we are about to send will be in.
@@ -1178,32 +2157,34 @@ static void SendChangePropertyRequest(WindowPlatformSpecific *platSpec, uint32_t
         packet[3] = 4; // type is ATOM.
         packet[4] = 32; // Format unit is 32 bits.
         packet[5] = 2; // Length is 2 format units;
-        packet[6] = platSpec->targetsId;
-        packet[7] = platSpec->stringId;
-        SendBuf(platSpec, packet, sizeof(packet));
+        packet[6] = x11->targetsId;
+        packet[7] = x11->stringId;
+        QueueRequest(x11, packet, sizeof(packet));
     }
     else {
         // This branch sends a change property request that includes the actual
         // clipboard data.
 //        puts("Sending ChangeProperty with clipboard contents");
 
-        const int amtPadding = 4 - platSpec->clipboardTxDataNumChars & 3;
-        const int numWords = 6 + (platSpec->clipboardTxDataNumChars + amtPadding) / 4;
-//        printf("amtPadding:%d numWords:%d numChars:%d\n", amtPadding, numWords, platSpec->clipboardTxDataNumChars);
+        const int amtPadding = 4 - x11->clipboardTxDataNumChars & 3;
+        const int numWords = 6 + (x11->clipboardTxDataNumChars + amtPadding) / 4;
+//        printf("amtPadding:%d numWords:%d numChars:%d\n", amtPadding, numWords, x11->clipboardTxDataNumChars);
         uint32_t packet[6];
         packet[0] = X11_OPCODE_CHANGE_PROPERTY | numWords << 16;
         packet[1] = destWindow;
         packet[2] = property;
-        packet[3] = platSpec->stringId; // type is STRING.
+        packet[3] = x11->stringId; // type is STRING.
         packet[4] = 8; // Format unit is this many bits.
-        packet[5] = platSpec->clipboardTxDataNumChars; // Length in format units;
-        SendBuf(platSpec, packet, sizeof(packet));
-        SendBuf(platSpec, platSpec->clipboardTxData, platSpec->clipboardTxDataNumChars + amtPadding);
+        packet[5] = x11->clipboardTxDataNumChars; // Length in format units;
+        MutexLock(x11->sendMutex);
+        QueueRequestLocked(x11, packet, sizeof(packet));
+        QueueRequestLocked(x11, x11->clipboardTxData, x11->clipboardTxDataNumChars + amtPadding);
+        MutexUnlock(x11->sendMutex);
     }
 }
 
 
-static void SendSendEventSelectionNotify(WindowPlatformSpecific *platSpec, uint32_t destWindow,
+static void SendSendEventSelectionNotify(X11Connection *x11, uint32_t destWindow,
                                          uint32_t target, uint32_t property, uint32_t time) {
 //    puts("Sending SendEventSelectionNotify");
     uint32_t packet[11];
@@ -1213,31 +2194,32 @@ static void SendSendEventSelectionNotify(WindowPlatformSpecific *platSpec, uint3
     packet[3] = 31; // SelectionNotify
     packet[4] = time;
     packet[5] = destWindow; // requestor
-    packet[6] = platSpec->clipboardId;
+    packet[6] = x11->clipboardId;
     packet[7] = target;
     packet[8] = property;
     packet[9] = 0;
     packet[10] = 0;
 
-    SendBuf(platSpec, packet, sizeof(packet));
+    QueueRequest(x11, packet, sizeof(packet));
 }
 
 
 void X11InternalClipboardSetData(char const *data, int numChars) {
-    CreateFakeWindowIfNeeded();
-    WindowPlatformSpecific *platSpec = g_fakeWindow._private->platSpec;
+    X11Connection *x11 = ConnectToXserver();
+    CreateClipboardWindowIfNeeded(x11);
 
-    delete [] platSpec->clipboardTxData;
-    platSpec->clipboardTxData = new char[numChars + 3]; // +3 to allow for maximum amount of padding needed when buffer is sent to xServer.
-    platSpec->clipboardTxDataNumChars = numChars;
-    memcpy(platSpec->clipboardTxData, data, numChars);
-    memset(platSpec->clipboardTxData + numChars, 0, 3); // Prevent Valgrind complaining about uninitialized memory.
+    delete [] x11->clipboardTxData;
+    x11->clipboardTxData = new char[numChars + 3]; // +3 to allow for maximum amount of padding needed when buffer is sent to xServer.
+    x11->clipboardTxDataNumChars = numChars;
+    memcpy(x11->clipboardTxData, data, numChars);
+    memset(x11->clipboardTxData + numChars, 0, 3); // Prevent Valgrind complaining about uninitialized memory.
 
 //    puts("Sending SetSelectionOwner request");
     uint32_t packet[4];
     packet[0] = X11_OPCODE_SET_SELECTION_OWNER | 4 << 16;
-    packet[1] = platSpec->windowId;
-    packet[2] = platSpec->clipboardId;
+    packet[1] = x11->clipboardWindowId;
+    packet[2] = x11->clipboardId;
     packet[3] = 0;
-    SendBuf(platSpec, packet, sizeof(packet));
+    QueueRequest(x11, packet, sizeof(packet));
+    FlushSendBuf(x11);
 }
@@ -0,0 +1,93 @@
+// Checks that the SSE2 and AVX2 blend kernels in df_blend.cpp give the same
+// pixels as the scalar ones, for every span length up to 40, to cover each
+// tail length, and then one long span, each starting at every alignment.
+
+#include "../src/df_blend.cpp"
+#include "test_helpers.h"
+
+
+#define MAX_LEN 301
+
+
+static DfColour RandomColour(unsigned maxAlpha)
+{
+    DfColour c;
+    c.c = (rand() << 16) ^ rand();
+    c.a = rand() % (maxAlpha + 1);
+    return c;
+}
+
+
+static void FillRandom(DfColour *row, int len)
+{
+    for (int i = 0; i < len; i++)
+        row[i] = RandomColour(255);
+}
+
+
+static void CheckSame(DfColour const *expected, DfColour const *actual, int spanLen, char const *kernelName)
+{
+    for (int i = 0; i < MAX_LEN + 16; i++)
+    {
+        ReleaseAssert(expected[i].c == actual[i].c, "%s: span len %i, pixel %i is %08x, should be %08x",
+                      kernelName, spanLen, i, actual[i].c, expected[i].c);
+    }
+}
+
+
+static void CheckKernels(char const *name, BlendSpanFunc *span, BlendSpanAlphasFunc *spanAlphas)
+{
+    // The extra 8 pixels let the start of the span be misaligned by different
+    // amounts. The guard pixels after the span must not be touched.
+    DfColour original[MAX_LEN + 16];
+    DfColour expected[MAX_LEN + 16];
+    DfColour actual[MAX_LEN + 16];
+    unsigned char alphas[MAX_LEN + 8];
+
+    for (int i = 0; i < 8 * 42; i++)
+    {
+        int len = (i / 8 <= 40) ? i / 8 : MAX_LEN;
+        int offset = i % 8;
+        DfColour c = RandomColour(254);
+
+        // Alphas 0 and 254 are the edge cases, so make them common.
+        for (int i = 0; i < len; i++)
+        {
+            int r = rand() % 8;
+            alphas[offset + i] = (r == 0) ? 0 : (r == 1) ? 254 : rand() % 255;
+        }
+
+        FillRandom(original, MAX_LEN + 16);
+        memcpy(expected, original, sizeof(original));
+        memcpy(actual, original, sizeof(original));
+        BlendSpanScalar(expected + offset, len, c);
+        span(actual + offset, len, c);
+        CheckSame(expected, actual, len, name);
+
+        memcpy(expected, original, sizeof(original));
+        memcpy(actual, original, sizeof(original));
+        BlendSpanAlphasScalar(expected + offset, len, c, alphas + offset);
+        spanAlphas(actual + offset, len, c, alphas + offset);
+        CheckSame(expected, actual, len, name);
+    }
+
+    printf("%s matches scalar\n", name);
+}
+
+
+int main()
+{
+    StartTest();
+
+#if BLEND_X64
+    CheckKernels("sse2", BlendSpanSse2, BlendSpanAlphasSse2);
+    if (CpuHasAvx2())
+        CheckKernels("avx2", BlendSpanAvx2, BlendSpanAlphasAvx2);
+    else
+        printf("avx2 skipped: not supported by this CPU\n");
+#else
+    printf("No SIMD kernels on this platform\n");
+#endif
+
+    return 0;
+}
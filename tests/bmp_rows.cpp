@@ -0,0 +1,58 @@
+// Checks that the SSSE3 row converters in df_bmp.cpp, which load and save
+// 24-bit BMPs, give the same bytes as the scalar ones. They do 16 pixels at a
+// time and leave the rest to the scalar code, so every width up to 48 is
+// tried, to cover each tail length, and then one long row.
+
+#include "../src/df_bmp.cpp"
+#include "test_helpers.h"
+
+
+#define MAX_WIDTH 1001
+
+
+static void CheckWidth(int width)
+{
+    static uint8_t bgr[MAX_WIDTH * 3];
+    static DfColour expectedPixels[MAX_WIDTH + GUARD_BYTES];
+    static DfColour actualPixels[MAX_WIDTH + GUARD_BYTES];
+    FillRandomBytes(bgr, width * 3);
+    FillGuardBytes(expectedPixels, sizeof(expectedPixels));
+    FillGuardBytes(actualPixels, sizeof(actualPixels));
+    Convert24BitRowScalar(bgr, expectedPixels, width);
+    Convert24BitRowSsse3(bgr, actualPixels, width);
+    CheckBytes(expectedPixels, actualPixels, sizeof(expectedPixels), "Convert24BitRow", width);
+
+    static DfColour pixels[MAX_WIDTH];
+    static uint8_t expectedBgr[MAX_WIDTH * 3 + GUARD_BYTES];
+    static uint8_t actualBgr[MAX_WIDTH * 3 + GUARD_BYTES];
+    FillRandomBytes(pixels, width * sizeof(DfColour));
+    FillGuardBytes(expectedBgr, sizeof(expectedBgr));
+    FillGuardBytes(actualBgr, sizeof(actualBgr));
+    PackBgrRowScalar(pixels, expectedBgr, width);
+    PackBgrRowSsse3(pixels, actualBgr, width);
+    CheckBytes(expectedBgr, actualBgr, sizeof(expectedBgr), "PackBgrRow", width);
+}
+
+
+int main()
+{
+    StartTest();
+
+#if BMP_X64
+    if (!CpuHasSsse3())
+    {
+        printf("Skipped: SSSE3 not supported by this CPU\n");
+        return 0;
+    }
+
+    for (int width = 1; width <= 48; width++)
+        CheckWidth(width);
+    CheckWidth(MAX_WIDTH);
+
+    printf("SSSE3 rows match scalar\n");
+#else
+    printf("No SIMD converters on this platform\n");
+#endif
+
+    return 0;
+}
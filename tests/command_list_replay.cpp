@@ -0,0 +1,332 @@
+// Checks that replaying a command list draws exactly the same pixels as
+// making the same calls directly, with CommandListReplay(),
+// CommandListReplayAt() and CommandListReplayTiled(). The commands are random,
+// and many of them cross the edges of the tiles and of the clip rect, which is
+// where the tiled replay is most likely to go wrong. Diagonal lines are the
+// most fragile case, because their pixels depend on the clip rect.
+//
+// Build it with the library, eg.
+//   g++ -O2 -I../src command_list_replay.cpp -L../build/linux -ldeadfrog -pthread
+
+#include "df_bitmap.h"
+#include "df_command_list.h"
+#include "df_font.h"
+#include "df_polygon.h"
+#include "df_thread.h"
+#include "fonts/df_mono.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define BMP_WIDTH       1000
+#define BMP_HEIGHT      700
+#define NUM_COMMANDS    5000
+
+
+enum {
+    CMD_CLEAR,
+    CMD_PUT_PIX,
+    CMD_HLINE,
+    CMD_VLINE,
+    CMD_DRAW_LINE,
+    CMD_RECT_FILL,
+    CMD_RECT_OUTLINE,
+    CMD_CIRCLE_OUTLINE,
+    CMD_CIRCLE_FILL,
+    CMD_TEXT,
+    CMD_POLYGON,
+    CMD_BLIT,
+    CMD_MASKED_BLIT,
+    CMD_STRETCH_BLIT,
+    NUM_CMD_TYPES
+};
+
+
+struct Command
+{
+    int type;
+    int x, y, x2, y2;
+    DfColour c;
+    DfFont *font;
+    char text[32];
+    PolyVertList verts;
+};
+
+
+static DfFont *g_font;
+static DfFont *g_aaFont;
+static DfBitmap *g_sprite;
+
+
+static int RandomInt(int min, int max)
+{
+    return min + rand() % (max - min + 1);
+}
+
+
+// Mostly opaque, because that's the common case, but blending makes the
+// result depend on the drawing order, so plenty are translucent.
+static DfColour RandomColour()
+{
+    int a = (rand() % 3 == 0) ? RandomInt(1, 254) : 255;
+    return Colour(rand() % 256, rand() % 256, rand() % 256, a);
+}
+
+
+static void MakeRandomCommand(Command *cmd)
+{
+    memset(cmd, 0, sizeof(Command));
+
+    // Clears are rare, because they wipe out everything before them.
+    do
+        cmd->type = rand() % NUM_CMD_TYPES;
+    while (cmd->type == CMD_CLEAR && rand() % 100 != 0);
+
+    // Start a bit outside the bitmap, so that some commands are clipped.
+    cmd->x = RandomInt(-100, BMP_WIDTH + 20);
+    cmd->y = RandomInt(-100, BMP_HEIGHT + 20);
+    cmd->c = RandomColour();
+
+    switch (cmd->type)
+    {
+    case CMD_HLINE:
+    case CMD_VLINE:
+        cmd->x2 = RandomInt(-10, 400);
+        break;
+    case CMD_DRAW_LINE:
+        // Horizontal, vertical and diagonal lines take different paths
+        // through the tiled replay.
+        cmd->x2 = cmd->x + RandomInt(-400, 400);
+        cmd->y2 = cmd->y + RandomInt(-400, 400);
+        if (rand() % 4 == 0)
+            cmd->x2 = cmd->x;
+        else if (rand() % 4 == 0)
+            cmd->y2 = cmd->y;
+        break;
+    case CMD_RECT_FILL:
+    case CMD_RECT_OUTLINE:
+    case CMD_STRETCH_BLIT:
+        cmd->x2 = RandomInt(0, 300);
+        cmd->y2 = RandomInt(0, 200);
+        break;
+    case CMD_CIRCLE_OUTLINE:
+    case CMD_CIRCLE_FILL:
+        cmd->x2 = RandomInt(0, 150);
+        break;
+    case CMD_TEXT:
+    {
+        cmd->font = (rand() % 2) ? g_font : g_aaFont;
+        int len = RandomInt(1, sizeof(cmd->text) - 1);
+        for (int i = 0; i < len; i++)
+            cmd->text[i] = RandomInt(32, 126);
+        break;
+    }
+    case CMD_POLYGON:
+    {
+        // Points on an ellipse, in order, make a convex polygon.
+        int rx = RandomInt(1, 200);
+        int ry = RandomInt(1, 200);
+        cmd->verts.numPoints = RandomInt(3, MAX_POLY_VERTICES);
+        double angle = 0.0;
+        for (int i = 0; i < cmd->verts.numPoints; i++)
+        {
+            angle += 6.28 / cmd->verts.numPoints;
+            cmd->verts.points[i].x = rx * cos(angle);
+            cmd->verts.points[i].y = ry * sin(angle);
+        }
+        break;
+    }
+    }
+}
+
+
+static void DrawCommand(Command *cmd, DfBitmap *bmp, int dx, int dy)
+{
+    int x = cmd->x + dx;
+    int y = cmd->y + dy;
+
+    switch (cmd->type)
+    {
+    case CMD_CLEAR:             BitmapClear(bmp, cmd->c); break;
+    case CMD_PUT_PIX:           PutPix(bmp, x, y, cmd->c); break;
+    case CMD_HLINE:             HLine(bmp, x, y, cmd->x2, cmd->c); break;
+    case CMD_VLINE:             VLine(bmp, x, y, cmd->x2, cmd->c); break;
+    case CMD_DRAW_LINE:         DrawLine(bmp, x, y, cmd->x2 + dx, cmd->y2 + dy, cmd->c); break;
+    case CMD_RECT_FILL:         RectFill(bmp, x, y, cmd->x2, cmd->y2, cmd->c); break;
+    case CMD_RECT_OUTLINE:      RectOutline(bmp, x, y, cmd->x2, cmd->y2, cmd->c); break;
+    case CMD_CIRCLE_OUTLINE:    CircleOutline(bmp, x, y, cmd->x2, cmd->c); break;
+    case CMD_CIRCLE_FILL:       CircleFill(bmp, x, y, cmd->x2, cmd->c); break;
+    case CMD_TEXT:              DrawTextSimple(cmd->font, cmd->c, bmp, x, y, cmd->text); break;
+    case CMD_POLYGON:           FillConvexPolygon(bmp, &cmd->verts, cmd->c, x, y); break;
+    case CMD_BLIT:              Blit(bmp, x, y, g_sprite); break;
+    case CMD_MASKED_BLIT:       MaskedBlit(bmp, x, y, g_sprite); break;
+    case CMD_STRETCH_BLIT:      StretchBlit(bmp, x, y, cmd->x2, cmd->y2, g_sprite); break;
+    }
+}
+
+
+static void RecordCommand(Command *cmd, DfCommandList *cl)
+{
+    switch (cmd->type)
+    {
+    case CMD_CLEAR:             CommandListBitmapClear(cl, cmd->c); break;
+    case CMD_PUT_PIX:           CommandListPutPix(cl, cmd->x, cmd->y, cmd->c); break;
+    case CMD_HLINE:             CommandListHLine(cl, cmd->x, cmd->y, cmd->x2, cmd->c); break;
+    case CMD_VLINE:             CommandListVLine(cl, cmd->x, cmd->y, cmd->x2, cmd->c); break;
+    case CMD_DRAW_LINE:         CommandListDrawLine(cl, cmd->x, cmd->y, cmd->x2, cmd->y2, cmd->c); break;
+    case CMD_RECT_FILL:         CommandListRectFill(cl, cmd->x, cmd->y, cmd->x2, cmd->y2, cmd->c); break;
+    case CMD_RECT_OUTLINE:      CommandListRectOutline(cl, cmd->x, cmd->y, cmd->x2, cmd->y2, cmd->c); break;
+    case CMD_CIRCLE_OUTLINE:    CommandListCircleOutline(cl, cmd->x, cmd->y, cmd->x2, cmd->c); break;
+    case CMD_CIRCLE_FILL:       CommandListCircleFill(cl, cmd->x, cmd->y, cmd->x2, cmd->c); break;
+    case CMD_TEXT:              CommandListDrawTextSimple(cl, cmd->font, cmd->c, cmd->x, cmd->y, cmd->text); break;
+    case CMD_POLYGON:           CommandListFillConvexPolygon(cl, &cmd->verts, cmd->c, cmd->x, cmd->y); break;
+    case CMD_BLIT:              CommandListBlit(cl, cmd->x, cmd->y, g_sprite); break;
+    case CMD_MASKED_BLIT:       CommandListMaskedBlit(cl, cmd->x, cmd->y, g_sprite); break;
+    case CMD_STRETCH_BLIT:      CommandListStretchBlit(cl, cmd->x, cmd->y, cmd->x2, cmd->y2, g_sprite); break;
+    }
+}
+
+
+static void CheckSame(DfBitmap *expected, DfBitmap *actual, char const *what)
+{
+    for (int y = 0; y < expected->height; y++)
+    {
+        for (int x = 0; x < expected->width; x++)
+        {
+            DfColour e = GetPixUnclipped(expected, x, y);
+            DfColour a = GetPixUnclipped(actual, x, y);
+            ReleaseAssert(e.c == a.c, "%s: pixel %i,%i is %08x, should be %08x", what, x, y, a.c, e.c);
+        }
+    }
+}
+
+
+// Clears the bitmap and sets a clip rect that doesn't line up with the tiles.
+static void ResetBitmap(DfBitmap *bmp)
+{
+    ClearClipRect(bmp);
+    BitmapClear(bmp, g_colourBlack);
+    SetClipRect(bmp, 37, 21, BMP_WIDTH - 80, BMP_HEIGHT - 50);
+}
+
+
+static void RunTest(Command *cmds, int numCmds, DfThreadPool *pool)
+{
+    DfBitmap *expected = BitmapCreate(BMP_WIDTH, BMP_HEIGHT);
+    DfBitmap *actual = BitmapCreate(BMP_WIDTH, BMP_HEIGHT);
+    DfCommandList *cl = CommandListCreate();
+    for (int i = 0; i < numCmds; i++)
+        RecordCommand(cmds + i, cl);
+
+    ResetBitmap(expected);
+    for (int i = 0; i < numCmds; i++)
+        DrawCommand(cmds + i, expected, 0, 0);
+
+    ResetBitmap(actual);
+    CommandListReplay(cl, actual);
+    CheckSame(expected, actual, "CommandListReplay");
+
+    ResetBitmap(actual);
+    CommandListReplayTiled(cl, actual, pool);
+    CheckSame(expected, actual, "CommandListReplayTiled");
+
+    ResetBitmap(actual);
+    CommandListReplayTiled(cl, actual, NULL);
+    CheckSame(expected, actual, "CommandListReplayTiled with the default pool");
+
+    // Once with the list well inside the clip rect, so that the unclipped
+    // paths are used, and once partly outside it.
+    int offsets[2][2] = { { 0, 0 }, { -73, 41 } };
+    for (int i = 0; i < 2; i++)
+    {
+        int dx = offsets[i][0];
+        int dy = offsets[i][1];
+        ResetBitmap(expected);
+        for (int j = 0; j < numCmds; j++)
+            DrawCommand(cmds + j, expected, dx, dy);
+
+        ResetBitmap(actual);
+        CommandListReplayAt(cl, actual, dx, dy);
+        CheckSame(expected, actual, "CommandListReplayAt");
+    }
+
+    CommandListDelete(cl);
+    BitmapDelete(actual);
+    BitmapDelete(expected);
+}
+
+
+int main()
+{
+    // ReleaseAssert() stops without flushing stdout.
+    setvbuf(stdout, NULL, _IONBF, 0);
+    srand(1);
+
+    g_font = LoadFontFromMemory(df_mono_7x13, sizeof(df_mono_7x13));
+    g_aaFont = LoadFontFromMemoryAA(df_mono_16x30, sizeof(df_mono_16x30), 12);
+
+    // Some of the sprite's pixels are transparent, for MaskedBlit().
+    g_sprite = BitmapCreate(70, 50);
+    for (int y = 0; y < g_sprite->height; y++)
+    {
+        for (int x = 0; x < g_sprite->width; x++)
+        {
+            DfColour c = Colour(x * 3, y * 5, x ^ y, ((x + y) % 7 == 0) ? 0 : 255);
+            PutPixUnclipped(g_sprite, x, y, c);
+        }
+    }
+
+    DfThreadPool *pool = ThreadPoolCreate(4);
+    Command *cmds = new Command[NUM_COMMANDS];
+
+    // Empty lines draw nothing, even when they are far outside the bitmap in
+    // a list that is otherwise inside the clip rect. That list is replayed
+    // without clip checks, so the empty lines must not reach the unclipped
+    // line functions.
+    {
+        Command *c = cmds;
+        MakeRandomCommand(c);
+        c->type = CMD_RECT_FILL;
+        c->x = c->y = 100;
+        c->x2 = c->y2 = 50;
+        for (int i = 1; i < 5; i++)
+        {
+            c = cmds + i;
+            MakeRandomCommand(c);
+            c->type = (i % 2) ? CMD_HLINE : CMD_VLINE;
+            c->x = -5000 * i;
+            c->y = 5000 * i;
+            c->x2 = (i < 3) ? 0 : -1000000;
+        }
+        RunTest(cmds, 5, pool);
+    }
+
+    // Lots of short lists, so that each type of command gets tested on its
+    // own, then a few long ones.
+    for (int i = 0; i < 200; i++)
+    {
+        int numCmds = RandomInt(1, 5);
+        for (int j = 0; j < numCmds; j++)
+            MakeRandomCommand(cmds + j);
+        RunTest(cmds, numCmds, pool);
+    }
+
+    for (int i = 0; i < 5; i++)
+    {
+        for (int j = 0; j < NUM_COMMANDS; j++)
+            MakeRandomCommand(cmds + j);
+        RunTest(cmds, NUM_COMMANDS, pool);
+    }
+
+    printf("All replays match\n");
+
+    delete [] cmds;
+    ThreadPoolDelete(pool);
+    BitmapDelete(g_sprite);
+    FontDelete(g_aaFont);
+    FontDelete(g_font);
+    return 0;
+}
@@ -0,0 +1,81 @@
+// Checks that the SSE2 row converters in df_frame_recorder.cpp give the same
+// Y, U, V and RGBA bytes as the scalar ones. They do 4 or 8 pixels at a time
+// and return how far they got, for the scalar code to finish the row, so
+// every width up to 32 is tried, to cover each tail length, and then one long
+// row.
+
+#include "../src/df_frame_recorder.cpp"
+#include "test_helpers.h"
+
+
+#define MAX_WIDTH 1001
+
+
+// Mostly 0s and 255s, which are where an overflow or a wrong rounding shows.
+static void FillRow(DfColour *row, int width)
+{
+    unsigned char *p = (unsigned char *)row;
+    for (int i = 0; i < width * 4; i++)
+    {
+        int r = rand() % 4;
+        p[i] = (r == 0) ? 0 : (r == 1) ? 255 : rand() % 256;
+    }
+}
+
+
+static void CheckWidth(int width)
+{
+    static DfColour row0[MAX_WIDTH];
+    static DfColour row1[MAX_WIDTH];
+    FillRow(row0, width);
+    FillRow(row1, width);
+
+    static unsigned char expectedY[MAX_WIDTH + GUARD_BYTES];
+    static unsigned char actualY[MAX_WIDTH + GUARD_BYTES];
+    FillGuardBytes(expectedY, sizeof(expectedY));
+    FillGuardBytes(actualY, sizeof(actualY));
+    ConvertRowToYScalar(row0, expectedY, 0, width);
+    ConvertRowToYScalar(row0, actualY, ConvertRowToYSse2(row0, actualY, width), width);
+    CheckBytes(expectedY, actualY, sizeof(expectedY), "Y", width);
+
+    // row1 is row0 again the second time, like the last chroma row of an
+    // image whose height is odd.
+    for (int i = 0; i < 2; i++)
+    {
+        DfColour const *other = (i == 0) ? row1 : row0;
+        static unsigned char expectedUv[2][MAX_WIDTH / 2 + GUARD_BYTES];
+        static unsigned char actualUv[2][MAX_WIDTH / 2 + GUARD_BYTES];
+        FillGuardBytes(expectedUv, sizeof(expectedUv));
+        FillGuardBytes(actualUv, sizeof(actualUv));
+        ConvertRowsToUvScalar(row0, other, expectedUv[0], expectedUv[1], 0, width);
+        int cx = ConvertRowsToUvSse2(row0, other, actualUv[0], actualUv[1], width);
+        ConvertRowsToUvScalar(row0, other, actualUv[0], actualUv[1], cx, width);
+        CheckBytes(expectedUv, actualUv, sizeof(expectedUv), "UV", width);
+    }
+
+    static uint32_t expectedRgba[MAX_WIDTH + GUARD_BYTES];
+    static uint32_t actualRgba[MAX_WIDTH + GUARD_BYTES];
+    FillGuardBytes(expectedRgba, sizeof(expectedRgba));
+    FillGuardBytes(actualRgba, sizeof(actualRgba));
+    ConvertRowToRgbaScalar(row0, expectedRgba, 0, width);
+    ConvertRowToRgbaScalar(row0, actualRgba, ConvertRowToRgbaSse2(row0, actualRgba, width), width);
+    CheckBytes(expectedRgba, actualRgba, sizeof(expectedRgba), "RGBA", width);
+}
+
+
+int main()
+{
+    StartTest();
+
+#if RECORDER_X64
+    for (int width = 1; width <= 32; width++)
+        CheckWidth(width);
+    CheckWidth(MAX_WIDTH);
+
+    printf("SSE2 rows match scalar\n");
+#else
+    printf("No SIMD converters on this platform\n");
+#endif
+
+    return 0;
+}
@@ -0,0 +1,305 @@
+// Checks that saving a bitmap as QOI and loading it again gives exactly the
+// same pixels. The test images are made to use each kind of QOI op: flat
+// colours for runs, small steps for diffs, bigger steps for luma, a small
+// palette for index lookups, and noise for full RGB and RGBA values. The
+// encoded data is scanned to check that each op really was used.
+//
+// Build it with the library, eg.
+//   g++ -O2 -I../src qoi_round_trip.cpp -L../build/linux -ldeadfrog -pthread
+
+#include "df_bitmap.h"
+#include "df_qoi.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+enum {
+    OP_RGB,
+    OP_RGBA,
+    OP_INDEX,
+    OP_DIFF,
+    OP_LUMA,
+    OP_RUN,
+    NUM_OPS
+};
+
+static char const *g_opNames[NUM_OPS] = { "RGB", "RGBA", "INDEX", "DIFF", "LUMA", "RUN" };
+static int g_opCounts[NUM_OPS];
+
+
+struct MemoryFile
+{
+    unsigned char *data;
+    int size;
+    int capacity;
+};
+
+
+static int RandomInt(int min, int max)
+{
+    return min + rand() % (max - min + 1);
+}
+
+
+static bool WriteToMemory(void *context, void const *data, int numBytes)
+{
+    MemoryFile *mf = (MemoryFile *)context;
+    if (mf->size + numBytes > mf->capacity)
+    {
+        mf->capacity = (mf->size + numBytes) * 2;
+        unsigned char *newData = new unsigned char[mf->capacity];
+        memcpy(newData, mf->data, mf->size);
+        delete [] mf->data;
+        mf->data = newData;
+    }
+
+    memcpy(mf->data + mf->size, data, numBytes);
+    mf->size += numBytes;
+    return true;
+}
+
+
+// Adds up the ops in an encoded file. The 14 byte header is skipped, and the
+// 8 byte end marker is left out.
+static void CountOps(unsigned char const *data, int numBytes)
+{
+    unsigned char const *p = data + 14;
+    unsigned char const *end = data + numBytes - 8;
+    while (p < end)
+    {
+        unsigned b = *p;
+        if (b == 0xfe)
+        {
+            g_opCounts[OP_RGB]++;
+            p += 4;
+        }
+        else if (b == 0xff)
+        {
+            g_opCounts[OP_RGBA]++;
+            p += 5;
+        }
+        else if ((b & 0xc0) == 0x00)
+        {
+            g_opCounts[OP_INDEX]++;
+            p += 1;
+        }
+        else if ((b & 0xc0) == 0x40)
+        {
+            g_opCounts[OP_DIFF]++;
+            p += 1;
+        }
+        else if ((b & 0xc0) == 0x80)
+        {
+            g_opCounts[OP_LUMA]++;
+            p += 2;
+        }
+        else
+        {
+            g_opCounts[OP_RUN]++;
+            p += 1;
+        }
+    }
+
+    ReleaseAssert(p == end, "The ops overrun the end marker");
+}
+
+
+static void CheckSame(DfBitmap *expected, DfBitmap *actual, bool withAlpha, char const *what)
+{
+    ReleaseAssert(actual != NULL, "%s: Couldn't load the image", what);
+    ReleaseAssert(actual->width == expected->width && actual->height == expected->height,
+                  "%s: Size is %ix%i, should be %ix%i", what, actual->width, actual->height,
+                  expected->width, expected->height);
+
+    // Without alpha, the image is saved as opaque.
+    unsigned alphaOr = withAlpha ? 0 : 0xff000000;
+    for (int y = 0; y < expected->height; y++)
+    {
+        for (int x = 0; x < expected->width; x++)
+        {
+            unsigned e = GetPixUnclipped(expected, x, y).c | alphaOr;
+            unsigned a = GetPixUnclipped(actual, x, y).c;
+            ReleaseAssert(e == a, "%s: %ix%i image, pixel %i,%i is %08x, should be %08x",
+                          what, expected->width, expected->height, x, y, a, e);
+        }
+    }
+}
+
+
+static void CheckRoundTrip(DfBitmap *bmp, char const *what)
+{
+    // Opaque, through memory.
+    int numBytes;
+    unsigned char *data = SaveQoiToMemory(bmp, &numBytes);
+    CountOps(data, numBytes);
+    DfBitmap *loaded = LoadQoiFromMemory(data, numBytes);
+    CheckSame(bmp, loaded, false, what);
+    BitmapDelete(loaded);
+    delete [] data;
+
+    // With alpha, through the streaming encoder, a few rows at a time.
+    MemoryFile mf = { NULL, 0, 0 };
+    DfQoiEncoder *enc = QoiEncoderCreate(bmp->width, bmp->height, true, WriteToMemory, &mf);
+    for (int y = 0; y < bmp->height; )
+    {
+        int numRows = IntMin(RandomInt(1, 5), bmp->height - y);
+        ReleaseAssert(QoiEncoderAddRows(enc, bmp->pixels + y * bmp->stride, bmp->stride, numRows),
+                      "%s: QoiEncoderAddRows failed", what);
+        y += numRows;
+    }
+    ReleaseAssert(QoiEncoderFinish(enc), "%s: QoiEncoderFinish failed", what);
+
+    CountOps(mf.data, mf.size);
+    loaded = LoadQoiFromMemory(mf.data, mf.size);
+    CheckSame(bmp, loaded, true, what);
+    BitmapDelete(loaded);
+    delete [] mf.data;
+}
+
+
+// ****************************************************************************
+// Test images
+// ****************************************************************************
+
+static void MakeFlat(DfBitmap *bmp)
+{
+    DfColour c = Colour(rand() % 256, rand() % 256, rand() % 256, rand() % 256);
+    BitmapClear(bmp, c);
+}
+
+
+// Adds a random step to each channel of each pixel, going along each row.
+static void MakeSteps(DfBitmap *bmp, int minStep, int maxStep, bool changeAlpha)
+{
+    DfColour c = Colour(rand() % 256, rand() % 256, rand() % 256, rand() % 256);
+    for (int y = 0; y < bmp->height; y++)
+    {
+        for (int x = 0; x < bmp->width; x++)
+        {
+            c.r += RandomInt(minStep, maxStep);
+            c.g += RandomInt(minStep, maxStep);
+            c.b += RandomInt(minStep, maxStep);
+            if (changeAlpha)
+                c.a += RandomInt(minStep, maxStep);
+            PutPixUnclipped(bmp, x, y, c);
+        }
+    }
+}
+
+
+// Luma steps: green changes by up to 32, and red and blue by up to 8 more or
+// less than green.
+static void MakeLumaSteps(DfBitmap *bmp)
+{
+    DfColour c = Colour(rand() % 256, rand() % 256, rand() % 256);
+    for (int y = 0; y < bmp->height; y++)
+    {
+        for (int x = 0; x < bmp->width; x++)
+        {
+            int dg = RandomInt(-32, 31);
+            c.g += dg;
+            c.r += dg + RandomInt(-8, 7);
+            c.b += dg + RandomInt(-8, 7);
+            PutPixUnclipped(bmp, x, y, c);
+        }
+    }
+}
+
+
+static void MakePalette(DfBitmap *bmp)
+{
+    DfColour palette[12];
+    for (int i = 0; i < 12; i++)
+        palette[i] = Colour(rand() % 256, rand() % 256, rand() % 256, rand() % 256);
+
+    for (int y = 0; y < bmp->height; y++)
+    {
+        for (int x = 0; x < bmp->width; x++)
+            PutPixUnclipped(bmp, x, y, palette[rand() % 12]);
+    }
+}
+
+
+static void MakeNoise(DfBitmap *bmp)
+{
+    for (int y = 0; y < bmp->height; y++)
+    {
+        for (int x = 0; x < bmp->width; x++)
+            PutPixUnclipped(bmp, x, y, Colour(rand() % 256, rand() % 256, rand() % 256, rand() % 256));
+    }
+}
+
+
+// A mix of all of the above, in horizontal bands.
+static void MakeMixture(DfBitmap *bmp)
+{
+    for (int y = 0; y < bmp->height; )
+    {
+        int h = IntMin(RandomInt(1, 20), bmp->height - y);
+        DfBitmap *band = BitmapCreateView(bmp, 0, y, bmp->width, h);
+        switch (rand() % 6)
+        {
+        case 0: MakeFlat(band); break;
+        case 1: MakeSteps(band, -2, 1, false); break;
+        case 2: MakeSteps(band, -2, 1, true); break;
+        case 3: MakeLumaSteps(band); break;
+        case 4: MakePalette(band); break;
+        case 5: MakeNoise(band); break;
+        }
+        BitmapDelete(band);
+        y += h;
+    }
+}
+
+
+int main()
+{
+    // ReleaseAssert() stops without flushing stdout.
+    setvbuf(stdout, NULL, _IONBF, 0);
+    srand(1);
+
+    for (int i = 0; i < 300; i++)
+    {
+        // Mostly small images, including single rows and columns, with the
+        // odd bigger one.
+        int w = (i % 10 == 0) ? RandomInt(1, 1000) : RandomInt(1, 70);
+        int h = (i % 10 == 0) ? RandomInt(1, 300) : RandomInt(1, 70);
+        DfBitmap *bmp = BitmapCreate(w, h);
+
+        MakeFlat(bmp);
+        CheckRoundTrip(bmp, "Flat");
+        MakeSteps(bmp, -2, 1, false);
+        CheckRoundTrip(bmp, "Small steps");
+        MakeLumaSteps(bmp);
+        CheckRoundTrip(bmp, "Luma steps");
+        MakePalette(bmp);
+        CheckRoundTrip(bmp, "Palette");
+        MakeNoise(bmp);
+        CheckRoundTrip(bmp, "Noise");
+        MakeMixture(bmp);
+        CheckRoundTrip(bmp, "Mixture");
+
+        BitmapDelete(bmp);
+    }
+
+    // And once through a file.
+    DfBitmap *bmp = BitmapCreate(123, 45);
+    MakeMixture(bmp);
+    ReleaseAssert(SaveQoi(bmp, "qoi_round_trip.qoi"), "SaveQoi failed");
+    DfBitmap *loaded = LoadQoi("qoi_round_trip.qoi");
+    CheckSame(bmp, loaded, false, "File");
+    BitmapDelete(loaded);
+    BitmapDelete(bmp);
+    remove("qoi_round_trip.qoi");
+
+    for (int i = 0; i < NUM_OPS; i++)
+    {
+        ReleaseAssert(g_opCounts[i] > 0, "No %s ops were used", g_opNames[i]);
+        printf("%-6s %i\n", g_opNames[i], g_opCounts[i]);
+    }
+    printf("All images match\n");
+
+    return 0;
+}
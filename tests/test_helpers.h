@@ -0,0 +1,60 @@
+// Bits shared by the tests that check a SIMD function against its scalar
+// version. Those functions are static, so each test #includes the .cpp file
+// that has them before this, rather than linking with the library. Build one
+// with the .cpp files that the included one needs, eg.
+//   g++ -O2 -I../src frame_recorder_rows.cpp ../src/df_common_linux.cpp
+//       ../src/df_thread.cpp ../src/df_time.cpp -pthread
+
+#pragma once
+
+
+#include "df_common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Outputs are followed by this many bytes of 0xcd, which must not change.
+#define GUARD_BYTES 64
+
+
+// Call at the start of main(). ReleaseAssert() stops without flushing stdout,
+// so stdout is made unbuffered. The random numbers are the same on every run.
+static inline void StartTest()
+{
+    setvbuf(stdout, NULL, _IONBF, 0);
+    srand(1);
+}
+
+
+static inline int RandomInt(int min, int max)
+{
+    return min + rand() % (max - min + 1);
+}
+
+
+static inline void FillRandomBytes(void *buf, int numBytes)
+{
+    unsigned char *p = (unsigned char *)buf;
+    for (int i = 0; i < numBytes; i++)
+        p[i] = rand() % 256;
+}
+
+
+static inline void FillGuardBytes(void *buf, int numBytes)
+{
+    memset(buf, 0xcd, numBytes);
+}
+
+
+static inline void CheckBytes(void const *expected, void const *actual, int numBytes, char const *what, int width)
+{
+    unsigned char const *e = (unsigned char const *)expected;
+    unsigned char const *a = (unsigned char const *)actual;
+    for (int i = 0; i < numBytes; i++)
+    {
+        ReleaseAssert(e[i] == a[i], "%s: width %i, byte %i is %i, should be %i",
+                      what, width, i, a[i], e[i]);
+    }
+}
@@ -0,0 +1,181 @@
+// Checks that drawing text through a DfTextCache gives exactly the same pixels
+// as the DrawText... functions in df_font.h, and returns the full width of the
+// text, like GetTextWidth(). The DrawText... functions return less than that
+// when the text is clipped. Strings are drawn on both the cache miss and hit
+// paths. Lots of them are clipped by the edges of the bitmap or by its clip
+// rect. The cache is small, so entries are evicted and rebuilt too.
+//
+// Build it with the library, eg.
+//   g++ -O2 -I../src text_cache.cpp -L../build/linux -ldeadfrog -pthread
+
+#include "df_bitmap.h"
+#include "df_font.h"
+#include "df_text_cache.h"
+#include "fonts/df_mono.h"
+#include "fonts/df_prop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define BMP_WIDTH   300
+#define BMP_HEIGHT  200
+
+
+static DfBitmap *g_noise;
+
+
+static int RandomInt(int min, int max)
+{
+    return min + rand() % (max - min + 1);
+}
+
+
+static void MakeRandomString(char *text, int maxLen)
+{
+    int len = RandomInt(0, maxLen);
+    for (int i = 0; i < len; i++)
+    {
+        // Mostly printable, with the odd control and high character.
+        int r = rand() % 20;
+        text[i] = (r == 0) ? RandomInt(1, 31) : (r == 1) ? RandomInt(128, 255) : RandomInt(32, 126);
+    }
+    text[len] = '\0';
+}
+
+
+static void CheckSame(DfBitmap *expected, DfBitmap *actual, char const *what, char const *text)
+{
+    for (int y = 0; y < expected->height; y++)
+    {
+        for (int x = 0; x < expected->width; x++)
+        {
+            DfColour e = GetPixUnclipped(expected, x, y);
+            DfColour a = GetPixUnclipped(actual, x, y);
+            ReleaseAssert(e.c == a.c, "%s(\"%s\"): pixel %i,%i is %08x, should be %08x",
+                          what, text, x, y, a.c, e.c);
+        }
+    }
+}
+
+
+// Fills both bitmaps with noise, so that blending is checked too, and gives
+// them the same clip rect. Half the time the clip rect is the whole bitmap, so
+// that the bitmap's edges do the clipping.
+static void ResetBitmaps(DfBitmap *a, DfBitmap *b)
+{
+    ClearClipRect(a);
+    ClearClipRect(b);
+    Blit(a, 0, 0, g_noise);
+    Blit(b, 0, 0, g_noise);
+
+    if (rand() % 2)
+    {
+        int x = RandomInt(0, BMP_WIDTH / 2);
+        int y = RandomInt(0, BMP_HEIGHT / 2);
+        int w = RandomInt(1, BMP_WIDTH - x);
+        int h = RandomInt(1, BMP_HEIGHT - y);
+        SetClipRect(a, x, y, w, h);
+        SetClipRect(b, x, y, w, h);
+    }
+}
+
+
+static void CheckString(DfTextCache *cache, DfFont *font, DfBitmap *expected, DfBitmap *actual, char const *text)
+{
+    DfColour c = Colour(rand() % 256, rand() % 256, rand() % 256, (rand() % 2) ? 255 : RandomInt(1, 254));
+
+    // Positions from well off the top left to well off the bottom right.
+    int x = RandomInt(-60, BMP_WIDTH + 10);
+    int y = RandomInt(-font->charHeight - 5, BMP_HEIGHT + 5);
+    int maxChars = RandomInt(0, 40);
+
+    int fullWidth = GetTextWidth(font, text);
+    int lenWidth = GetTextWidthNumChars(font, text, maxChars);
+
+    ResetBitmaps(expected, actual);
+    DrawTextSimple(font, c, expected, x, y, text);
+    int actualWidth = TextCacheDrawTextSimple(cache, font, c, actual, x, y, text);
+    ReleaseAssert(actualWidth == fullWidth, "TextCacheDrawTextSimple(\"%s\") returned %i, should be %i",
+                  text, actualWidth, fullWidth);
+    CheckSame(expected, actual, "TextCacheDrawTextSimple", text);
+
+    ResetBitmaps(expected, actual);
+    DrawTextSimpleLen(font, c, expected, x, y, text, maxChars);
+    actualWidth = TextCacheDrawTextSimpleLen(cache, font, c, actual, x, y, text, maxChars);
+    ReleaseAssert(actualWidth == lenWidth, "TextCacheDrawTextSimpleLen(\"%s\", %i) returned %i, should be %i",
+                  text, maxChars, actualWidth, lenWidth);
+    CheckSame(expected, actual, "TextCacheDrawTextSimpleLen", text);
+
+    ResetBitmaps(expected, actual);
+    DrawTextRight(font, c, expected, x, y, "%s", text);
+    actualWidth = TextCacheDrawTextRight(cache, font, c, actual, x, y, text);
+    ReleaseAssert(actualWidth == fullWidth, "TextCacheDrawTextRight(\"%s\") returned %i, should be %i",
+                  text, actualWidth, fullWidth);
+    CheckSame(expected, actual, "TextCacheDrawTextRight", text);
+
+    ResetBitmaps(expected, actual);
+    DrawTextCentre(font, c, expected, x, y, "%s", text);
+    actualWidth = TextCacheDrawTextCentre(cache, font, c, actual, x, y, text);
+    ReleaseAssert(actualWidth == fullWidth, "TextCacheDrawTextCentre(\"%s\") returned %i, should be %i",
+                  text, actualWidth, fullWidth);
+    CheckSame(expected, actual, "TextCacheDrawTextCentre", text);
+
+    actualWidth = TextCacheGetTextWidth(cache, font, text);
+    ReleaseAssert(actualWidth == fullWidth, "TextCacheGetTextWidth(\"%s\") returned %i, should be %i",
+                  text, actualWidth, fullWidth);
+}
+
+
+int main()
+{
+    // ReleaseAssert() stops without flushing stdout.
+    setvbuf(stdout, NULL, _IONBF, 0);
+    srand(1);
+
+    DfFont *fonts[] = {
+        LoadFontFromMemory(df_mono_7x13, sizeof(df_mono_7x13)),
+        LoadFontFromMemory(df_prop_16x30, sizeof(df_prop_16x30)),
+        LoadFontFromMemoryAA(df_prop_16x30, sizeof(df_prop_16x30), 11)
+    };
+    int numFonts = sizeof(fonts) / sizeof(fonts[0]);
+
+    g_noise = BitmapCreate(BMP_WIDTH, BMP_HEIGHT);
+    for (int y = 0; y < BMP_HEIGHT; y++)
+    {
+        for (int x = 0; x < BMP_WIDTH; x++)
+            PutPixUnclipped(g_noise, x, y, Colour(rand() % 256, rand() % 256, rand() % 256));
+    }
+
+    DfBitmap *expected = BitmapCreate(BMP_WIDTH, BMP_HEIGHT);
+    DfBitmap *actual = BitmapCreate(BMP_WIDTH, BMP_HEIGHT);
+    DfTextCache *cache = TextCacheCreate(32);
+
+    // A few strings that are used over and over, so that most draws are
+    // cache hits, and a new random string now and then.
+    char strings[32][64];
+    for (int i = 0; i < 32; i++)
+        MakeRandomString(strings[i], 63);
+
+    for (int i = 0; i < 3000; i++)
+    {
+        DfFont *font = fonts[rand() % numFonts];
+        char *text = strings[rand() % 32];
+        if (rand() % 10 == 0)
+            MakeRandomString(text, 63);
+        CheckString(cache, font, expected, actual, text);
+    }
+
+    DfTextCacheStats stats;
+    TextCacheGetStats(cache, &stats);
+    printf("All text matches. %u hits, %u misses, %u evictions\n", stats.hits, stats.misses, stats.evictions);
+
+    TextCacheDelete(cache);
+    BitmapDelete(actual);
+    BitmapDelete(expected);
+    BitmapDelete(g_noise);
+    for (int i = 0; i < numFonts; i++)
+        FontDelete(fonts[i]);
+    return 0;
+}